@@ -29,6 +29,7 @@
 
 #include "etchosts.hh"
 #include <algorithm>
+#include <chrono>
 #include <sstream>
 #include <sofia-sip/tport_tag.h>
 #include <sofia-sip/su_tagarg.h>
@@ -156,6 +157,73 @@ void Agent::checkAllowedParams(const url_t *uri) {
 	}
 }
 
+#ifdef TPTAG_REUSEPORT
+#define FLEXISIP_TPTAG_REUSEPORT(v) TPTAG_REUSEPORT(v)
+#else
+#define FLEXISIP_TPTAG_REUSEPORT(v) TAG_SKIP(v)
+#endif
+
+void Agent::addTransport(const url_t *url, const string &currDir, const string &mainTlsCertsDir, bool mainPeerCert,
+						 unsigned int tports_idle_timeout, unsigned int incompleteIncomingMessageTimeout,
+						 unsigned int keepAliveInterval, bool reusePort) {
+	int err;
+	char urlstr[512];
+	url_e(urlstr, sizeof(urlstr), url);
+	LOGD("Enabling transport %s", urlstr);
+	if (url->url_type == url_sips) {
+		string keys;
+		if (url_has_param(url, "tls-certificates-dir")) {
+			char keys_path[512];
+			url_param(url->url_params, "tls-certificates-dir", keys_path, sizeof(keys_path));
+			keys = keys_path, keys = absolutePath(currDir, keys);
+		} else {
+			keys = mainTlsCertsDir;
+		}
+		bool peerCert;
+		if (url_has_param(url, "require-peer-certificate")) {
+			char require_value[50];
+			url_param(url->url_params, "require-peer-certificate", require_value, sizeof(require_value));
+			string reqval = require_value;
+			peerCert = reqval == "1" || reqval == "true";
+			if (!peerCert && reqval != "0" && reqval != "false")
+				LOGF("Bad require-peer-certificate value: %s", require_value);
+		} else {
+			peerCert = mainPeerCert;
+		}
+
+		checkAllowedParams(url);
+
+		err = nta_agent_add_tport(mAgent, (const url_string_t *)url, TPTAG_CERTIFICATE(keys.c_str()),
+								  TPTAG_TLS_VERIFY_PEER(peerCert), TPTAG_IDLE(tports_idle_timeout),
+								  TPTAG_TIMEOUT(incompleteIncomingMessageTimeout),
+								  TPTAG_KEEPALIVE(keepAliveInterval), TPTAG_SDWN_ERROR(1),
+								  FLEXISIP_TPTAG_REUSEPORT(reusePort), TAG_END());
+	} else {
+		err = nta_agent_add_tport(mAgent, (const url_string_t *)url, TPTAG_IDLE(tports_idle_timeout),
+								  TPTAG_TIMEOUT(incompleteIncomingMessageTimeout),
+								  TPTAG_KEEPALIVE(keepAliveInterval), TPTAG_SDWN_ERROR(1),
+								  FLEXISIP_TPTAG_REUSEPORT(reusePort), TAG_END());
+	}
+	if (err == -1) {
+		LOGE("Could not enable transport %s: %s", urlstr, strerror(errno));
+		if (url_has_param(url, "transport")) {
+			char transport[64] = {0};
+			url_param(url->url_params, "transport", transport, sizeof(transport));
+			if (strcasecmp(transport, "tls") == 0) {
+				LOGE("Specifying an URI with transport=tls is not understood by flexisip. Use 'sips' uri scheme "
+					 "instead.");
+			}
+		}
+	}
+}
+
+void Agent::setWorker(int index, int count, const string &secret, SharedNonceTable *nonces) {
+	mWorkerIndex = index;
+	mWorkerCount = count;
+	mWorkerSecret = secret;
+	mWorkerNonces = nonces;
+}
+
 void Agent::start(const std::string &transport_override) {
 	char cCurrDir[FILENAME_MAX];
 	if (!getcwd(cCurrDir, sizeof(cCurrDir))) {
@@ -187,57 +255,32 @@ void Agent::start(const std::string &transport_override) {
 		transports = ConfigStringList::parse(transport_override);
 	}
 
-	for (auto it = transports.begin(); it != transports.end(); ++it) {
-		const string &uri = (*it);
+#ifndef TPTAG_REUSEPORT
+	if (mWorkerCount > 1)
+		LOGF("This sofia-sip does not support SO_REUSEPORT on transports (TPTAG_REUSEPORT), cannot run %i workers.",
+			 mWorkerCount);
+#endif
+	int workersPortBase = global->get<ConfigInt>("workers-port-base")->read();
+
+	int transportIndex = 0;
+	for (auto it = transports.begin(); it != transports.end(); ++it, ++transportIndex) {
 		url_t *url;
-		int err;
 		su_home_t home;
 		su_home_init(&home);
-		url = url_make(&home, uri.c_str());
-		LOGD("Enabling transport %s", uri.c_str());
-		if (uri.find("sips") == 0) {
-			string keys;
-			if (url_has_param(url, "tls-certificates-dir")) {
-				char keys_path[512];
-				url_param(url->url_params, "tls-certificates-dir", keys_path, sizeof(keys_path));
-				keys = keys_path, keys = absolutePath(currDir, keys);
-			} else {
-				keys = mainTlsCertsDir;
-			}
-			bool peerCert;
-			if (url_has_param(url, "require-peer-certificate")) {
-				char require_value[50];
-				url_param(url->url_params, "require-peer-certificate", require_value, sizeof(require_value));
-				string reqval = require_value;
-				peerCert = reqval == "1" || reqval == "true";
-				if (!peerCert && reqval != "0" && reqval != "false")
-					LOGF("Bad require-peer-certificate value: %s", require_value);
-			} else {
-				peerCert = mainPeerCert;
-			}
-
-			checkAllowedParams(url);
-
-			err = nta_agent_add_tport(mAgent, (const url_string_t *)url, TPTAG_CERTIFICATE(keys.c_str()),
-									  TPTAG_TLS_VERIFY_PEER(peerCert), TPTAG_IDLE(tports_idle_timeout),
-									  TPTAG_TIMEOUT(incompleteIncomingMessageTimeout),
-									  TPTAG_KEEPALIVE(keepAliveInterval), TPTAG_SDWN_ERROR(1), TAG_END());
-		} else {
-			err = nta_agent_add_tport(mAgent, (const url_string_t *)url, TPTAG_IDLE(tports_idle_timeout),
-									  TPTAG_TIMEOUT(incompleteIncomingMessageTimeout),
-									  TPTAG_KEEPALIVE(keepAliveInterval), TPTAG_SDWN_ERROR(1), TAG_END());
-		}
-		if (err == -1) {
-			LOGE("Could not enable transport %s: %s", uri.c_str(), strerror(errno));
-			if (url_has_param(url, "transport")) {
-				char transport[64] = {0};
-				url_param(url->url_params, "transport", transport, sizeof(transport));
-				if (strcasecmp(transport, "tls") == 0) {
-					LOGE("Specifying an URI with transport=tls is not understood by flexisip. Use 'sips' uri scheme "
-						 "instead.");
-				}
-			}
+		url = url_make(&home, it->c_str());
+		if (mWorkerCount > 1) {
+			/* In multi-worker mode, each worker first binds a private port for the same transport, so that it becomes
+			 * the primary used in Via and Record-Route: responses and in-dialog requests then come back to the worker
+			 * that owns the transaction and the dialog. The configured port is then shared by all workers with
+			 * SO_REUSEPORT.*/
+			url_t *privUrl = url_hdup(&home, url);
+			privUrl->url_port =
+				su_sprintf(&home, "%i", workersPortBase + transportIndex * mWorkerCount + mWorkerIndex);
+			addTransport(privUrl, currDir, mainTlsCertsDir, mainPeerCert, tports_idle_timeout,
+						 incompleteIncomingMessageTimeout, keepAliveInterval, false);
 		}
+		addTransport(url, currDir, mainTlsCertsDir, mainPeerCert, tports_idle_timeout,
+					 incompleteIncomingMessageTimeout, keepAliveInterval, mWorkerCount > 1);
 		su_home_deinit(&home);
 	}
 
@@ -335,7 +378,8 @@ void Agent::start(const std::string &transport_override) {
 	startLogWriter();
 }
 
-Agent::Agent(su_root_t *root) : mBaseConfigListener(NULL), mTerminating(false) {
+Agent::Agent(su_root_t *root)
+	: mBaseConfigListener(NULL), mWorkerIndex(0), mWorkerCount(1), mWorkerNonces(NULL), mTerminating(false) {
 	mHttpEngine = nth_engine_create(root, NTHTAG_ERROR_MSG(0), TAG_END());
 	GenericStruct *cr = GenericManager::get()->getRoot();
 
@@ -405,6 +449,11 @@ Agent::Agent(su_root_t *root) : mBaseConfigListener(NULL), mTerminating(false) {
 Agent::~Agent() {
 	mTerminating = true;
 	for_each(mModules.begin(), mModules.end(), delete_functor<Module>());
+	/*after the modules, which may still write logs*/
+	if (mLogWriter) {
+		delete mLogWriter;
+		mLogWriter = NULL;
+	}
 	if (mDrm)
 		delete mDrm;
 	if (mAgent)
@@ -454,6 +503,7 @@ void Agent::loadConfig(GenericManager *cm) {
 		(*it)->checkConfig();
 		(*it)->load();
 	}
+	buildPipelines();
 	if (mDrm)
 		mDrm->load();
 }
@@ -693,6 +743,12 @@ void Agent::logEvent(const shared_ptr<SipEvent> &ev) {
 	}
 }
 
+/* For event logs that are not attached to a sip event, such as expired registrations. */
+void Agent::writeEventLog(const shared_ptr<EventLog> &evlog) {
+	if (mLogWriter && evlog->isCompleted())
+		mLogWriter->write(evlog);
+}
+
 struct ModuleHasName {
 	ModuleHasName(const string &ref) : match(ref) {
 	}
@@ -706,9 +762,17 @@ Module *Agent::findModule(const string &modname) const {
 	return (it != mModules.end()) ? *it : NULL;
 }
 
+void Agent::buildPipelines() {
+	auto pipelines = make_shared<Pipelines>(mModules);
+	LOGD("Module pipelines built, %lu modules for INVITE, %lu for REGISTER, %lu for OPTIONS",
+		 (unsigned long)pipelines->requests(sip_method_invite).size(),
+		 (unsigned long)pipelines->requests(sip_method_register).size(),
+		 (unsigned long)pipelines->requests(sip_method_options).size());
+	mPipelines = pipelines;
+}
+
 template <typename SipEventT>
-inline void Agent::doSendEvent(shared_ptr<SipEventT> ev, const list<Module *>::iterator &begin,
-							   const list<Module *>::iterator &end) {
+inline void Agent::doSendEvent(shared_ptr<SipEventT> ev, int method, const vector<Module *> &pipeline, size_t start) {
 #define LOG_SCOPED_EV_THREAD(ssargs, key) LOG_SCOPED_THREAD(key, ssargs->getOrEmpty(key));
 
 	auto ssargs = ev->getMsgSip()->getSipAttr();
@@ -719,9 +783,14 @@ inline void Agent::doSendEvent(shared_ptr<SipEventT> ev, const list<Module *>::i
 	LOG_SCOPED_EV_THREAD(ssargs, "method_or_status");
 	LOG_SCOPED_EV_THREAD(ssargs, "callid");
 
-	for (auto it = begin; it != end; ++it) {
-		ev->mCurrModule = (*it);
-		(*it)->process(ev);
+	auto begin = chrono::steady_clock::now();
+	for (size_t i = start; i < pipeline.size(); ++i) {
+		ev->mCurrModule = pipeline[i];
+		pipeline[i]->process(ev);
+		auto end = chrono::steady_clock::now();
+		auto elapsed = chrono::duration_cast<chrono::microseconds>(end - begin).count();
+		pipeline[i]->recordProcessingTime(ev, method, elapsed);
+		begin = end;
 		if (ev->isTerminated() || ev->isSuspended())
 			break;
 	}
@@ -772,7 +841,9 @@ void Agent::sendRequestEvent(shared_ptr<RequestSipEvent> ev) {
 			break;
 	}
 
-	doSendEvent(ev, mModules.begin(), mModules.end());
+	shared_ptr<const Pipelines> pipelines = mPipelines;
+	int method = pipelineIndex(req->rq_method);
+	doSendEvent(ev, method, pipelines->requests(method), 0);
 }
 
 void Agent::sendResponseEvent(shared_ptr<ResponseSipEvent> ev) {
@@ -825,36 +896,41 @@ void Agent::sendResponseEvent(shared_ptr<ResponseSipEvent> ev) {
 			break;
 	}
 
-	doSendEvent(ev, mModules.begin(), mModules.end());
+	shared_ptr<const Pipelines> pipelines = mPipelines;
+	int method = pipelineIndex(sip->sip_cseq ? sip->sip_cseq->cs_method : sip_method_unknown);
+	doSendEvent(ev, method, pipelines->responses(method), 0);
+}
+
+/* Only the event that was suspended records it, once. */
+void Agent::recordSuspendedTime(const shared_ptr<SipEvent> &ev, int method) {
+	if (ev->mSuspendTime == chrono::steady_clock::time_point())
+		return;
+	auto suspended = chrono::steady_clock::now() - ev->mSuspendTime;
+	ev->mSuspendTime = chrono::steady_clock::time_point();
+	ev->mCurrModule->recordSuspendedTime(method, chrono::duration_cast<chrono::microseconds>(suspended).count());
 }
 
 void Agent::injectRequestEvent(shared_ptr<RequestSipEvent> ev) {
 	SLOGD << "Inject Request SIP message:\n" << *ev->getMsgSip();
 	ev->restartProcessing();
 	SLOGD << "Injecting request event after " << ev->mCurrModule->getModuleName();
-	list<Module *>::iterator it;
-	for (it = mModules.begin(); it != mModules.end(); ++it) {
-		if (ev->mCurrModule == *it) {
-			++it;
-			break;
-		}
-	}
-	doSendEvent(ev, it, mModules.end());
+	int method = pipelineIndex(ev->getSip()->sip_request->rq_method);
+	recordSuspendedTime(ev, method);
+	shared_ptr<const Pipelines> pipelines = mPipelines;
+	const vector<Module *> &pipeline = pipelines->requests(method);
+	doSendEvent(ev, method, pipeline, pipelines->resumeIndex(pipeline, ev->mCurrModule));
 }
 
 void Agent::injectResponseEvent(shared_ptr<ResponseSipEvent> ev) {
 	SLOGD << "Inject Response SIP message:\n" << *ev->getMsgSip();
-	list<Module *>::iterator it;
 	ev->restartProcessing();
 	SLOGD << "Injecting response event after " << ev->mCurrModule->getModuleName();
-	for (it = mModules.begin(); it != mModules.end(); ++it) {
-		if (ev->mCurrModule == *it) {
-			++it;
-			break;
-		}
-	}
-
-	doSendEvent(ev, it, mModules.end());
+	sip_t *sip = ev->getMsgSip()->getSip();
+	int method = pipelineIndex(sip->sip_cseq ? sip->sip_cseq->cs_method : sip_method_unknown);
+	recordSuspendedTime(ev, method);
+	shared_ptr<const Pipelines> pipelines = mPipelines;
+	const vector<Module *> &pipeline = pipelines->responses(method);
+	doSendEvent(ev, method, pipeline, pipelines->resumeIndex(pipeline, ev->mCurrModule));
 }
 
 /**
@@ -22,6 +22,7 @@
 #include <string>
 #include <sstream>
 #include <memory>
+#include <vector>
 
 #include <sofia-sip/sip.h>
 #include <sofia-sip/sip_protos.h>
@@ -37,9 +38,11 @@
 #include "event.hh"
 #include "transaction.hh"
 #include "eventlogs/eventlogs.hh"
+#include "module-pipelines.hh"
 
 class Module;
 class DomainRegistrationManager;
+class SharedNonceTable;
 
 /**
  * The agent class represents a SIP agent.
@@ -59,6 +62,7 @@ class Agent : public IncomingAgent,
 	friend class StatelessSipEvent;
 	friend class StatefulSipEvent;
 	friend class Module;
+	friend class RequestSipEvent;
 
 	StatCounter64 *mCountIncomingRegister;
 	StatCounter64 *mCountIncomingInvite;
@@ -103,12 +107,32 @@ class Agent : public IncomingAgent,
 	ConfigValueListener *mBaseConfigListener;
 
   private:
+	typedef ModulePipelines<Module> Pipelines;
+	static int pipelineIndex(sip_method_t method) {
+		return Pipelines::index(method);
+	}
+	void recordSuspendedTime(const std::shared_ptr<SipEvent> &ev, int method);
 	template <typename SipEventT>
-	void doSendEvent(std::shared_ptr<SipEventT> ev, const std::list<Module *>::iterator &begin,
-					 const std::list<Module *>::iterator &end);
+	void doSendEvent(std::shared_ptr<SipEventT> ev, int method, const std::vector<Module *> &pipeline, size_t start);
 
   public:
 	Agent(su_root_t *root);
+	/// Must be called before start() when several worker processes share the SIP transports.
+	void setWorker(int index, int count, const std::string &secret, SharedNonceTable *nonces);
+	int getWorkerIndex() const {
+		return mWorkerIndex;
+	}
+	int getWorkerCount() const {
+		return mWorkerCount;
+	}
+	/// Random key identical in all the workers, for the state they must be able to verify from each other.
+	const std::string &getWorkerSecret() const {
+		return mWorkerSecret;
+	}
+	/// Digest nonce counts shared by the workers, NULL with a single worker.
+	SharedNonceTable *getWorkerNonces() const {
+		return mWorkerNonces;
+	}
 	void start(const std::string &transport_override);
 	virtual void loadConfig(GenericManager *cm);
 	virtual ~Agent();
@@ -158,7 +182,10 @@ class Agent : public IncomingAgent,
 	void incrReplyStat(int status);
 	bool doOnConfigStateChanged(const ConfigValue &conf, ConfigState state);
 	void logEvent(const std::shared_ptr<SipEvent> &ev);
+	void writeEventLog(const std::shared_ptr<EventLog> &evlog);
 	Module *findModule(const std::string &modname) const;
+	/* Computes again which modules process each method, to be called when the configuration of a module changed. */
+	void buildPipelines();
 	int onIncomingMessage(msg_t *msg, const sip_t *sip);
 	nth_engine_t *getHttpEngine() {
 		return mHttpEngine;
@@ -174,10 +201,15 @@ class Agent : public IncomingAgent,
 					   tag_value_t value, ...);
 	void discoverInterfaces();
 	void startLogWriter();
+	void addTransport(const url_t *url, const std::string &currDir, const std::string &mainTlsCertsDir,
+					  bool mainPeerCert, unsigned int tports_idle_timeout, unsigned int incompleteIncomingMessageTimeout,
+					  unsigned int keepAliveInterval, bool reusePort);
 	std::string computeResolvedPublicIp(const std::string &host) const;
 	void checkAllowedParams(const url_t *uri);
 	std::string mServerString;
 	std::list<Module *> mModules;
+	/* Replaced as a whole by buildPipelines(): events being processed keep the pipelines they started with. */
+	std::shared_ptr<const Pipelines> mPipelines;
 	std::list<std::string> mAliases;
 	url_t *mPreferredRouteV4;
 	url_t *mPreferredRouteV6;
@@ -203,6 +235,10 @@ class Agent : public IncomingAgent,
 	EventLogWriter *mLogWriter;
 	DomainRegistrationManager *mDrm;
 	static int messageCallback(nta_agent_magic_t *context, nta_agent_t *agent, msg_t *msg, sip_t *sip);
+	int mWorkerIndex;
+	int mWorkerCount;
+	std::string mWorkerSecret;
+	SharedNonceTable *mWorkerNonces;
 	bool mTerminating;
 };
 
@@ -17,7 +17,9 @@
 */
 
 #include "callcontext-mediarelay.hh"
+#include <algorithm>
 #include <memory>
+#include <sstream>
 #include <string>
 #include "mediarelay.hh"
 #include "h264iframefilter.hh"
@@ -27,7 +29,7 @@ using namespace std;
 
 
 RelayedCall::RelayedCall(const shared_ptr<MediaRelayServer> &server, sip_t *sip) :
-					CallContextBase(sip), mServer(server), mBandwidthThres(0) {
+					CallContextBase(sip), mServer(server), mBandwidthThres(0), mCountH264BytesForwarded(NULL), mCountH264BytesDropped(NULL) {
 	LOGD("New RelayedCall %p", this);
 	mDropTelephoneEvents=false;
 	mIsEstablished=false;
@@ -36,10 +38,13 @@ RelayedCall::RelayedCall(const shared_ptr<MediaRelayServer> &server, sip_t *sip)
 }
 
 /*Enable filtering of H264 Iframes for low bandwidth.*/
-void RelayedCall::enableH264IFrameFiltering(int bandwidth_threshold, int decim, bool onlyIfLastProxy){
+void RelayedCall::enableH264IFrameFiltering(int bandwidth_threshold, int decim, bool onlyIfLastProxy,
+		StatCounter64 *countBytesForwarded, StatCounter64 *countBytesDropped){
 	mBandwidthThres=bandwidth_threshold;
 	mDecim=decim;
 	mH264DecimOnlyIfLastProxy=onlyIfLastProxy;
+	mCountH264BytesForwarded=countBytesForwarded;
+	mCountH264BytesDropped=countBytesDropped;
 }
 
 void RelayedCall::enableTelephoneEventDrooping(bool value){
@@ -197,7 +202,7 @@ void RelayedCall::removeBranch(const string &trId) {
 }
 
 
-bool RelayedCall::isInactive(time_t cur) {
+time_t RelayedCall::getLastActivityTime() {
 	time_t maxtime = 0;
 	shared_ptr<RelaySession> r;
 	for (int i = 0; i < sMaxSessions; ++i) {
@@ -206,23 +211,52 @@ bool RelayedCall::isInactive(time_t cur) {
 		if (r && ((tmp = r->getLastActivityTime()) > maxtime))
 			maxtime = tmp;
 	}
-	if (cur - maxtime > 90){ // this value shall not be less than the time to establish a call.
+	return maxtime;
+}
+
+bool RelayedCall::isInactive(time_t cur) {
+	if (cur - getLastActivityTime() > sInactivityTimeout){
 		return true;
 	}
 	return false;
 }
 
+time_t RelayedCall::getInactivityDeadline(time_t cur) {
+	return max(getLastActivityTime() + sInactivityTimeout + 1, cur + 1);
+}
+
 void RelayedCall::terminate(){
 	int i;
 	for (i = 0; i < sMaxSessions; ++i) {
 		shared_ptr<RelaySession> s = mSessions[i];
 		if (s) {
+			if (mServer->qualityReportsEnabled())
+				writeQualityReport(s);
 			s->unuse();
 			mSessions[i].reset();
 		}
 	}
 }
 
+/* Writes the metrics of the stream measured by the relay as a vq-rtcpxr report of the caller (RFC 6035). */
+void RelayedCall::writeQualityReport(const shared_ptr<RelaySession> &session) {
+	SofiaAutoHome home;
+	ostringstream report;
+	report << "VQSessionReport: CallTerm\r\n";
+	report << "CallID: " << getCallId() << "\r\n";
+	report << "LocalID: " << url_as_string(home.home(), getFrom()->a_url) << "\r\n";
+	report << "RemoteID: " << url_as_string(home.home(), getTo()->a_url) << "\r\n";
+	report << "OrigID: " << url_as_string(home.home(), getFrom()->a_url) << "\r\n";
+	if (!session->writeQualityReport(report))
+		return;
+	report << "DialogID: " << getCallId() << ";to-tag=" << getCalleeTag() << ";from-tag=" << getCallerTag() << "\r\n";
+
+	auto log = make_shared<CallQualityStatisticsLog>(getFrom(), getTo(), report.str().c_str());
+	log->setStatusCode(200, "OK");
+	log->setCompleted();
+	mServer->getAgent()->writeEventLog(log);
+}
+
 RelayedCall::~RelayedCall() {
 	LOGD("Destroy RelayedCall %p", this);
 	terminate();
@@ -258,6 +292,10 @@ void RelayedCall::configureRelayChannel(shared_ptr<RelayChannel> ms, sip_t *sip,
 	int i;
 	for(i=0,mline=session->sdp_media;i<mline_nr;mline=mline->m_next,++i){
 	}
+	if (ms->getMonitor() && mline->m_rtpmaps){
+		sdp_rtpmap_t *rtpmap=mline->m_rtpmaps;
+		ms->getMonitor()->setPayload(rtpmap->rm_pt, rtpmap->rm_encoding ? rtpmap->rm_encoding : "", rtpmap->rm_rate);
+	}
 	if (mBandwidthThres>0){
 		if (mline->m_type==sdp_media_video){
 			if (mline->m_rtpmaps && strcmp(mline->m_rtpmaps->rm_encoding,"H264")==0){
@@ -270,7 +308,7 @@ void RelayedCall::configureRelayChannel(shared_ptr<RelayChannel> ms, sip_t *sip,
 					}else enabled=true;
 					if (enabled) {
 						LOGI("Enabling H264 filtering for channel %p",ms.get());
-						ms->setFilter(make_shared<H264IFrameFilter>(mDecim));
+						ms->setFilter(make_shared<H264IFrameFilter>(mDecim, mCountH264BytesForwarded, mCountH264BytesDropped));
 					}
 				}
 			}
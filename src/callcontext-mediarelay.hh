@@ -57,6 +57,7 @@ public:
 
 	bool checkMediaValid();
 	bool isInactive(time_t cur);
+	time_t getInactivityDeadline(time_t cur);
 	void terminate();
 
 	virtual ~RelayedCall();
@@ -64,19 +65,25 @@ public:
 	void configureRelayChannel(std::shared_ptr<RelayChannel> chan,sip_t *sip, sdp_session_t *session, int mline_nr);
 
 	/*Enable filtering of H264 Iframes for low bandwidth.*/
-	void enableH264IFrameFiltering(int bandwidth_threshold, int decim, bool onlyIfLastProxy);
+	void enableH264IFrameFiltering(int bandwidth_threshold, int decim, bool onlyIfLastProxy,
+		StatCounter64 *countBytesForwarded = NULL, StatCounter64 *countBytesDropped = NULL);
 	/*Enable telephone-event dropping for tls clients*/
 	void enableTelephoneEventDrooping(bool value);
 	const shared_ptr<MediaRelayServer> & getServer()const{
 		return mServer;
 	}
 private:
+	static const time_t sInactivityTimeout = 90; // this value shall not be less than the time to establish a call.
+	time_t getLastActivityTime();
+	void writeQualityReport(const std::shared_ptr<RelaySession> &session);
 	std::shared_ptr<RelaySession> mSessions[sMaxSessions];
 	const shared_ptr<MediaRelayServer> & mServer;
 	int mBandwidthThres;
 	int mDecim;
 	int mEarlyMediaRelayCount;
 	bool mH264DecimOnlyIfLastProxy;
+	StatCounter64 *mCountH264BytesForwarded;
+	StatCounter64 *mCountH264BytesDropped;
 	bool mDropTelephoneEvents;
 	bool mHasSendRecvBack;
 	bool mIsEstablished;
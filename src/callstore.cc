@@ -26,6 +26,8 @@ using namespace std;
 CallContextBase::CallContextBase(sip_t *sip) {
 	su_home_init(&mHome);
 	mFrom = sip_from_dup(&mHome, sip->sip_from);
+	mTo = sip_to_dup(&mHome, sip->sip_to);
+	mCallId = sip->sip_call_id->i_id;
 	mCallHash = sip->sip_call_id->i_hash;
 	mInvCseq = sip->sip_cseq->cs_seq;
 	mResCseq = (uint32_t)-1;
@@ -124,72 +126,125 @@ CallContextBase::~CallContextBase() {
 	}
 }
 
-CallStore::CallStore() : mCountCalls(NULL), mCountCallsFinished(NULL) {
+const time_t CallContextBase::sInactivityCheckPeriod;
+
+CallStore::CallStore() : mInactivityWheel(getCurrentTime()), mCountCalls(NULL), mCountCallsFinished(NULL) {
 }
 
 CallStore::~CallStore() {
 }
 
+template <typename IndexT, typename KeyT>
+void CallStore::unindex(IndexT &index, const KeyT &key, CallList::iterator it) {
+	auto bucket = index.find(key);
+	if (bucket == index.end())
+		return;
+	auto &entries = bucket->second;
+	entries.erase(std::remove(entries.begin(), entries.end(), it), entries.end());
+	if (entries.empty())
+		index.erase(bucket);
+}
+
+CallStore::CallList::iterator CallStore::erase(CallList::iterator it) {
+	unindex(mCallIdIndex, (*it)->getCallHash(), it);
+	unindex(mTagIndex, (*it)->getCallerTag(), it);
+	mInactivityWheel.cancel(it);
+	return mCalls.erase(it);
+}
+
 void CallStore::store(const shared_ptr<CallContextBase> &ctx) {
 	if (mCountCalls)
 		++(*mCountCalls);
-	mCalls.push_back(ctx);
+	auto it = mCalls.insert(mCalls.end(), ctx);
+	mCallIdIndex[ctx->getCallHash()].push_back(it);
+	mTagIndex[ctx->getCallerTag()].push_back(it);
+	mInactivityWheel.schedule(it, ctx->getInactivityDeadline(getCurrentTime()));
 }
 
 shared_ptr<CallContextBase> CallStore::find(Agent *ag, sip_t *sip, bool match_call_id_only) {
-	for (auto it = mCalls.begin(); it != mCalls.end(); ++it) {
-		if ((*it)->match(ag, sip, match_call_id_only))
-			return *it;
+	if (sip->sip_call_id == NULL)
+		return shared_ptr<CallContextBase>();
+	auto bucket = mCallIdIndex.find(sip->sip_call_id->i_hash);
+	if (bucket == mCallIdIndex.end())
+		return shared_ptr<CallContextBase>();
+	for (auto it = bucket->second.begin(); it != bucket->second.end(); ++it) {
+		if ((**it)->match(ag, sip, match_call_id_only))
+			return **it;
 	}
 	return shared_ptr<CallContextBase>();
 }
 
 shared_ptr<CallContextBase> CallStore::findEstablishedDialog(Agent *ag, sip_t *sip) {
-	for (auto it = mCalls.begin(); it != mCalls.end(); ++it) {
-		if ((*it)->match(ag, sip, false, true))
-			return *it;
+	if (sip->sip_from == NULL || sip->sip_from->a_tag == NULL || sip->sip_to == NULL || sip->sip_to->a_tag == NULL)
+		return shared_ptr<CallContextBase>();
+	/* An established dialog is matched on both tags, the caller tag being either the from-tag or, for requests
+	 * sent by the callee, the to-tag.*/
+	const char *tags[2] = {sip->sip_from->a_tag, sip->sip_to->a_tag};
+	for (int i = 0; i < 2; ++i) {
+		auto bucket = mTagIndex.find(tags[i]);
+		if (bucket == mTagIndex.end())
+			continue;
+		for (auto it = bucket->second.begin(); it != bucket->second.end(); ++it) {
+			if ((**it)->match(ag, sip, false, true))
+				return **it;
+		}
 	}
 	return shared_ptr<CallContextBase>();
 }
 
 void CallStore::findAndRemoveExcept(Agent *ag, sip_t *sip, const shared_ptr<CallContextBase> &ctx, bool stateful) {
 	int removed = 0;
-	for (auto it = mCalls.begin(); it != mCalls.end();) {
-		if (*it != ctx && (*it)->match(ag, sip, stateful)) {
+	if (sip->sip_call_id == NULL)
+		return;
+	auto bucket = mCallIdIndex.find(sip->sip_call_id->i_hash);
+	if (bucket == mCallIdIndex.end())
+		return;
+	// copy the candidates, as erase() modifies the bucket.
+	vector<CallList::iterator> candidates = bucket->second;
+	for (auto it = candidates.begin(); it != candidates.end(); ++it) {
+		if (**it != ctx && (**it)->match(ag, sip, stateful)) {
 			if (mCountCallsFinished)
 				++(*mCountCallsFinished);
 			LOGD("CallStore::findAndRemoveExcept() removing CallContext %p", ctx.get());
-			it = mCalls.erase(it);
+			erase(*it);
 			++removed;
-		} else
-			++it;
+		}
 	}
 	LOGD("Removed %d maching call contexts from store", removed);
 }
 
 void CallStore::remove(const shared_ptr<CallContextBase> &ctx) {
-	auto it = std::find(mCalls.begin(), mCalls.end(), ctx);
-	if (it != mCalls.end()) {
+	auto bucket = mCallIdIndex.find(ctx->getCallHash());
+	if (bucket == mCallIdIndex.end())
+		return;
+	auto &entries = bucket->second;
+	auto entry = std::find_if(entries.begin(), entries.end(),
+							  [&ctx](const CallList::iterator &it) { return *it == ctx; });
+	if (entry != entries.end()) {
+		CallList::iterator it = *entry;
 		LOGD("CallStore::remove() removing CallContext %p", ctx.get());
 		if (mCountCallsFinished)
 			++(*mCountCallsFinished);
 		(*it)->terminate();
-		mCalls.erase(it);
+		erase(it);
 	}
 }
 
 void CallStore::removeAndDeleteInactives() {
 	time_t cur = getCurrentTime();
-	for (auto it = mCalls.begin(); it != mCalls.end();) {
+	/* Only the contexts whose deadline is reached are checked. The ones that had activity meanwhile are checked
+	 * again at their new deadline.*/
+	mInactivityWheel.advance(cur, [this, cur](const CallList::iterator &it, time_t deadline) {
 		if ((*it)->isInactive(cur)) {
 			LOGD("CallStore::removeAndDeleteInactives() removing CallContext %p", (*it).get());
 			if (mCountCallsFinished)
 				++(*mCountCallsFinished);
 			(*it)->terminate();
-			it = mCalls.erase(it);
-		} else
-			++it;
-	}
+			erase(it);
+		} else {
+			mInactivityWheel.schedule(it, (*it)->getInactivityDeadline(cur));
+		}
+	});
 }
 
 void CallStore::dump() {
@@ -20,7 +20,10 @@
 #define callstore_hh
 
 #include "agent.hh"
+#include "utils/timingwheel.hh"
 #include <list>
+#include <unordered_map>
+#include <vector>
 
 class CallContextBase {
   public:
@@ -35,6 +38,11 @@ class CallContextBase {
 	virtual bool isInactive(time_t cur) {
 		return false;
 	}
+	/* Time from which isInactive() may become true if nothing happens until then, after cur, called when the store
+	 * checks the context. The default is to check it again after sInactivityCheckPeriod seconds. */
+	virtual time_t getInactivityDeadline(time_t cur) {
+		return cur + sInactivityCheckPeriod;
+	}
 	virtual void terminate() {
 	}
 	virtual ~CallContextBase();
@@ -47,11 +55,30 @@ class CallContextBase {
 	uint32_t getViaCount() const {
 		return mViaCount;
 	}
+	/// Hash of the Call-ID, as computed by sofia-sip (sip_call_id_t::i_hash).
+	uint32_t getCallHash() const {
+		return mCallHash;
+	}
+	const std::string &getCallId() const {
+		return mCallId;
+	}
+	/// From and To headers of the request that created the call.
+	const sip_from_t *getFrom() const {
+		return mFrom;
+	}
+	const sip_to_t *getTo() const {
+		return mTo;
+	}
+
+  protected:
+	static const time_t sInactivityCheckPeriod = 5;
 
   private:
 	su_home_t mHome;
 	sip_from_t *mFrom;
+	sip_to_t *mTo;
 	msg_t *mInvite;
+	std::string mCallId;
 	uint32_t mCallHash;
 	uint32_t mInvCseq;
 	uint32_t mResCseq;
@@ -84,7 +111,24 @@ class CallStore {
 	int size();
 
   private:
-	std::list<std::shared_ptr<CallContextBase>> mCalls;
+	typedef std::list<std::shared_ptr<CallContextBase>> CallList;
+	/* Indexes referencing elements of mCalls. Entries of a bucket are kept in insertion order, so that
+	 * lookups return the oldest matching context, as a linear scan of mCalls would. */
+	typedef std::unordered_map<uint32_t, std::vector<CallList::iterator>> CallIdIndex;
+	typedef std::unordered_map<std::string, std::vector<CallList::iterator>> TagIndex;
+	struct CallListIteratorHash {
+		size_t operator()(const CallList::iterator &it) const {
+			return std::hash<CallContextBase *>()(it->get());
+		}
+	};
+	CallList::iterator erase(CallList::iterator it);
+	template <typename IndexT, typename KeyT>
+	static void unindex(IndexT &index, const KeyT &key, CallList::iterator it);
+	CallList mCalls;
+	CallIdIndex mCallIdIndex; // Call-ID hash -> contexts
+	TagIndex mTagIndex;		  // caller tag (From tag of the initial INVITE) -> contexts
+	/* Contexts are checked for inactivity when their deadline is reached, rather than all of them periodically. */
+	TimingWheel<CallList::iterator, CallListIteratorHash> mInactivityWheel;
 	StatCounter64 *mCountCalls;
 	StatCounter64 *mCountCallsFinished;
 };
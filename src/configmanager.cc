@@ -468,6 +468,13 @@ StatCounter64 *GenericStruct::createStat(const string &name, const string &help)
 	addChild(val);
 	return val;
 }
+
+StatGauge *GenericStruct::createGauge(const string &name, const string &help) {
+	StatGauge *val = new StatGauge(name, help, Oid::oidFromHashedString(name));
+	addChild(val);
+	return val;
+}
+
 pair<StatCounter64 *, StatCounter64 *> GenericStruct::createStatPair(const string &name, const string &help) {
 	return make_pair(createStat(name, help), createStat(name + "-finished", help + " Finished."));
 }
@@ -477,6 +484,20 @@ unique_ptr<StatPair> GenericStruct::createStats(const string &name, const string
 	auto finish = createStat(name + "-finished", help + " Finished.");
 	return unique_ptr<StatPair>(new StatPair(start, finish));
 }
+
+unique_ptr<StatLatency> GenericStruct::createLatencyStats(const string &name, const string &help) {
+	auto histogram = make_shared<LatencyHistogram>();
+	auto count = createStat(name + "-count", help + " Number of samples.");
+	string p50Name = name + "-p50";
+	auto p50 = new StatPercentile(p50Name, help + " Median, in microseconds.", Oid::oidFromHashedString(p50Name),
+								  histogram, 50);
+	addChild(p50);
+	string p99Name = name + "-p99";
+	auto p99 = new StatPercentile(p99Name, help + " 99th percentile, in microseconds.",
+								  Oid::oidFromHashedString(p99Name), histogram, 99);
+	addChild(p99);
+	return unique_ptr<StatLatency>(new StatLatency(histogram, count, p50, p99));
+}
 /*
 void GenericStruct::addChildrenValues(StatItemDescriptor *items){
 	for (;items->name!=NULL;items++){
@@ -593,9 +614,21 @@ void ConfigInt::write(int value) {
 	set(oss.str());
 }
 
+atomic<int> StatCounter64::sNextThreadSlot(0);
+
 StatCounter64::StatCounter64(const string &name, const string &help, oid oid_index)
 	: GenericEntry(name, Counter64, help, oid_index) {
-	mValue = 0;
+	mStorage = new char[sSlotCount * sizeof(Slot) + sCacheLineSize];
+	uintptr_t aligned = ((uintptr_t)mStorage + sCacheLineSize - 1) & ~(uintptr_t)(sCacheLineSize - 1);
+	mSlots = reinterpret_cast<Slot *>(aligned);
+	for (int i = 0; i < sSlotCount; ++i) {
+		new (&mSlots[i]) Slot();
+		mSlots[i].value.store(0, memory_order_relaxed);
+	}
+}
+
+StatCounter64::~StatCounter64() {
+	delete[] mStorage;
 }
 
 ConfigString::ConfigString(const string &name, const string &help, const string &default_value, oid oid_index)
@@ -781,6 +814,18 @@ GenericManager::GenericManager()
 		 "details. If sending large packets over UDP is not a problem, then set a big value such as 65535. "
 		 "Unlike the recommandation of the RFC, the default value of UDP MTU is 1460 in Flexisip (instead of 1300).",
 		 "1460"},
+		{Integer, "workers",
+		 "Number of SIP worker processes. Each worker runs its own SIP stack and module chain, and all of them share the "
+		 "listening ports of the transports with SO_REUSEPORT. A value greater than 1 requires a shared registrar "
+		 "database (module::Registrar/db-implementation=redis). Digest nonces of module::Authentication are signed "
+		 "with a key shared by the workers and their counts are kept in shared memory, so that a challenge can be "
+		 "answered through any of them but a request can't be replayed through another.",
+		 "1"},
+		{Integer, "workers-port-base",
+		 "When workers is greater than 1, each worker also listens on a private port for every transport, used in Via "
+		 "and Record-Route so that responses and in-dialog requests reach the worker owning the transaction. "
+		 "Private ports are allocated from this value: base + transport index * workers + worker index.",
+		 "15060"},
 		config_item_end};
 
 	static ConfigItemDescriptor cluster_conf[] = {
@@ -1160,12 +1205,14 @@ int StatCounter64::handleSnmpRequest(netsnmp_mib_handler *handler, netsnmp_handl
 	//	LOGD("counter64 handleSnmpRequest %s -> %lu", reginfo->handlerName, read());
 
 	switch (reqinfo->mode) {
-		case MODE_GET:
+		case MODE_GET: {
 			struct counter64 counter;
-			counter.high = read() >> 32;
-			counter.low = read() & 0x00000000FFFFFFFF;
+			uint64_t value = read();
+			counter.high = value >> 32;
+			counter.low = value & 0x00000000FFFFFFFF;
 			snmp_set_var_typed_value(requests->requestvb, ASN_COUNTER64, (const u_char *)&counter, sizeof(counter));
 			break;
+		}
 		default:
 			/* we should never get here, so this is a really bad error */
 			snmp_log(LOG_ERR, "unknown mode (%d)\n", reqinfo->mode);
@@ -44,6 +44,7 @@
 #include <typeinfo>
 #include <cxxabi.h>
 #include <memory>
+#include <atomic>
 
 #include "common.hh"
 
@@ -64,6 +65,7 @@ extern oid company_id;
 
 #include "expressionparser.hh"
 #include "utils/flexisip-exception.hh"
+#include "utils/histogram.hh"
 
 enum class ConfigState { Check, Changed, Reset, Commited };
 class ConfigValue;
@@ -296,14 +298,18 @@ template <typename _retType> _retType &GenericEntriesGetter::find(const std::str
 
 class ConfigValue;
 class StatCounter64;
+class StatGauge;
 struct StatPair;
+struct StatLatency;
 class GenericStruct : public GenericEntry {
   public:
 	GenericStruct(const std::string &name, const std::string &help, oid oid_index);
 	GenericEntry *addChild(GenericEntry *c);
 	StatCounter64 *createStat(const std::string &name, const std::string &help);
+	StatGauge *createGauge(const std::string &name, const std::string &help);
 	std::pair<StatCounter64 *, StatCounter64 *> createStatPair(const std::string &name, const std::string &help);
 	std::unique_ptr<StatPair> createStats(const std::string &name, const std::string &help);
+	std::unique_ptr<StatLatency> createLatencyStats(const std::string &name, const std::string &help);
 
 	void addChildrenValues(ConfigItemDescriptor *items);
 	void addChildrenValues(ConfigItemDescriptor *items, bool hashed);
@@ -331,39 +337,70 @@ class RootConfigStruct : public GenericStruct {
 	virtual ~RootConfigStruct();
 };
 
+/**
+ * Counter that can be updated from any thread without lock. Each thread increments its own slot, on its own cache
+ * line, and reading sums all the slots. Threads beyond sSlotCount share slots, which stay correct being atomic.
+ */
 class StatCounter64 : public GenericEntry {
   public:
 	StatCounter64(const std::string &name, const std::string &help, oid oid_index);
+	StatCounter64(const StatCounter64 &) = delete;
+	~StatCounter64();
 #ifdef ENABLE_SNMP
 	virtual int handleSnmpRequest(netsnmp_mib_handler *, netsnmp_handler_registration *, netsnmp_agent_request_info *,
 								  netsnmp_request_info *);
 #endif
 	virtual void mibFragment(std::ostream &ost, std::string spacing) const;
 	void setParent(GenericEntry *parent);
-	uint64_t read() {
-		return mValue;
+	virtual uint64_t read() {
+		uint64_t sum = 0;
+		for (int i = 0; i < sSlotCount; ++i) {
+			sum += mSlots[i].value.load(std::memory_order_relaxed);
+		}
+		return sum;
 	}
+	/* Not atomic with respect to concurrent increments, meant for values set by a single thread. */
 	void set(uint64_t val) {
-		mValue = val;
+		mSlots[0].value.store(val, std::memory_order_relaxed);
+		for (int i = 1; i < sSlotCount; ++i) {
+			mSlots[i].value.store(0, std::memory_order_relaxed);
+		}
 	}
 	void operator++() {
-		++mValue;
+		incr();
 	}
 	void operator++(int) {
-		mValue++;
+		incr();
 	}
 	void operator--() {
-		--mValue;
+		/* slots wrap around, their sum stays right */
+		mSlots[threadSlot()].value.fetch_sub(1, std::memory_order_relaxed);
 	}
 	void operator--(int) {
-		mValue--;
+		--*this;
 	}
 	inline void incr() {
-		mValue++;
+		mSlots[threadSlot()].value.fetch_add(1, std::memory_order_relaxed);
+	}
+	inline void add(uint64_t value) {
+		mSlots[threadSlot()].value.fetch_add(value, std::memory_order_relaxed);
 	}
 
   private:
-	uint64_t mValue;
+	static const int sSlotCount = 16;
+	static const size_t sCacheLineSize = 64;
+	struct Slot {
+		std::atomic<uint64_t> value;
+		char padding[sCacheLineSize - sizeof(std::atomic<uint64_t>)];
+	};
+	static int threadSlot() {
+		static thread_local int slot = sNextThreadSlot.fetch_add(1, std::memory_order_relaxed) % sSlotCount;
+		return slot;
+	}
+
+	static std::atomic<int> sNextThreadSlot;
+	char *mStorage;
+	Slot *mSlots; /* sSlotCount slots in mStorage, aligned on a cache line */
 };
 
 struct StatPair {
@@ -372,6 +409,7 @@ struct StatPair {
 	StatPair(StatCounter64 *istart, StatCounter64 *ifinish) : start(istart), finish(ifinish) {
 	}
 
+	/* both counters are lock-free, the pair may be updated from any thread */
 	inline void incrStart() {
 		start->incr();
 	}
@@ -380,6 +418,46 @@ struct StatPair {
 	}
 };
 
+/* Stat whose value goes up and down, given with set() rather than counted. */
+class StatGauge : public StatCounter64 {
+  public:
+	StatGauge(const std::string &name, const std::string &help, oid oid_index) : StatCounter64(name, help, oid_index) {
+	}
+};
+
+/* Percentile of a latency histogram, computed when read. */
+class StatPercentile : public StatGauge {
+  public:
+	StatPercentile(const std::string &name, const std::string &help, oid oid_index,
+				   const std::shared_ptr<const LatencyHistogram> &histogram, double percent)
+		: StatGauge(name, help, oid_index), mHistogram(histogram), mPercent(percent) {
+	}
+	virtual uint64_t read() {
+		return mHistogram->percentile(mPercent);
+	}
+
+  private:
+	std::shared_ptr<const LatencyHistogram> mHistogram;
+	double mPercent;
+};
+
+/* Number of samples of a duration in microseconds, with its median and 99th percentile. */
+struct StatLatency {
+	std::shared_ptr<LatencyHistogram> const histogram;
+	StatCounter64 *const count;
+	StatCounter64 *const p50;
+	StatCounter64 *const p99;
+	StatLatency(const std::shared_ptr<LatencyHistogram> &ihistogram, StatCounter64 *icount, StatCounter64 *ip50,
+				StatCounter64 *ip99)
+		: histogram(ihistogram), count(icount), p50(ip50), p99(ip99) {
+	}
+
+	inline void record(uint64_t us) {
+		histogram->record(us);
+		count->incr();
+	}
+};
+
 class StatFinishListener {
 	std::unordered_set<StatCounter64 *> mStatList;
 
@@ -130,6 +130,7 @@ void SipEvent::suspendProcessing() {
 	LOGD("Suspend SipEvent %p", this);
 	if (mState == STARTED) {
 		mState = SUSPENDED;
+		mSuspendTime = chrono::steady_clock::now();
 	} else {
 		LOGA("Can't suspendProcessing: wrong state %s", stateStr(mState).c_str());
 	}
@@ -203,8 +204,13 @@ void RequestSipEvent::reply(int status, char const *phrase, tag_type_t tag, tag_
 	} else {
 		SLOGD << "The Request SIP message is not replied";
 	}
-	if (status >= 200)
+	if (status >= 200) {
+		if (mState == SUSPENDED && mCurrModule) {
+			/*a module replying after suspending the event does not go through injectRequestEvent()*/
+			mAgent->recordSuspendedTime(shared_from_this(), Agent::pipelineIndex(getSip()->sip_request->rq_method));
+		}
 		terminateProcessing();
+	}
 }
 
 void RequestSipEvent::setIncomingAgent(const shared_ptr<IncomingAgent> &agent) {
@@ -18,6 +18,7 @@
 #ifndef event_hh
 #define event_hh
 
+#include <chrono>
 #include <memory>
 #include <list>
 #include <string>
@@ -153,6 +154,9 @@ class SipEvent : public std::enable_shared_from_this<SipEvent> {
 	std::shared_ptr<OutgoingAgent> mOutgoingAgent;
 	std::shared_ptr<EventLog> mEventLog;
 	Agent *mAgent;
+	/* Set by suspendProcessing(), cleared once the suspension is recorded. Not copied: a copy of a suspended event,
+	 * such as a branch of a fork, is not the event that was suspended. */
+	std::chrono::steady_clock::time_point mSuspendTime;
 
 	enum State {
 		STARTED,
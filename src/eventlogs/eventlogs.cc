@@ -61,13 +61,21 @@ EventLog::Init::Init() {
 		{String, "odb-password", "Password", ""},
 		{String, "odb-host", "Host", ""},
 		{Integer, "odb-port", "Port", ""},
-		{Integer, "nb-thread-max", "Number of thread max for writing in database", "500"},
+		{Integer, "nb-thread-max", "Unused: logs are written in database by a single thread.", "500"},
+		{Integer, "odb-queue-size", "Maximum number of logs waiting to be written in database. Logs arriving when the "
+									"queue is full are dropped. At most 1048576.",
+		 "4096"},
+		{Integer, "odb-batch-size", "Maximum number of logs written in database in a single transaction.", "100"},
 		config_item_end};
 	GenericStruct *ev = new GenericStruct(
 		"event-logs",
 		"Event logs contain per domain and user information about processed registrations, calls and messages.", 0);
 	GenericManager::get()->getRoot()->addChild(ev);
 	ev->addChildrenValues(items);
+	ev->deprecateChild("nb-thread-max");
+	ev->createStat("count-database-logs-written", "Number of logs written in database.");
+	ev->createStat("count-database-logs-dropped", "Number of logs dropped because too many were waiting to be written in database.");
+	ev->createStat("count-database-logs-failed", "Number of logs that could not be written in database.");
 }
 
 EventLog::EventLog() {
@@ -485,9 +493,22 @@ void FilesystemEventLogWriter::write(const std::shared_ptr<EventLog> &evlog) {
 #ifdef HAVE_ODB
 // Data Base EventLog Writer
 
+/* The queue is allocated at once, its size is kept between 1 and about a million logs. */
+static size_t readQueueSize() {
+	GenericStruct *config = GenericManager::get()->getRoot()->get<GenericStruct>("event-logs");
+	int size = config->get<ConfigInt>("odb-queue-size")->read();
+	return min(max(1, size), 1 << 20);
+}
+
 DataBaseEventLogWriter::DataBaseEventLogWriter(const std::string &db_name, const std::string &db_user,
 											   const std::string &db_password, const std::string &db_host, int db_port)
-	: mIsReady(false) {
+	: mIsReady(false), mQueue(readQueueSize()),
+	  mRunning(true), mWaiting(false) {
+	GenericStruct *config = GenericManager::get()->getRoot()->get<GenericStruct>("event-logs");
+	mBatchSize = max(1, config->get<ConfigInt>("odb-batch-size")->read());
+	mCountWritten = config->get<StatCounter64>("count-database-logs-written");
+	mCountDropped = config->get<StatCounter64>("count-database-logs-dropped");
+	mCountFailed = config->get<StatCounter64>("count-database-logs-failed");
 	try {
 		mDatabase =
 			unique_ptr<odb::database>(new odb::mysql::database(db_user, db_password, db_name, db_host, db_port));
@@ -526,62 +547,112 @@ DataBaseEventLogWriter::DataBaseEventLogWriter(const std::string &db_name, const
 	} catch (const odb::exception &e) {
 		LOGE("Fail to connect to the database: %s.", e.what());
 	}
+	if (mIsReady)
+		mThread = thread(&DataBaseEventLogWriter::run, this);
+}
+
+DataBaseEventLogWriter::~DataBaseEventLogWriter() {
+	if (mThread.joinable()) {
+		mMutex.lock();
+		mRunning = false;
+		mCond.notify_one();
+		mMutex.unlock();
+		mThread.join();
+	}
 }
 
 bool DataBaseEventLogWriter::isReady() const {
 	return mIsReady;
 }
 
-void DataBaseEventLogWriter::writeLogs() {
-	mMutex.lock();
-	shared_ptr<EventLog> evlog = mListLogs.front();
-	mListLogs.pop();
-	mMutex.unlock();
-
-	EventLogDb *ev = NULL;
+EventLogDb *DataBaseEventLogWriter::toDb(const shared_ptr<EventLog> &evlog) {
 	if (typeid(*evlog.get()) == typeid(RegistrationLog)) {
-		ev = new RegistrationLogDb(static_pointer_cast<RegistrationLog>(evlog));
+		return new RegistrationLogDb(static_pointer_cast<RegistrationLog>(evlog));
 	} else if (typeid(*evlog.get()) == typeid(CallLog)) {
-		ev = new CallLogDb(static_pointer_cast<CallLog>(evlog));
+		return new CallLogDb(static_pointer_cast<CallLog>(evlog));
 	} else if (typeid(*evlog.get()) == typeid(MessageLog)) {
-		ev = new MessageLogDb(static_pointer_cast<MessageLog>(evlog));
+		return new MessageLogDb(static_pointer_cast<MessageLog>(evlog));
 	} else if (typeid(*evlog.get()) == typeid(AuthLog)) {
-		ev = new AuthLogDb(static_pointer_cast<AuthLog>(evlog));
+		return new AuthLogDb(static_pointer_cast<AuthLog>(evlog));
 	} else if (typeid(*evlog.get()) == typeid(CallQualityStatisticsLog)) {
-		ev = new CallQualityStatisticsLogDb(static_pointer_cast<CallQualityStatisticsLog>(evlog));
+		return new CallQualityStatisticsLogDb(static_pointer_cast<CallQualityStatisticsLog>(evlog));
 	}
+	return NULL;
+}
 
-	if (ev) {
-		if (mIsReady) {
-			try {
-				transaction t(mDatabase->begin());
-				mDatabase->persist(*ev);
-				t.commit();
-			} catch (const odb::exception &e) {
-				LOGE("DataBaseEventLogWriter: could not write log in database: %s", e.what());
-			}
+void DataBaseEventLogWriter::writeLogs(vector<shared_ptr<EventLog>> &logs) {
+	vector<unique_ptr<EventLogDb>> evs;
+	for (auto it = logs.begin(); it != logs.end(); ++it) {
+		EventLogDb *ev = toDb(*it);
+		if (ev)
+			evs.push_back(unique_ptr<EventLogDb>(ev));
+	}
+	logs.clear();
+	if (evs.empty())
+		return;
+
+	try {
+		transaction t(mDatabase->begin());
+		for (auto it = evs.begin(); it != evs.end(); ++it) {
+			mDatabase->persist(**it);
+		}
+		t.commit();
+		mCountWritten->add(evs.size());
+		return;
+	} catch (const odb::exception &e) {
+		LOGE("DataBaseEventLogWriter: could not write %zu logs in database: %s", evs.size(), e.what());
+	}
+	if (evs.size() == 1) {
+		++*mCountFailed;
+		return;
+	}
+	/*the batch is lost because of one of its logs or of the connection, write them separately*/
+	for (auto it = evs.begin(); it != evs.end(); ++it) {
+		try {
+			transaction t(mDatabase->begin());
+			mDatabase->persist(**it);
+			t.commit();
+			++*mCountWritten;
+		} catch (const odb::exception &e) {
+			LOGE("DataBaseEventLogWriter: could not write log in database: %s", e.what());
+			++*mCountFailed;
 		}
-		delete ev;
 	}
 }
 
-void *DataBaseEventLogWriter::threadFunc(void *arg) {
-	DataBaseEventLogWriter *dbLW = (DataBaseEventLogWriter *)arg;
-	dbLW->writeLogs();
-	return NULL;
+void DataBaseEventLogWriter::run() {
+	vector<shared_ptr<EventLog>> logs;
+	shared_ptr<EventLog> evlog;
+	logs.reserve(mBatchSize);
+	for (;;) {
+		while (logs.size() < mBatchSize && mQueue.tryPop(evlog)) {
+			logs.push_back(move(evlog));
+		}
+		if (!logs.empty()) {
+			writeLogs(logs);
+			continue;
+		}
+		unique_lock<mutex> lock(mMutex);
+		if (!mRunning)
+			break;
+		/*write() checks mWaiting after queueing and the queue is checked after setting it, so that a log queued
+		 meanwhile is either seen or notified*/
+		mWaiting = true;
+		mCond.wait(lock, [this] { return !mRunning || !mQueue.empty(); });
+		mWaiting = false;
+	}
 }
 
 void DataBaseEventLogWriter::write(const std::shared_ptr<EventLog> &evlog) {
-	unsigned int nb_thread_max =
-		GenericManager::get()->getRoot()->get<GenericStruct>("event-logs")->get<ConfigInt>("nb-thread-max")->read();
-	mMutex.lock();
-	if (mListLogs.size() < nb_thread_max) {
-		mListLogs.push(evlog);
-		mMutex.unlock();
-		thread t = thread(DataBaseEventLogWriter::threadFunc, this);
-		t.detach();
-	} else {
-		mMutex.unlock();
+	shared_ptr<EventLog> queued = evlog;
+	if (!mQueue.tryPush(move(queued))) {
+		++*mCountDropped;
+		return;
+	}
+	atomic_thread_fence(memory_order_seq_cst);
+	if (mWaiting) {
+		lock_guard<mutex> lock(mMutex);
+		mCond.notify_one();
 	}
 }
 
@@ -23,10 +23,14 @@
 #include <sofia-sip/sip_protos.h>
 
 #include "../common.hh"
+#include "../utils/bounded-queue.hh"
 #include <string>
 #include <memory>
-#include <queue>
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 #ifdef HAVE_ODB
 #include <odb/database.hxx>
@@ -159,20 +163,37 @@ class FilesystemEventLogWriter : public EventLogWriter {
 };
 
 #if HAVE_ODB
+class EventLogDb;
+
+/**
+ * Writes the event logs in a database from a dedicated thread. write() only queues the log, dropping it if the
+ * queue is full, and the thread persists the queued logs by batches, each one in a single transaction.
+ */
 class DataBaseEventLogWriter : public EventLogWriter {
   public:
 	DataBaseEventLogWriter(const std::string &db_name, const std::string &db_user, const std::string &db_password,
 						   const std::string &db_host, int db_port);
+	/* Writes the logs still queued before returning. */
+	~DataBaseEventLogWriter();
 	virtual void write(const std::shared_ptr<EventLog> &evlog);
-	void static *threadFunc(void *arg);
 	bool isReady() const;
 
   private:
+	static EventLogDb *toDb(const std::shared_ptr<EventLog> &evlog);
+	void run();
+	void writeLogs(std::vector<std::shared_ptr<EventLog>> &logs);
 	bool mIsReady;
-	void writeLogs();
-	std::mutex mMutex;
 	std::unique_ptr<odb::database> mDatabase;
-	std::queue<std::shared_ptr<EventLog>> mListLogs;
+	BoundedQueue<std::shared_ptr<EventLog>> mQueue;
+	size_t mBatchSize;
+	std::thread mThread;
+	bool mRunning;		   /* protected by mMutex */
+	std::atomic<bool> mWaiting; /* whether the thread waits for logs to be queued */
+	std::mutex mMutex;
+	std::condition_variable mCond;
+	StatCounter64 *mCountWritten;
+	StatCounter64 *mCountDropped;
+	StatCounter64 *mCountFailed;
 };
 #endif
 
@@ -25,60 +25,146 @@
 #define TYPE_FU_A 28   /*fragmented unit 0x1C*/
 #define TYPE_STAP_A 24 /*single time aggregation packet  0x18*/
 
+#define FU_START 0x80
+#define FU_END 0x40
+
 static inline uint8_t nal_header_get_type(const uint8_t *h) {
 	return (*h) & ((1 << 5) - 1);
 }
 
-H264IFrameFilter::H264IFrameFilter(int skipcount) : mSkipCount(skipcount), mLastIframeTimestamp(0), mIframeCount(0) {
+H264IFrameFilter::H264IFrameFilter(int skipcount, StatCounter64 *countForwarded, StatCounter64 *countDropped)
+	: mSkipCount(skipcount > 0 ? skipcount : 1), mSsrc(0), mStarted(false), mFrameTimestamp(0), mFrameEnded(false),
+	  mFrameIsIFrame(false), mFrameKept(false), mFragmentKept(false), mIframeCount(0), mBytesForwarded(0),
+	  mBytesDropped(0), mCountForwarded(countForwarded), mCountDropped(countDropped) {
 }
 
-bool H264IFrameFilter::onOutgoingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen) {
-	const uint8_t *p = data;
-	bool ret = false;
-	bool isIFrame = false;
-	if (size < 16)
-		return true; // not a RTP h264 packet probably
-	uint32_t ts = ntohl(((uint32_t *)p)[1]);
-	p += 12;
-	uint8_t ptype = nal_header_get_type(p);
-	switch (ptype) {
+H264IFrameFilter::~H264IFrameFilter() {
+	LOGD("H264IFrameFilter [%p] forwarded %llu bytes and dropped %llu bytes, over %i I-frames", this,
+		 (unsigned long long)mBytesForwarded, (unsigned long long)mBytesDropped, mIframeCount);
+}
+
+H264IFrameFilter::NalContent H264IFrameFilter::getNalTypeContent(uint8_t type) {
+	switch (type) {
 		case TYPE_IDR:
-			isIFrame = true;
-		case TYPE_PPS:
+			return Idr;
 		case TYPE_SPS:
-			ret = true;
-			break;
-		case TYPE_FU_A: {
-			// need to go deeper in the packet
-			p++;
-			switch (nal_header_get_type(p)) {
-				case TYPE_IDR:
-					isIFrame = true;
-				case TYPE_PPS:
-				case TYPE_SPS:
-					ret = true;
-					break;
-				default:
-					break;
-			}
-		} break;
-		case TYPE_STAP_A:
-			LOGW("H264 STAP-A packets not properly handled.");
-			ret = true; // anyway these are usually small NALs
-			break;
+		case TYPE_PPS:
+			return ParameterSets;
 		default:
+			return Other;
+	}
+}
+
+/* Returns the NalContent flags of the NAL units in the RTP payload. */
+int H264IFrameFilter::getNalContent(const uint8_t *payload, size_t size) {
+	if (size < 1)
+		return Other;
+	uint8_t type = nal_header_get_type(payload);
+	if (type == TYPE_FU_A) {
+		if (size < 2)
+			return Other;
+		return getNalTypeContent(nal_header_get_type(payload + 1));
+	}
+	if (type != TYPE_STAP_A)
+		return getNalTypeContent(type);
+
+	/*aggregated NAL units, each one preceded by its size on 16 bits*/
+	int content = 0;
+	size_t offset = 1;
+	while (offset + 2 < size) {
+		size_t nalSize = (payload[offset] << 8) | payload[offset + 1];
+		offset += 2;
+		if (nalSize == 0 || offset + nalSize > size)
 			break;
+		content |= getNalTypeContent(nal_header_get_type(payload + offset));
+		offset += nalSize;
 	}
-	if (isIFrame) {
-		if (mLastIframeTimestamp != ts || mIframeCount == 0) {
+	/*a malformed aggregate is forwarded, as parameter sets would*/
+	return content ? content : ParameterSets;
+}
+
+/* Returns whether the packet must be forwarded. */
+bool H264IFrameFilter::filter(const uint8_t *data, size_t size) {
+	if (size < 12 || (data[0] >> 6) != 2)
+		return true; // not a RTP packet
+	size_t offset = 12 + 4 * (data[0] & 0x0f);
+	if (data[0] & 0x10) {
+		/*header extension*/
+		if (offset + 4 > size)
+			return true;
+		offset += 4 + 4 * ((data[offset + 2] << 8) | data[offset + 3]);
+	}
+	if (data[0] & 0x20) {
+		/*padding, its length is the last byte*/
+		size_t padding = data[size - 1];
+		if (padding > size)
+			return true;
+		size -= padding;
+	}
+	if (offset >= size)
+		return true;
+	bool marker = (data[1] & 0x80) != 0;
+	uint32_t ts = ntohl(((const uint32_t *)data)[1]);
+	uint32_t ssrc = ntohl(((const uint32_t *)data)[2]);
+	const uint8_t *payload = data + offset;
+	size_t payloadSize = size - offset;
+
+	if (!mStarted || ssrc != mSsrc) {
+		if (mStarted)
+			LOGD("H264IFrameFilter [%p]: new stream with ssrc %u", this, ssrc);
+		mSsrc = ssrc;
+		mIframeCount = 0;
+		mFragmentKept = false;
+		mFrameEnded = true;
+		mStarted = true;
+	}
+	if (mFrameEnded || ts != mFrameTimestamp) {
+		mFrameTimestamp = ts;
+		mFrameIsIFrame = false;
+		mFrameKept = false;
+	}
+	mFrameEnded = marker;
+
+	int content = getNalContent(payload, payloadSize);
+	if (content & Idr) {
+		if (!mFrameIsIFrame) {
 			LOGD("Seeing a new I-frame");
-			mLastIframeTimestamp = ts;
+			mFrameIsIFrame = true;
 			mIframeCount++;
+			mFrameKept = (mIframeCount - 1) % mSkipCount == 0;
 		}
-		if ((mIframeCount - 1) % mSkipCount != 0)
-			ret = false;
 	}
 
+	bool keep;
+	if (mFrameIsIFrame) {
+		/*everything belonging to a kept I-frame, parameter sets included*/
+		keep = mFrameKept;
+	} else {
+		keep = (content & ParameterSets) != 0;
+	}
+	if (nal_header_get_type(payload) == TYPE_FU_A && payloadSize >= 2) {
+		/*the rest of a fragmented NAL unit is useless without its start*/
+		if (payload[1] & FU_START)
+			mFragmentKept = keep;
+		else
+			keep = keep && mFragmentKept;
+		if (payload[1] & FU_END)
+			mFragmentKept = false;
+	}
+	return keep;
+}
+
+bool H264IFrameFilter::onOutgoingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen) {
+	bool ret = filter(data, size);
+	if (ret) {
+		mBytesForwarded += size;
+		if (mCountForwarded)
+			mCountForwarded->add(size);
+	} else {
+		mBytesDropped += size;
+		if (mCountDropped)
+			mCountDropped->add(size);
+	}
 	return ret;
 }
 
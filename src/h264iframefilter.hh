@@ -21,18 +21,45 @@
 
 #include "mediarelay.hh"
 
+/**
+ * Filter of an H264 stream keeping only one I-frame over skipcount, along with the parameter sets. Single NAL,
+ * STAP-A and FU-A packets are understood: a packet belongs to an I-frame if one of its NAL units is an IDR slice.
+ * Frames are delimited by the RTP timestamp and marker bit, the stream being restarted when its SSRC changes.
+ */
 class H264IFrameFilter : public MediaFilter {
   public:
-	H264IFrameFilter(int skipcount);
+	/* The bytes forwarded and dropped are also added to the optional counters. */
+	H264IFrameFilter(int skipcount, StatCounter64 *countForwarded = NULL, StatCounter64 *countDropped = NULL);
+	~H264IFrameFilter();
 	/// Should return false if the incoming packet must not be transfered.
 	bool onIncomingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen);
 	/// Should return false if the packet output must not be sent.
 	bool onOutgoingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen);
+	uint64_t getForwardedBytes() const {
+		return mBytesForwarded;
+	}
+	uint64_t getDroppedBytes() const {
+		return mBytesDropped;
+	}
 
   private:
+	enum NalContent { ParameterSets = 1, Idr = 2, Other = 4 };
+	static NalContent getNalTypeContent(uint8_t type);
+	static int getNalContent(const uint8_t *payload, size_t size);
+	bool filter(const uint8_t *data, size_t size);
 	int mSkipCount;
-	uint32_t mLastIframeTimestamp;
+	uint32_t mSsrc;
+	bool mStarted;
+	uint32_t mFrameTimestamp;
+	bool mFrameEnded; /* the marker bit was seen on the current frame */
+	bool mFrameIsIFrame;
+	bool mFrameKept;
+	bool mFragmentKept; /* whether the start of the FU-A being received was kept */
 	int mIframeCount;
+	uint64_t mBytesForwarded;
+	uint64_t mBytesDropped;
+	StatCounter64 *mCountForwarded;
+	StatCounter64 *mCountDropped;
 };
 
 #endif
@@ -38,6 +38,7 @@
 
 #include "agent.hh"
 #include "stun.hh"
+#include "metrics-exporter.hh"
 #include "module.hh"
 
 #include <cstdlib>
@@ -63,9 +64,12 @@
 #endif
 
 #include "log/logmanager.hh"
+#include "utils/shared-nonce-table.hh"
 #include <ortp/ortp.h>
 #include <functional>
+#include <random>
 #include <list>
+#include <vector>
 
 #include "etchosts.hh"
 
@@ -88,14 +92,19 @@
 
 #include <openssl/crypto.h>
 
+using namespace std;
+
 static int run = 1;
 static int pipe_wdog_flexisip[2] = {
 	-1}; // This is the pipe that flexisip will write to to signify it has started to the Watchdog
 static pid_t flexisip_pid = -1;
 static pid_t monitor_pid = -1;
 static su_root_t *root = NULL;
-
-using namespace std;
+static int worker_index = 0;
+static vector<pid_t> worker_pids; // pids of the other SIP workers, only known by worker 0
+static string worker_secret;	   // random key shared by the SIP workers, drawn before they are forked
+static SharedNonceTable *worker_nonces = NULL; // digest nonce counts, mapped before the workers are forked
+static const size_t sSharedNonces = 1 << 16;	 // outstanding nonces kept for the workers, about 5MB
 
 static unsigned long threadid_cb(){
 	return (unsigned long)pthread_self();
@@ -124,6 +133,9 @@ static void flexisip_stop(int signum) {
 	} else if (run != 0) {
 		// LOGD("Received quit signal...");
 		run = 0;
+		for (auto it = worker_pids.begin(); it != worker_pids.end(); ++it) {
+			kill(*it, signum);
+		}
 		if (root) {
 			su_root_break(root);
 		}
@@ -143,7 +155,34 @@ static void sofiaLogHandler(void *, const char *fmt, va_list ap) {
 	}
 }
 
+static void stopWorkers() {
+	for (auto it = worker_pids.begin(); it != worker_pids.end(); ++it) {
+		kill(*it, SIGTERM);
+	}
+	for (auto it = worker_pids.begin(); it != worker_pids.end(); ++it) {
+		waitpid(*it, NULL, 0);
+	}
+	worker_pids.clear();
+}
+
+static void checkWorkers() {
+	for (auto it = worker_pids.begin(); it != worker_pids.end(); ++it) {
+		int status = 0;
+		/* only the workers are waited for, the other children are reaped by whoever started them */
+		if (waitpid(*it, &status, WNOHANG) != *it)
+			continue;
+		/* Workers cannot be forked again from here (threads do not survive fork), so let the watchdog restart
+		 * the whole group.*/
+		LOGE("SIP worker %d exited unexpectedly, restarting all workers.", *it);
+		worker_pids.erase(it);
+		stopWorkers();
+		exit(RESTART_EXIT_CODE);
+	}
+}
+
 static void timerfunc(su_root_magic_t *magic, su_timer_t *t, Agent *a) {
+	if (!worker_pids.empty())
+		checkWorkers();
 	a->idle();
 }
 
@@ -260,6 +299,48 @@ static void set_process_name(const char *process_name) {
 #endif
 }
 
+/*
+ * Forks the additional SIP worker processes. Must be called before any thread or su_root is created.
+ * The calling process becomes worker 0 and keeps the duties that must not be duplicated (watchdog
+ * notification, SNMP, STUN, presence).
+ */
+static void spawnWorkers(int count, bool daemonMode) {
+	random_device rd;
+	char hex[9];
+	for (int i = 0; i < 4; ++i) {
+		snprintf(hex, sizeof(hex), "%08x", (unsigned)rd());
+		worker_secret += hex;
+	}
+	worker_nonces = SharedNonceTable::create(sSharedNonces);
+	if (!worker_nonces) {
+		LOGF("Could not map the nonce table shared by the SIP workers: %s", strerror(errno));
+	}
+	worker_pids.reserve(count);
+	for (int i = 1; i < count; ++i) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			LOGF("Could not fork SIP worker %i: %s", i, strerror(errno));
+		}
+		if (pid == 0) {
+			char name[16];
+			worker_index = i;
+			worker_pids.clear();
+			snprintf(name, sizeof(name), "flexisip_w%i", i);
+			set_process_name(name);
+#ifdef PR_SET_PDEATHSIG
+			prctl(PR_SET_PDEATHSIG, SIGTERM, NULL, NULL, NULL);
+#endif
+			if (daemonMode) {
+				// only worker 0 reports the successful start to the watchdog
+				close(pipe_wdog_flexisip[1]);
+			}
+			return;
+		}
+		worker_pids.push_back(pid);
+	}
+	LOGI("Started %i SIP workers.", count);
+}
+
 static void forkAndDetach(const char *pidfile, bool auto_respawn, bool startMonitor) {
 	int pipe_launcher_wdog[2];
 	int err = pipe(pipe_launcher_wdog);
@@ -554,6 +635,7 @@ static string version() {
 int main(int argc, char *argv[]) {
 	shared_ptr<Agent> a;
 	StunServer *stun = NULL;
+	MetricsExporter *metricsExporter = NULL;
 	bool debug;
 	map<string, string> oset;
 
@@ -762,12 +844,22 @@ int main(int argc, char *argv[]) {
 	LOGN("Starting flexisip version %s (git %s)", VERSION, FLEXISIP_GIT_VERSION);
 	GenericManager::get()->sendTrap("Flexisip starting");
 
+	int workers = cfg->getGlobal()->get<ConfigInt>("workers")->read();
+	if (workers < 1) {
+		LOGF("Invalid number of workers: %i", workers);
+	}
+	if (workers > 1)
+		spawnWorkers(workers, daemonMode);
+
 	root = su_root_create(NULL);
 	a = make_shared<Agent>(root);
+	a->setWorker(worker_index, workers, worker_secret, worker_nonces);
 	a->start(transportsArg.getValue());
 	setOpenSSLThreadSafe();
 #ifdef ENABLE_SNMP
-	SnmpAgent lAgent(*a, *cfg, oset);
+	unique_ptr<SnmpAgent> lAgent;
+	if (worker_index == 0)
+		lAgent.reset(new SnmpAgent(*a, *cfg, oset));
 #endif
 
 	ortp_init();
@@ -778,7 +870,7 @@ int main(int argc, char *argv[]) {
 	a->loadConfig(cfg);
 
 	// Create cached test accounts for the Flexisip monitor if necessary
-	if (monitorEnabled) {
+	if (monitorEnabled && worker_index == 0) {
 		try {
 			Monitor::createAccounts();
 		} catch (const FlexisipException &e) {
@@ -788,27 +880,35 @@ int main(int argc, char *argv[]) {
 
 	increase_fd_limit();
 
-	if (daemonMode) {
+	if (daemonMode && worker_index == 0) {
 		if (write(pipe_wdog_flexisip[1], "ok", 3) == -1) {
 			LOGF("Failed to write starter pipe: %s", strerror(errno));
 		}
 		close(pipe_wdog_flexisip[1]);
 	}
 
-	if (cfg->getRoot()->get<GenericStruct>("stun-server")->get<ConfigBoolean>("enabled")->read()) {
+	if (worker_index == 0 && cfg->getRoot()->get<GenericStruct>("stun-server")->get<ConfigBoolean>("enabled")->read()) {
 		stun = new StunServer(cfg->getRoot()->get<GenericStruct>("stun-server")->get<ConfigInt>("port")->read());
 		stun->start();
 	}
 
+	GenericStruct *metricsConf = cfg->getRoot()->get<GenericStruct>("metrics-exporter");
+	if (metricsConf->get<ConfigBoolean>("enabled")->read()) {
+		metricsExporter = new MetricsExporter(metricsConf->get<ConfigInt>("port")->read() + worker_index);
+		metricsExporter->start();
+	}
+
 #ifdef ENABLE_PRESENCE
 	bool enableLongTermPresence = (cfg->getRoot()->get<GenericStruct>("presence-server")->get<ConfigBoolean>("long-term-enabled")->read());
 	flexisip::PresenceServer presenceServer(configFile.getValue());
 	flexisip::PresenceLongterm *presenceLongTerm = NULL;
-	if (enableLongTermPresence) {
-		presenceLongTerm = new flexisip::PresenceLongterm(presenceServer.getBelleSipMainLoop());
-		presenceServer.addNewPresenceInfoListener(presenceLongTerm);
+	if (worker_index == 0) {
+		if (enableLongTermPresence) {
+			presenceLongTerm = new flexisip::PresenceLongterm(presenceServer.getBelleSipMainLoop());
+			presenceServer.addNewPresenceInfoListener(presenceLongTerm);
+		}
+		presenceServer.start();
 	}
-	presenceServer.start();
 #endif // ENABLE_PRESENCE
 
 	if (trackAllocs)
@@ -818,14 +918,19 @@ int main(int argc, char *argv[]) {
 	su_timer_set_for_ever(timer, (su_timer_f)timerfunc, a.get());
 	su_root_run(root);
 	su_timer_destroy(timer);
+	if (metricsExporter) {
+		metricsExporter->stop();
+		delete metricsExporter;
+	}
 	a.reset();
 	if (stun) {
 		stun->stop();
 		delete stun;
 	}
 	su_root_destroy(root);
+	stopWorkers();
 #ifdef ENABLE_PRESENCE
-	if (enableLongTermPresence) {
+	if (presenceLongTerm) {
 		presenceServer.removeNewPresenceInfoListener(presenceLongTerm);
 		delete presenceLongTerm;
 	}
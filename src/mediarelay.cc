@@ -20,52 +20,22 @@
 #include "agent.hh"
 #include "mediarelay.hh"
 
-#include <poll.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
 #include <algorithm>
+#include <chrono>
 #include <list>
 
 using namespace std;
 
-PollFd::PollFd(int init_size) : mCurSize(init_size) {
-	mPfd = (struct pollfd *)malloc(mCurSize * sizeof(struct pollfd));
-	mCurIndex = 0;
-}
-
-PollFd::~PollFd() {
-	free(mPfd);
-}
-
-void PollFd::reset() {
-	mCurIndex = 0;
-}
-
-int PollFd::addFd(int fd, unsigned int events) {
-	if (mCurIndex == mCurSize) {
-		mCurSize *= 2;
-		mPfd = (struct pollfd *)realloc(mPfd, mCurSize * sizeof(struct pollfd));
-	}
-	mPfd[mCurIndex].fd = fd;
-	mPfd[mCurIndex].events = events;
-	mPfd[mCurIndex].revents = 0;
-	return mCurIndex++;
-}
-
-unsigned int PollFd::getREvents(int index) const {
-	if (index >= mCurSize) {
-		LOGA("Bad access to pollfd table.");
-		return 0;
-	}
-	return mPfd[index].revents;
-}
-
 RelayChannel::RelayChannel(RelaySession *relaySession, const std::pair<std::string, std::string> &relayIps,
 						   bool preventLoops)
-	: mDir(SendRecv), mLocalIp(relayIps.first), mRemoteIp(std::string("undefined")), mRemotePort(-1) {
-	mPfdIndex = -1;
-	mSession = relaySession->getRelayServer()->createRtpSession(relayIps.second);
+	: mRelaySession(relaySession), mServer(relaySession->getRelayServer()), mRetired(false), mDir(SendRecv),
+	  mLocalIp(relayIps.first), mBindIp(relayIps.second), mRemoteIp(std::string("undefined")), mRemotePort(-1) {
+	mSession = mServer->createRtpSession(relayIps.second);
 	mSockets[0] = rtp_session_get_rtp_socket(mSession);
 	mSockets[1] = rtp_session_get_rtcp_socket(mSession);
 	mSockAddrSize[0] = mSockAddrSize[1] = 0;
@@ -73,6 +43,8 @@ RelayChannel::RelayChannel(RelaySession *relaySession, const std::pair<std::stri
 	mPacketsSent = 0;
 	mPreventLoop = preventLoops;
 	mHasMultipleTargets = false;
+	if (mServer->qualityReportsEnabled())
+		mMonitor.reset(new RtpStreamMonitor());
 }
 
 bool RelayChannel::checkSocketsValid() {
@@ -80,7 +52,8 @@ bool RelayChannel::checkSocketsValid() {
 }
 
 RelayChannel::~RelayChannel() {
-	rtp_session_destroy(mSession);
+	/*retired channels may outlive their session, but not their server*/
+	mServer->destroyRtpSession(mBindIp, mSession);
 }
 
 const char *RelayChannel::dirToString(Dir dir) {
@@ -145,63 +118,75 @@ void RelayChannel::setRemoteAddr(const string &ip, int port, Dir dir) {
 	}
 }
 
-void RelayChannel::fillPollFd(PollFd *pfd) {
-	mPfdIndex = -1;
-	if (mSockets[0] == -1)
-		return; // no socket to monitor
-	for (int i = 0; i < 2; ++i) {
-		int index = pfd->addFd(mSockets[i], POLLIN);
-		if (mPfdIndex == -1)
-			mPfdIndex = index;
-	}
-}
-
-bool RelayChannel::checkPollFd(const PollFd *pfd, int i) {
-	if (mPfdIndex != -1) {
-		return pfd->getREvents(mPfdIndex + i);
-	}
-	return false;
-}
-
-int RelayChannel::recv(int i, uint8_t *buf, size_t buflen) {
-	socklen_t addrsize = sizeof(mSockAddr[i]);
-	int err = recvfrom(mSockets[i], buf, buflen, 0, (struct sockaddr *)&mSockAddr[i], &addrsize);
-	if (err > 0) {
-		mPacketsReceived++;
-		mSockAddrSize[i] = addrsize;
-		if (mDir == SendOnly || mDir == Inactive) {
-			/*LOGD("ignored packet");*/
-			return 0;
+/* Reads the packets waiting on socket i, dropping from the batch the ones that must not be relayed. Returns their
+ * number, 0 if the socket may still have packets to read after an error, or -1 when it has no more. */
+int RelayChannel::recv(int i, UdpBatch &batch) {
+	int count = batch.receive(mSockets[i]);
+	if (count > 0) {
+		mPacketsReceived += count;
+		/*the remote address is the one of the latest packet*/
+		int last = count - 1;
+		memcpy(&mSockAddr[i], batch.source(last), batch.sourceLength(last));
+		mSockAddrSize[i] = batch.sourceLength(last);
+		if (mMonitor) {
+			uint64_t now =
+				chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+			RtpStreamMonitor *peer = i == 1 ? mRelaySession->getPeerMonitor(this) : NULL;
+			for (int n = 0; n < count; ++n) {
+				if (i == 0)
+					mMonitor->onRtp(batch.data(n), batch.size(n), now);
+				else
+					mMonitor->onRtcp(batch.data(n), batch.size(n), now, peer);
+			}
 		}
-		if (mFilter &&
-			mFilter->onIncomingTransfer(buf, buflen, (struct sockaddr *)&mSockAddr[i], mSockAddrSize[i]) == false) {
-			return 0;
+		for (int n = 0; n < count; ++n) {
+			if (mDir == SendOnly || mDir == Inactive) {
+				/*LOGD("ignored packet");*/
+				batch.drop(n);
+			} else if (mFilter &&
+					   !mFilter->onIncomingTransfer(batch.data(n), batch.size(n), batch.source(n),
+													batch.sourceLength(n))) {
+				batch.drop(n);
+			}
 		}
-	} else if (err == -1) {
+	} else if (count == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -1;
+		int error = errno;
 		LOGW("Error receiving on port %i from %s:%i: %s", getLocalPort(), mRemoteIp.c_str(), mRemotePort + i,
-			 strerror(errno));
-		if (errno == ECONNREFUSED) {
+			 strerror(error));
+		if (error == ECONNREFUSED) {
 			/*this will avoid to continue sending if there are ICMP errors*/
 			mSockAddrSize[i] = 0;
 		}
+		/*the error is reported once, packets may be queued behind it*/
+		return 0;
 	}
-	return err;
+	return count;
 }
 
-int RelayChannel::send(int i, uint8_t *buf, size_t buflen) {
+/* Sends the packets of the batch that the filter lets through, returns the number sent. */
+int RelayChannel::send(int i, UdpBatch &batch) {
 	int err = 0;
 	/*if destination address is working mSockAddrSize>0*/
 	if (mRemotePort > 0 && mSockAddrSize[i] > 0 && mDir != Inactive) {
-		if (!mFilter || mFilter->onOutgoingTransfer(buf, buflen, (struct sockaddr *)&mSockAddr[i], mSockAddrSize[i])) {
-			err = sendto(mSockets[i], buf, buflen, 0, (struct sockaddr *)&mSockAddr[i], mSockAddrSize[i]);
-			mPacketsSent++;
-			if (err == -1) {
-				LOGW("Error sending %i bytes (localport=%i dest=%s:%i) : %s", (int)buflen, getLocalPort() + i,
-					 mRemoteIp.c_str(), mRemotePort, strerror(errno));
-			} else if (err != (int)buflen) {
-				LOGW("Only %i bytes sent over %i bytes (localport=%i dest=%s:%i)", err, (int)buflen, getLocalPort() + i,
-					 mRemoteIp.c_str(), mRemotePort + i);
-			}
+		const struct sockaddr *addr = (struct sockaddr *)&mSockAddr[i];
+		socklen_t addrlen = mSockAddrSize[i];
+		MediaFilter *filter = mFilter.get();
+		int accepted = 0;
+		err = batch.send(mSockets[i], addr, addrlen, [&](uint8_t *data, size_t size) {
+			if (filter && !filter->onOutgoingTransfer(data, size, addr, addrlen))
+				return false;
+			accepted++;
+			return true;
+		});
+		mPacketsSent += accepted;
+		if (err == -1) {
+			LOGW("Error sending %i packets (localport=%i dest=%s:%i) : %s", accepted, getLocalPort() + i,
+				 mRemoteIp.c_str(), mRemotePort + i, strerror(errno));
+		} else if (err != accepted) {
+			LOGW("Only %i packets sent over %i (localport=%i dest=%s:%i)", err, accepted, getLocalPort() + i,
+				 mRemoteIp.c_str(), mRemotePort + i);
 		}
 	} else {
 		/*LOGW("Not sending media, destination not valid or inactive stream."); */
@@ -215,10 +200,11 @@ void RelayChannel::setFilter(shared_ptr<MediaFilter> filter) {
 
 RelaySession::RelaySession(MediaRelayServer *server, const string &frontId,
 						   const std::pair<std::string, std::string> &relayIps)
-	: mServer(server), mFrontId(frontId) {
+	: mServer(server), mFrontId(frontId), mUsed(true) {
 	mLastActivityTime = getCurrentTime();
-	mUsed = true;
 	mFront = make_shared<RelayChannel>(this, relayIps, mServer->loopPreventionEnabled());
+	/*packets can be relayed as soon as the channel is registered, it must be reachable from the session by then*/
+	mServer->addChannel(mFront.get());
 }
 
 shared_ptr<RelayChannel> RelaySession::getChannel(const string &partyId, const string &trId) {
@@ -246,6 +232,7 @@ std::shared_ptr<RelayChannel> RelaySession::createBranch(const std::string &trId
 	ret = make_shared<RelayChannel>(this, relayIps, mServer->loopPreventionEnabled());
 	ret->setMultipleTargets(hasMultipleTargets);
 	mBacks.insert(make_pair(trId, ret));
+	mServer->addChannel(ret.get());
 	mMutex.unlock();
 	LOGD("RelaySession [%p]: branch corresponding to transaction [%s] added.", this, trId.c_str());
 	return ret;
@@ -257,6 +244,7 @@ void RelaySession::removeBranch(const std::string &trId) {
 	auto it = mBacks.find(trId);
 	if (it != mBacks.end()) {
 		removed = true;
+		retire(it->second);
 		mBacks.erase(it);
 	}
 	mMutex.unlock();
@@ -284,47 +272,27 @@ void RelaySession::setEstablished(const std::string &tr_id) {
 		LOGD("RelaySession [%p] is established.", this);
 		mMutex.lock();
 		mBack = winner;
+		for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
+			if (it->second != winner)
+				retire(it->second);
+		}
 		mBacks.clear();
 		mMutex.unlock();
 	} else
 		LOGE("RelaySession [%p] is with from an unknown branch [%s].", this, tr_id.c_str());
 }
 
-void RelaySession::fillPollFd(PollFd *pfd) {
-	mMutex.lock();
-
-	if (mFront)
-		mFront->fillPollFd(pfd);
-	if (mBack)
-		mBack->fillPollFd(pfd);
-	else {
-		for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
-			(*it).second->fillPollFd(pfd);
-		}
-	}
-	mMutex.unlock();
-}
-
-void RelaySession::checkPollFd(const PollFd *pfd, time_t curtime) {
-	int i;
-	mMutex.lock();
-	for (i = 0; i < 2; ++i) {
-		if (mFront && mFront->checkPollFd(pfd, i))
-			transfer(curtime, mFront, i);
-		if (!mBack) {
-			for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
-				shared_ptr<RelayChannel> chan = (*it).second;
-				if (chan->checkPollFd(pfd, i))
-					transfer(curtime, chan, i);
-			}
-		} else if (mBack->checkPollFd(pfd, i)) {
-			transfer(curtime, mBack, i);
-		}
-	}
-	mMutex.unlock();
+void RelaySession::retire(const shared_ptr<RelayChannel> &chan) {
+	if (chan)
+		mServer->retireChannel(chan);
 }
 
 RelaySession::~RelaySession() {
+	retire(mFront);
+	retire(mBack);
+	for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
+		retire(it->second);
+	}
 	LOGD("RelaySession %p destroyed", this);
 }
 
@@ -338,7 +306,6 @@ void RelaySession::unuse() {
 	LOGD("RelaySession [%p] terminated.", this);
 
 	mMutex.lock();
-	mUsed = false;
 	if (mFront) {
 		front.port = mFront->getLocalPort();
 		front.recv = mFront->getReceivedPackets();
@@ -349,10 +316,17 @@ void RelaySession::unuse() {
 		back.recv = mBack->getReceivedPackets();
 		back.sent = mBack->getSentPackets();
 	}
+	retire(mFront);
+	retire(mBack);
+	for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
+		retire(it->second);
+	}
 	mFront.reset();
 	mBacks.clear();
 	mBack.reset();
+	mUsed = false;
 	mMutex.unlock();
+	mServer->sessionUnused(this);
 
 	/*do not log while holding a mutex*/
 	if (front.port > 0)
@@ -377,61 +351,277 @@ bool RelaySession::checkChannels() {
 	return true;
 }
 
-void RelaySession::transfer(time_t curtime, const shared_ptr<RelayChannel> &chan, int i) {
-	uint8_t buf[1500];
-	const int maxsize = sizeof(buf);
-	int recv_len;
+RtpStreamMonitor *RelaySession::getPeerMonitor(RelayChannel *chan) {
+	if (chan != mFront.get())
+		return mFront ? mFront->getMonitor() : NULL;
+	if (mBack)
+		return mBack->getMonitor();
+	/*before the call is established, reports can only be attributed if there is a single branch*/
+	if (mBacks.size() == 1)
+		return mBacks.begin()->second->getMonitor();
+	return NULL;
+}
 
-	mLastActivityTime = curtime;
-	recv_len = chan->recv(i, buf, maxsize);
-	if (recv_len > 0) {
-		if (chan == mFront) {
-			if (mBack) {
-				mBack->send(i, buf, recv_len);
-			} else {
-				for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
-					shared_ptr<RelayChannel> dest = (*it).second;
-					dest->send(i, buf, recv_len);
+bool RelaySession::writeQualityReport(ostream &ost) {
+	bool written = false;
+	mMutex.lock();
+	RtpStreamMonitor *front = mFront ? mFront->getMonitor() : NULL;
+	RtpStreamMonitor *back = mBack ? mBack->getMonitor() : NULL;
+	if (front && back && (front->hasRtp() || back->hasRtp())) {
+		/*the local metrics are about the stream received by the front party, sent by the back one*/
+		ost << "LocalAddr: IP=" << mFront->getRemoteIp() << " PORT=" << mFront->getRemotePort()
+			<< " SSRC=" << front->getSsrc() << "\r\n";
+		ost << "RemoteAddr: IP=" << mBack->getRemoteIp() << " PORT=" << mBack->getRemotePort()
+			<< " SSRC=" << back->getSsrc() << "\r\n";
+		/*a direction that carried no RTP has no metrics, nor even a start time*/
+		if (back->hasRtp()) {
+			ost << "LocalMetrics:\r\n";
+			back->writeMetrics(ost);
+		}
+		if (front->hasRtp()) {
+			ost << "RemoteMetrics:\r\n";
+			front->writeMetrics(ost);
+		}
+		written = true;
+	}
+	mMutex.unlock();
+	return written;
+}
+
+int RelaySession::transfer(time_t curtime, RelayChannel *chan, int i, UdpBatch &batch, bool &pending) {
+	int count;
+	int received = 0;
+
+	pending = false;
+	mMutex.lock();
+	/*the channel may have been removed since the event was reported*/
+	if (!chan->isRetired()) {
+		mLastActivityTime = curtime;
+		/*sockets are edge triggered: read until EAGAIN, packets arriving after that trigger a new event, or until
+		 sMaxBatches were relayed, the server thread then coming back to the socket after serving the others. A socket
+		 error is reported once and may have packets queued behind it, two in a row mean that the socket can't be read*/
+		int errors = 0;
+		int batches = 0;
+		while ((count = chan->recv(i, batch)) != -1) {
+			if (count == 0) {
+				if (++errors == 2)
+					break;
+				continue;
+			}
+			errors = 0;
+			received += count;
+			if (chan == mFront.get()) {
+				if (mBack) {
+					mBack->send(i, batch);
+				} else {
+					for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
+						(*it).second->send(i, batch);
+					}
 				}
+			} else {
+				mFront->send(i, batch);
+			}
+			if (++batches == sMaxBatches) {
+				pending = true;
+				break;
 			}
-		} else {
-			mFront->send(i, buf, recv_len);
 		}
 	}
+	mMutex.unlock();
+	return received;
 }
 
-MediaRelayServer::MediaRelayServer(MediaRelay *module) : mModule(module) {
-	mRunning = false;
-	if (pipe(mCtlPipe) == -1) {
-		LOGF("Could not create MediaRelayServer control pipe.");
-	}
+RtpPortAllocator::RtpPortAllocator(int minPort, int maxPort, StatCounter64 *countExhausted)
+	: mCountExhausted(countExhausted) {
+	/*RTP on an even port, RTCP on the next one, both below maxPort*/
+	mFirstPort = (minPort + 1) & ~1;
+	mPairCount = maxPort > mFirstPort ? (maxPort - mFirstPort) / 2 : 0;
 }
 
-Agent *MediaRelayServer::getAgent() {
-	return mModule->getAgent();
+RtpPortAllocator::~RtpPortAllocator() {
+	for (auto it = mInterfaces.begin(); it != mInterfaces.end(); ++it) {
+		for (auto session : it->second.pool) {
+			rtp_session_destroy(session);
+		}
+	}
 }
 
-RtpSession *MediaRelayServer::createRtpSession(const std::string &bindIp) {
+RtpSession *RtpPortAllocator::bind(const std::string &bindIp, int port) {
 	RtpSession *session = rtp_session_new(RTP_SESSION_SENDRECV);
 #if ORTP_HAS_REUSEADDR
 	rtp_session_set_reuseaddr(session, FALSE);
 #endif
-	for (int i = 0; i < 100; ++i) {
-		int port = ((rand() % (mModule->mMaxPort - mModule->mMinPort)) + mModule->mMinPort) & 0xfffe;
-
 #if ORTP_ABI_VERSION >= 9
-		if (rtp_session_set_local_addr(session, bindIp.c_str(), port, port + 1) == 0) {
+	if (rtp_session_set_local_addr(session, bindIp.c_str(), port, port + 1) == 0) {
 #else
-		if (rtp_session_set_local_addr(session, bindIp.c_str(), port) == 0) {
+	if (rtp_session_set_local_addr(session, bindIp.c_str(), port) == 0) {
 #endif
-			return session;
-		}
+		return session;
+	}
+	rtp_session_destroy(session);
+	return NULL;
+}
+
+RtpPortAllocator::Interface &RtpPortAllocator::getInterface(const std::string &bindIp) {
+	auto it = mInterfaces.find(bindIp);
+	if (it != mInterfaces.end())
+		return it->second;
+	Interface &itf = mInterfaces[bindIp];
+	itf.used.assign((mPairCount + 63) / 64, 0);
+	if (mPairCount % 64)
+		itf.used.back() = ~(uint64_t)0 << (mPairCount % 64);
+	itf.freeCount = mPairCount;
+	/*start at a random place, so that a restart does not reuse the ports of the previous run first*/
+	itf.cursor = mPairCount > 0 ? rand() % mPairCount : 0;
+	return itf;
+}
+
+/* Marks the first free pair from the cursor as used, returns its RTP port or -1 if none is free. */
+int RtpPortAllocator::reserve(Interface &itf) {
+	if (itf.freeCount == 0)
+		return -1;
+	size_t word = itf.cursor / 64;
+	uint64_t bits = ~itf.used[word] & (~(uint64_t)0 << (itf.cursor % 64));
+	while (bits == 0) {
+		word = (word + 1) % itf.used.size();
+		bits = ~itf.used[word];
 	}
+	size_t pair = word * 64 + __builtin_ctzll(bits);
+	itf.used[word] |= (uint64_t)1 << (pair % 64);
+	itf.freeCount--;
+	itf.cursor = (pair + 1) % mPairCount;
+	return mFirstPort + 2 * pair;
+}
 
-	LOGE("Could not find a random port on interface %s !", bindIp.c_str());
+void RtpPortAllocator::unreserve(Interface &itf, int port) {
+	size_t pair = (port - mFirstPort) / 2;
+	if (port < mFirstPort || pair >= mPairCount)
+		return;
+	itf.used[pair / 64] &= ~((uint64_t)1 << (pair % 64));
+	itf.freeCount++;
+}
+
+RtpSession *RtpPortAllocator::take(const std::string &bindIp) {
+	RtpSession *session = NULL;
+
+	mMutex.lock();
+	Interface &itf = getInterface(bindIp);
+	if (!itf.pool.empty()) {
+		session = itf.pool.front();
+		itf.pool.pop_front();
+		mMutex.unlock();
+		return session;
+	}
+	/*a pair may still be bound by another program, the next ones are tried*/
+	for (int i = 0; i < sMaxBindAttempts; ++i) {
+		int port = reserve(itf);
+		if (port == -1)
+			break;
+		mMutex.unlock();
+		session = bind(bindIp, port);
+		mMutex.lock();
+		if (session)
+			break;
+		unreserve(itf, port);
+	}
+	mMutex.unlock();
+
+	if (session == NULL) {
+		LOGE("Could not find a free port among the %zu pairs of interface %s !", mPairCount, bindIp.c_str());
+		if (mCountExhausted)
+			++*mCountExhausted;
+		session = rtp_session_new(RTP_SESSION_SENDRECV);
+	}
 	return session;
 }
 
+void RtpPortAllocator::release(const std::string &bindIp, RtpSession *session) {
+	int port = rtp_session_get_local_port(session);
+	rtp_session_destroy(session);
+	if (port <= 0)
+		return;
+	mMutex.lock();
+	auto it = mInterfaces.find(bindIp);
+	if (it != mInterfaces.end())
+		unreserve(it->second, port);
+	mMutex.unlock();
+}
+
+void RtpPortAllocator::addInterface(const std::string &bindIp) {
+	mMutex.lock();
+	getInterface(bindIp);
+	mMutex.unlock();
+}
+
+void RtpPortAllocator::fill(size_t count) {
+	mMutex.lock();
+	for (auto it = mInterfaces.begin(); it != mInterfaces.end(); ++it) {
+		Interface &itf = it->second;
+		/*interfaces are never removed, binding is done out of the lock*/
+		while (itf.pool.size() < count) {
+			int port = reserve(itf);
+			if (port == -1)
+				break;
+			mMutex.unlock();
+			RtpSession *session = bind(it->first, port);
+			mMutex.lock();
+			if (session == NULL) {
+				unreserve(itf, port);
+				break;
+			}
+			itf.pool.push_back(session);
+		}
+	}
+	mMutex.unlock();
+}
+
+MediaRelayServer::MediaRelayServer(MediaRelay *module, int index, int minPort, int maxPort,
+								   StatCounter64 *countPortsExhausted)
+	: mModule(module), mIndex(index), mPortAllocator(minPort, maxPort, countPortsExhausted),
+	  mChannelCount(0), mPacketRate(0) {
+	mRunning = false;
+	if (pipe(mCtlPipe) == -1) {
+		LOGF("Could not create MediaRelayServer control pipe.");
+	}
+	mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (mEpollFd == -1) {
+		LOGF("Could not create MediaRelayServer epoll instance: %s", strerror(errno));
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; /*the control pipe*/
+	if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mCtlPipe[0], &ev) == -1) {
+		LOGF("Could not watch MediaRelayServer control pipe: %s", strerror(errno));
+	}
+	/*the default interfaces are known from the start, so that the first calls already get prebound ports*/
+	for (bool ipv6 : {false, true}) {
+		const string &bindIp = getAgent()->getRtpBindIp(ipv6);
+		if (!bindIp.empty())
+			mPortAllocator.addInterface(bindIp);
+	}
+	/*the thread otherwise starts with the first session, too late to bind its ports in advance*/
+	if (mModule->mPreboundPorts > 0)
+		start();
+}
+
+Agent *MediaRelayServer::getAgent() {
+	return mModule->getAgent();
+}
+
+RtpSession *MediaRelayServer::createRtpSession(const std::string &bindIp) {
+	return mPortAllocator.take(bindIp);
+}
+
+void MediaRelayServer::destroyRtpSession(const std::string &bindIp, RtpSession *session) {
+	mPortAllocator.release(bindIp, session);
+}
+
+void MediaRelayServer::prebindPorts() {
+	if (mModule->mPreboundPorts > 0)
+		mPortAllocator.fill(mModule->mPreboundPorts);
+}
+
 void MediaRelayServer::start() {
 	mRunning = true;
 	pthread_create(&mThread, NULL, &MediaRelayServer::threadFunc, this);
@@ -444,26 +634,77 @@ MediaRelayServer::~MediaRelayServer() {
 			LOGE("MediaRelayServer: Fail to write to control pipe.");
 		pthread_join(mThread, NULL);
 	}
+	mRetiredChannels.clear();
+	/*sessions retire their remaining channels when destroyed*/
 	mSessions.clear();
+	mRetiredChannels.clear();
+	close(mEpollFd);
 	close(mCtlPipe[0]);
 	close(mCtlPipe[1]);
 }
 
+void MediaRelayServer::addChannel(RelayChannel *chan) {
+	for (int i = 0; i < 2; ++i) {
+		int sock = chan->mSockets[i];
+		if (sock == -1)
+			continue;
+		int flags = fcntl(sock, F_GETFL);
+		if (flags != -1 && !(flags & O_NONBLOCK))
+			fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+		chan->mEpollSlots[i].channel = chan;
+		chan->mEpollSlots[i].index = i;
+		chan->mEpollSlots[i].ready = false;
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &chan->mEpollSlots[i];
+		if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+			LOGE("MediaRelayServer: could not watch socket of port %i: %s", chan->getLocalPort() + i, strerror(errno));
+		}
+	}
+	mChannelCount++;
+}
+
+void MediaRelayServer::retireChannel(const shared_ptr<RelayChannel> &chan) {
+	if (chan->mRetired.exchange(true))
+		return;
+	for (int i = 0; i < 2; ++i) {
+		if (chan->mSockets[i] != -1)
+			epoll_ctl(mEpollFd, EPOLL_CTL_DEL, chan->mSockets[i], NULL);
+	}
+	mChannelCount--;
+	mMutex.lock();
+	mRetiredChannels.push_back(chan);
+	mMutex.unlock();
+}
+
+void MediaRelayServer::sessionUnused(RelaySession *session) {
+	mMutex.lock();
+	mUnusedSessions.push_back(session);
+	mMutex.unlock();
+	update();
+}
+
 shared_ptr<RelaySession> MediaRelayServer::createSession(const std::string &frontId,
 														 const std::pair<std::string, std::string> &frontRelayIps) {
 	shared_ptr<RelaySession> s = make_shared<RelaySession>(this, frontId, frontRelayIps);
 	mMutex.lock();
-	mSessions.push_back(s);
+	mSessions[s.get()] = s;
+	size_t count = mSessions.size();
 	mMutex.unlock();
 	if (!mRunning)
 		start();
 
-	LOGD("There are now %zu relay sessions running on MediaRelayServer [%p]", mSessions.size(), this);
-	/*write to the control pipe to wakeup the server thread */
-	update();
+	LOGD("There are now %zu relay sessions running on MediaRelayServer [%p]", count, this);
 	return s;
 }
 
+unsigned int MediaRelayServer::getLoad() const {
+	/*channels not yet measured, or silent, still count for an audio stream*/
+	unsigned int expected = (unsigned int)max(0, (int)mChannelCount) * sExpectedChannelRate;
+	return max(expected, (unsigned int)mPacketRate);
+}
+
 void MediaRelayServer::update() {
 	/*write to the control pipe to wakeup the server thread */
 	if (write(mCtlPipe[1], "e", 1) == -1)
@@ -501,46 +742,115 @@ static void set_high_prio() {
 	}
 }
 
+/* Pins the calling thread to cpu index, modulo the number of cpus it is allowed to run on. */
+static void set_cpu_affinity(int index) {
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+		LOGW("MediaRelayServer: sched_getaffinity() failed: %s", strerror(errno));
+		return;
+	}
+	int target = index % CPU_COUNT(&allowed);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		if (target-- > 0)
+			continue;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (result != 0) {
+			LOGW("MediaRelayServer: could not pin thread to cpu %i: %s", cpu, strerror(result));
+		} else {
+			LOGD("MediaRelayServer: thread pinned to cpu %i", cpu);
+		}
+		return;
+	}
+#endif
+}
+
 void MediaRelayServer::run() {
-	PollFd pfd(512);
-	int ctl_index;
-	int err;
+	const int maxEvents = 128;
+	struct epoll_event events[maxEvents];
+	UdpBatch batch;
+	uint64_t packets = 0;
+	time_t rateTime = getCurrentTime();
+
+	/*sockets left with packets to read by transfer(), served again after the events reported meanwhile*/
+	vector<RelayChannel::EpollSlot *> ready, serving;
+	time_t curtime;
+	auto serve = [&](RelayChannel::EpollSlot *slot) {
+		bool pending;
+		packets += slot->channel->getRelaySession()->transfer(curtime, slot->channel, slot->index, batch, pending);
+		if (pending && !slot->ready) {
+			slot->ready = true;
+			ready.push_back(slot);
+		}
+	};
 
 	set_high_prio();
+	set_cpu_affinity(mIndex);
+	prebindPorts();
 	while (mRunning) {
-		pfd.reset();
-		// fill the pollfd table
-		mMutex.lock();
-		for (auto it = mSessions.begin(); it != mSessions.end(); ++it) {
-			if ((*it)->isUsed())
-				(*it)->fillPollFd(&pfd);
+		int count = epoll_wait(mEpollFd, events, maxEvents, ready.empty() ? 1000 : 0);
+		if (count == -1 && errno != EINTR) {
+			LOGE("MediaRelayServer: epoll_wait() failed: %s", strerror(errno));
 		}
-		mMutex.unlock();
-
-		ctl_index = pfd.addFd(mCtlPipe[0], POLLIN);
-
-		err = poll(pfd.getPfd(), pfd.getCurIndex(), 1000);
-		if (err > 0) {
-			// examine pollfd results
-			if (pfd.getREvents(ctl_index) & POLLIN) {
-				char tmp;
-				if (read(mCtlPipe[0], &tmp, 1) == -1) {
+		curtime = getCurrentTime();
+		serving.swap(ready);
+		for (int i = 0; i < count; ++i) {
+			RelayChannel::EpollSlot *slot = (RelayChannel::EpollSlot *)events[i].data.ptr;
+			if (slot == NULL) {
+				char tmp[64];
+				if (read(mCtlPipe[0], tmp, sizeof(tmp)) == -1) {
 					LOGE("Fail to read from control pipe.");
 				}
+				continue;
 			}
-			time_t curtime = getCurrentTime();
-			mMutex.lock();
-			for (auto it = mSessions.begin(); it != mSessions.end();) {
-				if (!(*it)->isUsed()) {
-					it = mSessions.erase(it);
-					LOGD("There are now %i relay sessions running.", (int)mSessions.size());
-				} else {
-					(*it)->checkPollFd(&pfd, curtime);
-					++it;
+			/*a channel is retired before its session is released, which can't happen before the sweep below*/
+			if (!slot->channel->isRetired())
+				serve(slot);
+		}
+		for (auto slot : serving) {
+			slot->ready = false;
+			if (!slot->channel->isRetired())
+				serve(slot);
+		}
+		serving.clear();
+		if (curtime != rateTime) {
+			mPacketRate = (unsigned int)(packets / (curtime - rateTime));
+			packets = 0;
+			rateTime = curtime;
+			/*the ports taken during the last second are replaced here rather than by the thread processing calls*/
+			prebindPorts();
+		}
+
+		/*epoll_wait() no longer reports the channels retired until now, it is safe to release them. Sessions are
+		 released out of the lock, since they retire their remaining channels. Declared first, they are released after
+		 the channels.*/
+		vector<shared_ptr<RelaySession>> unused;
+		vector<shared_ptr<RelayChannel>> retired;
+		mMutex.lock();
+		retired.swap(mRetiredChannels);
+		/*the channels released below must not be served again*/
+		ready.erase(remove_if(ready.begin(), ready.end(),
+							  [](RelayChannel::EpollSlot *slot) { return slot->channel->isRetired(); }),
+					ready.end());
+		if (!mUnusedSessions.empty()) {
+			/*a session being alive until erased here, its address can't be reused by another one meanwhile*/
+			for (auto session : mUnusedSessions) {
+				auto it = mSessions.find(session);
+				if (it != mSessions.end() && !session->isUsed()) {
+					unused.push_back(it->second);
+					mSessions.erase(it);
 				}
 			}
-			mMutex.unlock();
+			mUnusedSessions.clear();
+			LOGD("There are now %i relay sessions running.", (int)mSessions.size());
 		}
+		mMutex.unlock();
 	}
 }
 
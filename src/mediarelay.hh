@@ -23,7 +23,10 @@
 #include "agent.hh"
 #include "callstore.hh"
 #include "sdp-modifier.hh"
+#include "utils/udp-batch.hh"
+#include "rtp-stream-monitor.hh"
 #include <ortp/rtpsession.h>
+#include <atomic>
 
 class RelayedCall;
 class MediaRelayServer;
@@ -39,13 +42,25 @@ class MediaRelay : public Module, protected ModuleToolbox {
 	virtual void onUnload();
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
+	virtual bool handlesRequest(sip_method_t method) const {
+		return method == sip_method_invite || method == sip_method_bye || method == sip_method_cancel;
+	}
+	virtual bool handlesResponse(sip_method_t method) const {
+		return method == sip_method_invite;
+	}
 	virtual void onIdle();
+	/* Share index out of count of the port range [minPort, maxPort), made of whole RTP/RTCP pairs starting on an
+	 * even port, the last share getting what remains. */
+	static std::pair<int, int> portShare(int minPort, int maxPort, int index, int count);
+	/* Index of the least loaded of servers, the ties going to the first one from next. */
+	static size_t leastLoaded(const vector<shared_ptr<MediaRelayServer>> &servers, size_t next);
 
   protected:
 	virtual void onDeclare(GenericStruct *mc);
 
   private:
 	void createServers();
+	const shared_ptr<MediaRelayServer> &pickServer();
 	bool processNewInvite(const shared_ptr<RelayedCall> &c, const shared_ptr<OutgoingTransaction> &transaction,
 						  const shared_ptr<RequestSipEvent> &ev);
 	void processResponseWithSDP(const shared_ptr<RelayedCall> &c, const shared_ptr<OutgoingTransaction> &transaction,
@@ -60,72 +75,120 @@ class MediaRelay : public Module, protected ModuleToolbox {
 
 	StatCounter64 *mCountCalls;
 	StatCounter64 *mCountCallsFinished;
+	StatCounter64 *mCountPortsExhausted;
+	StatCounter64 *mCountH264BytesForwarded;
+	StatCounter64 *mCountH264BytesDropped;
 	int mH264Decim;
 	int mMaxCalls;
 	int mMinPort, mMaxPort;
+	int mPreboundPorts;
+	int mRelayThreads;
 	int mMaxRelayedEarlyMedia;
 	bool mDropTelephoneEvent;
 	bool mByeOrphanDialogs;
 	bool mEarlyMediaRelaySingle;
 	bool mPreventLoop;
 	bool mForceRelayForNonIceTargets;
+	bool mQualityReports;
 	static ModuleInfo<MediaRelay> sInfo;
 };
 
 class RelaySession;
 class MediaRelay;
+class RelayChannel;
 
-class PollFd {
+/**
+ * Hands out the RTP/RTCP port pairs of a port range, keeping a bitmap of the ones in use on each interface so that
+ * a free pair is found without trying to bind the used ones. Pairs are handed out in turn, so that a released pair is
+ * not reused until the others were. Sessions may also be bound in advance, to be handed out without waiting for it.
+ * It is thread safe.
+ */
+class RtpPortAllocator {
   public:
-	PollFd(int init_size);
-	~PollFd();
-	void reset();
-	int addFd(int fd, unsigned int events);
-	unsigned int getREvents(int index) const;
-	struct pollfd *getPfd() {
-		return mPfd;
-	}
-	int getCurIndex() const {
-		return mCurIndex;
-	}
+	RtpPortAllocator(int minPort, int maxPort, StatCounter64 *countExhausted);
+	~RtpPortAllocator();
+	/* Returns a session bound to a free port pair of bindIp, or an unbound one if the range is exhausted. */
+	RtpSession *take(const std::string &bindIp);
+	/* Destroys a session returned by take(), making its ports available again. */
+	void release(const std::string &bindIp, RtpSession *session);
+	/* Makes bindIp one of the interfaces on which sessions are bound in advance, before any session is taken. */
+	void addInterface(const std::string &bindIp);
+	/* Binds sessions in advance on each interface added or used so far, until count of them are ready. */
+	void fill(size_t count);
 
   private:
-	struct pollfd *mPfd;
-	int mCurIndex;
-	int mCurSize;
+	struct Interface {
+		std::vector<uint64_t> used; /* one bit per pair, the bits beyond the range are set */
+		size_t freeCount;
+		size_t cursor;
+		std::list<RtpSession *> pool;
+	};
+	static const int sMaxBindAttempts = 10;
+	static RtpSession *bind(const std::string &bindIp, int port);
+	Interface &getInterface(const std::string &bindIp);
+	int reserve(Interface &itf);
+	void unreserve(Interface &itf, int port);
+	Mutex mMutex;
+	std::map<std::string, Interface> mInterfaces;
+	int mFirstPort;
+	size_t mPairCount;
+	StatCounter64 *mCountExhausted;
 };
 
 class MediaRelayServer {
 	friend class RelayedCall;
 
   public:
-	MediaRelayServer(MediaRelay *module);
+	/* Relays the sessions it creates on ports within [minPort, maxPort), from a thread pinned to cpu index. */
+	MediaRelayServer(MediaRelay *module, int index, int minPort, int maxPort, StatCounter64 *countPortsExhausted);
 	~MediaRelayServer();
 	std::shared_ptr<RelaySession> createSession(const std::string &frontId,
 												const std::pair<std::string, std::string> &frontRelayIps);
 	void update();
 	Agent *getAgent();
 	RtpSession *createRtpSession(const std::string &bindIp);
+	void destroyRtpSession(const std::string &bindIp, RtpSession *session);
+	/* Binds the configured number of port pairs in advance, from the server thread. */
+	void prebindPorts();
 	void enableLoopPrevention(bool val);
 	bool loopPreventionEnabled() const {
 		return mModule->mPreventLoop;
 	}
+	bool qualityReportsEnabled() const {
+		return mModule->mQualityReports;
+	}
+	/* Registers the sockets of the channel, whose packets are then relayed by its session. To be called once the
+	 * session holds the channel. */
+	void addChannel(RelayChannel *chan);
+	/* Unregisters the sockets of the channel, which is kept alive until the server thread can no longer be handling
+	 * an event about it. */
+	void retireChannel(const std::shared_ptr<RelayChannel> &chan);
+	/* Releases the session once unused, from the server thread. */
+	void sessionUnused(RelaySession *session);
+	/* Estimated packets relayed per second, used to balance new sessions between servers. */
+	unsigned int getLoad() const;
 
   private:
+	static const unsigned int sExpectedChannelRate = 50; /* RTP packets per second of a 20ms audio stream */
 	void start();
 	void run();
 	static void *threadFunc(void *arg);
 	Mutex mMutex;
-	std::list<std::shared_ptr<RelaySession>> mSessions;
+	std::unordered_map<RelaySession *, std::shared_ptr<RelaySession>> mSessions;
+	std::vector<std::shared_ptr<RelayChannel>> mRetiredChannels;
+	std::vector<RelaySession *> mUnusedSessions;
 	MediaRelay *mModule;
+	int mIndex;
+	RtpPortAllocator mPortAllocator;
+	std::atomic<int> mChannelCount;
+	std::atomic<unsigned int> mPacketRate; /* measured over the last second by the server thread */
 	pthread_t mThread;
+	int mEpollFd;
 	int mCtlPipe[2];
 	bool mRunning;
 	friend class RelayChannel;
 };
 
-class RelayChannel;
-
 /**
  * The RelaySession holds context for relaying for a single media stream, RTP and RTCP included.
  * It has one front channel (the one to communicate with the party that generated the SDP offer,
@@ -141,14 +204,17 @@ class RelaySession : public std::enable_shared_from_this<RelaySession> {
 				 const std::pair<std::string, std::string> &frontRelayIps);
 	~RelaySession();
 
-	void fillPollFd(PollFd *pfd);
-	void checkPollFd(const PollFd *pfd, time_t curtime);
 	void unuse();
 	int getActiveBranchesCount();
 
 	bool isUsed() const {
 		return mUsed;
 	}
+	/* Relays the packets waiting on socket i of chan, at most sMaxBatches batches of them so that a flooded socket
+	 * can't hold the server thread, pending telling whether some may be left. Called by the server thread. Returns the
+	 * number received. */
+	int transfer(time_t current, RelayChannel *chan, int i, UdpBatch &batch, bool &pending);
+	static const int sMaxBatches = 4;
 
 	time_t getLastActivityTime() const {
 		return mLastActivityTime;
@@ -172,17 +238,23 @@ class RelaySession : public std::enable_shared_from_this<RelaySession> {
 		return mServer;
 	}
 	bool checkChannels();
+	/* Monitor of the stream received by the party of chan, called by the server thread while transferring. */
+	RtpStreamMonitor *getPeerMonitor(RelayChannel *chan);
+	/* Writes the addresses and metrics of the established streams for a vq-rtcpxr report, as seen from the front
+	 * party. The metrics of a direction that carried no RTP are left out. Returns false if there is nothing to
+	 * report. */
+	bool writeQualityReport(std::ostream &ost);
 
   private:
-	void transfer(time_t current, const std::shared_ptr<RelayChannel> &org, int i);
+	void retire(const std::shared_ptr<RelayChannel> &chan);
 	Mutex mMutex;
 	MediaRelayServer *mServer;
-	time_t mLastActivityTime;
+	std::atomic<time_t> mLastActivityTime; /* written by the server thread, read by the main one */
 	std::string mFrontId;
 	std::shared_ptr<RelayChannel> mFront;
 	std::map<std::string, std::shared_ptr<RelayChannel>> mBacks;
 	std::shared_ptr<RelayChannel> mBack;
-	bool_t mUsed;
+	std::atomic<bool> mUsed; /* only cleared once all the channels are retired */
 };
 
 class MediaFilter {
@@ -213,11 +285,19 @@ class RelayChannel : public SdpMasqueradeContext{
 	int getLocalPort() const {
 		return rtp_session_get_local_port(mSession);
 	}
-	int recv(int i, uint8_t *buf, size_t size);
-	int send(int i, uint8_t *buf, size_t size);
-	void fillPollFd(PollFd *pfd);
-	bool checkPollFd(const PollFd *pfd, int i);
+	int recv(int i, UdpBatch &batch);
+	int send(int i, UdpBatch &batch);
+	RelaySession *getRelaySession() const {
+		return mRelaySession;
+	}
+	bool isRetired() const {
+		return mRetired;
+	}
 	void setFilter(std::shared_ptr<MediaFilter> filter);
+	/* Monitor of the stream sent by the remote party, if quality reports are enabled. */
+	RtpStreamMonitor *getMonitor() const {
+		return mMonitor.get();
+	}
 	uint64_t getReceivedPackets() const {
 		return mPacketsReceived;
 	}
@@ -233,8 +313,20 @@ class RelayChannel : public SdpMasqueradeContext{
 	static const char *dirToString(Dir dir);
 
   private:
+	friend class MediaRelayServer;
+	/* What the epoll events of each socket point to. */
+	struct EpollSlot {
+		RelayChannel *channel;
+		int index;
+		bool ready; /* left with packets to read, in the ready list of the server thread */
+	};
+	RelaySession *mRelaySession;
+	MediaRelayServer *mServer;
+	EpollSlot mEpollSlots[2];
+	std::atomic<bool> mRetired;
 	Dir mDir;
 	std::string mLocalIp;
+	std::string mBindIp;
 	std::string mRemoteIp;
 	int mRemotePort;
 	RtpSession *mSession;
@@ -242,7 +334,7 @@ class RelayChannel : public SdpMasqueradeContext{
 	struct sockaddr_storage mSockAddr[2];
 	socklen_t mSockAddrSize[2];
 	std::shared_ptr<MediaFilter> mFilter;
-	int mPfdIndex;
+	std::unique_ptr<RtpStreamMonitor> mMonitor;
 	uint64_t mPacketsSent;
 	uint64_t mPacketsReceived;
 	bool mPreventLoop;
@@ -0,0 +1,241 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "metrics-exporter.hh"
+#include "common.hh"
+#include "configmanager.hh"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sstream>
+#include <unistd.h>
+
+using namespace std;
+
+MetricsExporter::Init MetricsExporter::sStaticInit;
+
+MetricsExporter::Init::Init() {
+	ConfigItemDescriptor items[] = {
+		{Boolean, "enabled", "Enable or disable the HTTP endpoint serving the stats in OpenMetrics format on /metrics.",
+		 "false"},
+		{String, "bind-address", "Local ip address where to bind the socket.", "127.0.0.1"},
+		{Integer, "port",
+		 "Port number of the endpoint. When there are several workers (global/workers), worker n listens on port + n.",
+		 "9180"},
+		config_item_end};
+	GenericStruct *s = new GenericStruct("metrics-exporter", "OpenMetrics (Prometheus) exporter of the stats.", 0);
+	GenericManager::get()->getRoot()->addChild(s);
+	s->addChildrenValues(items);
+}
+
+MetricsExporter::MetricsExporter(int port) {
+	mRunning = false;
+	mPort = port;
+	mSock = -1;
+}
+
+int MetricsExporter::start() {
+	int err;
+	struct sockaddr_in laddr;
+	string bind_address = GenericManager::get()
+							  ->getRoot()
+							  ->get<GenericStruct>("metrics-exporter")
+							  ->get<ConfigString>("bind-address")
+							  ->read();
+
+	if (bind_address.size() == 0)
+		bind_address = "0.0.0.0";
+
+	mSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (mSock == -1) {
+		LOGE("Could not create socket: %s", strerror(errno));
+		return -1;
+	}
+	int on = 1;
+	setsockopt(mSock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&laddr, 0, sizeof(laddr));
+	laddr.sin_family = AF_INET;
+	laddr.sin_addr.s_addr = inet_addr(bind_address.c_str());
+	laddr.sin_port = htons(mPort);
+
+	err = ::bind(mSock, (struct sockaddr *)&laddr, sizeof(laddr));
+	if (err == -1 || listen(mSock, 16) == -1) {
+		LOGE("Could not listen for metrics scrapers on %s port %i: %s", bind_address.c_str(), mPort, strerror(errno));
+		close(mSock);
+		mSock = -1;
+		return -1;
+	}
+	LOGI("Serving metrics on http://%s:%i/metrics", bind_address.c_str(), mPort);
+
+	mRunning = true;
+	pthread_create(&mThread, NULL, &MetricsExporter::threadfunc, this);
+	return 0;
+}
+
+void MetricsExporter::stop() {
+	if (mRunning) {
+		mRunning = false;
+		pthread_join(mThread, NULL);
+	}
+}
+
+void MetricsExporter::run() {
+	while (mRunning) {
+		struct pollfd pfd[1];
+
+		pfd[0].fd = mSock;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+
+		int err = poll(pfd, 1, 200);
+		if (err > 0 && (pfd[0].revents & POLLIN)) {
+			int sock = accept(mSock, NULL, NULL);
+			if (sock == -1) {
+				LOGW("Could not accept metrics connection: %s", strerror(errno));
+				continue;
+			}
+			serve(sock);
+			close(sock);
+		}
+	}
+}
+
+/* Handles a single request and closes the connection, which is all scrapers need. */
+void MetricsExporter::serve(int sock) {
+	string request;
+	char buf[1024];
+	while (request.find("\r\n\r\n") == string::npos && request.size() < 8192) {
+		struct pollfd pfd[1];
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		if (poll(pfd, 1, 1000) <= 0)
+			return;
+		ssize_t len = recv(sock, buf, sizeof(buf), 0);
+		if (len <= 0)
+			return;
+		request.append(buf, len);
+	}
+
+	ostringstream response;
+	if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 14, "GET /metrics?") == 0) {
+		ostringstream body;
+		dump(body, GenericManager::get()->getRoot());
+		string content = body.str();
+		response << "HTTP/1.1 200 OK\r\n"
+				 << "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+				 << "Content-Length: " << content.size() << "\r\n"
+				 << "Connection: close\r\n\r\n"
+				 << content;
+	} else {
+		response << "HTTP/1.1 404 Not Found\r\n"
+				 << "Content-Length: 0\r\n"
+				 << "Connection: close\r\n\r\n";
+	}
+
+	string data = response.str();
+	size_t sent = 0;
+	while (sent < data.size()) {
+		ssize_t len = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (len <= 0) {
+			LOGD("Could not send metrics: %s", strerror(errno));
+			return;
+		}
+		sent += len;
+	}
+}
+
+void *MetricsExporter::threadfunc(void *arg) {
+	MetricsExporter *zis = (MetricsExporter *)arg;
+	zis->run();
+	return NULL;
+}
+
+MetricsExporter::~MetricsExporter() {
+	if (mRunning)
+		stop();
+	if (mSock != -1)
+		close(mSock);
+}
+
+void MetricsExporter::dump(ostream &ostr, GenericStruct *root) {
+	dumpRecursive(ostr, root, "flexisip");
+	ostr << "# EOF\n";
+}
+
+void MetricsExporter::dumpRecursive(ostream &ostr, GenericEntry *entry, const string &prefix) {
+	GenericStruct *cs = dynamic_cast<GenericStruct *>(entry);
+	StatCounter64 *stat;
+	if (cs) {
+		string name = (cs->getParent() == NULL) ? prefix : prefix + "_" + metricName(cs->getName());
+		for (auto it = cs->getChildren().begin(); it != cs->getChildren().end(); ++it) {
+			dumpRecursive(ostr, *it, name);
+		}
+	} else if ((stat = dynamic_cast<StatCounter64 *>(entry)) != NULL) {
+		string name = prefix + "_" + metricName(stat->getName());
+		/* gauges, percentiles included, go up and down, the other stats only count */
+		if (dynamic_cast<StatGauge *>(stat)) {
+			ostr << "# TYPE " << name << " gauge\n"
+				 << "# HELP " << name << " " << escapeHelp(stat->getHelp()) << "\n"
+				 << name << " " << stat->read() << "\n";
+		} else {
+			ostr << "# TYPE " << name << " counter\n"
+				 << "# HELP " << name << " " << escapeHelp(stat->getHelp()) << "\n"
+				 << name << "_total " << stat->read() << "\n";
+		}
+	}
+}
+
+/* Lowercase, with runs of characters not allowed in metric names replaced by a single '_'. */
+string MetricsExporter::metricName(const string &name) {
+	string result;
+	bool separator = false;
+	for (auto it = name.begin(); it != name.end(); ++it) {
+		char c = *it;
+		if (isalnum((unsigned char)c)) {
+			if (separator && !result.empty())
+				result += '_';
+			separator = false;
+			result += tolower((unsigned char)c);
+		} else {
+			separator = true;
+		}
+	}
+	return result;
+}
+
+string MetricsExporter::escapeHelp(const string &help) {
+	string result;
+	for (auto it = help.begin(); it != help.end(); ++it) {
+		switch (*it) {
+			case '\\':
+				result += "\\\\";
+				break;
+			case '\n':
+				result += "\\n";
+				break;
+			case '"':
+				result += "\\\"";
+				break;
+			default:
+				result += *it;
+		}
+	}
+	return result;
+}
@@ -0,0 +1,62 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef metrics_exporter_hh
+#define metrics_exporter_hh
+
+#include <atomic>
+#include <pthread.h>
+#include <ostream>
+#include <string>
+
+class GenericEntry;
+class GenericStruct;
+
+/**
+ * Minimal HTTP server serving the stats of the configuration tree in the OpenMetrics text format, for Prometheus
+ * scrapers. It runs in its own thread and only reads the counters, which are lock-free, so scraping never blocks
+ * the SIP processing.
+ */
+class MetricsExporter {
+  public:
+	MetricsExporter(int port);
+	~MetricsExporter();
+	int start();
+	void stop();
+	/* Writes all the stats below root, in the OpenMetrics text format. */
+	static void dump(std::ostream &ostr, GenericStruct *root);
+
+  private:
+	void run();
+	void serve(int sock);
+	static void *threadfunc(void *arg);
+	static void dumpRecursive(std::ostream &ostr, GenericEntry *entry, const std::string &prefix);
+	static std::string metricName(const std::string &name);
+	static std::string escapeHelp(const std::string &help);
+	std::atomic<bool> mRunning; /* cleared by stop() while the thread runs */
+	pthread_t mThread;
+	int mPort;
+	int mSock;
+	class Init {
+	  public:
+		Init();
+	};
+	static Init sStaticInit;
+};
+
+#endif
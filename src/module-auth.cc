@@ -32,6 +32,7 @@
 #include <sofia-sip/nua.h>
 
 #include "authdb.hh"
+#include "utils/shared-nonce-table.hh"
 
 using namespace std;
 class Authentication;
@@ -51,6 +52,7 @@ struct auth_mod_size {
 	auth_plugin_t plug[1];
 };
 
+/* Nonce counts of the issued nonces. With several workers, they are kept in the table shared by all of them. */
 class NonceStore {
 	struct NonceCount {
 		NonceCount(int c, time_t ex) : nc(c), expires(ex) {
@@ -61,19 +63,16 @@ class NonceStore {
 	map<string, NonceCount> mNc;
 	mutex mMutex;
 	int mNonceExpires;
+	SharedNonceTable *mShared;
 
   public:
-	NonceStore() : mNonceExpires(3600) {
+	NonceStore() : mNonceExpires(3600), mShared(NULL) {
 	}
 	void setNonceExpires(int value) {
 		mNonceExpires = value;
 	}
-	int getNc(const string &nonce) {
-		unique_lock<mutex> lck(mMutex);
-		auto it = mNc.find(nonce);
-		if (it != mNc.end())
-			return (*it).second.nc;
-		return -1;
+	void setShared(SharedNonceTable *shared) {
+		mShared = shared;
 	}
 
 	void insert(msg_header_t *response) {
@@ -84,8 +83,12 @@ class NonceStore {
 		insert(snonce);
 	}
 	void insert(const string &nonce) {
-		unique_lock<mutex> lck(mMutex);
 		time_t expiration = getCurrentTime() + mNonceExpires;
+		if (mShared) {
+			mShared->insert(nonce, expiration);
+			return;
+		}
+		unique_lock<mutex> lck(mMutex);
 		auto it = mNc.find(nonce);
 		if (it != mNc.end()) {
 			LOGE("Replacing nonce count for %s", nonce.c_str());
@@ -96,23 +99,34 @@ class NonceStore {
 		}
 	}
 
-	void updateNc(const string &nonce, int newnc) {
+	/* Stores newnc as the count of nonce if it is greater than the current one. Returns the previous count, -1 if
+	 * the nonce is unknown. */
+	int updateNc(const string &nonce, int newnc) {
+		if (mShared)
+			return mShared->updateNc(nonce, newnc, getCurrentTime());
 		unique_lock<mutex> lck(mMutex);
 		auto it = mNc.find(nonce);
-		if (it != mNc.end()) {
+		if (it == mNc.end())
+			return -1;
+		int pnc = it->second.nc;
+		if (newnc > pnc) {
 			LOGD("Updating nonce %s with nc=%d", nonce.c_str(), newnc);
-			(*it).second.nc = newnc;
-		} else {
-			LOGE("Couldn't update nonce %s: not found", nonce.c_str());
+			it->second.nc = newnc;
 		}
+		return pnc;
 	}
 
 	void erase(const string &nonce) {
-		unique_lock<mutex> lck(mMutex);
 		LOGD("Erasing nonce %s", nonce.c_str());
+		if (mShared) {
+			mShared->erase(nonce);
+			return;
+		}
+		unique_lock<mutex> lck(mMutex);
 		mNc.erase(nonce);
 	}
 
+	/* Entries of the shared table expire in place. */
 	void cleanExpired() {
 		unique_lock<mutex> lck(mMutex);
 		int count = 0;
@@ -364,6 +378,7 @@ class Authentication : public Module {
 		mTestAccountsEnabled = mc->get<ConfigBoolean>("enable-test-accounts-creation")->read();
 		mDisableQOPAuth = mc->get<ConfigBoolean>("disable-qop-auth")->read();
 		mNonceStore.setNonceExpires(nonceExpires);
+		mNonceStore.setShared(getAgent()->getWorkerNonces());
 
 		for (it = mDomains.begin(); it != mDomains.end(); ++it) {
 			auto domain = *it;
@@ -389,13 +404,18 @@ class Authentication : public Module {
 	}
 
 	auth_mod_t *createAuthModule(const std::string &domain, int nonceExpires) {
+		/* Nonces are signed with the master key: with several workers, they all use the same one so that a nonce
+		 * issued by a worker is valid in the others.*/
+		const std::string &masterKey = getAgent()->getWorkerSecret();
 		if (mDisableQOPAuth) {
 			return auth_mod_create(NULL, AUTHTAG_METHOD("odbc"), AUTHTAG_REALM(domain.c_str()),
-								   AUTHTAG_OPAQUE("+GNywA=="), AUTHTAG_FORBIDDEN(1), AUTHTAG_ALLOW("ACK CANCEL BYE"),
-								   TAG_END());
+								   AUTHTAG_OPAQUE("+GNywA=="),
+								   TAG_IF(!masterKey.empty(), AUTHTAG_MASTER_KEY(masterKey.c_str())),
+								   AUTHTAG_FORBIDDEN(1), AUTHTAG_ALLOW("ACK CANCEL BYE"), TAG_END());
 		} else {
 			return auth_mod_create(NULL, AUTHTAG_METHOD("odbc"), AUTHTAG_REALM(domain.c_str()),
 								   AUTHTAG_OPAQUE("+GNywA=="), AUTHTAG_QOP("auth"),
+								   TAG_IF(!masterKey.empty(), AUTHTAG_MASTER_KEY(masterKey.c_str())),
 								   AUTHTAG_EXPIRES(nonceExpires),	  // in seconds
 								   AUTHTAG_NEXT_EXPIRES(nonceExpires), // in seconds
 								   AUTHTAG_FORBIDDEN(1), AUTHTAG_ALLOW("ACK CANCEL BYE"), TAG_END());
@@ -871,8 +891,9 @@ void Authentication::flexisip_auth_check_digest(auth_mod_t *am, auth_status_t *a
 	}
 
 	if (!listener->mModule->mDisableQOPAuth) {
-		int pnc = module->mNonceStore.getNc(ar->ar_nonce);
 		int nnc = (int)strtoul(ar->ar_nc, NULL, 16);
+		/* checked and updated at once, so that a request replayed through another worker meanwhile is refused */
+		int pnc = module->mNonceStore.updateNc(ar->ar_nonce, nnc);
 		if (pnc == -1 || pnc >= nnc) {
 			LOGE("Bad nonce count %d -> %d for %s", pnc, nnc, ar->ar_nonce);
 			as->as_blacklist = am->am_blacklist;
@@ -880,8 +901,6 @@ void Authentication::flexisip_auth_check_digest(auth_mod_t *am, auth_status_t *a
 			module->mNonceStore.insert(as->as_response);
 			listener->finish();
 			return;
-		} else {
-			module->mNonceStore.updateNc(ar->ar_nonce, nnc);
 		}
 	}
 
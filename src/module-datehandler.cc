@@ -45,6 +45,9 @@ class DateHandler : public Module, protected ModuleToolbox {
 	}
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) {
 	}
+	virtual bool handlesResponse(sip_method_t method) const {
+		return false;
+	}
 
   protected:
 	virtual void onDeclare(GenericStruct *module_config) {
@@ -335,6 +335,9 @@ class GatewayAdapter : public Module {
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
+	virtual bool handlesResponse(sip_method_t method) const {
+		return false;
+	}
 
 	virtual bool isValidNextConfig(const ConfigValue &cv);
 
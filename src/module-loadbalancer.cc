@@ -31,6 +31,9 @@ class LoadBalancer : public Module, public ModuleToolbox {
 	virtual void onLoad(const GenericStruct *modconf);
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
+	virtual bool handlesResponse(sip_method_t method) const {
+		return false;
+	}
 
   private:
 	vector<string> mRoutes;
@@ -59,6 +59,11 @@ void MediaRelay::onDeclare(GenericStruct * mc) {
 			{ String, "nortpproxy", "SDP attribute set by the first proxy to forbid subsequent proxies to provide relay. Use 'disable' to disable.", "nortpproxy" },
 			{ Integer, "sdp-port-range-min", "The minimal value of SDP port range", "1024" },
 			{ Integer, "sdp-port-range-max", "The maximal value of SDP port range", "65535" },
+			{ Integer, "relay-threads", "Number of threads relaying media, each one pinned to a cpu and using its own share of the "
+				"SDP port range. New calls go to the least loaded thread. A value of 0 means one thread per cpu, "
+				"the cpus and the SDP port range being shared among the worker processes.", "0" },
+			{ Integer, "prebound-ports", "Number of RTP/RTCP port pairs each relay thread keeps bound in advance on each interface, "
+				"so that relaying a new stream does not wait for binding. A value of 0 disables it.", "0" },
 			{ Boolean, "bye-orphan-dialogs", "Sends a ACK and BYE to 200Ok for INVITEs not belonging to any established call.", "false"},
 			{ Integer, "max-calls", "Maximum concurrent calls processed by the media-relay. Calls arriving when the limit is exceed will be rejected. "
 						"A value of 0 means no limit.", "0" },
@@ -69,6 +74,9 @@ void MediaRelay::onDeclare(GenericStruct * mc) {
 						"You need to set this property to false if you are running test calls from clients running on the same "
 						"IP address as the flexisip server" , "true"},
 			{ Boolean, "early-media-relay-single", "In case multiples 183 Early media responses are received for a call, only the first one will have RTP streams forwarded back to caller. This feature prevents the caller to receive 'mixed' streams, but it breaks scenarios where multiple servers play early media announcement in sequence.", "true"},
+			{ Boolean, "quality-reports", "Inspect the relayed RTP and RTCP packets to measure the loss and jitter of the streams, and read "
+				"the reports of the clients. A call quality statistics event log is written for each stream at the end of the call, "
+				"as if the caller had published it.", "false"},
 			{ Integer, "max-early-media-per-call", "Maximum number of relayed early media streams per call. This is useful to limit the cpu usage due to early media relaying on"
 				" embedded systems. A value of 0 stands for unlimited.", "0"},
 #ifdef MEDIARELAY_SPECIFIC_FEATURES_ENABLED
@@ -84,17 +92,61 @@ void MediaRelay::onDeclare(GenericStruct * mc) {
 	auto p=mc->createStatPair("count-calls", "Number of relayed calls.");
 	mCountCalls=p.first;
 	mCountCallsFinished=p.second;
+	mCountPortsExhausted=mc->createStat("count-ports-exhausted", "Number of relayed streams that could not get a port because the SDP port range was exhausted.");
+	mCountH264BytesForwarded=mc->createStat("count-h264-filtered-bytes-forwarded", "Number of bytes of H264 streams forwarded by the I-frame filter.");
+	mCountH264BytesDropped=mc->createStat("count-h264-filtered-bytes-dropped", "Number of bytes of H264 streams dropped by the I-frame filter.");
+}
+
+pair<int, int> MediaRelay::portShare(int minPort, int maxPort, int index, int count) {
+	int firstPort = (minPort + 1) & ~1;
+	int share = ((maxPort - firstPort) / count) & ~1;
+	int shareMin = firstPort + index * share;
+	return make_pair(shareMin, (index == count - 1) ? maxPort : shareMin + share);
 }
 
 void MediaRelay::createServers(){
-	int cpuCount = ModuleToolbox::getCpuCount();
-	int i;
-	for(i = 0; i<cpuCount; ++i){
-		mServers.push_back(make_shared<MediaRelayServer>(this));
+	/*worker processes each relay on their own slice of the SDP port range and of the cpus*/
+	int workerIndex = getAgent()->getWorkerIndex();
+	int workerCount = getAgent()->getWorkerCount();
+	pair<int, int> range = portShare(mMinPort, mMaxPort, workerIndex, workerCount);
+	int count = mRelayThreads > 0 ? mRelayThreads : max(1, ModuleToolbox::getCpuCount() / workerCount);
+	/*each server needs at least one RTP/RTCP port pair of its own*/
+	int maxCount = max(1, (range.second - range.first) / 2);
+	if (count > maxCount) {
+		LOGW("SDP port range [%i, %i] too small for %i relay threads, using %i.", range.first, range.second, count,
+			 maxCount);
+		count = maxCount;
+	}
+	for (int i = 0; i < count; ++i) {
+		pair<int, int> share = portShare(range.first, range.second, i, count);
+		/*the index picks the cpu, servers of the next worker start on the next cpus*/
+		mServers.push_back(make_shared<MediaRelayServer>(this, workerIndex * count + i, share.first, share.second,
+														 mCountPortsExhausted));
 	}
 	mCurServer = 0;
 }
 
+size_t MediaRelay::leastLoaded(const vector<shared_ptr<MediaRelayServer>> &servers, size_t next) {
+	size_t best = next;
+	unsigned int bestLoad = servers[best]->getLoad();
+	for (size_t n = 1; n < servers.size() && bestLoad > 0; ++n) {
+		size_t i = (next + n) % servers.size();
+		unsigned int load = servers[i]->getLoad();
+		if (load < bestLoad) {
+			best = i;
+			bestLoad = load;
+		}
+	}
+	return best;
+}
+
+/* Returns the least loaded server, the ties being shared in turn. */
+const shared_ptr<MediaRelayServer> &MediaRelay::pickServer() {
+	size_t best = leastLoaded(mServers, mCurServer);
+	mCurServer = (best + 1) % mServers.size();
+	return mServers[best];
+}
+
 void MediaRelay::onLoad(const GenericStruct * modconf) {
 	mCalls = new CallStore();
 	mCalls->setCallStatCounters(mCountCalls, mCountCallsFinished);
@@ -116,10 +168,13 @@ void MediaRelay::onLoad(const GenericStruct * modconf) {
 #endif
 	mMinPort = modconf->get<ConfigInt>("sdp-port-range-min")->read();
 	mMaxPort = modconf->get<ConfigInt>("sdp-port-range-max")->read();
+	mRelayThreads = modconf->get<ConfigInt>("relay-threads")->read();
+	mPreboundPorts = modconf->get<ConfigInt>("prebound-ports")->read();
 	mPreventLoop = modconf->get<ConfigBoolean>("prevent-loops")->read();
 	mMaxCalls=modconf->get<ConfigInt>("max-calls")->read();
 	mMaxRelayedEarlyMedia = modconf->get<ConfigInt>("max-early-media-per-call")->read();
 	mForceRelayForNonIceTargets = modconf->get<ConfigBoolean>("force-relay-for-non-ice-targets")->read();
+	mQualityReports = modconf->get<ConfigBoolean>("quality-reports")->read();
 	createServers();
 }
 
@@ -200,7 +255,8 @@ bool MediaRelay::processNewInvite(const shared_ptr<RelayedCall> &c, const shared
 void MediaRelay::configureContext(shared_ptr<RelayedCall> &c){
 #ifdef MEDIARELAY_SPECIFIC_FEATURES_ENABLED
 	if (mH264FilteringBandwidth)
-		c->enableH264IFrameFiltering(mH264FilteringBandwidth,mH264Decim,mH264DecimOnlyIfLastProxy);
+		c->enableH264IFrameFiltering(mH264FilteringBandwidth,mH264Decim,mH264DecimOnlyIfLastProxy,
+			mCountH264BytesForwarded,mCountH264BytesDropped);
 	if (mDropTelephoneEvent)
 		c->enableTelephoneEventDrooping(true);
 #endif
@@ -228,8 +284,7 @@ void MediaRelay::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipExcept
 				return;
 			}
 
-			c = make_shared<RelayedCall>(mServers[mCurServer], sip);
-			mCurServer = (mCurServer + 1) % mServers.size();
+			c = make_shared<RelayedCall>(pickServer(), sip);
 			newContext=true;
 			it->setProperty<RelayedCall>(getModuleName(), c);
 			configureContext(c);
@@ -367,7 +422,6 @@ void MediaRelay::onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipExc
 }
 
 void MediaRelay::onIdle() {
-	mCalls->dump();
 	mCalls->removeAndDeleteInactives();
 	if (mCalls->size() > 0)
 		LOGD("There are %i calls active in the MediaRelay call list.",mCalls->size());
@@ -0,0 +1,76 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <list>
+#include <vector>
+#include <sofia-sip/sip.h>
+
+/**
+ * Enabled modules handling requests of each method, and responses to them, in module order. Built from the modules
+ * of the agent, which are asked isEnabled(), handlesRequest(method) and handlesResponse(method). The order of the
+ * modules is kept with them, so that an event injected back resumes after its module in the pipelines it was
+ * processed with.
+ */
+template <typename ModuleT>
+class ModulePipelines {
+  public:
+	/* One pipeline per request method, the methods sofia doesn't know sharing the sip_method_unknown one. */
+	static const int sCount = sip_method_publish + 1;
+	static int index(sip_method_t method) {
+		return (method > 0 && method < sCount) ? method : 0;
+	}
+
+	ModulePipelines(const std::list<ModuleT *> &modules) : mModules(modules) {
+		for (int m = 0; m < sCount; ++m) {
+			for (auto it = mModules.begin(); it != mModules.end(); ++it) {
+				ModuleT *module = *it;
+				if (!module->isEnabled())
+					continue;
+				if (module->handlesRequest((sip_method_t)m))
+					mRequests[m].push_back(module);
+				if (module->handlesResponse((sip_method_t)m))
+					mResponses[m].push_back(module);
+			}
+		}
+	}
+	const std::vector<ModuleT *> &requests(int method) const {
+		return mRequests[method];
+	}
+	const std::vector<ModuleT *> &responses(int method) const {
+		return mResponses[method];
+	}
+	/* Index in pipeline of the first module coming after current in the module order, the size of pipeline if there
+	 * is none. */
+	size_t resumeIndex(const std::vector<ModuleT *> &pipeline, ModuleT *current) const {
+		size_t index = 0;
+		for (auto it = mModules.begin(); it != mModules.end() && index < pipeline.size(); ++it) {
+			if (pipeline[index] == *it)
+				index++;
+			if (*it == current)
+				break;
+		}
+		return index;
+	}
+
+  private:
+	std::list<ModuleT *> mModules;
+	std::vector<ModuleT *> mRequests[sCount];
+	std::vector<ModuleT *> mResponses[sCount];
+};
@@ -100,6 +100,12 @@ class ModulePresence : public Module, ModuleToolbox {
 			route(ev);
 	}
 	void onResponse(std::shared_ptr<ResponseSipEvent> &ev)throw (FlexisipException){};
+	bool handlesRequest(sip_method_t method) const {
+		return method == sip_method_subscribe || method == sip_method_publish;
+	}
+	bool handlesResponse(sip_method_t method) const {
+		return false;
+	}
 
   public:
 	ModulePresence(Agent *ag) : Module(ag) {
@@ -66,6 +66,9 @@ class ModuleRedirect : public Module, ModuleToolbox {
 				  SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
 	}
 	void onResponse(std::shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException){};
+	virtual bool handlesResponse(sip_method_t method) const {
+		return false;
+	}
 
   public:
 	ModuleRedirect(Agent *ag) : Module(ag) {
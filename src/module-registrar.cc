@@ -60,7 +60,7 @@ class FakeFetchListener : public RegistrarDbListener {
 struct RegistrarStats {
 	unique_ptr<StatPair> mCountBind;
 	unique_ptr<StatPair> mCountClear;
-	StatCounter64 *mCountLocalActives;
+	StatGauge *mCountLocalActives;
 };
 
 class OnRequestBindListener;
@@ -119,14 +119,34 @@ class ModuleRegistrar : public Module, public ModuleToolbox {
 			 "Timeout in seconds after which the static records file is re-read and the contacts updated.", "600"},
 
 			{String, "db-implementation",
-			 "Implementation used for storing address of records contact uris. [redis, internal]", "internal"},
+			 "Implementation used for storing address of records contact uris. [redis, internal, compact]\n"
+			 "'compact' is an in-memory storage like 'internal', using much less memory per registration.",
+			 "internal"},
+			{String, "persistence-dir",
+			 "Directory where the 'internal' implementation saves the registrations, so that they survive a restart. "
+			 "Each change is appended to a journal, and all the registrations are written to a snapshot "
+			 "periodically. Empty to keep them in memory only.",
+			 ""},
+			{Integer, "persistence-snapshot-period",
+			 "Interval in seconds between two snapshots of the registrations, when persistence-dir is set.", "300"},
 			// Redis config support
 			{String, "redis-server-domain", "Domain of the redis server. ", "localhost"},
 			{Integer, "redis-server-port", "Port of the redis server.", "6379"},
+			{StringList, "redis-server-shards",
+			 "List of independent redis masters, as host:port, over which the registrations are spread by "
+			 "consistent hashing of the address of record. When set, it replaces redis-server-domain and "
+			 "redis-server-port, the other redis settings apply to every master. All the proxies sharing the "
+			 "registrations must use the same list. Adding or removing a master moves a part of the "
+			 "registrations to another one, they are lost until the clients register again.",
+			 ""},
 			{Integer, "redis-server-db", "DB number of the redis server.", "0"},
 			{String, "redis-auth-password", "Authentication password for redis. Empty to disable.", ""},
 			{Integer, "redis-server-timeout", "Timeout in milliseconds of the redis connection.", "1500"},
-			{String, "redis-record-serializer", "Serialize contacts with: [C, protobuf, json, msgpack]", "protobuf"},
+			{String, "redis-record-serializer",
+			 "Serialize contacts with: [C, protobuf, json, msgpack, binary]\n"
+			 "'binary' is the most compact and the fastest to parse, it reads the records written by the other "
+			 "serializers too, so that it can replace them on a running deployment.",
+			 "protobuf"},
 			{Integer, "redis-slave-check-period", "When Redis is configured in master-slave, flexisip will "
 												  "periodically ask what are the slaves and the master."
 												  "This is the period with which it will query the server."
@@ -135,6 +155,33 @@ class ModuleRegistrar : public Module, public ModuleToolbox {
 												  "Note: This requires that all redis instances have the same "
 												  "password. Otherwise the authentication will fail.",
 			 "60"},
+			{Integer, "redis-connection-pool-size",
+			 "Number of connections opened to the redis server. Requests are dispatched to the connection having the "
+			 "least outstanding requests.",
+			 "1"},
+			{Integer, "redis-pending-queue-size",
+			 "Maximum number of registrar requests kept while the connection to redis is down. They are replayed when "
+			 "the connection is up again, or fail after redis-server-timeout. 0 makes them fail immediately.",
+			 "1000"},
+			{Boolean, "redis-atomic-bind",
+			 "Merge the contacts of a REGISTER into the stored record with a Lua script executed by the redis server, "
+			 "in a single atomic round trip, instead of a GET followed by a SET. This prevents concurrent REGISTERs "
+			 "handled by different proxies from overwriting each other. Requires redis-record-serializer=json.",
+			 "false"},
+			{Integer, "redis-cache-size",
+			 "Memory, in kilobytes, of the local cache of the registrations read from each redis master. Cached "
+			 "records are invalidated through a redis pub/sub channel, on which every write to the registrations "
+			 "is announced. All the proxies sharing the redis server must enable it, so that they publish their "
+			 "writes. 0 to disable the cache.",
+			 "0"},
+			{String, "redis-record-layout",
+			 "How address of records are stored in redis: [string, hash]. 'string' stores the whole serialized record "
+			 "under aor:<aor>. 'hash' stores a redis hash fs:<aor> with one serialized contact per field, keyed by the "
+			 "contact unique id (see unique-id-parameters), so that refreshing a device only rewrites its own field. "
+			 "With redis-cache-size enabled, a REGISTER refreshing a cached contact is a single HSET, without reading "
+			 "the record first. The two layouts use distinct keys: changing it loses the registrations stored with "
+			 "the other one.",
+			 "string"},
 			{String, "service-route",
 			 "Sequence of proxies (space-separated) where requests will be redirected through (RFC3608)", ""},
 			config_item_end};
@@ -142,8 +189,8 @@ class ModuleRegistrar : public Module, public ModuleToolbox {
 
 		mStats.mCountClear = mc->createStats("count-clear", "Number of cleared registrations.");
 		mStats.mCountBind = mc->createStats("count-bind", "Number of registers.");
-		mStats.mCountLocalActives =
-			mc->createStat("count-local-registered-users", "Number of users currently registered through this server.");
+		mStats.mCountLocalActives = mc->createGauge("count-local-registered-users",
+													"Number of users currently registered through this server.");
 	}
 
 	virtual void onLoad(const GenericStruct *mc) {
@@ -191,6 +238,12 @@ class ModuleRegistrar : public Module, public ModuleToolbox {
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
+	virtual bool handlesRequest(sip_method_t method) const {
+		return method == sip_method_register;
+	}
+	virtual bool handlesResponse(sip_method_t method) const {
+		return method == sip_method_register;
+	}
 
 	template <typename SipEventT, typename ListenerT>
 	void processUpdateRequest(shared_ptr<SipEventT> &ev, const sip_t *sip);
@@ -548,8 +601,9 @@ void ModuleRegistrar::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipE
 		return;
 	}
 
-	// Use path as a contact route in all cases
-	addPathHeader(getAgent(), ev, ev->getIncomingTport().get());
+	// Use path as a contact route in all cases. With several workers, the connection of the contact is only held by
+	// the worker that received the REGISTER: the path is its private address, the one the router checks against.
+	addPathHeader(getAgent(), ev, getAgent()->getWorkerCount() > 1 ? NULL : ev->getIncomingTport().get());
 
 	// domain registration case, does nothing for the moment
 	if (sipurl->url_user == NULL && !mAllowDomainRegistrations) {
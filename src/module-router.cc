@@ -35,7 +35,7 @@ struct RouterStats {
 	unique_ptr<StatPair> mCountForks;
 	unique_ptr<StatPair> mCountForkTransactions;
 	StatCounter64 *mCountNonForks;
-	StatCounter64 *mCountLocalActives;
+	StatGauge *mCountLocalActives;
 };
 
 class ModuleRouter : public Module, public ModuleToolbox, public ForkContextListener {
@@ -105,8 +105,8 @@ class ModuleRouter : public Module, public ModuleToolbox, public ForkContextList
 			mc->createStats("count-fork-transactions", "Number of outgoing transaction created for forking");
 
 		mStats.mCountNonForks = mc->createStat("count-non-forked", "Number of non forked invites.");
-		mStats.mCountLocalActives =
-			mc->createStat("count-local-registered-users", "Number of users currently registered through this server.");
+		mStats.mCountLocalActives = mc->createGauge("count-local-registered-users",
+													"Number of users currently registered through this server.");
 	}
 
 	virtual void onLoad(const GenericStruct *mc) {
@@ -36,6 +36,9 @@ class StatisticsCollector : public Module, ModuleToolbox {
 	virtual void onLoad(const GenericStruct *root);
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
+	virtual bool handlesResponse(sip_method_t method) const {
+		return false;
+	}
 
   private:
 	int managePublishContent(const shared_ptr<RequestSipEvent> ev);
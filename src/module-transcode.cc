@@ -71,6 +71,13 @@ class Transcoder : public Module, protected ModuleToolbox {
 	virtual void onLoad(const GenericStruct *module_config);
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
+	virtual bool handlesRequest(sip_method_t method) const {
+		return method == sip_method_invite || method == sip_method_ack || method == sip_method_info ||
+			   method == sip_method_bye;
+	}
+	virtual bool handlesResponse(sip_method_t method) const {
+		return method == sip_method_invite;
+	}
 	virtual void onIdle();
 	virtual void onDeclare(GenericStruct *mc);
 #ifdef ENABLE_TRANSCODER
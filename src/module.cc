@@ -135,6 +135,50 @@ void Module::declare(GenericStruct *root) {
 	root->addChild(mModuleConfig);
 	mFilter->declareConfig(mModuleConfig);
 	onDeclare(mModuleConfig);
+	declareLatencyStats();
+}
+
+void Module::declareLatencyStats() {
+	static const struct {
+		sip_method_t method;
+		const char *name;
+	} tracked[] = {{sip_method_invite, "invite"},
+				   {sip_method_register, "register"},
+				   {sip_method_subscribe, "subscribe"},
+				   {sip_method_message, "message"}};
+
+	mLatencyStats.emplace_back(mModuleConfig->createLatencyStats(
+		"latency-request-other", "Time spent processing requests of the methods without stats of their own."));
+	StatLatency *request = mLatencyStats.back().get();
+	mLatencyStats.emplace_back(mModuleConfig->createLatencyStats(
+		"latency-response-other", "Time spent processing responses to the methods without stats of their own."));
+	StatLatency *response = mLatencyStats.back().get();
+	mLatencyStats.emplace_back(mModuleConfig->createLatencyStats(
+		"latency-suspended-other", "Time events of the methods without stats of their own stayed suspended."));
+	StatLatency *suspended = mLatencyStats.back().get();
+	for (int m = 0; m < sLatencyMethodCount; ++m) {
+		mRequestLatency[m] = request;
+		mResponseLatency[m] = response;
+		mSuspendedLatency[m] = suspended;
+	}
+
+	for (size_t i = 0; i < sizeof(tracked) / sizeof(tracked[0]); ++i) {
+		string name = tracked[i].name;
+		string method = sip_method_name(tracked[i].method, "");
+		if (handlesRequest(tracked[i].method)) {
+			mLatencyStats.emplace_back(mModuleConfig->createLatencyStats(
+				"latency-request-" + name, "Time spent processing " + method + " requests."));
+			mRequestLatency[tracked[i].method] = mLatencyStats.back().get();
+			mLatencyStats.emplace_back(mModuleConfig->createLatencyStats(
+				"latency-suspended-" + name, "Time " + method + " requests and responses stayed suspended."));
+			mSuspendedLatency[tracked[i].method] = mLatencyStats.back().get();
+		}
+		if (handlesResponse(tracked[i].method)) {
+			mLatencyStats.emplace_back(mModuleConfig->createLatencyStats(
+				"latency-response-" + name, "Time spent processing responses to " + method + "."));
+			mResponseLatency[tracked[i].method] = mLatencyStats.back().get();
+		}
+	}
 }
 
 void Module::checkConfig() {
@@ -156,6 +200,7 @@ void Module::load() {
 void Module::reload() {
 	onUnload();
 	load();
+	mAgent->buildPipelines();
 }
 
 void Module::processRequest(shared_ptr<RequestSipEvent> &ev) {
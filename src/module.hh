@@ -152,6 +152,25 @@ class Module : protected ConfigValueListener {
 	inline void process(std::shared_ptr<ResponseSipEvent> &ev) {
 		processResponse(ev);
 	}
+	/* Whether the module has anything to do with requests of the given method, or with the responses to them. The
+	 * agent leaves a module out of the processing of the methods it ignores. */
+	virtual bool handlesRequest(sip_method_t method) const {
+		return true;
+	}
+	virtual bool handlesResponse(sip_method_t method) const {
+		return true;
+	}
+	/* Time the module took to process an event of the given method, indexed like the agent pipelines. */
+	void recordProcessingTime(const std::shared_ptr<RequestSipEvent> &ev, int method, uint64_t us) {
+		mRequestLatency[method]->record(us);
+	}
+	void recordProcessingTime(const std::shared_ptr<ResponseSipEvent> &ev, int method, uint64_t us) {
+		mResponseLatency[method]->record(us);
+	}
+	/* Time an event of the given method stayed suspended by the module. */
+	void recordSuspendedTime(int method, uint64_t us) {
+		mSuspendedLatency[method]->record(us);
+	}
 
   protected:
 	virtual void onDeclare(GenericStruct *root) {
@@ -186,11 +205,18 @@ class Module : protected ConfigValueListener {
 
   private:
 	void setInfo(ModuleInfoBase *i);
+	void declareLatencyStats();
+	static const int sLatencyMethodCount = sip_method_publish + 1;
 	ModuleInfoBase *mInfo;
 	GenericStruct *mModuleConfig;
 	EntryFilter *mFilter;
 	bool mDirtyConfig;
 	su_home_t mHome;
+	/* Methods without stats of their own share the "other" ones. */
+	StatLatency *mRequestLatency[sLatencyMethodCount];
+	StatLatency *mResponseLatency[sLatencyMethodCount];
+	StatLatency *mSuspendedLatency[sLatencyMethodCount];
+	std::list<std::unique_ptr<StatLatency>> mLatencyStats;
 };
 
 inline std::ostringstream &operator<<(std::ostringstream &__os, const Module &m) {
@@ -0,0 +1,261 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.hh"
+#include "registrardb.hh"
+#include "recordserializer.hh"
+
+#include <cstring>
+
+using namespace std;
+
+/*
+ * record  := magic[3] version:u8 count:u32 contact*
+ * contact := size:u32 uri contactId callId uniqueId q:f32 expireAt:i64 updatedTime:i64 cseq:u32 flags:u8
+ *            pathCount:u32 string* acceptCount:u32 string*
+ * string  := length:u32 bytes
+ * size counts the bytes of the contact after itself.
+ */
+static const char sMagic[3] = {'F', 'X', 'B'};
+static const uint8_t sVersion = 1;
+static const uint8_t sFlagAlias = 0x1;
+static const uint8_t sFlagUsedAsRoute = 0x2;
+
+namespace {
+
+class BinaryWriter {
+  public:
+	BinaryWriter(string &out) : mOut(out) {
+	}
+	void u8(uint8_t v) {
+		mOut.push_back((char)v);
+	}
+	void u32(uint32_t v) {
+		char b[4] = {(char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24)};
+		mOut.append(b, sizeof(b));
+	}
+	void i64(int64_t v) {
+		u32((uint32_t)v);
+		u32((uint32_t)((uint64_t)v >> 32));
+	}
+	void f32(float v) {
+		uint32_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		u32(bits);
+	}
+	void str(const string &v) {
+		u32(v.size());
+		mOut.append(v);
+	}
+	void strList(const list<string> &v) {
+		u32(v.size());
+		for (auto it = v.begin(); it != v.end(); ++it) {
+			str(*it);
+		}
+	}
+	/* Overwrites the u32 at offset. */
+	void patch(size_t offset, uint32_t v) {
+		for (int i = 0; i < 4; ++i) {
+			mOut[offset + i] = (char)(v >> (8 * i));
+		}
+	}
+	size_t size() const {
+		return mOut.size();
+	}
+
+  private:
+	string &mOut;
+};
+
+/* Reads from the buffer without copying it, every read fails once the end is overrun. */
+class BinaryReader {
+  public:
+	BinaryReader(const char *data, size_t len) : mPos((const uint8_t *)data), mEnd((const uint8_t *)data + len) {
+	}
+	bool ok() const {
+		return mPos != NULL;
+	}
+	const char *pos() const {
+		return (const char *)mPos;
+	}
+	size_t remaining() const {
+		return mPos ? mEnd - mPos : 0;
+	}
+	bool skip(size_t n) {
+		if (!mPos || (size_t)(mEnd - mPos) < n) {
+			mPos = NULL;
+			return false;
+		}
+		mPos += n;
+		return true;
+	}
+	uint8_t u8() {
+		const uint8_t *p = mPos;
+		return skip(1) ? p[0] : 0;
+	}
+	uint32_t u32() {
+		const uint8_t *p = mPos;
+		if (!skip(4))
+			return 0;
+		return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+	int64_t i64() {
+		uint64_t low = u32();
+		uint64_t high = u32();
+		return (int64_t)(low | (high << 32));
+	}
+	float f32() {
+		uint32_t bits = u32();
+		float v;
+		memcpy(&v, &bits, sizeof(v));
+		return v;
+	}
+	void str(string &v) {
+		uint32_t len = u32();
+		const char *p = pos();
+		if (skip(len))
+			v.assign(p, len);
+	}
+	void strList(list<string> &v) {
+		uint32_t count = u32();
+		for (uint32_t i = 0; i < count && ok(); ++i) {
+			v.emplace_back();
+			str(v.back());
+		}
+	}
+
+  private:
+	const uint8_t *mPos;
+	const uint8_t *mEnd;
+};
+}
+
+bool RecordSerializerBinary::parseLegacy(const char *str, int len, Record *r) {
+	switch (str[0]) {
+		case '#': {
+			static RecordSerializerC c;
+			return c.parse(str, len, r);
+		}
+		case '{': {
+			static RecordSerializerJson json;
+			return json.parse(str, len, r);
+		}
+		default:
+			break;
+	}
+#ifdef ENABLE_MSGPACK
+	/* a msgpack record is an array of contacts */
+	uint8_t first = str[0];
+	if ((first & 0xf0) == 0x90 || first == 0xdc || first == 0xdd) {
+		static RecordSerializerMsgPack msgpack;
+		return msgpack.parse(str, len, r);
+	}
+#endif
+#ifdef ENABLE_PROTOBUF
+	static RecordSerializerPb pb;
+	return pb.parse(str, len, r);
+#else
+	LOGE("Unrecognized serialized record format");
+	return false;
+#endif
+}
+
+bool RecordSerializerBinary::parse(const char *str, int len, Record *r) {
+	if (!str || len == 0)
+		return true;
+	if (len < (int)sizeof(sMagic) || memcmp(str, sMagic, sizeof(sMagic)) != 0)
+		return parseLegacy(str, len, r);
+
+	BinaryReader reader(str, len);
+	reader.skip(sizeof(sMagic));
+	uint8_t version = reader.u8();
+	if (version > sVersion) {
+		LOGE("Serialized record version %u is not supported (up to %u)", version, sVersion);
+		return false;
+	}
+	uint32_t count = reader.u32();
+	for (uint32_t i = 0; i < count && reader.ok(); ++i) {
+		uint32_t size = reader.u32();
+		if (!reader.ok() || size > reader.remaining()) {
+			LOGE("Truncated serialized record");
+			return false;
+		}
+		const char *end = reader.pos() + size;
+		auto ec = make_shared<ExtendedContact>();
+		reader.str(ec->mSipUri);
+		reader.str(ec->mContactId);
+		reader.str(ec->mCallId);
+		reader.str(ec->mUniqueId);
+		ec->mQ = reader.f32();
+		ec->mExpireAt = reader.i64();
+		ec->mUpdatedTime = reader.i64();
+		ec->mCSeq = reader.u32();
+		uint8_t flags = reader.u8();
+		ec->mAlias = (flags & sFlagAlias) != 0;
+		ec->mUsedAsRoute = (flags & sFlagUsedAsRoute) != 0;
+		reader.strList(ec->mPath);
+		reader.strList(ec->mAcceptHeader);
+		/* fields of newer versions */
+		if (reader.ok() && end > reader.pos())
+			reader.skip(end - reader.pos());
+		if (!reader.ok() || reader.pos() != end) {
+			LOGE("Invalid serialized contact %u", i + 1);
+			return false;
+		}
+		if (ec->mSipUri.empty() || ec->mContactId.empty() || ec->mCallId.empty()) {
+			LOGE("Incomplete serialized contact %u", i + 1);
+			return false;
+		}
+		r->update(ec);
+	}
+	return reader.ok();
+}
+
+bool RecordSerializerBinary::serialize(Record *r, string &serialized, bool log) {
+	if (!r)
+		return true;
+
+	const auto &contacts = r->getExtendedContacts();
+	serialized.clear();
+	serialized.reserve(8 + contacts.size() * 256);
+	BinaryWriter writer(serialized);
+	serialized.append(sMagic, sizeof(sMagic));
+	writer.u8(sVersion);
+	writer.u32(contacts.size());
+	for (auto it = contacts.begin(); it != contacts.end(); ++it) {
+		const shared_ptr<ExtendedContact> &ec = *it;
+		size_t sizeOffset = writer.size();
+		writer.u32(0);
+		writer.str(ec->mSipUri);
+		writer.str(ec->mContactId);
+		writer.str(ec->mCallId);
+		writer.str(ec->mUniqueId);
+		writer.f32(ec->mQ);
+		writer.i64(ec->mExpireAt);
+		writer.i64(ec->mUpdatedTime);
+		writer.u32(ec->mCSeq);
+		writer.u8((ec->mAlias ? sFlagAlias : 0) | (ec->mUsedAsRoute ? sFlagUsedAsRoute : 0));
+		writer.strList(ec->mPath);
+		writer.strList(ec->mAcceptHeader);
+		writer.patch(sizeOffset, writer.size() - sizeOffset - 4);
+	}
+
+	if (log)
+		SLOGI << "Serialized contacts: " << contacts.size() << " in " << serialized.size() << " bytes";
+	return true;
+}
@@ -45,22 +45,23 @@ bool RecordSerializerJson::parse(const char *str, int len, Record *r) {
 		LOGE("Error parsing JSON contact: [%s]", cJSON_GetErrorPtr());
 		return false;
 	}
-	cJSON *contact = cJSON_GetObjectItem(root, "contacts");
+	cJSON *contacts = cJSON_GetObjectItem(root, "contacts");
+	cJSON *contact = contacts ? contacts->child : NULL;
 
 	int i = 0;
-	while (contact && contact->child) {
-		const char *sip_contact = cJSON_GetObjectItem(contact->child, "uri")->valuestring;
-		time_t expire = cJSON_GetObjectItem(contact->child, "expires_at")->valuedouble;
-		float q = cJSON_GetObjectItem(contact->child, "q")->valuedouble;
-		const char *lineValue = parseOptionalField(contact->child, "line_value_copy");
-		const char *route = parseOptionalField(contact->child, "route");
-		const char *contactId = cJSON_GetObjectItem(contact->child, "contact_id")->valuestring;
-		time_t update_time = cJSON_GetObjectItem(contact->child, "update_time")->valuedouble;
-		char *call_id = cJSON_GetObjectItem(contact->child, "call_id")->valuestring;
-		int cseq = cJSON_GetObjectItem(contact->child, "cseq")->valueint;
-		bool alias = cJSON_GetObjectItem(contact->child, "alias")->valueint != 0;
-		cJSON *path = cJSON_GetObjectItem(contact->child, "path");
-		cJSON *accept = cJSON_GetObjectItem(contact->child, "acceptHeaders");
+	while (contact) {
+		const char *sip_contact = cJSON_GetObjectItem(contact, "uri")->valuestring;
+		time_t expire = cJSON_GetObjectItem(contact, "expires_at")->valuedouble;
+		float q = cJSON_GetObjectItem(contact, "q")->valuedouble;
+		const char *lineValue = parseOptionalField(contact, "line_value_copy");
+		const char *route = parseOptionalField(contact, "route");
+		const char *contactId = cJSON_GetObjectItem(contact, "contact_id")->valuestring;
+		time_t update_time = cJSON_GetObjectItem(contact, "update_time")->valuedouble;
+		char *call_id = cJSON_GetObjectItem(contact, "call_id")->valuestring;
+		int cseq = cJSON_GetObjectItem(contact, "cseq")->valueint;
+		bool alias = cJSON_GetObjectItem(contact, "alias")->valueint != 0;
+		cJSON *path = cJSON_GetObjectItem(contact, "path");
+		cJSON *accept = cJSON_GetObjectItem(contact, "acceptHeaders");
 
 		CHECK(" no sip_contact", !sip_contact || sip_contact[0] == 0);
 		CHECK(" no contactId", !contactId || contactId[0] == 0);
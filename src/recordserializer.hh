@@ -54,6 +54,22 @@ class RecordSerializerJson : public RecordSerializer {
 	virtual bool serialize(Record *r, std::string &serialized, bool log);
 };
 
+/**
+ * Compact binary format: a magic and version header, then for each contact its size followed by its fields,
+ * little-endian and length-prefixed. Fields added by later versions are appended to the contacts, so that older
+ * readers can skip them.
+ * Strings are copied straight from the parsed buffer into the contacts. Data written by the other serializers is
+ * recognized and parsed with them, which lets a deployment switch to this format progressively.
+ */
+class RecordSerializerBinary : public RecordSerializer {
+  public:
+	virtual bool parse(const char *str, int len, Record *r);
+	virtual bool serialize(Record *r, std::string &serialized, bool log);
+
+  private:
+	bool parseLegacy(const char *str, int len, Record *r);
+};
+
 #ifdef ENABLE_PROTOBUF
 class RecordSerializerPb : public RecordSerializer {
   public:
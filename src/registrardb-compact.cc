@@ -0,0 +1,415 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "registrardb-compact.hh"
+#include "common.hh"
+
+#include <ctime>
+#include <functional>
+#include <sstream>
+
+#include <sofia-sip/sip_protos.h>
+
+using namespace std;
+
+const size_t RegistrarDbCompact::sNotFound = (size_t)-1;
+
+/******
+ * StringPool class
+ */
+
+static const string sEmptyString;
+
+RegistrarDbCompact::StringPool::StringPool() {
+	clear();
+}
+
+uint32_t RegistrarDbCompact::StringPool::intern(const string &value) {
+	if (value.empty())
+		return 0;
+	auto it = mIds.find(value);
+	if (it != mIds.end()) {
+		mEntries[it->second].refs++;
+		return it->second;
+	}
+	uint32_t id;
+	if (!mFree.empty()) {
+		id = mFree.back();
+		mFree.pop_back();
+	} else {
+		id = mEntries.size();
+		mEntries.push_back(Entry());
+	}
+	it = mIds.insert(make_pair(value, id)).first;
+	mEntries[id].value = &it->first;
+	mEntries[id].refs = 1;
+	return id;
+}
+
+void RegistrarDbCompact::StringPool::release(uint32_t id) {
+	if (id == 0 || --mEntries[id].refs > 0)
+		return;
+	mIds.erase(*mEntries[id].value);
+	mEntries[id].value = &sEmptyString;
+	mFree.push_back(id);
+}
+
+void RegistrarDbCompact::StringPool::clear() {
+	mIds.clear();
+	mFree.clear();
+	mEntries.clear();
+	Entry empty = {&sEmptyString, 0};
+	mEntries.push_back(empty);
+}
+
+/******
+ * RegistrarDbCompact class
+ */
+
+RegistrarDbCompact::RegistrarDbCompact(const string &preferredRoute, Agent *agent)
+	: RegistrarDb(preferredRoute), mTable(1024), mCount(0), mAgent(agent), mExpiryTimer(NULL),
+	  mExpiryWheel(getCurrentTime()) {
+	if (mAgent)
+		mExpiryTimer = mAgent->createTimer(1000, sExpiryTimer, this);
+}
+
+RegistrarDbCompact::~RegistrarDbCompact() {
+	if (mExpiryTimer)
+		mAgent->stopTimer(mExpiryTimer);
+}
+
+void RegistrarDbCompact::sExpiryTimer(void *unused, su_timer_t *t, void *data) {
+	((RegistrarDbCompact *)data)->removeExpired(getCurrentTime());
+}
+
+size_t RegistrarDbCompact::hashOf(const string &key) {
+	size_t hash = std::hash<string>()(key);
+	return hash == 0 ? 1 : hash;
+}
+
+string RegistrarDbCompact::join(const list<string> &lines) {
+	string joined;
+	for (auto it = lines.begin(); it != lines.end(); ++it) {
+		if (it != lines.begin())
+			joined += '\n';
+		joined += *it;
+	}
+	return joined;
+}
+
+list<string> RegistrarDbCompact::split(const string &joined) {
+	list<string> lines;
+	if (joined.empty())
+		return lines;
+	istringstream input(joined);
+	for (string line; getline(input, line, '\n');)
+		lines.push_back(line);
+	return lines;
+}
+
+string RegistrarDbCompact::keyOf(const Aor &aor) const {
+	return aor.user + mStrings.get(aor.domain);
+}
+
+size_t RegistrarDbCompact::find(const string &key, size_t hash) const {
+	size_t mask = mTable.size() - 1;
+	for (size_t i = hash & mask; mTable[i].hash != 0; i = (i + 1) & mask) {
+		if (mTable[i].hash == hash && keyOf(mTable[i]) == key)
+			return i;
+	}
+	return sNotFound;
+}
+
+/* Adds an aor without contacts, key must not be in the table yet. */
+size_t RegistrarDbCompact::insert(const string &key, size_t hash) {
+	if ((mCount + 1) * 4 > mTable.size() * 3)
+		grow();
+	size_t mask = mTable.size() - 1;
+	size_t i = hash & mask;
+	while (mTable[i].hash != 0)
+		i = (i + 1) & mask;
+	Aor &aor = mTable[i];
+	size_t at = key.rfind('@');
+	aor.hash = hash;
+	aor.user = (at == string::npos) ? string() : key.substr(0, at + 1);
+	aor.domain = mStrings.intern((at == string::npos) ? key : key.substr(at + 1));
+	mCount++;
+	return i;
+}
+
+/* Removes the aor at index, moving back the following entries of its probe sequence so that no tombstone is needed. */
+void RegistrarDbCompact::erase(size_t index) {
+	Aor &aor = mTable[index];
+	for (auto it = aor.contacts.begin(); it != aor.contacts.end(); ++it) {
+		releaseContact(*it);
+	}
+	mStrings.release(aor.domain);
+	mTable[index] = Aor();
+	mCount--;
+
+	size_t mask = mTable.size() - 1;
+	size_t hole = index;
+	for (size_t i = (index + 1) & mask; mTable[i].hash != 0; i = (i + 1) & mask) {
+		size_t home = mTable[i].hash & mask;
+		/* the entry can fill the hole if its home slot is not cyclically within (hole, i] */
+		bool homeInRange = (hole <= i) ? (home > hole && home <= i) : (home > hole || home <= i);
+		if (homeInRange)
+			continue;
+		mTable[hole] = std::move(mTable[i]);
+		mTable[i] = Aor();
+		hole = i;
+	}
+}
+
+void RegistrarDbCompact::grow() {
+	vector<Aor> old(mTable.size() * 2);
+	old.swap(mTable);
+	size_t mask = mTable.size() - 1;
+	for (auto it = old.begin(); it != old.end(); ++it) {
+		if (it->hash == 0)
+			continue;
+		size_t i = it->hash & mask;
+		while (mTable[i].hash != 0)
+			i = (i + 1) & mask;
+		mTable[i] = std::move(*it);
+	}
+}
+
+void RegistrarDbCompact::toRecord(const Aor &aor, Record &record) const {
+	for (auto it = aor.contacts.begin(); it != aor.contacts.end(); ++it) {
+		const Contact &c = *it;
+		string uri = c.strings.substr(0, c.uriLen);
+		string contactId = c.strings.substr(c.uriLen, c.contactIdLen);
+		string callId = c.strings.substr(c.uriLen + c.contactIdLen, c.callIdLen);
+		string uniqueId = c.strings.substr(c.uriLen + c.contactIdLen + c.callIdLen);
+		ExtendedContactCommon common(contactId.c_str(), split(mStrings.get(c.path)), callId.c_str(),
+									 uniqueId.c_str());
+		auto ec = make_shared<ExtendedContact>(common, uri.c_str(), c.expireAt, c.q, c.cseq, c.updatedTime, c.alias,
+											   split(mStrings.get(c.accept)));
+		ec->mUsedAsRoute = c.usedAsRoute;
+		record.pushContact(ec);
+	}
+}
+
+/* Replaces the contacts of aor by the ones of record. */
+void RegistrarDbCompact::fromRecord(Aor &aor, const Record &record) {
+	SmallVector<Contact, 1> contacts;
+	for (auto it = record.getExtendedContacts().begin(); it != record.getExtendedContacts().end(); ++it) {
+		const ExtendedContact &ec = **it;
+		if (ec.mSipUri.size() > UINT16_MAX || ec.mContactId.size() > UINT16_MAX || ec.mCallId.size() > UINT16_MAX) {
+			LOGE("Contact of %s too large to be stored, ignored", record.getKey().c_str());
+			continue;
+		}
+		Contact c;
+		c.strings.reserve(ec.mSipUri.size() + ec.mContactId.size() + ec.mCallId.size() + ec.mUniqueId.size());
+		c.strings.append(ec.mSipUri).append(ec.mContactId).append(ec.mCallId).append(ec.mUniqueId);
+		c.uriLen = ec.mSipUri.size();
+		c.contactIdLen = ec.mContactId.size();
+		c.callIdLen = ec.mCallId.size();
+		c.alias = ec.mAlias;
+		c.usedAsRoute = ec.mUsedAsRoute;
+		c.path = mStrings.intern(join(ec.mPath));
+		c.accept = mStrings.intern(join(ec.mAcceptHeader));
+		c.cseq = ec.mCSeq;
+		c.q = ec.mQ;
+		c.expireAt = ec.mExpireAt;
+		c.updatedTime = ec.mUpdatedTime;
+		contacts.push_back(std::move(c));
+	}
+	/* released after the new contacts were interned, so that the strings they share are not freed in between */
+	for (auto it = aor.contacts.begin(); it != aor.contacts.end(); ++it) {
+		releaseContact(*it);
+	}
+	aor.contacts = std::move(contacts);
+}
+
+void RegistrarDbCompact::releaseContact(const Contact &contact) {
+	mStrings.release(contact.path);
+	mStrings.release(contact.accept);
+}
+
+/* All the aors sharing a hash share their timer, due at the earliest expiration among them. */
+void RegistrarDbCompact::scheduleExpiry(size_t hash) {
+	time_t earliest = 0;
+	size_t mask = mTable.size() - 1;
+	for (size_t i = hash & mask; mTable[i].hash != 0; i = (i + 1) & mask) {
+		if (mTable[i].hash != hash)
+			continue;
+		const Aor &aor = mTable[i];
+		/* an aor left without contacts is due right away, so that it gets freed */
+		if (aor.contacts.empty())
+			earliest = 1;
+		for (auto it = aor.contacts.begin(); it != aor.contacts.end(); ++it) {
+			if (earliest == 0 || it->expireAt < earliest)
+				earliest = it->expireAt;
+		}
+	}
+	if (earliest == 0) {
+		mExpiryWheel.cancel(hash);
+	} else {
+		mExpiryWheel.schedule(hash, earliest);
+	}
+}
+
+void RegistrarDbCompact::removeExpired(time_t now) {
+	mExpiryWheel.advance(now, [this, now](size_t hash, time_t expire) { onExpiry(hash, now); });
+}
+
+void RegistrarDbCompact::onExpiry(size_t hash, time_t now) {
+	list<string> keys;
+	size_t mask = mTable.size() - 1;
+	for (size_t i = hash & mask; mTable[i].hash != 0; i = (i + 1) & mask) {
+		if (mTable[i].hash == hash)
+			keys.push_back(keyOf(mTable[i]));
+	}
+	for (auto kit = keys.begin(); kit != keys.end(); ++kit) {
+		const string &key = *kit;
+		size_t index = find(key, hash);
+		Aor &aor = mTable[index];
+		bool expired = false;
+		for (size_t i = 0; i < aor.contacts.size();) {
+			const Contact &c = aor.contacts[i];
+			if (now < c.expireAt) {
+				++i;
+				continue;
+			}
+			if (mAgent)
+				logExpiredContact(mAgent, key, c.strings.substr(0, c.uriLen),
+								  c.strings.substr(c.uriLen + c.contactIdLen + c.callIdLen));
+			releaseContact(c);
+			aor.contacts.erase(i);
+			expired = true;
+		}
+		if (expired || aor.contacts.empty()) {
+			Record r(key);
+			toRecord(aor, r);
+			mLocalRegExpire->update(r);
+		}
+		if (aor.contacts.empty()) {
+			LOGD("AOR %s expired", key.c_str());
+			erase(index);
+		}
+	}
+	scheduleExpiry(hash);
+}
+
+void RegistrarDbCompact::doBind(const BindParameters &p, const shared_ptr<RegistrarDbListener> &listener) {
+	char key[AOR_KEY_SIZE] = {0};
+	defineKeyFromUrl(key, AOR_KEY_SIZE - 1, p.sip.from);
+
+	if (count_sip_contacts(p.sip.contact) > Record::getMaxContacts()) {
+		LOGD("Too many contacts in register %s %i > %i", key, count_sip_contacts(p.sip.contact),
+			 Record::getMaxContacts());
+		listener->onError();
+		return;
+	}
+
+	time_t now = getCurrentTime();
+	size_t hash = hashOf(key);
+	size_t index = find(key, hash);
+	Record r(key);
+	if (index != sNotFound) {
+		LOGD("AOR %s found", key);
+		toRecord(mTable[index], r);
+	}
+
+	if (r.isInvalidRegister(p.sip.call_id, p.sip.cs_seq)) {
+		LOGD("Invalid register");
+		listener->onInvalid();
+		return;
+	}
+
+	const sip_accept_t *accept = p.sip.accept;
+	list<string> acceptHeaders;
+	while (accept != NULL) {
+		acceptHeaders.push_back(accept->ac_type);
+		accept = accept->ac_next;
+	}
+
+	r.clean(p.sip.contact, p.sip.call_id, p.sip.cs_seq, now, p.version);
+	r.update(p.sip.contact, p.sip.path, p.global_expire, p.sip.call_id, p.sip.cs_seq, now, p.alias, acceptHeaders,
+			 p.usedAsRoute);
+	mLocalRegExpire->update(r);
+
+	if (index == sNotFound) {
+		LOGD("Creating AOR %s association", key);
+		index = insert(key, hash);
+	}
+	fromRecord(mTable[index], r);
+	scheduleExpiry(hash);
+	listener->onRecordFound(&r);
+}
+
+void RegistrarDbCompact::doFetch(const url_t *url, const shared_ptr<RegistrarDbListener> &listener) {
+	char key[AOR_KEY_SIZE] = {0};
+	defineKeyFromUrl(key, AOR_KEY_SIZE - 1, url);
+	size_t hash = hashOf(key);
+	size_t index = find(key, hash);
+	if (index == sNotFound) {
+		listener->onRecordFound(NULL);
+		return;
+	}
+	Record r(key);
+	toRecord(mTable[index], r);
+	r.clean(getCurrentTime());
+	if (r.isEmpty()) {
+		erase(index);
+		scheduleExpiry(hash);
+		listener->onRecordFound(NULL);
+		return;
+	}
+	listener->onRecordFound(&r);
+}
+
+void RegistrarDbCompact::doClear(const sip_t *sip, const shared_ptr<RegistrarDbListener> &listener) {
+	char key[AOR_KEY_SIZE] = {0};
+	defineKeyFromUrl(key, AOR_KEY_SIZE - 1, sip->sip_from->a_url);
+
+	if (errorOnTooMuchContactInBind(sip->sip_contact, key, listener)) {
+		listener->onError();
+		return;
+	}
+
+	size_t hash = hashOf(key);
+	size_t index = find(key, hash);
+	if (index == sNotFound) {
+		listener->onRecordFound(NULL);
+		return;
+	}
+
+	LOGD("AOR %s found", key);
+	Record r(key);
+	toRecord(mTable[index], r);
+	if (r.isInvalidRegister(sip->sip_call_id->i_id, sip->sip_cseq->cs_seq)) {
+		listener->onInvalid();
+		return;
+	}
+
+	erase(index);
+	scheduleExpiry(hash);
+	mLocalRegExpire->remove(key);
+	listener->onRecordFound(NULL);
+}
+
+void RegistrarDbCompact::clearAll() {
+	vector<Aor>(1024).swap(mTable);
+	mCount = 0;
+	mStrings.clear();
+	mExpiryWheel.clear();
+	mLocalRegExpire->clearAll();
+}
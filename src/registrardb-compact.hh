@@ -0,0 +1,123 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef registrardb_compact_hh
+#define registrardb_compact_hh
+
+#include "registrardb.hh"
+#include "utils/smallvector.hh"
+#include "utils/timingwheel.hh"
+#include <sofia-sip/sip.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * In-memory registrar storing the contacts in compact form, for large numbers of registrations.
+ * Aors live in an open addressing hash table, with their contacts stored contiguously in the table slot when there
+ * are few of them. The strings shared by many contacts (domains, paths, accept headers) are interned, and the
+ * strings specific to a contact are packed in a single allocation.
+ * Records are only built when handed to a listener, bind and clear reuse the Record logic on them.
+ */
+class RegistrarDbCompact : public RegistrarDb {
+	friend class RegistrarDbCompactTester;
+
+  public:
+	RegistrarDbCompact(const std::string &preferredRoute, Agent *agent = NULL);
+	~RegistrarDbCompact();
+	void clearAll();
+	void removeExpired(time_t now);
+	size_t count() const {
+		return mCount;
+	}
+
+  private:
+	/* Reference counted string interning, the id 0 is the empty string. */
+	class StringPool {
+	  public:
+		StringPool();
+		uint32_t intern(const std::string &value);
+		void release(uint32_t id);
+		void clear();
+		const std::string &get(uint32_t id) const {
+			return *mEntries[id].value;
+		}
+
+	  private:
+		struct Entry {
+			const std::string *value; /* key of mIds */
+			uint32_t refs;
+		};
+		std::vector<Entry> mEntries;
+		std::vector<uint32_t> mFree;
+		std::unordered_map<std::string, uint32_t> mIds;
+	};
+
+	struct Contact {
+		std::string strings; /* sip uri, contact id, call id and unique id, concatenated */
+		uint16_t uriLen;
+		uint16_t contactIdLen;
+		uint16_t callIdLen;
+		bool alias;
+		bool usedAsRoute;
+		uint32_t path;	 /* interned, lines separated by '\n' */
+		uint32_t accept; /* interned, lines separated by '\n' */
+		uint32_t cseq;
+		float q;
+		time_t expireAt;
+		time_t updatedTime;
+	};
+
+	struct Aor {
+		Aor() : hash(0), domain(0) {
+		}
+		size_t hash; /* 0 for a free slot */
+		std::string user; /* part of the key up to the '@' included, empty for a domain */
+		uint32_t domain;  /* rest of the key, interned */
+		SmallVector<Contact, 1> contacts;
+	};
+
+	virtual void doBind(const BindParameters &params, const std::shared_ptr<RegistrarDbListener> &listener);
+	virtual void doClear(const sip_t *sip, const std::shared_ptr<RegistrarDbListener> &listener);
+	virtual void doFetch(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener);
+
+	static size_t hashOf(const std::string &key);
+	static std::string join(const std::list<std::string> &lines);
+	static std::list<std::string> split(const std::string &joined);
+	std::string keyOf(const Aor &aor) const;
+	size_t find(const std::string &key, size_t hash) const;
+	size_t insert(const std::string &key, size_t hash);
+	void erase(size_t index);
+	void grow();
+	void toRecord(const Aor &aor, Record &record) const;
+	void fromRecord(Aor &aor, const Record &record);
+	void releaseContact(const Contact &contact);
+	void scheduleExpiry(size_t hash);
+	void onExpiry(size_t hash, time_t now);
+	static void sExpiryTimer(void *unused, su_timer_t *t, void *data);
+
+	static const size_t sNotFound;
+	std::vector<Aor> mTable; /* size is a power of two, linear probing */
+	size_t mCount;
+	StringPool mStrings;
+	Agent *mAgent;
+	su_timer_t *mExpiryTimer;
+	/* keyed on the hash of the aors, which are due at the expiration of their earliest contact */
+	TimingWheel<size_t> mExpiryWheel;
+};
+
+#endif
@@ -29,7 +29,87 @@
 
 using namespace std;
 
-RegistrarDbInternal::RegistrarDbInternal(const string &preferredRoute) : RegistrarDb(preferredRoute) {
+RegistrarDbInternal::RegistrarDbInternal(const string &preferredRoute, Agent *agent)
+	: RegistrarDb(preferredRoute), mAgent(agent), mExpiryTimer(NULL), mSnapshotTimer(NULL), mExpiryWheel(getCurrentTime()) {
+	if (mAgent)
+		mExpiryTimer = mAgent->createTimer(1000, sExpiryTimer, this);
+}
+
+RegistrarDbInternal::~RegistrarDbInternal() {
+	if (mExpiryTimer)
+		mAgent->stopTimer(mExpiryTimer);
+	if (mSnapshotTimer)
+		mAgent->stopTimer(mSnapshotTimer);
+	for (auto it = mRecords.begin(); it != mRecords.end(); ++it) {
+		delete it->second;
+	}
+}
+
+void RegistrarDbInternal::sExpiryTimer(void *unused, su_timer_t *t, void *data) {
+	((RegistrarDbInternal *)data)->removeExpired(getCurrentTime());
+}
+
+bool RegistrarDbInternal::enablePersistence(const string &dir, int snapshotPeriod) {
+	mPersistence.reset(new RegistrarDbPersistence(dir));
+	bool ok = mPersistence->load(mRecords);
+	time_t now = getCurrentTime();
+	for (auto it = mRecords.begin(); it != mRecords.end();) {
+		Record *r = it->second;
+		r->clean(now);
+		if (r->isEmpty()) {
+			delete r;
+			it = mRecords.erase(it);
+			continue;
+		}
+		scheduleExpiry(r);
+		mLocalRegExpire->update(*r);
+		++it;
+	}
+	LOGI("%lu records restored from %s", (unsigned long)mRecords.size(), dir.c_str());
+	if (mAgent && snapshotPeriod > 0)
+		mSnapshotTimer = mAgent->createTimer(snapshotPeriod * 1000, sSnapshotTimer, this);
+	return ok;
+}
+
+bool RegistrarDbInternal::snapshot() {
+	return mPersistence ? mPersistence->snapshot(mRecords) : false;
+}
+
+void RegistrarDbInternal::sSnapshotTimer(void *unused, su_timer_t *t, void *data) {
+	((RegistrarDbInternal *)data)->snapshot();
+}
+
+void RegistrarDbInternal::scheduleExpiry(Record *r) {
+	/* an empty record is due right away, so that it gets freed */
+	mExpiryWheel.schedule(r->getKey(), r->isEmpty() ? 0 : r->earliestExpire());
+}
+
+/* Only the records with expired contacts are visited. */
+void RegistrarDbInternal::removeExpired(time_t now) {
+	mExpiryWheel.advance(now, [this, now](const string &key, time_t expire) { onRecordExpiry(key, now); });
+}
+
+void RegistrarDbInternal::onRecordExpiry(const string &key, time_t now) {
+	auto it = mRecords.find(key);
+	if (it == mRecords.end())
+		return;
+	Record *r = it->second;
+	if (mAgent) {
+		for (auto ecit = r->getExtendedContacts().begin(); ecit != r->getExtendedContacts().end(); ++ecit) {
+			const shared_ptr<ExtendedContact> &ec = *ecit;
+			if (now >= ec->mExpireAt)
+				logExpiredContact(mAgent, key, ec->mSipUri, ec->mUniqueId);
+		}
+	}
+	r->clean(now);
+	mLocalRegExpire->update(*r);
+	if (r->isEmpty()) {
+		LOGD("AOR %s expired", key.c_str());
+		mRecords.erase(it);
+		delete r;
+		return;
+	}
+	scheduleExpiry(r);
 }
 
 void RegistrarDbInternal::doBind(const BindParameters &p, const shared_ptr<RegistrarDbListener> &listener) {
@@ -74,6 +154,9 @@ void RegistrarDbInternal::doBind(const BindParameters &p, const shared_ptr<Regis
 			  p.usedAsRoute);
 
 	mLocalRegExpire->update(*r);
+	scheduleExpiry(r);
+	if (mPersistence)
+		mPersistence->journalBind(*r);
 	listener->onRecordFound(r);
 }
 
@@ -87,6 +170,8 @@ void RegistrarDbInternal::doFetch(const url_t *url, const shared_ptr<RegistrarDb
 		r->clean(getCurrentTime());
 		if (r->isEmpty()) {
 			mRecords.erase(it);
+			mExpiryWheel.cancel(key);
+			delete r;
 			r = NULL;
 		}
 	}
@@ -119,11 +204,24 @@ void RegistrarDbInternal::doClear(const sip_t *sip, const shared_ptr<RegistrarDb
 	}
 
 	mRecords.erase(it);
+	mExpiryWheel.cancel(key);
+	delete r;
 	mLocalRegExpire->remove(key);
+	if (mPersistence)
+		mPersistence->journalClear(key);
 	listener->onRecordFound(NULL);
 }
 
 void RegistrarDbInternal::clearAll() {
+	for (auto it = mRecords.begin(); it != mRecords.end(); ++it) {
+		/* journaled too, the snapshot being skipped while the previous one is written */
+		if (mPersistence)
+			mPersistence->journalClear(it->first);
+		delete it->second;
+	}
 	mRecords.clear();
+	mExpiryWheel.clear();
 	mLocalRegExpire->clearAll();
+	if (mPersistence)
+		mPersistence->snapshot(mRecords);
 }
@@ -21,17 +21,37 @@
 #define registrardb_internal_hh
 
 #include "registrardb.hh"
+#include "registrardb-persistence.hh"
+#include <memory>
 #include <sofia-sip/sip.h>
 
 class RegistrarDbInternal : public RegistrarDb {
   public:
-	RegistrarDbInternal(const std::string &preferredRoute);
+	/* When an agent is given, expired contacts are removed every second and logged as RegistrationLog::Expired.
+	 * Otherwise records are only cleaned when fetched. */
+	RegistrarDbInternal(const std::string &preferredRoute, Agent *agent = NULL);
+	~RegistrarDbInternal();
 	void clearAll();
+	void removeExpired(time_t now);
+	/* Restores the records saved in dir, then journals every change there and snapshots all the records every
+	 * snapshotPeriod seconds. Requires an agent. */
+	bool enablePersistence(const std::string &dir, int snapshotPeriod);
+	bool snapshot();
 
   private:
 	virtual void doBind(const BindParameters &params, const std::shared_ptr<RegistrarDbListener> &listener);
 	virtual void doClear(const sip_t *sip, const std::shared_ptr<RegistrarDbListener> &listener);
 	virtual void doFetch(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener);
+	void scheduleExpiry(Record *r);
+	void onRecordExpiry(const std::string &key, time_t now);
+	static void sExpiryTimer(void *unused, su_timer_t *t, void *data);
+	static void sSnapshotTimer(void *unused, su_timer_t *t, void *data);
+	Agent *mAgent;
+	su_timer_t *mExpiryTimer;
+	su_timer_t *mSnapshotTimer;
+	std::unique_ptr<RegistrarDbPersistence> mPersistence;
+	/* records, keyed like mRecords, due at the expiration of their earliest contact */
+	TimingWheel<std::string> mExpiryWheel;
 };
 
 #endif
@@ -0,0 +1,251 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "registrardb-persistence.hh"
+#include "common.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+const char *RegistrarDbPersistence::sSnapshotMagic = "FLXSNAP1";
+const char *RegistrarDbPersistence::sJournalMagic = "FLXJRNL1";
+const size_t RegistrarDbPersistence::sMagicLen = 8;
+
+RegistrarDbPersistence::RegistrarDbPersistence(const string &dir)
+	: mSnapshotPath(dir + "/registrar.snapshot"), mJournalPath(dir + "/registrar.journal"),
+	  mOldJournalPath(dir + "/registrar.journal.old"), mJournalFd(-1), mSnapshotting(false) {
+}
+
+RegistrarDbPersistence::~RegistrarDbPersistence() {
+	if (mSnapshotThread.joinable())
+		mSnapshotThread.join();
+	if (mJournalFd != -1)
+		close(mJournalFd);
+}
+
+uint32_t RegistrarDbPersistence::checksum(const char *key, size_t keyLen, const char *data, size_t dataLen) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < keyLen; ++i) {
+		h = (h ^ (uint8_t)key[i]) * 16777619u;
+	}
+	for (size_t i = 0; i < dataLen; ++i) {
+		h = (h ^ (uint8_t)data[i]) * 16777619u;
+	}
+	return h;
+}
+
+string RegistrarDbPersistence::frame(FrameType type, const string &key, const string &data) {
+	FrameHeader header;
+	memset(&header, 0, sizeof(header));
+	header.type = type;
+	header.keyLen = key.size();
+	header.dataLen = data.size();
+	header.checksum = checksum(key.data(), key.size(), data.data(), data.size());
+	string out;
+	out.reserve(sizeof(header) + key.size() + data.size());
+	out.append((const char *)&header, sizeof(header));
+	out.append(key);
+	out.append(data);
+	return out;
+}
+
+/* Applies the frames of the file at path to records. Returns the length of its valid part, 0 if it does not exist
+ * or is not of the expected kind. */
+size_t RegistrarDbPersistence::replay(const string &path, const char *magic, map<string, Record *> &records) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sMagicLen) {
+		close(fd);
+		return 0;
+	}
+	size_t size = st.st_size;
+	const char *data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		LOGE("Couldn't map %s: %s", path.c_str(), strerror(errno));
+		return 0;
+	}
+	madvise((void *)data, size, MADV_SEQUENTIAL);
+	if (memcmp(data, magic, sMagicLen) != 0) {
+		LOGE("%s is not a registrar %s, ignored", path.c_str(), magic == sSnapshotMagic ? "snapshot" : "journal");
+		munmap((void *)data, size);
+		return 0;
+	}
+
+	size_t offset = sMagicLen;
+	unsigned long frames = 0;
+	while (offset + sizeof(FrameHeader) <= size) {
+		FrameHeader header;
+		memcpy(&header, data + offset, sizeof(header));
+		const char *key = data + offset + sizeof(header);
+		size_t end = offset + sizeof(header) + (size_t)header.keyLen + header.dataLen;
+		if (end > size || checksum(key, header.keyLen, key + header.keyLen, header.dataLen) != header.checksum) {
+			LOGW("Truncated or corrupted frame at offset %lu of %s, ignoring the rest of the file",
+				 (unsigned long)offset, path.c_str());
+			break;
+		}
+		string k(key, header.keyLen);
+		auto it = records.find(k);
+		if (it != records.end()) {
+			delete it->second;
+			records.erase(it);
+		}
+		if (header.type == Bind) {
+			Record *r = new Record(k);
+			if (mSerializer.parse(key + header.keyLen, header.dataLen, r)) {
+				records.insert(make_pair(k, r));
+			} else {
+				LOGE("Couldn't parse the record of %s in %s", k.c_str(), path.c_str());
+				delete r;
+			}
+		}
+		offset = end;
+		frames++;
+	}
+	munmap((void *)data, size);
+	LOGI("Read %lu entries from %s", frames, path.c_str());
+	return offset;
+}
+
+bool RegistrarDbPersistence::load(map<string, Record *> &records) {
+	replay(mSnapshotPath, sSnapshotMagic, records);
+	/* left by a snapshot that did not complete, it is older than the journal */
+	replay(mOldJournalPath, sJournalMagic, records);
+	size_t valid = replay(mJournalPath, sJournalMagic, records);
+	return openJournal(valid);
+}
+
+/* Opens the journal for appending after its first valid bytes, restarting it if none are. */
+bool RegistrarDbPersistence::openJournal(size_t valid) {
+	mJournalFd = open(mJournalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (mJournalFd == -1) {
+		LOGE("Couldn't open registrar journal %s: %s", mJournalPath.c_str(), strerror(errno));
+		return false;
+	}
+	bool ok;
+	if (valid == 0) {
+		/* new or unusable journal: restart it */
+		ok = ftruncate(mJournalFd, 0) == 0 && write(mJournalFd, sJournalMagic, sMagicLen) == (ssize_t)sMagicLen;
+	} else {
+		ok = ftruncate(mJournalFd, valid) == 0;
+	}
+	if (!ok) {
+		LOGE("Couldn't %s registrar journal %s: %s", valid == 0 ? "initialize" : "truncate", mJournalPath.c_str(),
+			 strerror(errno));
+		close(mJournalFd);
+		mJournalFd = -1;
+	}
+	return ok;
+}
+
+void RegistrarDbPersistence::append(const string &frame) {
+	if (mJournalFd == -1)
+		return;
+	/* a single write, so that a frame is either entirely appended or detected as truncated */
+	ssize_t written = write(mJournalFd, frame.data(), frame.size());
+	if (written != (ssize_t)frame.size()) {
+		LOGE("Couldn't append to registrar journal %s: %s", mJournalPath.c_str(),
+			 written == -1 ? strerror(errno) : "short write");
+	}
+}
+
+void RegistrarDbPersistence::journalBind(Record &record) {
+	string serialized;
+	if (!mSerializer.serialize(&record, serialized)) {
+		LOGE("Couldn't serialize %s for the registrar journal", record.getKey().c_str());
+		return;
+	}
+	append(frame(Bind, record.getKey(), serialized));
+}
+
+void RegistrarDbPersistence::journalClear(const string &key) {
+	append(frame(Clear, key, string()));
+}
+
+/* Sets the journal aside and starts a new one, unless the one set aside by a previous snapshot is still there: the
+ * journal then goes on, replaying it over a newer snapshot giving the same result. */
+void RegistrarDbPersistence::rotateJournal() {
+	if (mJournalFd == -1 || access(mOldJournalPath.c_str(), F_OK) == 0)
+		return;
+	if (rename(mJournalPath.c_str(), mOldJournalPath.c_str()) != 0) {
+		LOGE("Couldn't set registrar journal %s aside: %s", mJournalPath.c_str(), strerror(errno));
+		return;
+	}
+	close(mJournalFd);
+	mJournalFd = -1;
+	openJournal(0);
+}
+
+bool RegistrarDbPersistence::snapshot(const map<string, Record *> &records) {
+	if (mSnapshotting) {
+		LOGW("Registrar snapshot %s still being written, skipped", mSnapshotPath.c_str());
+		return false;
+	}
+	if (mSnapshotThread.joinable())
+		mSnapshotThread.join();
+
+	/* the records only live in this thread: the writer gets them serialized */
+	string content(sSnapshotMagic, sMagicLen);
+	string serialized;
+	for (auto it = records.begin(); it != records.end(); ++it) {
+		serialized.clear();
+		if (!mSerializer.serialize(it->second, serialized)) {
+			LOGE("Couldn't serialize %s for the registrar snapshot", it->first.c_str());
+			continue;
+		}
+		content.append(frame(Bind, it->first, serialized));
+	}
+	/* the changes made from now on are not in this snapshot */
+	rotateJournal();
+	mSnapshotting = true;
+	mSnapshotThread = thread(&RegistrarDbPersistence::writeSnapshot, this, move(content), records.size());
+	return true;
+}
+
+/* Runs in mSnapshotThread. */
+void RegistrarDbPersistence::writeSnapshot(string content, size_t count) {
+	string tmpPath = mSnapshotPath + ".tmp";
+	FILE *f = fopen(tmpPath.c_str(), "w");
+	if (!f) {
+		LOGE("Couldn't create registrar snapshot %s: %s", tmpPath.c_str(), strerror(errno));
+		mSnapshotting = false;
+		return;
+	}
+	bool ok = fwrite(content.data(), content.size(), 1, f) == 1;
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmpPath.c_str(), mSnapshotPath.c_str()) != 0) {
+		LOGE("Couldn't write registrar snapshot %s: %s", mSnapshotPath.c_str(), strerror(errno));
+		unlink(tmpPath.c_str());
+	} else {
+		/* the journal set aside is now part of the snapshot */
+		unlink(mOldJournalPath.c_str());
+		LOGI("Registrar snapshot written, %lu records", (unsigned long)count);
+	}
+	mSnapshotting = false;
+}
@@ -0,0 +1,80 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef registrardb_persistence_hh
+#define registrardb_persistence_hh
+
+#include "registrardb.hh"
+#include "recordserializer.hh"
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+
+/**
+ * On-disk copy of the records of an in-memory registrar, made of a snapshot of all the records and of a journal of
+ * the changes made since that snapshot. The journal holds the whole record after each bind, so that replaying it
+ * over any older snapshot gives the same result.
+ * Both files are sequences of frames: a type, the key, the record in binary form and a checksum. A frame partially
+ * written when the process died is ignored, and cut from the journal before appending to it.
+ * A snapshot is written by a thread of its own. The journal is set aside when it starts and removed once the snapshot
+ * is complete, the changes made meanwhile going to a new journal: a crash in between replays both journals.
+ */
+class RegistrarDbPersistence {
+  public:
+	RegistrarDbPersistence(const std::string &dir);
+	~RegistrarDbPersistence();
+	/* Reads the snapshot then the journal into records, and opens the journal. Returns false if the journal can't
+	 * be written. */
+	bool load(std::map<std::string, Record *> &records);
+	void journalBind(Record &record);
+	void journalClear(const std::string &key);
+	/* Serializes the records and replaces the snapshot by them from the writer thread, then removes the journal of
+	 * the changes they include. Returns false if the previous snapshot is still being written. */
+	bool snapshot(const std::map<std::string, Record *> &records);
+
+  private:
+	enum FrameType { Bind = 'B', Clear = 'C' };
+	struct FrameHeader {
+		uint8_t type;
+		uint8_t reserved[3];
+		uint32_t keyLen;
+		uint32_t dataLen;
+		uint32_t checksum;
+	};
+	static uint32_t checksum(const char *key, size_t keyLen, const char *data, size_t dataLen);
+	static std::string frame(FrameType type, const std::string &key, const std::string &data);
+	size_t replay(const std::string &path, const char *magic, std::map<std::string, Record *> &records);
+	void append(const std::string &frame);
+	bool openJournal(size_t valid);
+	void rotateJournal();
+	void writeSnapshot(std::string content, size_t count);
+
+	static const char *sSnapshotMagic;
+	static const char *sJournalMagic;
+	static const size_t sMagicLen;
+	std::string mSnapshotPath;
+	std::string mJournalPath;
+	std::string mOldJournalPath; /* the journal set aside while a snapshot is written */
+	int mJournalFd;
+	std::thread mSnapshotThread;
+	std::atomic<bool> mSnapshotting;
+	RecordSerializerBinary mSerializer; /* also parses the json records written before */
+};
+
+#endif
@@ -32,6 +32,7 @@
 
 #include "registrardb-redis-sofia-event.h"
 #include <sofia-sip/sip_protos.h>
+#include <sofia-sip/su_time.h>
 
 using namespace std;
 
@@ -56,57 +57,169 @@ struct RegistrarDbRedisAsync::RegistrarUserData {
 	int mVersion;
 	std::list<std::string> accept;
 	bool mUsedAsRoute;
+	/* arguments of the bind script, kept to replay it with EVAL if the server lost it */
+	std::string mScriptContacts;
+	std::string mScriptLine;
+	time_t mScriptNow;
+	int mSlot;			 /* index of the pool connection the request is running on, -1 if none */
+	redisAsyncContext *mContext; /* that connection */
+	su_time_t mQueuedAt; /* time at which the request entered the pending queue */
+	bool mCacheTracked;	 /* fetch registered in self->mCacheFetches */
+	unsigned long mCacheEpoch;
+	std::string mRefreshField; /* hash field of the contact refreshed without reading the record, if any */
 
 	RegistrarUserData(RegistrarDbRedisAsync *self, const url_t *url, const sip_contact_t *sip_contact,
 					  const char *calld_id, uint32_t cs_seq, const sip_path_t *path, bool alias, int version,
 					  shared_ptr<RegistrarDbListener> listener, forwardFn *fn)
 		: self(self), fn(fn), token(0), sipContact(sip_contact), calldId(calld_id), csSeq(cs_seq), listener(listener),
-		  record(""), globalExpire(0), path(path), alias(alias), mVersion(version), mUsedAsRoute(false) {
+		  record(""), globalExpire(0), path(path), alias(alias), mVersion(version), mUsedAsRoute(false),
+		  mScriptNow(0), mSlot(-1), mContext(NULL), mQueuedAt(),
+		  mCacheTracked(false), mCacheEpoch(0) {
 		self->defineKeyFromUrl(key, AOR_KEY_SIZE - 1, url);
 		record.setKey(key);
 	}
 	RegistrarUserData(RegistrarDbRedisAsync *self, const url_t *url, const sip_contact_t *sip_contact,
 					  const char *calld_id, uint32_t cs_seq, shared_ptr<RegistrarDbListener> listener, forwardFn *fn)
 		: self(self), fn(fn), token(0), sipContact(sip_contact), calldId(calld_id), csSeq(cs_seq), listener(listener),
-		  record(""), globalExpire(0), mVersion(0), mUsedAsRoute(false) {
+		  record(""), globalExpire(0), mVersion(0), mUsedAsRoute(false), mScriptNow(0), mSlot(-1), mContext(NULL), mQueuedAt(),
+		  mCacheTracked(false), mCacheEpoch(0) {
 		self->defineKeyFromUrl(key, AOR_KEY_SIZE - 1, url);
 		record.setKey(key);
 	}
 	RegistrarUserData(RegistrarDbRedisAsync *self, const url_t *url, shared_ptr<RegistrarDbListener> listener,
 					  forwardFn *fn)
 		: self(self), fn(fn), token(0), sipContact(NULL), calldId(NULL), csSeq(-1), listener(listener), record(""),
-		  globalExpire(0), mVersion(0), mUsedAsRoute(false) {
+		  globalExpire(0), mVersion(0), mUsedAsRoute(false), mScriptNow(0), mSlot(-1), mContext(NULL), mQueuedAt(),
+		  mCacheTracked(false), mCacheEpoch(0) {
 		self->defineKeyFromUrl(key, AOR_KEY_SIZE - 1, url);
 		record.setKey(key);
 	}
 	~RegistrarUserData() {
+		if (mSlot >= 0)
+			self->mOutstanding[mSlot]--;
+		if (mCacheTracked)
+			self->untrackFetch(key);
 	}
 };
 
+/* Fetches sent together with a single MGET. */
+struct RegistrarDbRedisAsync::FetchBatch {
+	FetchBatch(RegistrarDbRedisAsync *self) : self(self), mSlot(-1) {
+	}
+	~FetchBatch() {
+		if (mSlot >= 0)
+			self->mOutstanding[mSlot]--;
+	}
+	RegistrarDbRedisAsync *self;
+	vector<RegistrarUserData *> requests;
+	int mSlot;
+};
+
+/******
+ * RecordCache class
+ */
+
+void RecordCache::copyContacts(const Record &from, Record &to) {
+	for (auto it = from.getExtendedContacts().begin(); it != from.getExtendedContacts().end(); ++it) {
+		to.pushContact(make_shared<ExtendedContact>(**it));
+	}
+}
+
+bool RecordCache::get(const string &key, Record &record, bool &found) {
+	auto it = mIndex.find(key);
+	if (it == mIndex.end())
+		return false;
+	mLru.splice(mLru.begin(), mLru, it->second);
+	const Entry &entry = *it->second;
+	found = entry.record != nullptr;
+	if (found)
+		copyContacts(*entry.record, record);
+	return true;
+}
+
+void RecordCache::put(const string &key, const Record *record, size_t cost) {
+	if (cost > mMaxBytes)
+		return;
+	remove(key);
+	mLru.push_front(Entry());
+	Entry &entry = mLru.front();
+	entry.key = key;
+	entry.cost = cost;
+	if (record) {
+		entry.record.reset(new Record(key));
+		copyContacts(*record, *entry.record);
+	}
+	mIndex[key] = mLru.begin();
+	mBytes += cost;
+	while (mBytes > mMaxBytes) {
+		const Entry &oldest = mLru.back();
+		mBytes -= oldest.cost;
+		mIndex.erase(oldest.key);
+		mLru.pop_back();
+	}
+}
+
+void RecordCache::remove(const string &key) {
+	auto it = mIndex.find(key);
+	if (it == mIndex.end())
+		return;
+	mBytes -= it->second->cost;
+	mLru.erase(it->second);
+	mIndex.erase(it);
+}
+
+void RecordCache::clear() {
+	mIndex.clear();
+	mLru.clear();
+	mBytes = 0;
+}
+
 /******
  * RegistrarDbRedisAsync class
  */
 
 RegistrarDbRedisAsync::RegistrarDbRedisAsync(Agent *ag, RedisParameters params)
-	: RegistrarDb(ag->getPreferredRoute()), mAgent(ag), mContext(NULL), mDomain(params.domain),
+	: RegistrarDb(ag->getPreferredRoute()), mAgent(ag), mContexts(max(params.poolSize, 1), NULL),
+	  mOutstanding(mContexts.size(), 0), mMaxPendingRequests(max(params.pendingQueueSize, 0)), mPendingTimer(NULL),
+	  mDomain(params.domain),
 	  mAuthPassword(params.auth), mPort(params.port),mDb(params.db), mTimeout(params.timeout), mRoot(ag->getRoot()),
-	  mReplicationTimer(NULL), mSlaveCheckTimeout(params.mSlaveCheckTimeout) {
+	  mReplicationTimer(NULL), mSlaveCheckTimeout(params.mSlaveCheckTimeout), mAtomicBind(params.atomicBind),
+	  mHashLayout(params.hashLayout), mCache(params.cacheSize), mSubscriber(NULL), mCacheReady(false), mCacheEpoch(0) {
 	mSerializer = RecordSerializer::get();
+	mCacheChannel = "flexisip:registrar:" + to_string(mDb);
 	mCurSlave = 0;
+	if (mAtomicBind && dynamic_cast<RecordSerializerJson *>(mSerializer) == NULL) {
+		LOGF("redis-atomic-bind requires the json record serializer (redis-record-serializer=json).");
+	}
+	if (mAtomicBind && mHashLayout) {
+		LOGF("redis-atomic-bind is only available with the 'string' redis record layout.");
+	}
 }
 
 RegistrarDbRedisAsync::RegistrarDbRedisAsync(const string &preferredRoute, su_root_t *root,
 											 RecordSerializer *serializer, RedisParameters params)
-	: RegistrarDb(preferredRoute), mAgent(NULL), mContext(NULL), mDomain(params.domain), mAuthPassword(params.auth),
-	  mPort(params.port), mTimeout(params.timeout), mRoot(root), mReplicationTimer(NULL),
-	  mSlaveCheckTimeout(params.mSlaveCheckTimeout) {
+	: RegistrarDb(preferredRoute), mAgent(NULL), mContexts(max(params.poolSize, 1), NULL),
+	  mOutstanding(mContexts.size(), 0), mMaxPendingRequests(max(params.pendingQueueSize, 0)), mPendingTimer(NULL),
+	  mDomain(params.domain), mAuthPassword(params.auth),
+	  mPort(params.port), mDb(params.db), mTimeout(params.timeout), mRoot(root), mReplicationTimer(NULL),
+	  mSlaveCheckTimeout(params.mSlaveCheckTimeout), mAtomicBind(params.atomicBind), mHashLayout(params.hashLayout),
+	  mCache(params.cacheSize), mSubscriber(NULL), mCacheReady(false), mCacheEpoch(0) {
 	mSerializer = serializer;
+	mCacheChannel = "flexisip:registrar:" + to_string(mDb);
 	mCurSlave = 0;
+	if (mAtomicBind && dynamic_cast<RecordSerializerJson *>(mSerializer) == NULL) {
+		LOGF("redis-atomic-bind requires the json record serializer.");
+	}
+	if (mAtomicBind && mHashLayout) {
+		LOGF("redis-atomic-bind is only available with the 'string' redis record layout.");
+	}
 }
 
 RegistrarDbRedisAsync::~RegistrarDbRedisAsync() {
-	if (mContext) {
-		redisAsyncDisconnect(mContext);
+	disconnect();
+	if (mPendingTimer) {
+		su_timer_destroy(mPendingTimer);
+		mPendingTimer = NULL;
 	}
 	if (mAgent && mReplicationTimer) {
 		mAgent->stopTimer(mReplicationTimer);
@@ -114,13 +227,86 @@ RegistrarDbRedisAsync::~RegistrarDbRedisAsync() {
 	}
 }
 
+/*
+ * Server side equivalent of Record::isInvalidRegister(), Record::clean() and Record::update(), operating on the
+ * json serialization of the record.
+ * KEYS[1]: aor key
+ * ARGV[1]: current time, ARGV[2]: call-id, ARGV[3]: cseq, ARGV[4]: max contacts per aor,
+ * ARGV[5]: json record holding the contacts of the REGISTER, ARGV[6]: unique id of the first contact (may be empty).
+ * Returns {0, stored record} for an invalid register, {1, merged record} otherwise.
+ */
+static const char *sBindScript =
+	"local now = tonumber(ARGV[1])\n"
+	"local callid = ARGV[2]\n"
+	"local cseq = tonumber(ARGV[3])\n"
+	"local maxContacts = tonumber(ARGV[4])\n"
+	"local line = ARGV[6]\n"
+	"local stored = redis.call('GET', KEYS[1])\n"
+	"local contacts = {}\n"
+	"if stored then\n"
+	"  local ok, rec = pcall(cjson.decode, stored)\n"
+	"  if ok and type(rec) == 'table' and type(rec.contacts) == 'table' then contacts = rec.contacts end\n"
+	"end\n"
+	"for _, c in ipairs(contacts) do\n"
+	"  if c.call_id == callid and cseq <= c.cseq then return {0, stored} end\n"
+	"end\n"
+	"local kept = {}\n"
+	"for _, c in ipairs(contacts) do\n"
+	"  if now < c.expires_at and not (line ~= '' and c.line_value_copy == line) and c.call_id ~= callid then\n"
+	"    table.insert(kept, c)\n"
+	"  end\n"
+	"end\n"
+	"local added = cjson.decode(ARGV[5]).contacts\n"
+	"if type(added) ~= 'table' then added = {} end\n"
+	"for _, nc in ipairs(added) do\n"
+	"  local replaced = false\n"
+	"  local oldest = nil\n"
+	"  for i, c in ipairs(kept) do\n"
+	"    if c.contact_id == nc.contact_id then\n"
+	"      table.remove(kept, i)\n"
+	"      replaced = true\n"
+	"      break\n"
+	"    end\n"
+	"    if oldest == nil or kept[oldest].update_time > c.update_time then oldest = i end\n"
+	"  end\n"
+	"  if not replaced and #kept >= maxContacts and oldest ~= nil then table.remove(kept, oldest) end\n"
+	"  table.insert(kept, nc)\n"
+	"end\n"
+	"local latest = 0\n"
+	"for _, c in ipairs(kept) do\n"
+	"  if c.expires_at > latest then latest = c.expires_at end\n"
+	"end\n"
+	"local merged = cjson.encode({contacts = kept})\n"
+	"if latest <= now then\n"
+	"  redis.call('DEL', KEYS[1])\n"
+	"else\n"
+	"  redis.call('SET', KEYS[1], merged)\n"
+	"  redis.call('EXPIREAT', KEYS[1], latest)\n"
+	"end\n"
+	"return {1, merged}\n";
+
+int RegistrarDbRedisAsync::slotOf(const redisAsyncContext *c) const {
+	for (size_t i = 0; i < mContexts.size(); ++i) {
+		if (mContexts[i] == c)
+			return i;
+	}
+	return -1;
+}
+
 void RegistrarDbRedisAsync::onDisconnect(const redisAsyncContext *c, int status) {
-	if (mContext != NULL && mContext != c) {
-		LOGE("Redis context %p disconnected, but current context is %p", c, mContext);
+	if (c == mSubscriber) {
+		LOGW("Lost the redis cache invalidation channel, cache disabled until it is restored");
+		mSubscriber = NULL;
+		invalidateAll();
+		return;
+	}
+	int slot = slotOf(c);
+	if (slot == -1) {
+		LOGD("Redis context %p disconnected, it is no longer part of the pool", c);
 		return;
 	}
 
-	mContext = NULL;
+	mContexts[slot] = NULL;
 	LOGD("Disconnected %p...", c);
 	if (status != REDIS_OK) {
 		LOGE("Redis disconnection message: %s", c->errstr);
@@ -130,17 +316,127 @@ void RegistrarDbRedisAsync::onDisconnect(const redisAsyncContext *c, int status)
 }
 
 void RegistrarDbRedisAsync::onConnect(const redisAsyncContext *c, int status) {
+	if (c == mSubscriber) {
+		if (status != REDIS_OK) {
+			LOGE("Couldn't open the redis cache invalidation channel: %s", c->errstr);
+			mSubscriber = NULL;
+		}
+		return;
+	}
+	int slot = slotOf(c);
 	if (status != REDIS_OK) {
 		LOGE("Couldn't connect to redis: %s", c->errstr);
-		mContext = NULL;
+		if (slot != -1)
+			mContexts[slot] = NULL;
 		tryReconnect();
 		return;
 	}
 	LOGD("Connected... %p", c);
+	replayPendingRequests();
 }
 
+/* Returns true if at least one connection of the pool is up or being established. */
 bool RegistrarDbRedisAsync::isConnected() {
-	return mContext != NULL;
+	for (auto it = mContexts.begin(); it != mContexts.end(); ++it) {
+		if (*it != NULL)
+			return true;
+	}
+	return false;
+}
+
+void RegistrarDbRedisAsync::sendRequest(RegistrarUserData *data) {
+	/* reopen the connections of the pool, and the invalidation channel, that were lost */
+	if (find(mContexts.begin(), mContexts.end(), (redisAsyncContext *)NULL) != mContexts.end() ||
+		(mCache.enabled() && mSubscriber == NULL))
+		connect();
+
+	int best = -1;
+	for (size_t i = 0; i < mContexts.size(); ++i) {
+		if (mContexts[i] == NULL)
+			continue;
+		if (best == -1 || mOutstanding[i] < mOutstanding[best])
+			best = i;
+	}
+	if (best == -1) {
+		queueRequest(data);
+		return;
+	}
+	if (data->mSlot >= 0)
+		mOutstanding[data->mSlot]--;
+	data->mSlot = best;
+	data->mContext = mContexts[best];
+	mOutstanding[best]++;
+
+	if (mAtomicBind && !data->mScriptContacts.empty()) {
+		sendBindScript(data, !mBindScriptSha.empty());
+	} else if (!data->mRefreshField.empty()) {
+		sendRefresh(data);
+	} else {
+		getRecord(data);
+	}
+}
+
+void RegistrarDbRedisAsync::queueRequest(RegistrarUserData *data) {
+	if (data->mSlot >= 0) {
+		mOutstanding[data->mSlot]--;
+		data->mSlot = -1;
+		data->mContext = NULL;
+	}
+	if (!data->mRefreshField.empty()) {
+		/* the cached record may be outdated when the request is replayed, it will be read from redis */
+		data->mRefreshField.clear();
+		data->record = Record(data->key);
+	}
+	if (mPendingRequests.size() >= mMaxPendingRequests) {
+		LOGE("Not connected to redis server, %lu requests already pending", (unsigned long)mPendingRequests.size());
+		data->listener->onError();
+		delete data;
+		return;
+	}
+	LOGD("Not connected to redis server, aor:%s [%lu] queued", data->key, data->token);
+	if (data->mQueuedAt.tv_sec == 0)
+		data->mQueuedAt = su_now();
+	mPendingRequests.push_back(data);
+	if (mPendingTimer == NULL) {
+		mPendingTimer = su_timer_create(su_root_task(mRoot), 200);
+		su_timer_set_for_ever(mPendingTimer, sHandlePendingTimer, this);
+	}
+}
+
+void RegistrarDbRedisAsync::replayPendingRequests() {
+	if (mPendingRequests.empty())
+		return;
+	LOGD("Replaying %lu pending redis requests", (unsigned long)mPendingRequests.size());
+	list<RegistrarUserData *> pending;
+	pending.swap(mPendingRequests);
+	for (auto it = pending.begin(); it != pending.end(); ++it) {
+		sendRequest(*it);
+	}
+}
+
+void RegistrarDbRedisAsync::expirePendingRequests() {
+	su_time_t now = su_now();
+	while (!mPendingRequests.empty() && su_duration(now, mPendingRequests.front()->mQueuedAt) >= mTimeout) {
+		RegistrarUserData *data = mPendingRequests.front();
+		mPendingRequests.pop_front();
+		LOGE("Redis server still unreachable, request for aor:%s [%lu] failed", data->key, data->token);
+		data->listener->onError();
+		delete data;
+	}
+	if (mPendingRequests.empty()) {
+		su_timer_destroy(mPendingTimer);
+		mPendingTimer = NULL;
+		return;
+	}
+	if (!isConnected())
+		connect();
+	/* commands issued on a connection being established are sent as soon as it is up */
+	if (isConnected())
+		replayPendingRequests();
+}
+
+void RegistrarDbRedisAsync::sHandlePendingTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *data) {
+	((RegistrarDbRedisAsync *)data)->expirePendingRequests();
 }
 
 /* This method checks that a redis command was successful, and cleans up if not. You use it with the macro defined
@@ -338,63 +634,117 @@ void RegistrarDbRedisAsync::handleReplicationInfoReply(const char *reply) {
 	}
 }
 
-void RegistrarDbRedisAsync::handleAuthReply(const redisReply *reply) {
+void RegistrarDbRedisAsync::handleAuthReply(const redisAsyncContext *c, const redisReply *reply) {
 	if (!reply || reply->type == REDIS_REPLY_ERROR) {
 		LOGE("Couldn't authenticate with redis server");
 		disconnect();
-	} else {
+	} else if (slotOf(c) == 0) {
 		getReplicationInfo();
 	}
 }
 
 void RegistrarDbRedisAsync::getReplicationInfo() {
-	redisAsyncCommand(mContext, sHandleReplicationInfoReply, this, "INFO replication");
+	/* the replication status is checked on the first connection of the pool only */
+	if (mContexts[0])
+		redisAsyncCommand(mContexts[0], sHandleReplicationInfoReply, this, "INFO replication");
 }
 
-bool RegistrarDbRedisAsync::connect() {
-	if (isConnected()) {
-		LOGW("Redis already connected");
-		return true;
-	}
-
-	mContext = redisAsyncConnect(mDomain.c_str(), mPort);
-	mContext->data = this;
-	if (mContext->err) {
-		LOGE("Redis Connection error: %s", mContext->errstr);
-		redisAsyncFree(mContext);
-		mContext = NULL;
+bool RegistrarDbRedisAsync::connectSlot(size_t slot) {
+	redisAsyncContext *context = redisAsyncConnect(mDomain.c_str(), mPort);
+	context->data = this;
+	if (context->err) {
+		LOGE("Redis Connection error: %s", context->errstr);
+		redisAsyncFree(context);
 		return false;
 	}
 
 #ifndef WITHOUT_HIREDIS_CONNECT_CALLBACK
-	redisAsyncSetConnectCallback(mContext, sConnectCallback);
+	redisAsyncSetConnectCallback(context, sConnectCallback);
 #endif
 
-	redisAsyncSetDisconnectCallback(mContext, sDisconnectCallback);
+	redisAsyncSetDisconnectCallback(context, sDisconnectCallback);
 
-	if (REDIS_OK != redisSofiaAttach(mContext, mRoot)) {
-		LOGE("Redis Connection error - %p", mContext);
-		redisAsyncDisconnect(mContext);
-		mContext = NULL;
+	if (REDIS_OK != redisSofiaAttach(context, mRoot)) {
+		LOGE("Redis Connection error - %p", context);
+		redisAsyncDisconnect(context);
 		return false;
 	}
-	redisAsyncCommand(mContext, NULL, NULL, "SELECT %d", mDb);
+	mContexts[slot] = context;
+	/* commands are handled in order, the ones below must come after the authentication */
 	if (!mAuthPassword.empty()) {
-		redisAsyncCommand(mContext, shandleAuthReply, this, "AUTH %s", mAuthPassword.c_str());
-	} else {
+		redisAsyncCommand(context, shandleAuthReply, this, "AUTH %s", mAuthPassword.c_str());
+	} else if (slot == 0) {
 		getReplicationInfo();
 	}
+	redisAsyncCommand(context, NULL, NULL, "SELECT %d", mDb);
+	if (mAtomicBind && slot == 0) {
+		/* scripts are shared by all the connections to a server */
+		mBindScriptSha.clear();
+		redisAsyncCommand(context, sHandleScriptLoadReply, this, "SCRIPT LOAD %s", sBindScript);
+	}
 	return true;
 }
 
+bool RegistrarDbRedisAsync::connectSubscriber() {
+	redisAsyncContext *context = redisAsyncConnect(mDomain.c_str(), mPort);
+	context->data = this;
+	if (context->err) {
+		LOGE("Redis Connection error: %s", context->errstr);
+		redisAsyncFree(context);
+		return false;
+	}
+#ifndef WITHOUT_HIREDIS_CONNECT_CALLBACK
+	redisAsyncSetConnectCallback(context, sConnectCallback);
+#endif
+	redisAsyncSetDisconnectCallback(context, sDisconnectCallback);
+	if (REDIS_OK != redisSofiaAttach(context, mRoot)) {
+		LOGE("Redis Connection error - %p", context);
+		redisAsyncDisconnect(context);
+		return false;
+	}
+	mSubscriber = context;
+	if (!mAuthPassword.empty()) {
+		redisAsyncCommand(context, NULL, NULL, "AUTH %s", mAuthPassword.c_str());
+	}
+	/* the cache becomes usable when the subscription is confirmed */
+	redisAsyncCommand(context, sHandleInvalidation, this, "SUBSCRIBE %s", mCacheChannel.c_str());
+	return true;
+}
+
+bool RegistrarDbRedisAsync::connect() {
+	if (mCache.enabled() && mSubscriber == NULL)
+		connectSubscriber();
+	bool connected = false;
+	for (size_t slot = 0; slot < mContexts.size(); ++slot) {
+		if (mContexts[slot] != NULL) {
+			connected = true;
+			continue;
+		}
+		if (connectSlot(slot))
+			connected = true;
+	}
+	return connected;
+}
+
 bool RegistrarDbRedisAsync::disconnect() {
-	LOGD("disconnect(%p)", mContext);
-	if (mContext) {
-		redisAsyncDisconnect(mContext);
-		mContext = NULL;
-		return true;
+	bool disconnected = false;
+	if (mSubscriber) {
+		redisAsyncContext *context = mSubscriber;
+		mSubscriber = NULL;
+		invalidateAll();
+		redisAsyncDisconnect(context);
 	}
-	return false;
+	for (size_t slot = 0; slot < mContexts.size(); ++slot) {
+		redisAsyncContext *context = mContexts[slot];
+		if (context == NULL)
+			continue;
+		LOGD("disconnect(%p)", context);
+		/* remove it from the pool first, the disconnect callback may be invoked synchronously */
+		mContexts[slot] = NULL;
+		redisAsyncDisconnect(context);
+		disconnected = true;
+	}
+	return disconnected;
 }
 
 /**
@@ -405,6 +755,11 @@ bool RegistrarDbRedisAsync::disconnect() {
 void RegistrarDbRedisAsync::sHandleAorGetReply(redisAsyncContext *ac, void *r, void *privdata) {
 	redisReply *reply = (redisReply *)r;
 	RegistrarUserData *data = (RegistrarUserData *)privdata;
+	if (!reply && data->self->mMaxPendingRequests > 0) {
+		/* the connection was lost: reading is harmless, so the request can safely be replayed later */
+		data->self->queueRequest(data);
+		return;
+	}
 	if (!reply || reply->type == REDIS_REPLY_ERROR) {
 		LOGE("Redis error getting aor:%s [%lu] - %s", data->key, data->token, reply ? reply->str : "null reply");
 		data->listener->onError();
@@ -412,7 +767,10 @@ void RegistrarDbRedisAsync::sHandleAorGetReply(redisAsyncContext *ac, void *r, v
 		return;
 	}
 
-	LOGD("GOT aor:%s [%lu] --> %i bytes", data->key, data->token, reply->len);
+	if (reply->type == REDIS_REPLY_ARRAY)
+		LOGD("GOT fs:%s [%lu] --> %lu fields", data->key, data->token, (unsigned long)reply->elements / 2);
+	else
+		LOGD("GOT aor:%s [%lu] --> %i bytes", data->key, data->token, reply->len);
 	data->fn(ac, reply, data);
 }
 
@@ -431,10 +789,28 @@ void RegistrarDbRedisAsync::sHandleSet(redisAsyncContext *ac, void *r, void *pri
 		return;
 	}
 	LOGD("Sent updated aor:%s [%lu] success", data->key, data->token);
+	data->self->publishInvalidation(data);
 	data->listener->onRecordFound(&data->record);
 	delete data;
 }
 
+void RegistrarDbRedisAsync::sHandleBindScriptReply(redisAsyncContext *ac, void *r, void *privdata) {
+	RegistrarUserData *data = (RegistrarUserData *)privdata;
+	if (!r && !(ac->c.flags & REDIS_CONNECTED) && data->self->mMaxPendingRequests > 0) {
+		/* the connection never came up, so the script was not executed */
+		data->self->queueRequest(data);
+		return;
+	}
+	data->self->handleBindScriptReply((redisReply *)r, data);
+}
+
+void RegistrarDbRedisAsync::sHandleScriptLoadReply(redisAsyncContext *ac, void *r, void *privdata) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
+	if (zis) {
+		zis->handleScriptLoadReply((const redisReply *)r);
+	}
+}
+
 /* Static functions that are used as callbacks to redisAsync API */
 
 #ifndef WITHOUT_HIREDIS_CONNECT_CALLBACK
@@ -465,6 +841,11 @@ void RegistrarDbRedisAsync::sHandleFetch(redisAsyncContext *ac, redisReply *repl
 	data->self->handleFetch(reply, data);
 }
 
+void RegistrarDbRedisAsync::sHandleFetchBatch(redisAsyncContext *ac, void *r, void *privdata) {
+	FetchBatch *batch = (FetchBatch *)privdata;
+	batch->self->handleFetchBatch(ac, (redisReply *)r, batch);
+}
+
 void RegistrarDbRedisAsync::sHandleReplicationInfoReply(redisAsyncContext *ac, void *r, void *privdata) {
 	redisReply *reply = (redisReply *)r;
 	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
@@ -480,24 +861,232 @@ void RegistrarDbRedisAsync::sHandleReplicationInfoReply(redisAsyncContext *ac, v
 /* this callback is called periodically to check if the current REDIS connection is valid */
 void RegistrarDbRedisAsync::sHandleInfoTimer(void *unused, su_timer_t *t, void *data) {
 	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)data;
-	if (zis && zis->mContext) {
+	if (zis && zis->mContexts[0]) {
 		SLOGI << "Launching periodic INFO query on REDIS";
 		zis->getReplicationInfo();
 	}
 }
 
+void RegistrarDbRedisAsync::sHandleInvalidation(redisAsyncContext *ac, void *r, void *privdata) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
+	/* a NULL reply is received when the subscriber is disconnected, which is handled by onDisconnect() */
+	if (zis && r && ac == zis->mSubscriber) {
+		zis->handleInvalidation((const redisReply *)r);
+	}
+}
+
 void RegistrarDbRedisAsync::shandleAuthReply(redisAsyncContext *ac, void *r, void *privdata) {
 	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
 	if (zis) {
-		zis->handleAuthReply((const redisReply *)r);
+		zis->handleAuthReply(ac, (const redisReply *)r);
 	}
 }
 
 /* Methods called by the callbacks */
 
+void RegistrarDbRedisAsync::handleInvalidation(const redisReply *reply) {
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 3 || reply->element[0]->type != REDIS_REPLY_STRING) {
+		LOGE("Unexpected message on the redis cache invalidation channel: %s",
+			 reply->type == REDIS_REPLY_ERROR ? reply->str : "");
+		return;
+	}
+	const redisReply *kind = reply->element[0];
+	const redisReply *value = reply->element[2];
+	if (strcmp(kind->str, "subscribe") == 0) {
+		LOGD("Subscribed to %s, record cache enabled", mCacheChannel.c_str());
+		mCacheReady = true;
+	} else if (strcmp(kind->str, "message") == 0 && value->type == REDIS_REPLY_STRING) {
+		invalidate(string(value->str, value->len));
+	}
+}
+
+void RegistrarDbRedisAsync::invalidate(const string &key) {
+	mCache.remove(key);
+	auto it = mCacheFetches.find(key);
+	if (it != mCacheFetches.end())
+		it->second.invalidated = true;
+}
+
+void RegistrarDbRedisAsync::invalidateAll() {
+	mCacheReady = false;
+	mCache.clear();
+	mCacheEpoch++;
+}
+
+void RegistrarDbRedisAsync::publishInvalidation(RegistrarUserData *data) {
+	invalidate(data->key);
+	/*published even without a local cache: the other proxies may have theirs enabled*/
+	redisAsyncCommand(data->mContext, NULL, NULL, "PUBLISH %s %s", mCacheChannel.c_str(), data->key);
+}
+
+void RegistrarDbRedisAsync::untrackFetch(const string &key) {
+	auto it = mCacheFetches.find(key);
+	if (it != mCacheFetches.end() && --it->second.count == 0)
+		mCacheFetches.erase(it);
+}
+
+RecordHashUpdate::RecordHashUpdate(const Record &stored, const set<string> &storedFields)
+	: mStored(stored.getExtendedContacts().begin(), stored.getExtendedContacts().end()), mStoredFields(storedFields) {
+}
+
+void RecordHashUpdate::compare(const Record &bound) {
+	set<string> keptFields;
+	for (auto it = bound.getExtendedContacts().begin(); it != bound.getExtendedContacts().end(); ++it) {
+		keptFields.insert(contactField(**it));
+		if (mStored.find(*it) == mStored.end())
+			mChanged.push_back(*it);
+	}
+	for (auto it = mStoredFields.begin(); it != mStoredFields.end(); ++it) {
+		if (keptFields.find(*it) == keptFields.end())
+			mRemoved.insert(*it);
+	}
+}
+
+bool RecordHashUpdate::isRefresh() const {
+	return mChanged.size() == 1 && mRemoved.empty() &&
+		   mStoredFields.find(contactField(*mChanged.front())) != mStoredFields.end();
+}
+
+/* Name of the hash field holding a contact in the 'hash' layout: its unique id when it has one, so that a device
+ * refreshing its registration from a new address replaces its previous binding. */
+string RecordHashUpdate::contactField(const ExtendedContact &ec) {
+	return ec.mUniqueId.empty() ? ec.mContactId : ec.mUniqueId;
+}
+
+bool RecordHashUpdate::parse(RecordSerializer *serializer, const redisReply *reply, Record *record,
+							 set<string> *fields) {
+	bool ok = true;
+	for (size_t i = 0; i + 1 < reply->elements; i += 2) {
+		redisReply *field = reply->element[i];
+		redisReply *value = reply->element[i + 1];
+		if (fields)
+			fields->insert(string(field->str, field->len));
+		if (!serializer->parse(value->str, value->len, record)) {
+			LOGW("Couldn't parse contact '%.*s' of fs:%s", (int)field->len, field->str, record->getKey().c_str());
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+bool RecordHashUpdate::serialize(RecordSerializer *serializer, const string &key, const shared_ptr<ExtendedContact> &ec,
+								 string &serialized) {
+	Record single(key);
+	single.pushContact(ec);
+	return serializer->serialize(&single, serialized);
+}
+
+/* Parses a GET (string layout) or HGETALL (hash layout) reply into record. When given, fields receives the name of
+ * the hash fields found. */
+bool RegistrarDbRedisAsync::parseRecordReply(redisReply *reply, Record *record, set<string> *fields) {
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		return reply->len <= 0 || mSerializer->parse(reply->str, reply->len, record);
+	}
+	return RecordHashUpdate::parse(mSerializer, reply, record, fields);
+}
+
+void RegistrarDbRedisAsync::getRecord(RegistrarUserData *data) {
+	if (mHashLayout) {
+		check_redis_command(redisAsyncCommand(data->mContext, sHandleAorGetReply, data, "HGETALL fs:%s", data->key), data);
+	} else {
+		check_redis_command(redisAsyncCommand(data->mContext, sHandleAorGetReply, data, "GET aor:%s", data->key), data);
+	}
+}
+
+void RegistrarDbRedisAsync::handleScriptLoadReply(const redisReply *reply) {
+	if (!reply || reply->type != REDIS_REPLY_STRING) {
+		LOGW("Couldn't load the bind script, binds will be sent with EVAL: %s",
+			 reply && reply->str ? reply->str : "null reply");
+		return;
+	}
+	mBindScriptSha.assign(reply->str, reply->len);
+	LOGD("Bind script loaded with sha %s", mBindScriptSha.c_str());
+}
+
+void RegistrarDbRedisAsync::sendBindScript(RegistrarUserData *data, bool useSha) {
+	if (useSha) {
+		check_redis_command(redisAsyncCommand(data->mContext, sHandleBindScriptReply, data,
+											  "EVALSHA %s 1 aor:%s %lu %s %u %d %b %s", mBindScriptSha.c_str(),
+											  data->key, (unsigned long)data->mScriptNow, data->calldId, data->csSeq,
+											  Record::getMaxContacts(), data->mScriptContacts.data(),
+											  data->mScriptContacts.length(), data->mScriptLine.c_str()),
+							data);
+	} else {
+		check_redis_command(redisAsyncCommand(data->mContext, sHandleBindScriptReply, data,
+											  "EVAL %s 1 aor:%s %lu %s %u %d %b %s", sBindScript, data->key,
+											  (unsigned long)data->mScriptNow, data->calldId, data->csSeq,
+											  Record::getMaxContacts(), data->mScriptContacts.data(),
+											  data->mScriptContacts.length(), data->mScriptLine.c_str()),
+							data);
+	}
+}
+
+void RegistrarDbRedisAsync::handleBindScriptReply(redisReply *reply, RegistrarUserData *data) {
+	if (!reply || reply->type == REDIS_REPLY_ERROR) {
+		if (reply && strncmp(reply->str, "NOSCRIPT", 8) == 0) {
+			LOGD("Bind script unknown by the server, sending it again.");
+			mBindScriptSha.clear();
+			sendBindScript(data, false);
+			return;
+		}
+		LOGE("Redis error binding aor:%s [%lu] - %s", data->key, data->token, reply ? reply->str : "null reply");
+		if (reply && string(reply->str).find("READONLY") != string::npos) {
+			LOGW("Redis couldn't set the AOR because we're connected to a slave. Replying 480.");
+			data->listener->onRecordFound(NULL);
+		} else {
+			data->listener->onError();
+		}
+		delete data;
+		return;
+	}
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 || reply->element[0]->type != REDIS_REPLY_INTEGER) {
+		LOGE("Unexpected reply to the bind script for aor:%s", data->key);
+		data->listener->onError();
+		delete data;
+		return;
+	}
+	if (reply->element[0]->integer == 0) {
+		SLOGD << "Cannot Bind: invalid register for call id " << data->calldId << ", CSeq " << data->csSeq;
+		data->listener->onInvalid();
+		delete data;
+		return;
+	}
+	redisReply *merged = reply->element[1];
+	if (merged->type != REDIS_REPLY_STRING || !mSerializer->parse(merged->str, merged->len, &data->record)) {
+		LOGE("Couldn't parse merged contacts for aor:%s", data->key);
+		data->listener->onError();
+		delete data;
+		return;
+	}
+	LOGD("Bound aor:%s [%lu] atomically, %i contacts", data->key, data->token, data->record.count());
+	publishInvalidation(data);
+	mLocalRegExpire->update(data->record);
+	data->listener->onRecordFound(&data->record);
+	delete data;
+}
+
+/* A fetched record may be cached if no invalidation was received for it, nor the whole cache dropped, since the
+ * GET was sent. */
+bool RegistrarDbRedisAsync::isCacheable(const RegistrarUserData *data) const {
+	if (!mCacheReady || !data->mCacheTracked || data->mCacheEpoch != mCacheEpoch)
+		return false;
+	auto it = mCacheFetches.find(data->key);
+	return it != mCacheFetches.end() && !it->second.invalidated;
+}
+
+size_t RegistrarDbRedisAsync::replySize(const redisReply *reply) {
+	if (reply->type != REDIS_REPLY_ARRAY)
+		return reply->len;
+	size_t size = 0;
+	for (size_t i = 0; i < reply->elements; ++i) {
+		size += reply->element[i]->len;
+	}
+	return size;
+}
+
 void RegistrarDbRedisAsync::handleFetch(redisReply *reply, RegistrarUserData *data) {
-	if (reply->len > 0) {
-		if (!mSerializer->parse(reply->str, reply->len, &data->record)) {
+	if (reply->len > 0 || reply->elements > 0) {
+		if (!parseRecordReply(reply, &data->record) && !mHashLayout) {
 			LOGE("Couldn't parse stored contacts for aor:%s : %u bytes", data->key, reply->len);
 			data->listener->onError();
 			delete data;
@@ -505,16 +1094,46 @@ void RegistrarDbRedisAsync::handleFetch(redisReply *reply, RegistrarUserData *da
 		}
 		time_t now = getCurrentTime();
 		data->record.clean(now);
+		if (isCacheable(data))
+			mCache.put(data->key, &data->record, sizeof(Record) + strlen(data->key) + replySize(reply));
 		data->listener->onRecordFound(&data->record);
 	} else {
+		if (isCacheable(data))
+			mCache.put(data->key, NULL, sizeof(Record) + strlen(data->key));
 		data->listener->onRecordFound(NULL);
 	}
 	delete data;
 }
 
+void RegistrarDbRedisAsync::handleFetchBatch(redisAsyncContext *ac, redisReply *reply, FetchBatch *batch) {
+	vector<RegistrarUserData *> requests;
+	requests.swap(batch->requests);
+	delete batch;
+	if (!reply && mMaxPendingRequests > 0) {
+		/* the connection was lost: the fetches are replayed one by one once it is back */
+		for (auto it = requests.begin(); it != requests.end(); ++it) {
+			queueRequest(*it);
+		}
+		return;
+	}
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != requests.size()) {
+		LOGE("Redis error getting %lu aors - %s", (unsigned long)requests.size(),
+			 reply && reply->type == REDIS_REPLY_ERROR ? reply->str : "unexpected reply");
+		for (auto it = requests.begin(); it != requests.end(); ++it) {
+			(*it)->listener->onError();
+			delete *it;
+		}
+		return;
+	}
+	LOGD("GOT %lu aors in one MGET", (unsigned long)requests.size());
+	for (size_t i = 0; i < requests.size(); ++i) {
+		handleFetch(reply->element[i], requests[i]);
+	}
+}
+
 void RegistrarDbRedisAsync::handleClear(redisReply *reply, RegistrarUserData *data) {
-	if (reply->len > 0) {
-		if (!mSerializer->parse(reply->str, reply->len, &data->record)) {
+	if (reply->len > 0 || reply->elements > 0) {
+		if (!parseRecordReply(reply, &data->record) && !mHashLayout) {
 			LOGE("Couldn't parse stored contacts for aor:%s : %i bytes", data->key, reply->len);
 			data->listener->onError();
 			delete data;
@@ -526,10 +1145,121 @@ void RegistrarDbRedisAsync::handleClear(redisReply *reply, RegistrarUserData *da
 			return;
 		}
 	}
-	check_redis_command(redisAsyncCommand(mContext, sHandleSet, data, "DEL aor:%s", data->key), data);
+	check_redis_command(
+		redisAsyncCommand(data->mContext, sHandleSet, data, "DEL %s:%s", mHashLayout ? "fs" : "aor", data->key), data);
+}
+
+void RegistrarDbRedisAsync::handleBindHash(redisReply *reply, RegistrarUserData *data) {
+	set<string> storedFields;
+	parseRecordReply(reply, &data->record, &storedFields);
+
+	if (data->record.isInvalidRegister(data->calldId, data->csSeq)) {
+		SLOGD << "Cannot Bind: invalid register for call id " << data->calldId << ", CSeq " << data->csSeq << endl;
+		data->listener->onInvalid();
+		delete data;
+		return;
+	}
+
+	/* only the contacts created by update() need to be serialized and written */
+	RecordHashUpdate changes(data->record, storedFields);
+	time_t now = getCurrentTime();
+	data->record.clean(data->sipContact, data->calldId, data->csSeq, now, data->mVersion);
+	data->record.update(data->sipContact, data->path, data->globalExpire, data->calldId, data->csSeq, now, data->alias,
+						data->accept, data->mUsedAsRoute);
+	mLocalRegExpire->update(data->record);
+	changes.compare(data->record);
+
+	string hashKey = string("fs:") + data->key;
+	vector<string> setArgs = {"HMSET", hashKey};
+	for (auto it = changes.changed().begin(); it != changes.changed().end(); ++it) {
+		string serialized;
+		RecordHashUpdate::serialize(mSerializer, data->key, *it, serialized);
+		setArgs.push_back(RecordHashUpdate::contactField(**it));
+		setArgs.push_back(serialized);
+	}
+	vector<string> delArgs = {"HDEL", hashKey};
+	delArgs.insert(delArgs.end(), changes.removed().begin(), changes.removed().end());
+
+	LOGD("Sending updated fs:%s [%lu] --> %lu fields set, %lu removed", data->key, data->token,
+		 (unsigned long)(setArgs.size() - 2) / 2, (unsigned long)delArgs.size() - 2);
+	/* All commands are pipelined, the reply to the last one completes the bind. */
+	if (data->record.isEmpty()) {
+		check_redis_command(redisAsyncCommand(data->mContext, sHandleSet, data, "DEL %s", hashKey.c_str()), data);
+		return;
+	}
+	vector<const char *> argv;
+	vector<size_t> argvlen;
+	for (auto args : {&delArgs, &setArgs}) {
+		if (args->size() <= 2)
+			continue;
+		argv.clear();
+		argvlen.clear();
+		for (auto it = args->begin(); it != args->end(); ++it) {
+			argv.push_back(it->data());
+			argvlen.push_back(it->length());
+		}
+		check_redis_command(redisAsyncCommandArgv(data->mContext, NULL, NULL, argv.size(), &argv[0], &argvlen[0]), data);
+	}
+	time_t expireat = data->record.latestExpire();
+	check_redis_command(
+		redisAsyncCommand(data->mContext, sHandleSet, data, "EXPIREAT %s %lu", hashKey.c_str(), expireat), data);
+}
+
+/* With the hash layout, a REGISTER that only refreshes a contact of a cached record is written without reading the
+ * record first. The update is computed on the cached copy, and is a refresh if it changed a single stored contact
+ * and removed none: the bind is then a HSET of that contact and an EXPIREAT of the key. */
+bool RegistrarDbRedisAsync::prepareRefresh(RegistrarUserData *data) {
+	bool found = false;
+	if (!mCacheReady || !mCache.get(data->key, data->record, found))
+		return false;
+	if (!found || data->record.isInvalidRegister(data->calldId, data->csSeq)) {
+		data->record = Record(data->key);
+		return false;
+	}
+	set<string> storedFields;
+	for (auto it = data->record.getExtendedContacts().begin(); it != data->record.getExtendedContacts().end(); ++it) {
+		storedFields.insert(RecordHashUpdate::contactField(**it));
+	}
+	RecordHashUpdate changes(data->record, storedFields);
+
+	time_t now = getCurrentTime();
+	data->record.clean(data->sipContact, data->calldId, data->csSeq, now, data->mVersion);
+	data->record.update(data->sipContact, data->path, data->globalExpire, data->calldId, data->csSeq, now, data->alias,
+						data->accept, data->mUsedAsRoute);
+	changes.compare(data->record);
+	if (!changes.isRefresh()) {
+		data->record = Record(data->key);
+		return false;
+	}
+	data->mRefreshField = RecordHashUpdate::contactField(*changes.changed().front());
+	return true;
+}
+
+void RegistrarDbRedisAsync::sendRefresh(RegistrarUserData *data) {
+	mLocalRegExpire->update(data->record);
+	string serialized;
+	for (auto it = data->record.getExtendedContacts().begin(); it != data->record.getExtendedContacts().end(); ++it) {
+		if (RecordHashUpdate::contactField(**it) != data->mRefreshField)
+			continue;
+		RecordHashUpdate::serialize(mSerializer, data->key, *it, serialized);
+		break;
+	}
+	LOGD("Refreshing fs:%s [%lu] contact %s", data->key, data->token, data->mRefreshField.c_str());
+	/* pipelined, the reply to EXPIREAT completes the bind */
+	check_redis_command(redisAsyncCommand(data->mContext, NULL, NULL, "HSET fs:%s %b %b", data->key,
+										  data->mRefreshField.data(), data->mRefreshField.length(), serialized.data(),
+										  serialized.length()),
+						data);
+	check_redis_command(redisAsyncCommand(data->mContext, sHandleSet, data, "EXPIREAT fs:%s %lu", data->key,
+										  (unsigned long)data->record.latestExpire()),
+						data);
 }
 
 void RegistrarDbRedisAsync::handleBind(redisReply *reply, RegistrarUserData *data) {
+	if (mHashLayout) {
+		handleBindHash(reply, data);
+		return;
+	}
 	if (!mSerializer->parse(reply->str, reply->len, &data->record)) {
 		LOGW("Couldn't parse stored contacts for aor:%s : %u bytes, going to erase previous value.", data->key,
 			 reply->len);
@@ -551,12 +1281,12 @@ void RegistrarDbRedisAsync::handleBind(redisReply *reply, RegistrarUserData *dat
 	string serialized;
 	mSerializer->serialize(&data->record, serialized);
 	LOGD("Sending updated aor:%s [%lu] --> %u bytes", data->key, data->token, (unsigned)serialized.length());
-	check_redis_command(redisAsyncCommand(mContext, sHandleSet, data, "SET aor:%s %b", data->key, serialized.data(),
+	check_redis_command(redisAsyncCommand(data->mContext, sHandleSet, data, "SET aor:%s %b", data->key, serialized.data(),
 										  serialized.length()),
 						data);
 
 	time_t expireat = data->record.latestExpire();
-	check_redis_command(redisAsyncCommand(data->self->mContext, NULL, NULL, "EXPIREAT aor:%s %lu", data->key, expireat),
+	check_redis_command(redisAsyncCommand(data->mContext, NULL, NULL, "EXPIREAT aor:%s %lu", data->key, expireat),
 						data);
 }
 
@@ -574,45 +1304,134 @@ void RegistrarDbRedisAsync::doBind(const RegistrarDb::BindParameters &p,
 	data->globalExpire = p.global_expire;
 	data->accept = acceptHeaders;
 	data->mUsedAsRoute = p.usedAsRoute;
-	if (!isConnected() && !connect()) {
-		LOGE("Not connected to redis server");
-		data->listener->onError();
-		delete data;
-		return;
-	}
+	/* read the cached record before the write invalidates it */
+	bool refresh = mHashLayout && !mAtomicBind && prepareRefresh(data);
+	invalidate(data->key);
 	if (errorOnTooMuchContactInBind(p.sip.contact, data->key, listener)) {
 		data->listener->onError();
 		delete data;
 		return;
 	}
 
-	LOGD("Binding aor:%s [%lu]", data->key, data->token);
-	check_redis_command(redisAsyncCommand(mContext, sHandleAorGetReply, data, "GET aor:%s", data->key), data);
+	if (mAtomicBind) {
+		/* The new contacts are built locally, then merged with the stored ones by the redis server.*/
+		Record added(data->key);
+		data->mScriptNow = getCurrentTime();
+		added.update(data->sipContact, data->path, data->globalExpire, data->calldId, data->csSeq, data->mScriptNow,
+					 data->alias, data->accept, data->mUsedAsRoute);
+		mSerializer->serialize(&added, data->mScriptContacts);
+		if (data->sipContact)
+			data->mScriptLine = Record::extractUniqueId(data->sipContact);
+		LOGD("Binding aor:%s [%lu] with script", data->key, data->token);
+	} else if (refresh) {
+		LOGD("Binding fs:%s [%lu] as a refresh", data->key, data->token);
+	} else {
+		LOGD("Binding aor:%s [%lu]", data->key, data->token);
+	}
+	sendRequest(data);
 }
 
 void RegistrarDbRedisAsync::doClear(const sip_t *sip, const shared_ptr<RegistrarDbListener> &listener) {
 	RegistrarUserData *data =
 		new RegistrarUserData(this, sip->sip_from->a_url, sip->sip_contact, sip->sip_call_id->i_id,
 							  sip->sip_cseq->cs_seq, listener, sHandleClear);
-	if (!isConnected() && !connect()) {
-		LOGE("Not connected to redis server");
-		data->listener->onError();
-		delete data;
-		return;
-	}
 	LOGD("Clearing aor:%s [%lu]", data->key, data->token);
+	invalidate(data->key);
 	mLocalRegExpire->remove(data->key);
-	check_redis_command(redisAsyncCommand(mContext, sHandleAorGetReply, data, "GET aor:%s", data->key), data);
+	sendRequest(data);
 }
 
-void RegistrarDbRedisAsync::doFetch(const url_t *url, const shared_ptr<RegistrarDbListener> &listener) {
+/* Serves the fetch from the record cache if possible. */
+bool RegistrarDbRedisAsync::fetchFromCache(const url_t *url, const shared_ptr<RegistrarDbListener> &listener) {
+	if (!mCacheReady)
+		return false;
+	char key[AOR_KEY_SIZE] = {0};
+	defineKeyFromUrl(key, AOR_KEY_SIZE - 1, url);
+	Record cached(key);
+	bool found = false;
+	if (!mCache.get(key, cached, found))
+		return false;
+	LOGD("Fetched aor:%s from cache", key);
+	if (found) {
+		cached.clean(getCurrentTime());
+		listener->onRecordFound(&cached);
+	} else {
+		listener->onRecordFound(NULL);
+	}
+	return true;
+}
+
+RegistrarDbRedisAsync::RegistrarUserData *
+RegistrarDbRedisAsync::createFetch(const url_t *url, const shared_ptr<RegistrarDbListener> &listener) {
 	RegistrarUserData *data = new RegistrarUserData(this, url, listener, sHandleFetch);
-	if (!isConnected() && !connect()) {
-		LOGE("Not connected to redis server");
-		data->listener->onError();
-		delete data;
-		return;
+	if (mCacheReady) {
+		mCacheFetches[data->key].count++;
+		data->mCacheTracked = true;
+		data->mCacheEpoch = mCacheEpoch;
 	}
+	return data;
+}
+
+void RegistrarDbRedisAsync::doFetch(const url_t *url, const shared_ptr<RegistrarDbListener> &listener) {
+	if (fetchFromCache(url, listener))
+		return;
+	RegistrarUserData *data = createFetch(url, listener);
 	LOGD("Fetching aor:%s [%lu]", data->key, data->token);
-	check_redis_command(redisAsyncCommand(mContext, sHandleAorGetReply, data, "GET aor:%s", data->key), data);
+	sendRequest(data);
+}
+
+void RegistrarDbRedisAsync::doFetchMany(const vector<const url_t *> &urls,
+										const vector<shared_ptr<RegistrarDbListener>> &listeners) {
+	FetchBatch *batch = new FetchBatch(this);
+	for (size_t i = 0; i < urls.size(); ++i) {
+		if (!fetchFromCache(urls[i], listeners[i]))
+			batch->requests.push_back(createFetch(urls[i], listeners[i]));
+	}
+	sendFetchBatch(batch);
+}
+
+void RegistrarDbRedisAsync::sendFetchBatch(FetchBatch *batch) {
+	if (find(mContexts.begin(), mContexts.end(), (redisAsyncContext *)NULL) != mContexts.end() ||
+		(mCache.enabled() && mSubscriber == NULL))
+		connect();
+
+	int best = -1;
+	for (size_t i = 0; i < mContexts.size(); ++i) {
+		if (mContexts[i] != NULL && (best == -1 || mOutstanding[i] < mOutstanding[best]))
+			best = i;
+	}
+	/* Without connection the fetches go through the pending queue. The hash layout has no multi-key read:
+	 * HGETALLs issued in a row are pipelined by hiredis anyway. */
+	if (batch->requests.size() < 2 || mHashLayout || best == -1) {
+		for (auto it = batch->requests.begin(); it != batch->requests.end(); ++it) {
+			LOGD("Fetching aor:%s [%lu]", (*it)->key, (*it)->token);
+			sendRequest(*it);
+		}
+		batch->requests.clear();
+		delete batch;
+		return;
+	}
+
+	vector<string> keys;
+	vector<const char *> argv = {"MGET"};
+	vector<size_t> argvlen = {4};
+	keys.reserve(batch->requests.size());
+	for (auto it = batch->requests.begin(); it != batch->requests.end(); ++it) {
+		keys.push_back(string("aor:") + (*it)->key);
+		argv.push_back(keys.back().data());
+		argvlen.push_back(keys.back().length());
+	}
+	batch->mSlot = best;
+	mOutstanding[best]++;
+	LOGD("Fetching %lu aors with MGET", (unsigned long)batch->requests.size());
+	if (redisAsyncCommandArgv(mContexts[best], sHandleFetchBatch, batch, argv.size(), &argv[0], &argvlen[0]) !=
+		REDIS_OK) {
+		LOGE("Redis error sending MGET of %lu aors", (unsigned long)batch->requests.size());
+		for (auto it = batch->requests.begin(); it != batch->requests.end(); ++it) {
+			(*it)->listener->onError();
+			delete *it;
+		}
+		batch->requests.clear();
+		delete batch;
+	}
 }
@@ -0,0 +1,143 @@
+/*
+ Flexisip, a flexible SIP proxy server with media capabilities.
+ Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "registrardb-redis.hh"
+#include "common.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+using namespace std;
+
+/* Enough points per master for the keys to be spread within a few percents of an even split. */
+const int RegistrarDbRedisSharded::sVirtualNodesPerShard = 160;
+
+bool RegistrarDbRedisSharded::parseShards(const list<string> &descriptions, vector<Shard> &shards) {
+	for (auto it = descriptions.begin(); it != descriptions.end(); ++it) {
+		const string &desc = *it;
+		size_t colon = desc.rfind(':');
+		string address = desc.substr(0, colon);
+		int port = 6379;
+		if (colon != string::npos) {
+			char *end = NULL;
+			port = (int)strtol(desc.c_str() + colon + 1, &end, 10);
+			if (*end != '\0' || port <= 0 || port > 65535) {
+				LOGE("Invalid port in redis shard '%s'", desc.c_str());
+				return false;
+			}
+		}
+		if (address.empty()) {
+			LOGE("Missing host in redis shard '%s'", desc.c_str());
+			return false;
+		}
+		shards.push_back(Shard(address, port));
+	}
+	return true;
+}
+
+uint64_t RegistrarDbRedisSharded::hashKey(const char *key, size_t len) {
+	/* FNV-1a followed by a 64 bits finalizer, so that keys differing by their last characters, which is common for
+	 * both aors and virtual node names, still land far apart on the ring. The result must not depend on the
+	 * platform: all the proxies sharing the redis masters have to agree on it.*/
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+RegistrarDbRedisSharded::RegistrarDbRedisSharded(Agent *ag, RedisParameters params, const vector<Shard> &shards,
+												 bool useGlobalDomain)
+	: RegistrarDb(ag->getPreferredRoute()), mShards(shards) {
+	mUseGlobalDomain = useGlobalDomain;
+	for (size_t i = 0; i < mShards.size(); ++i) {
+		Shard &shard = mShards[i];
+		RedisParameters shardParams = params;
+		shardParams.domain = shard.address;
+		shardParams.port = shard.port;
+		shard.db = new RegistrarDbRedisAsync(ag, shardParams);
+		/* The expiration of local registrations is tracked once for all shards.*/
+		shard.db->mLocalRegExpire = mLocalRegExpire;
+		shard.db->mUseGlobalDomain = mUseGlobalDomain;
+
+		for (int v = 0; v < sVirtualNodesPerShard; ++v) {
+			ostringstream node;
+			node << shard.address << ":" << shard.port << "-" << v;
+			const string name = node.str();
+			uint64_t point = hashKey(name.c_str(), name.size());
+			auto inserted = mRing.insert(make_pair(point, i));
+			if (!inserted.second) {
+				/* Collisions are resolved deterministically, whatever the order of the configured shards.*/
+				const Shard &other = mShards[inserted.first->second];
+				if (other.address + ":" + to_string(other.port) > shard.address + ":" + to_string(shard.port))
+					inserted.first->second = i;
+			}
+		}
+		LOGI("Redis shard %zu is %s:%d", i, shard.address.c_str(), shard.port);
+	}
+}
+
+RegistrarDbRedisSharded::~RegistrarDbRedisSharded() {
+	for (auto it = mShards.begin(); it != mShards.end(); ++it) {
+		delete it->db;
+	}
+}
+
+RegistrarDbRedisAsync *RegistrarDbRedisSharded::shardOf(const url_t *url) {
+	char key[AOR_KEY_SIZE] = {0};
+	defineKeyFromUrl(key, AOR_KEY_SIZE - 1, url);
+	auto it = mRing.lower_bound(hashKey(key, strlen(key)));
+	if (it == mRing.end())
+		it = mRing.begin();
+	const Shard &shard = mShards[it->second];
+	LOGD("aor:%s is on redis shard %s:%d", key, shard.address.c_str(), shard.port);
+	return shard.db;
+}
+
+void RegistrarDbRedisSharded::doBind(const BindParameters &params, const shared_ptr<RegistrarDbListener> &listener) {
+	shardOf(params.sip.from)->doBind(params, listener);
+}
+
+void RegistrarDbRedisSharded::doClear(const sip_t *sip, const shared_ptr<RegistrarDbListener> &listener) {
+	shardOf(sip->sip_from->a_url)->doClear(sip, listener);
+}
+
+void RegistrarDbRedisSharded::doFetch(const url_t *url, const shared_ptr<RegistrarDbListener> &listener) {
+	shardOf(url)->doFetch(url, listener);
+}
+
+void RegistrarDbRedisSharded::doFetchMany(const vector<const url_t *> &urls,
+										  const vector<shared_ptr<RegistrarDbListener>> &listeners) {
+	map<RegistrarDbRedisAsync *, pair<vector<const url_t *>, vector<shared_ptr<RegistrarDbListener>>>> byShard;
+	for (size_t i = 0; i < urls.size(); ++i) {
+		auto &part = byShard[shardOf(urls[i])];
+		part.first.push_back(urls[i]);
+		part.second.push_back(listeners[i]);
+	}
+	for (auto it = byShard.begin(); it != byShard.end(); ++it) {
+		it->first->doFetchMany(it->second.first, it->second.second);
+	}
+}
@@ -26,9 +26,12 @@
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 #include "agent.hh"
+#include <unordered_map>
 
 struct RedisParameters {
-	RedisParameters() : db(0), port(0), timeout(0) {
+	RedisParameters()
+		: port(0), db(0), timeout(0), mSlaveCheckTimeout(0), atomicBind(false), hashLayout(false), poolSize(1),
+		  pendingQueueSize(0), cacheSize(0) {
 	}
 	std::string domain;
 	std::string auth;
@@ -36,6 +39,85 @@ struct RedisParameters {
 	int db;
 	int timeout;
 	int mSlaveCheckTimeout;
+	bool atomicBind; /* merge bindings server-side with a Lua script, requires the json serializer */
+	bool hashLayout; /* store each aor as a hash of serialized contacts, keyed by contact unique id */
+	int poolSize;	 /* number of connections opened to the redis server */
+	int pendingQueueSize; /* max requests kept while the connection to redis is down */
+	size_t cacheSize;	  /* memory, in bytes, of the local record cache, 0 to disable it */
+};
+
+/**
+ * Memory bounded LRU cache of the records fetched from redis, including the aors found to be unregistered.
+ * Records are deep copied in and out, so that listeners can never alter a cached entry.
+ */
+class RecordCache {
+  public:
+	RecordCache(size_t maxBytes) : mMaxBytes(maxBytes), mBytes(0) {
+	}
+	bool enabled() const {
+		return mMaxBytes > 0;
+	}
+	/* Returns false on a miss. On a hit, found tells whether the aor had a record, which is then copied into
+	 * record. */
+	bool get(const std::string &key, Record &record, bool &found);
+	/* record is NULL for an aor known to have no registration. cost estimates the memory used by the entry. */
+	void put(const std::string &key, const Record *record, size_t cost);
+	void remove(const std::string &key);
+	void clear();
+	size_t size() const {
+		return mIndex.size();
+	}
+
+  private:
+	struct Entry {
+		std::string key;
+		std::unique_ptr<Record> record;
+		size_t cost;
+	};
+	static void copyContacts(const Record &from, Record &to);
+	std::list<Entry> mLru; /* most recently used first */
+	std::unordered_map<std::string, std::list<Entry>::iterator> mIndex;
+	size_t mMaxBytes;
+	size_t mBytes;
+};
+
+/**
+ * Writes made by a bind to a record stored in the 'hash' layout, where fs:<aor> holds each contact serialized alone
+ * under the field given by contactField().
+ * Contacts are never modified in place: update() replaces a refreshed contact by a new one. The contacts found
+ * before the bind are held until the comparison, so that a replacement allocated at the address of the contact it
+ * replaces is still written.
+ */
+class RecordHashUpdate {
+  public:
+	/* stored is the record before the bind, read from the fields storedFields of the hash. */
+	RecordHashUpdate(const Record &stored, const std::set<std::string> &storedFields);
+	/* Compares with the record once the bind is applied. */
+	void compare(const Record &bound);
+	/* Whether the bind replaced a single stored contact and removed none, so that it can be written with one HSET. */
+	bool isRefresh() const;
+	/* contacts added or replaced, to be written with HSET */
+	const std::vector<std::shared_ptr<ExtendedContact>> &changed() const {
+		return mChanged;
+	}
+	/* fields of the contacts removed, to be deleted with HDEL */
+	const std::set<std::string> &removed() const {
+		return mRemoved;
+	}
+
+	static std::string contactField(const ExtendedContact &ec);
+	/* Parses a HGETALL reply into record. When given, fields receives the name of the hash fields found. */
+	static bool parse(RecordSerializer *serializer, const redisReply *reply, Record *record,
+					  std::set<std::string> *fields = NULL);
+	/* Serializes the value of the field of a contact. */
+	static bool serialize(RecordSerializer *serializer, const std::string &key,
+						  const std::shared_ptr<ExtendedContact> &ec, std::string &serialized);
+
+  private:
+	std::set<std::shared_ptr<ExtendedContact>> mStored;
+	std::set<std::string> mStoredFields;
+	std::vector<std::shared_ptr<ExtendedContact>> mChanged;
+	std::set<std::string> mRemoved;
 };
 
 /**
@@ -84,16 +166,45 @@ class RegistrarDbRedisAsync : public RegistrarDb {
 	virtual void doBind(const BindParameters &params, const std::shared_ptr<RegistrarDbListener> &listener);
 	virtual void doClear(const sip_t *sip, const std::shared_ptr<RegistrarDbListener> &listener);
 	virtual void doFetch(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener);
+	/* Sent as a single MGET with the string layout, as pipelined HGETALLs with the hash layout. */
+	virtual void doFetchMany(const std::vector<const url_t *> &urls,
+							 const std::vector<std::shared_ptr<RegistrarDbListener>> &listeners);
 
   private:
+	struct FetchBatch;
 	RegistrarDbRedisAsync(Agent *agent, RedisParameters params);
 	~RegistrarDbRedisAsync();
 	static void sConnectCallback(const redisAsyncContext *c, int status);
 	static void sDisconnectCallback(const redisAsyncContext *c, int status);
 	bool isConnected();
+	bool connectSlot(size_t slot);
+	int slotOf(const redisAsyncContext *c) const;
+	void sendRequest(RegistrarUserData *data);
+	void queueRequest(RegistrarUserData *data);
+	void replayPendingRequests();
+	void expirePendingRequests();
+	bool connectSubscriber();
+	void invalidate(const std::string &key);
+	void invalidateAll();
+	void publishInvalidation(RegistrarUserData *data);
+	void untrackFetch(const std::string &key);
+	bool isCacheable(const RegistrarUserData *data) const;
+	bool fetchFromCache(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener);
+	RegistrarUserData *createFetch(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener);
+	void sendFetchBatch(FetchBatch *batch);
+	static size_t replySize(const redisReply *reply);
 	friend class RegistrarDb;
+	friend class RegistrarDbRedisSharded;
 	Agent *mAgent;
-	redisAsyncContext *mContext;
+	/* Connection pool: requests are dispatched to the connected slot with the least outstanding requests. hiredis
+	 * pipelines the commands issued on a connection, they are written together when the socket becomes writable. */
+	std::vector<redisAsyncContext *> mContexts;
+	std::vector<int> mOutstanding;
+	/* Requests received, or whose connection failed before their first command was sent, while redis is
+	 * unreachable. They are replayed once a connection is up again, or fail after the redis timeout. */
+	std::list<RegistrarUserData *> mPendingRequests;
+	size_t mMaxPendingRequests;
+	su_timer_t *mPendingTimer;
 	RecordSerializer *mSerializer;
 	std::string mDomain;
 	std::string mAuthPassword;
@@ -105,16 +216,45 @@ class RegistrarDbRedisAsync : public RegistrarDb {
 	size_t mCurSlave;
 	su_timer_t *mReplicationTimer;
 	int mSlaveCheckTimeout;
+	bool mAtomicBind;
+	bool mHashLayout;
+	std::string mBindScriptSha;
+	/* Read-through cache of fetched records. Every write is followed by a PUBLISH of the aor key on mCacheChannel,
+	 * received by all the proxies through mSubscriber. The cache is only used while subscribed: invalidations
+	 * missed while the subscription is down would leave stale entries. */
+	RecordCache mCache;
+	std::string mCacheChannel;
+	redisAsyncContext *mSubscriber;
+	bool mCacheReady;
+	/* Fetches in flight for cacheable keys: a reply must not be cached if the key was invalidated meanwhile. */
+	struct CacheFetch {
+		CacheFetch() : count(0), invalidated(false) {
+		}
+		int count;
+		bool invalidated;
+	};
+	std::unordered_map<std::string, CacheFetch> mCacheFetches;
+	unsigned long mCacheEpoch; /* incremented each time the whole cache is dropped */
 
 	bool handleRedisStatus(const std::string &desc, int redisStatus, RegistrarUserData *data);
+	bool parseRecordReply(redisReply *reply, Record *record, std::set<std::string> *fields = NULL);
+	void getRecord(RegistrarUserData *data);
 	void onErrorData(RegistrarUserData *data);
 
 	/* callbacks */
-	void handleAuthReply(const redisReply *reply);
+	void handleAuthReply(const redisAsyncContext *c, const redisReply *reply);
+	void handleInvalidation(const redisReply *reply);
 	void handleBind(redisReply *reply, RegistrarUserData *data);
 	void handleBindReplyAorSet(redisReply *reply, RegistrarUserData *data);
+	void handleBindHash(redisReply *reply, RegistrarUserData *data);
+	bool prepareRefresh(RegistrarUserData *data);
+	void sendRefresh(RegistrarUserData *data);
+	void sendBindScript(RegistrarUserData *data, bool useSha);
+	void handleBindScriptReply(redisReply *reply, RegistrarUserData *data);
+	void handleScriptLoadReply(const redisReply *reply);
 	void handleClear(redisReply *reply, RegistrarUserData *data);
 	void handleFetch(redisReply *reply, RegistrarUserData *data);
+	void handleFetchBatch(redisAsyncContext *ac, redisReply *reply, FetchBatch *batch);
 	void handleReplicationInfoReply(const char *str);
 	void onConnect(const redisAsyncContext *c, int status);
 	void onDisconnect(const redisAsyncContext *c, int status);
@@ -130,9 +270,54 @@ class RegistrarDbRedisAsync : public RegistrarDb {
 	static void sHandleBind(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data);
 	static void sHandleClear(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data);
 	static void sHandleFetch(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data);
+	static void sHandleFetchBatch(redisAsyncContext *ac, void *r, void *privdata);
 	static void sHandleInfoTimer(void *unused, su_timer_t *t, void *data);
+	static void sHandlePendingTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *data);
 	static void sHandleReplicationInfoReply(redisAsyncContext *ac, void *r, void *privdata);
 	static void sHandleSet(redisAsyncContext *ac, void *r, void *privdata);
+	static void sHandleBindScriptReply(redisAsyncContext *ac, void *r, void *privdata);
+	static void sHandleScriptLoadReply(redisAsyncContext *ac, void *r, void *privdata);
+	static void sHandleInvalidation(redisAsyncContext *ac, void *r, void *privdata);
+};
+
+/**
+ * Client side sharding of the registrations over several independent redis masters.
+ * Each aor key is mapped to a shard by consistent hashing, so that adding or removing a master only moves the keys
+ * of its neighbours on the ring. Every shard is a full RegistrarDbRedisAsync, with its own connection pool, pending
+ * queue and slave failover. Alias resolution is done here, as the records of an alias chain may live on different
+ * shards.
+ */
+class RegistrarDbRedisSharded : public RegistrarDb {
+  public:
+	struct Shard {
+		Shard(const std::string &address, int port) : address(address), port(port), db(NULL) {
+		}
+		std::string address;
+		int port;
+		RegistrarDbRedisAsync *db;
+	};
+	/* Parses a list of "host:port" shard descriptions, the port defaults to 6379. Returns false on a malformed
+	 * entry.*/
+	static bool parseShards(const std::list<std::string> &descriptions, std::vector<Shard> &shards);
+
+  protected:
+	virtual void doBind(const BindParameters &params, const std::shared_ptr<RegistrarDbListener> &listener);
+	virtual void doClear(const sip_t *sip, const std::shared_ptr<RegistrarDbListener> &listener);
+	virtual void doFetch(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener);
+	/* Split by shard, each shard fetching its part in one round trip. */
+	virtual void doFetchMany(const std::vector<const url_t *> &urls,
+							 const std::vector<std::shared_ptr<RegistrarDbListener>> &listeners);
+
+  private:
+	RegistrarDbRedisSharded(Agent *agent, RedisParameters params, const std::vector<Shard> &shards,
+							bool useGlobalDomain);
+	~RegistrarDbRedisSharded();
+	RegistrarDbRedisAsync *shardOf(const url_t *url);
+	static uint64_t hashKey(const char *key, size_t len);
+	friend class RegistrarDb;
+	static const int sVirtualNodesPerShard;
+	std::vector<Shard> mShards;
+	std::map<uint64_t, size_t> mRing; /* point on the ring -> index in mShards */
 };
 
 #endif
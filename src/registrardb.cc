@@ -18,6 +18,7 @@
 
 #include "registrardb.hh"
 #include "registrardb-internal.hh"
+#include "registrardb-compact.hh"
 #ifdef ENABLE_REDIS
 #include "registrardb-redis.hh"
 #endif
@@ -245,6 +246,15 @@ time_t Record::latestExpire() const {
 	return latest;
 }
 
+time_t Record::earliestExpire() const {
+	time_t earliest = 0;
+	for (auto it = mContacts.begin(); it != mContacts.end(); ++it) {
+		if (earliest == 0 || (*it)->mExpireAt < earliest)
+			earliest = (*it)->mExpireAt;
+	}
+	return earliest;
+}
+
 time_t Record::latestExpire(const std::string &route) const {
 	time_t latest = 0;
 	for (auto it = mContacts.begin(); it != mContacts.end(); ++it) {
@@ -385,7 +395,7 @@ void Record::appendContactsFrom(Record *src) {
 	}
 }
 
-RegistrarDb::LocalRegExpire::LocalRegExpire(string preferredRoute) {
+RegistrarDb::LocalRegExpire::LocalRegExpire(string preferredRoute) : mRegWheel(getCurrentTime()) {
 	mPreferedRoute = preferredRoute;
 }
 
@@ -394,40 +404,24 @@ RegistrarDb::RegistrarDb(const string &preferredRoute)
 }
 
 RegistrarDb::~RegistrarDb() {
-	delete mLocalRegExpire;
 }
 
 void RegistrarDb::LocalRegExpire::update(const Record &record) {
 	unique_lock<mutex> lock(mMutex);
 	time_t latest = record.latestExpire(mPreferedRoute);
 	if (latest > 0) {
-		auto it = mRegMap.find(record.getKey());
-		if (it != mRegMap.end()) {
-			(*it).second = latest;
-		} else {
-			mRegMap.insert(make_pair(record.getKey(), latest));
-		}
+		mRegWheel.schedule(record.getKey(), latest);
 	} else {
-		mRegMap.erase(record.getKey());
+		mRegWheel.cancel(record.getKey());
 	}
 }
 
 size_t RegistrarDb::LocalRegExpire::countActives() {
-	return mRegMap.size();
+	return mRegWheel.size();
 }
 void RegistrarDb::LocalRegExpire::removeExpiredBefore(time_t before) {
 	unique_lock<mutex> lock(mMutex);
-
-	for (auto it = mRegMap.begin(); it != mRegMap.end();) {
-		// LOGE("> %s [%lu]", (*it).first.c_str(), (*it).second-before);
-		if ((*it).second <= before) {
-			auto prevIt = it;
-			++it;
-			mRegMap.erase(prevIt);
-		} else {
-			++it;
-		}
-	}
+	mRegWheel.advance(before, [](const string &key, time_t expire) {});
 }
 
 int RegistrarDb::count_sip_contacts(const sip_contact_t *contact) {
@@ -440,6 +434,20 @@ int RegistrarDb::count_sip_contacts(const sip_contact_t *contact) {
 	return count;
 }
 
+/* Writes a RegistrationLog::Expired event for a contact of the aor key that expired without being refreshed. */
+void RegistrarDb::logExpiredContact(Agent *agent, const string &key, const string &sipUri, const string &instanceId) {
+	su_home_t home;
+	su_home_init(&home);
+	sip_from_t *from = sip_from_make(&home, ("<sip:" + key + ">").c_str());
+	sip_contact_t *contact = sip_contact_make(&home, (sipUri + ";expires=0").c_str());
+	if (from && contact) {
+		auto evlog = make_shared<RegistrationLog>(RegistrationLog::Expired, from, instanceId, contact);
+		evlog->setCompleted();
+		agent->writeEventLog(evlog);
+	}
+	su_home_destroy(&home);
+}
+
 void RegistrarDb::defineKeyFromUrl(char *key, int len, const url_t *url) {
 	if (url->url_user) {
 		if (!mUseGlobalDomain) {
@@ -477,7 +485,30 @@ RegistrarDb *RegistrarDb::get(Agent *ag) {
 		string dbImplementation = mr->get<ConfigString>("db-implementation")->read();
 		if ("internal" == dbImplementation) {
 			LOGI("RegistrarDB implementation is internal");
-			sUnique = new RegistrarDbInternal(ag->getPreferredRoute());
+			if (ag->getWorkerCount() > 1) {
+				/* Each worker is a separate process: an in-memory registrar would only know the contacts
+				 * registered through the worker that happened to receive the REGISTER.*/
+				LOGF("The internal registrar cannot be shared between %i workers, use the 'redis' implementation.",
+					 ag->getWorkerCount());
+			}
+			RegistrarDbInternal *internal = new RegistrarDbInternal(ag->getPreferredRoute(), ag);
+			string persistenceDir = mr->get<ConfigString>("persistence-dir")->read();
+			if (!persistenceDir.empty()) {
+				if (!internal->enablePersistence(persistenceDir,
+												 mr->get<ConfigInt>("persistence-snapshot-period")->read())) {
+					LOGE("Registrations won't be saved to %s", persistenceDir.c_str());
+				}
+			}
+			sUnique = internal;
+			sUnique->mUseGlobalDomain = useGlobalDomain;
+		}
+		else if ("compact" == dbImplementation) {
+			LOGI("RegistrarDB implementation is compact");
+			if (ag->getWorkerCount() > 1) {
+				LOGF("The compact registrar cannot be shared between %i workers, use the 'redis' implementation.",
+					 ag->getWorkerCount());
+			}
+			sUnique = new RegistrarDbCompact(ag->getPreferredRoute(), ag);
 			sUnique->mUseGlobalDomain = useGlobalDomain;
 		}
 #ifdef ENABLE_REDIS
@@ -493,17 +524,37 @@ RegistrarDb *RegistrarDb::get(Agent *ag) {
 			params.timeout = registrar->get<ConfigInt>("redis-server-timeout")->read();
 			params.auth = registrar->get<ConfigString>("redis-auth-password")->read();
 			params.mSlaveCheckTimeout = registrar->get<ConfigInt>("redis-slave-check-period")->read();
+			params.atomicBind = registrar->get<ConfigBoolean>("redis-atomic-bind")->read();
+			params.poolSize = registrar->get<ConfigInt>("redis-connection-pool-size")->read();
+			params.pendingQueueSize = registrar->get<ConfigInt>("redis-pending-queue-size")->read();
+			params.cacheSize = (size_t)max(registrar->get<ConfigInt>("redis-cache-size")->read(), 0) * 1024;
+			string layout = registrar->get<ConfigString>("redis-record-layout")->read();
+			if (layout == "hash") {
+				params.hashLayout = true;
+			} else if (layout != "string") {
+				LOGF("Unsupported redis record layout '%s', use 'string' or 'hash'.", layout.c_str());
+			}
 
-			sUnique = new RegistrarDbRedisAsync(ag, params);
-			sUnique->mUseGlobalDomain = useGlobalDomain;
+			list<string> shardList = registrar->get<ConfigStringList>("redis-server-shards")->read();
+			if (shardList.empty()) {
+				sUnique = new RegistrarDbRedisAsync(ag, params);
+				sUnique->mUseGlobalDomain = useGlobalDomain;
+			} else {
+				vector<RegistrarDbRedisSharded::Shard> shards;
+				if (!RegistrarDbRedisSharded::parseShards(shardList, shards)) {
+					LOGF("Invalid redis-server-shards, expected a list of host:port.");
+				}
+				LOGI("Registrations are sharded over %zu redis masters", shards.size());
+				sUnique = new RegistrarDbRedisSharded(ag, params, shards, useGlobalDomain);
+			}
 		}
 #endif
 		else {
 			LOGF("Unsupported implementation '%s'. %s",
 #ifdef ENABLE_REDIS
-				 "Supported implementations are 'internal' or 'redis'.", dbImplementation.c_str());
+				 "Supported implementations are 'internal', 'compact' or 'redis'.", dbImplementation.c_str());
 #else
-				 "Supported implementation is 'internal'.", dbImplementation.c_str());
+				 "Supported implementations are 'internal' or 'compact'.", dbImplementation.c_str());
 #endif
 		}
 	}
@@ -563,12 +614,16 @@ class RecursiveRegistrarDbListener : public RegistrarDbListener,
 				}
 			}
 			m_request += vectToRecurseOn.size();
+			/* all the aliases of this level are fetched together */
+			vector<const url_t *> urls;
+			vector<shared_ptr<RegistrarDbListener>> listeners;
 			for (auto itrec = vectToRecurseOn.cbegin(); itrec != vectToRecurseOn.cend(); ++itrec) {
-				m_database->fetch((*itrec)->m_url,
-								  make_shared<RecursiveRegistrarDbListener>(m_database, this->shared_from_this(),
-																			(*itrec)->m_url, m_step - 1),
-								  false);
+				urls.push_back((*itrec)->m_url);
+				listeners.push_back(make_shared<RecursiveRegistrarDbListener>(m_database, this->shared_from_this(),
+																			  (*itrec)->m_url, m_step - 1));
 			}
+			if (!urls.empty())
+				m_database->fetchMany(urls, listeners);
 		}
 
 		if (waitPullUpOrFail()) {
@@ -697,14 +752,37 @@ class AgregatorRegistrarDbListener : public RegistrarDbListener {
 	}
 };
 
+void RegistrarDb::fetchMany(const vector<const url_t *> &urls,
+							const vector<shared_ptr<RegistrarDbListener>> &listeners) {
+	doFetchMany(urls, listeners);
+}
+
+void RegistrarDb::fetchMany(const vector<const url_t *> &urls, const shared_ptr<RegistrarDbListener> &listener) {
+	if (urls.empty()) {
+		listener->onRecordFound(NULL);
+		return;
+	}
+	shared_ptr<RegistrarDbListener> agregator = make_shared<AgregatorRegistrarDbListener>(listener, urls.size());
+	doFetchMany(urls, vector<shared_ptr<RegistrarDbListener>>(urls.size(), agregator));
+}
+
+void RegistrarDb::doFetchMany(const vector<const url_t *> &urls,
+							  const vector<shared_ptr<RegistrarDbListener>> &listeners) {
+	for (size_t i = 0; i < urls.size(); ++i) {
+		doFetch(urls[i], listeners[i]);
+	}
+}
+
 void RegistrarDb::fetchWithDomain(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener,
 								  bool recursive) {
 	url_t domainOnlyUrl = *url;
 	domainOnlyUrl.url_user = NULL;
 
 	auto agregator = make_shared<AgregatorRegistrarDbListener>(listener, 2);
-	fetch(url, agregator, recursive);
-	fetch(&domainOnlyUrl, agregator, false);
+	shared_ptr<RegistrarDbListener> userListener = agregator;
+	if (recursive)
+		userListener = make_shared<RecursiveRegistrarDbListener>(this, agregator, url);
+	doFetchMany({url, &domainOnlyUrl}, {userListener, agregator});
 }
 
 RecordSerializer *RecordSerializer::create(const string &name) {
@@ -712,6 +790,8 @@ RecordSerializer *RecordSerializer::create(const string &name) {
 		return new RecordSerializerC();
 	} else if (name == "json") {
 		return new RecordSerializerJson();
+	} else if (name == "binary") {
+		return new RecordSerializerBinary();
 	}
 #if ENABLE_PROTOBUF
 	else if (name == "protobuf") {
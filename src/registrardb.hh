@@ -28,12 +28,15 @@
 #include <algorithm>
 #include <limits>
 #include <mutex>
+#include <memory>
 #include <iosfwd>
+#include <vector>
 
 #include <sofia-sip/sip.h>
 #include <sofia-sip/url.h>
 #include "log/logmanager.hh"
 #include "agent.hh"
+#include "utils/timingwheel.hh"
 #include <string>
 #include <list>
 
@@ -138,6 +141,11 @@ struct ExtendedContact {
 		  mAcceptHeader(acceptHeaders), mUsedAsRoute(false) {
 	}
 
+	/* Empty contact, to be filled field by field by a record parser. */
+	ExtendedContact()
+		: mQ(0), mExpireAt(0), mUpdatedTime(0), mCSeq(0), mAlias(false), mUsedAsRoute(false) {
+	}
+
 	ExtendedContact(const url_t *url, const std::string &route)
 		: mContactId(), mCallId(), mUniqueId(), mPath({route}), mSipUri(), mQ(0), mExpireAt(LONG_MAX), mUpdatedTime(0),
 		  mCSeq(0), mAlias(false), mAcceptHeader({}), mUsedAsRoute(false) {
@@ -179,6 +187,9 @@ class Record {
 				uint32_t cseq, time_t now, bool alias, const std::list<std::string> accept, bool usedAsRoute);
 	void update(const ExtendedContactCommon &ecc, const char *sipuri, long int expireAt, float q, uint32_t cseq,
 				time_t updated_time, bool alias, const std::list<std::string> accept, bool usedAsRoute);
+	void update(const std::shared_ptr<ExtendedContact> &ec) {
+		insertOrUpdateBinding(ec);
+	}
 
 	void print(std::ostream &stream) const;
 	bool isEmpty() {
@@ -203,6 +214,7 @@ class Record {
 	}
 	time_t latestExpire() const;
 	time_t latestExpire(const std::string &route) const;
+	time_t earliestExpire() const;
 	static std::list<std::string> route_to_stl(su_home_t *home, const sip_route_s *route);
 	void appendContactsFrom(Record *src);
 	~Record();
@@ -278,6 +290,12 @@ class RegistrarDb {
 	void fetch(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener, bool recursive = false);
 	void fetch(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener, bool includingDomains,
 			   bool recursive);
+	/* Fetches several aors at once, listeners[i] being notified of the record of urls[i]. Backends that can do it
+	 * fetch them all in a single round trip. */
+	void fetchMany(const std::vector<const url_t *> &urls,
+				   const std::vector<std::shared_ptr<RegistrarDbListener>> &listeners);
+	/* Same, the contacts of all the aors being gathered in a single record. */
+	void fetchMany(const std::vector<const url_t *> &urls, const std::shared_ptr<RegistrarDbListener> &listener);
 	void updateRemoteExpireTime(const std::string &key, time_t expireat);
 	unsigned long countLocalActiveRecords() {
 		return mLocalRegExpire->countActives();
@@ -285,14 +303,15 @@ class RegistrarDb {
 
   protected:
 	class LocalRegExpire {
-		std::map<std::string, time_t> mRegMap;
+		/* aors registered through this proxy, expiring with their latest contact using it as route */
+		TimingWheel<std::string> mRegWheel;
 		std::mutex mMutex;
 		std::string mPreferedRoute;
 
 	  public:
 		void remove(const std::string key) {
 			std::lock_guard<std::mutex> lock(mMutex);
-			mRegMap.erase(key);
+			mRegWheel.cancel(key);
 		}
 		void update(const Record &record);
 		size_t countActives();
@@ -300,22 +319,27 @@ class RegistrarDb {
 		LocalRegExpire(std::string preferedRoute);
 		void clearAll() {
 			std::lock_guard<std::mutex> lock(mMutex);
-			mRegMap.clear();
+			mRegWheel.clear();
 		}
 	};
 	virtual void doBind(const BindParameters &params, const std::shared_ptr<RegistrarDbListener> &listener) = 0;
 	virtual void doClear(const sip_t *sip, const std::shared_ptr<RegistrarDbListener> &listener) = 0;
 	virtual void doFetch(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener) = 0;
+	/* The urls only need to remain valid during the call. The default implementation fetches them one by one. */
+	virtual void doFetchMany(const std::vector<const url_t *> &urls,
+							 const std::vector<std::shared_ptr<RegistrarDbListener>> &listeners);
 
 	int count_sip_contacts(const sip_contact_t *contact);
 	bool errorOnTooMuchContactInBind(const sip_contact_t *sip_contact, const char *key,
 									 const std::shared_ptr<RegistrarDbListener> &listener);
 	void defineKeyFromUrl(char *key, int len, const url_t *url);
 	void fetchWithDomain(const url_t *url, const std::shared_ptr<RegistrarDbListener> &listener, bool recursive);
+	static void logExpiredContact(Agent *agent, const std::string &key, const std::string &sipUri,
+								  const std::string &instanceId);
 	RegistrarDb(const std::string &preferedRoute);
 	virtual ~RegistrarDb();
 	std::map<std::string, Record *> mRecords;
-	LocalRegExpire *mLocalRegExpire;
+	std::shared_ptr<LocalRegExpire> mLocalRegExpire; /* may be shared by the backends of a sharded registrar */
 	bool mUseGlobalDomain;
 	static RegistrarDb *sUnique;
 };
@@ -0,0 +1,241 @@
+/*
+ Flexisip, a flexible SIP proxy server with media capabilities.
+ Copyright (C) 2012  Belledonne Communications SARL.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rtp-stream-monitor.hh"
+
+#include <arpa/inet.h>
+#include <cstring>
+#include <iomanip>
+
+using namespace std;
+
+#define RTCP_SR 200
+#define RTCP_RR 201
+#define RTCP_XR 207
+#define XR_VOIP_METRICS 7
+
+static const uint16_t sMaxDropout = 3000;
+static const uint16_t sMaxMisorder = 100;
+
+static inline uint16_t read16(const uint8_t *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+RtpStreamMonitor::RtpStreamMonitor()
+	: mPayloadType(-1), mClockRate(8000), mStarted(false), mSsrc(0), mMaxSeq(0), mCycles(0), mBaseSeq(0),
+	  mReceived(0), mHasTransit(false), mTransit(0), mJitter(0), mStart(0), mStop(0), mLastSr(0), mLastSrTime(0),
+	  mRoundTripDelay(-1), mHasReport(false), mReportedJitter(0), mHasVoipMetrics(false) {
+}
+
+void RtpStreamMonitor::setPayload(int type, const string &name, int clockRate) {
+	mPayloadType = type;
+	mPayloadName = name;
+	if (clockRate > 0)
+		mClockRate = clockRate;
+}
+
+void RtpStreamMonitor::onRtp(const uint8_t *data, size_t size, uint64_t now) {
+	if (size < 12 || (data[0] >> 6) != 2)
+		return;
+	uint16_t seq = read16(data + 2);
+	uint32_t ts = read32(data + 4);
+	uint32_t ssrc = read32(data + 8);
+
+	if (!mStarted || ssrc != mSsrc) {
+		/*new stream*/
+		mStarted = true;
+		mSsrc = ssrc;
+		mBaseSeq = seq;
+		mMaxSeq = seq;
+		mCycles = 0;
+		mReceived = 0;
+		mHasTransit = false;
+		mJitter = 0;
+		mStart = time(NULL);
+	} else {
+		uint16_t delta = seq - mMaxSeq;
+		if (delta < sMaxDropout) {
+			if (seq < mMaxSeq)
+				mCycles += 65536;
+			mMaxSeq = seq;
+		} else if (delta <= 65535 - sMaxMisorder) {
+			/*the sender restarted its sequence*/
+			mBaseSeq = seq;
+			mMaxSeq = seq;
+			mCycles = 0;
+			mReceived = 0;
+		}
+		/*else a duplicate or reordered packet*/
+	}
+	mReceived++;
+	mStop = time(NULL);
+
+	/*in timestamp units, modulo 2^32 as the timestamps*/
+	uint64_t clockRate = mClockRate;
+	uint32_t arrival = (uint32_t)((now / 1000000) * clockRate + (now % 1000000) * clockRate / 1000000);
+	int32_t transit = (int32_t)(arrival - ts);
+	if (mHasTransit) {
+		int32_t d = transit - mTransit;
+		if (d < 0)
+			d = -d;
+		mJitter += (d - mJitter) / 16;
+	}
+	mTransit = transit;
+	mHasTransit = true;
+}
+
+void RtpStreamMonitor::onRtcp(const uint8_t *data, size_t size, uint64_t now, RtpStreamMonitor *peer) {
+	size_t offset = 0;
+	while (offset + 8 <= size) {
+		const uint8_t *p = data + offset;
+		if ((p[0] >> 6) != 2)
+			return;
+		int count = p[0] & 0x1f;
+		size_t length = (read16(p + 2) + 1) * 4;
+		if (offset + length > size)
+			return;
+		size_t blocks = 8;
+		switch (p[1]) {
+			case RTCP_SR:
+				if (length < 28)
+					break;
+				/*middle of the NTP timestamp, as the receivers will echo it*/
+				mLastSr = (read32(p + 8) << 16) | (read32(p + 12) >> 16);
+				mLastSrTime = now;
+				blocks = 28;
+			/*fall through*/
+			case RTCP_RR:
+				for (int i = 0; i < count && blocks + 24 <= length; ++i, blocks += 24) {
+					if (peer)
+						peer->onReportBlock(p + blocks, now);
+				}
+				break;
+			case RTCP_XR:
+				while (blocks + 4 <= length) {
+					size_t blockLength = (read16(p + blocks + 2) + 1) * 4;
+					if (blocks + blockLength > length)
+						break;
+					if (p[blocks] == XR_VOIP_METRICS && blockLength >= 36 && peer)
+						peer->onVoipMetrics(p + blocks);
+					blocks += blockLength;
+				}
+				break;
+			default:
+				break;
+		}
+		offset += length;
+	}
+}
+
+/* Reads a report block of the receiver of this stream. */
+void RtpStreamMonitor::onReportBlock(const uint8_t *block, uint64_t now) {
+	if (!mStarted || read32(block) != mSsrc)
+		return;
+	mHasReport = true;
+	mReportedJitter = read32(block + 12);
+	uint32_t lsr = read32(block + 16);
+	uint32_t dlsr = read32(block + 20);
+	if (lsr != 0 && lsr == mLastSr) {
+		/*the SR went from the relay to the receiver, the report from the receiver to the relay*/
+		int64_t rtt = (int64_t)(now - mLastSrTime) / 1000 - (int64_t)dlsr * 1000 / 65536;
+		if (rtt >= 0)
+			mRoundTripDelay = (int)rtt;
+	}
+}
+
+/* Reads a VoIP metrics report block of the receiver of this stream. */
+void RtpStreamMonitor::onVoipMetrics(const uint8_t *block) {
+	if (!mStarted || read32(block + 4) != mSsrc)
+		return;
+	mHasVoipMetrics = true;
+	mLossRate = block[8];
+	mDiscardRate = block[9];
+	mReportedRoundTripDelay = read16(block + 16);
+	mEndSystemDelay = read16(block + 18);
+	mSignalLevel = (int8_t)block[20];
+	mNoiseLevel = (int8_t)block[21];
+	mMosLq = block[26];
+	mMosCq = block[27];
+	mRxConfig = block[28];
+	mJbNominal = read16(block + 30);
+	mJbMax = read16(block + 32);
+	mJbAbsMax = read16(block + 34);
+}
+
+uint64_t RtpStreamMonitor::getExpected() const {
+	return (uint64_t)mCycles + mMaxSeq - mBaseSeq + 1;
+}
+
+uint64_t RtpStreamMonitor::getLost() const {
+	uint64_t expected = getExpected();
+	return expected > mReceived ? expected - mReceived : 0;
+}
+
+static string formatTime(time_t t) {
+	char buf[32];
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	return buf;
+}
+
+void RtpStreamMonitor::writeMetrics(ostream &ost) const {
+	int clockRate = mClockRate;
+	ost << "Timestamps: START=" << formatTime(mStart) << " STOP=" << formatTime(mStop) << "\r\n";
+	ost << "SessionDesc:";
+	if (mPayloadType >= 0)
+		ost << " PT=" << mPayloadType;
+	if (!mPayloadName.empty())
+		ost << " PD=" << mPayloadName;
+	ost << " SR=" << clockRate << "\r\n";
+	if (mHasVoipMetrics) {
+		ost << "JitterBuffer: JBA=" << ((mRxConfig >> 4) & 0x3) << " JBN=" << mJbNominal << " JBM=" << mJbMax
+			<< " JBX=" << mJbAbsMax << "\r\n";
+	}
+
+	/*what the receiver reports is end to end, what the relay measures only covers the way from the sender*/
+	ost << fixed << setprecision(1);
+	ost << "PacketLoss: NLR=";
+	if (mHasVoipMetrics) {
+		ost << mLossRate * 100.0 / 256 << " JDR=" << mDiscardRate * 100.0 / 256;
+	} else {
+		ost << getLost() * 100.0 / getExpected();
+	}
+	ost << "\r\n";
+
+	ost << "Delay:";
+	if (mHasVoipMetrics && mReportedRoundTripDelay > 0) {
+		ost << " RTD=" << mReportedRoundTripDelay << " ESD=" << mEndSystemDelay;
+	} else if (mRoundTripDelay >= 0) {
+		ost << " RTD=" << mRoundTripDelay;
+	}
+	uint32_t jitter = mHasReport ? mReportedJitter : (uint32_t)mJitter;
+	ost << " IAJ=" << (uint64_t)jitter * 1000 / clockRate << "\r\n";
+
+	if (mHasVoipMetrics) {
+		if (mSignalLevel != sUnavailable && mNoiseLevel != sUnavailable)
+			ost << "Signal: SL=" << (int)mSignalLevel << " NL=" << (int)mNoiseLevel << "\r\n";
+		if (mMosLq != sUnavailable && mMosCq != sUnavailable)
+			ost << "QualityEst: MOSLQ=" << mMosLq / 10.0 << " MOSCQ=" << mMosCq / 10.0 << "\r\n";
+	}
+	ost.unsetf(ios::floatfield);
+}
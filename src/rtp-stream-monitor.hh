@@ -0,0 +1,92 @@
+/*
+ Flexisip, a flexible SIP proxy server with media capabilities.
+ Copyright (C) 2012  Belledonne Communications SARL.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef rtp_stream_monitor_hh
+#define rtp_stream_monitor_hh
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <atomic>
+
+/**
+ * Quality metrics of an RTP stream sent by a party, as seen by the relay and as reported by the party receiving it.
+ * The relay measures the loss from the sequence numbers and the interarrival jitter (RFC 3550 A.1 and A.8). The
+ * receiving party reports them, along with the round trip delay, in the report blocks of its RTCP SR and RR, and in
+ * the VoIP metrics blocks of its RTCP XR (RFC 3611).
+ * It is not thread safe.
+ */
+class RtpStreamMonitor {
+  public:
+	RtpStreamMonitor();
+	/* Sets the description of the stream from the SDP of its sender. */
+	void setPayload(int type, const std::string &name, int clockRate);
+	/* Accounts for an RTP packet of the stream, received at now (in microseconds, monotonic). */
+	void onRtp(const uint8_t *data, size_t size, uint64_t now);
+	/* Reads an RTCP compound packet sent by the sender of this stream. The reports it holds are about the stream it
+	 * receives, whose monitor is peer if it is known. */
+	void onRtcp(const uint8_t *data, size_t size, uint64_t now, RtpStreamMonitor *peer);
+	bool hasRtp() const {
+		return mStarted;
+	}
+	uint32_t getSsrc() const {
+		return mSsrc;
+	}
+	/* Writes the metrics in the format of the vq-rtcpxr reports (RFC 6035), from the Timestamps line. */
+	void writeMetrics(std::ostream &ost) const;
+
+  private:
+	static const uint8_t sUnavailable = 127;
+	void onReportBlock(const uint8_t *block, uint64_t now);
+	void onVoipMetrics(const uint8_t *block);
+	uint64_t getExpected() const;
+	uint64_t getLost() const;
+
+	/* description */
+	int mPayloadType;
+	std::string mPayloadName;
+	std::atomic<int> mClockRate;
+	/* measured by the relay */
+	bool mStarted;
+	uint32_t mSsrc;
+	uint16_t mMaxSeq;
+	uint32_t mCycles;
+	uint32_t mBaseSeq;
+	uint64_t mReceived;
+	bool mHasTransit;
+	int32_t mTransit;
+	double mJitter; /* in timestamp units */
+	time_t mStart, mStop;
+	uint32_t mLastSr; /* middle 32 bits of the NTP timestamp of the last SR of the sender */
+	uint64_t mLastSrTime;
+	int mRoundTripDelay; /* between the relay and the receiver in ms, -1 if unknown */
+	/* reported by the receiver */
+	bool mHasReport;
+	uint32_t mReportedJitter; /* in timestamp units */
+	bool mHasVoipMetrics;
+	uint8_t mLossRate, mDiscardRate; /* fractions of 256 */
+	uint16_t mReportedRoundTripDelay, mEndSystemDelay;
+	int8_t mSignalLevel, mNoiseLevel;
+	uint8_t mMosLq, mMosCq; /* times 10 */
+	uint8_t mRxConfig;
+	uint16_t mJbNominal, mJbMax, mJbAbsMax;
+};
+
+#endif
@@ -0,0 +1,124 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Checks the capacity and ordering of the bounded queue, and that values pushed and popped by several threads at once
+ * are each received exactly once. */
+
+#include "tester.hh"
+#include "../utils/bounded-queue.hh"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static void test_capacity() {
+	startSuite("capacity");
+	CHECK_EQUAL((size_t)2, BoundedQueue<int>(0).capacity());
+	CHECK_EQUAL((size_t)2, BoundedQueue<int>(1).capacity());
+	CHECK_EQUAL((size_t)8, BoundedQueue<int>(5).capacity());
+	CHECK_EQUAL((size_t)4096, BoundedQueue<int>(4096).capacity());
+
+	BoundedQueue<int> queue(4);
+	CHECK(queue.empty());
+	for (int i = 0; i < 4; ++i) {
+		CHECK(queue.tryPush(int(i)));
+	}
+	/* a refused value is left to the caller */
+	CHECK(!queue.tryPush(4));
+	int value = -1;
+	for (int i = 0; i < 4; ++i) {
+		CHECK(queue.tryPop(value));
+		CHECK_EQUAL(i, value);
+	}
+	CHECK(!queue.tryPop(value));
+	CHECK(queue.empty());
+}
+
+static void test_wrap_around() {
+	startSuite("wrap around");
+	BoundedQueue<unique_ptr<int>> queue(4);
+	int next = 0, expected = 0;
+	/* positions go around the cells many times, values being moved in and out */
+	for (int round = 0; round < 1000; ++round) {
+		for (int i = 0; i < 3; ++i) {
+			unique_ptr<int> value(new int(next++));
+			CHECK(queue.tryPush(move(value)));
+			CHECK(!value);
+		}
+		for (int i = 0; i < 3; ++i) {
+			unique_ptr<int> value;
+			CHECK(queue.tryPop(value));
+			CHECK(value && *value == expected);
+			expected++;
+		}
+	}
+	CHECK(queue.empty());
+}
+
+static void test_threads() {
+	startSuite("threads");
+	const int producers = 4, consumers = 4, perProducer = 100000;
+	BoundedQueue<int> queue(1024);
+	vector<int> received(producers * perProducer, 0);
+	vector<thread> threads;
+	for (int p = 0; p < producers; ++p) {
+		threads.emplace_back([&queue, p, perProducer]() {
+			for (int i = 0; i < perProducer; ++i) {
+				while (!queue.tryPush(p * perProducer + i))
+					this_thread::yield();
+			}
+		});
+	}
+	/* each consumer counts its share of the values in its own vector, merged after the join */
+	vector<vector<int>> seen(consumers, vector<int>(producers * perProducer, 0));
+	for (int c = 0; c < consumers; ++c) {
+		threads.emplace_back([&queue, &seen, c, producers, consumers, perProducer]() {
+			for (int n = 0; n < producers * perProducer / consumers; ++n) {
+				int value;
+				while (!queue.tryPop(value))
+					this_thread::yield();
+				seen[c][value]++;
+			}
+		});
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	for (int c = 0; c < consumers; ++c) {
+		for (size_t i = 0; i < received.size(); ++i) {
+			received[i] += seen[c][i];
+		}
+	}
+	int wrong = 0;
+	for (size_t i = 0; i < received.size(); ++i) {
+		if (received[i] != 1)
+			wrong++;
+	}
+	CHECK_EQUAL(0, wrong);
+	CHECK(queue.empty());
+}
+
+int main(int argc, char *argv[]) {
+	test_capacity();
+	test_wrap_around();
+	test_threads();
+	return testResult();
+}
@@ -0,0 +1,135 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Drives CallStore::removeAndDeleteInactives() second by second with calls of a short inactivity timeout, and checks
+ * that a call is only checked at its deadline, that one with recent activity is rescheduled rather than reaped, that
+ * an idle one is reaped and counted, and that removing a call cancels its timer. */
+
+#include "tester.hh"
+#include "../tools/tool_utils.hh"
+#include "../callstore.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+using namespace std;
+
+static const time_t sTimeout = 1;
+
+/* A call whose activity is set by the test, inactive after sTimeout seconds without any, as a RelayedCall. */
+class TestCall : public CallContextBase {
+  public:
+	TestCall(sip_t *sip, time_t lastActivity)
+		: CallContextBase(sip), lastActivity(lastActivity), checks(0), terminated(false) {
+	}
+	bool isInactive(time_t cur) {
+		checks++;
+		return cur - lastActivity > sTimeout;
+	}
+	time_t getInactivityDeadline(time_t cur) {
+		return max(lastActivity + sTimeout + 1, cur + 1);
+	}
+	void terminate() {
+		terminated = true;
+	}
+	time_t lastActivity;
+	int checks;
+	bool terminated;
+};
+
+static shared_ptr<TestCall> makeCall(SofiaHome &home, const string &id, time_t lastActivity) {
+	sip_t sip;
+	memset(&sip, 0, sizeof(sip));
+	sip.sip_from = sip_from_make(home.h, ("<sip:caller@example.org>;tag=" + id).c_str());
+	sip.sip_to = sip_to_make(home.h, "<sip:callee@example.org>");
+	sip.sip_call_id = sip_call_id_make(home.h, id.c_str());
+	sip.sip_cseq = sip_cseq_create(home.h, 1, sip_method_invite, NULL);
+	return make_shared<TestCall>(&sip, lastActivity);
+}
+
+/* Waits for the start of the second at, so that the steps of a check run within the same second. */
+static void waitUntil(time_t at) {
+	while (getCurrentTime() < at) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+	}
+}
+
+static void test_inactivity() {
+	startSuite("inactivity");
+	SofiaHome home;
+	StatCounter64 calls("calls", "Calls stored.", 1);
+	StatCounter64 finished("finished", "Calls removed.", 2);
+	CallStore store;
+	store.setCallStatCounters(&calls, &finished);
+
+	time_t start = getCurrentTime();
+	waitUntil(start + 1);
+	start = getCurrentTime();
+	/* active has activity during the test, removed is removed before its deadline, idle never had any activity */
+	auto active = makeCall(home, "active", start);
+	auto removed = makeCall(home, "removed", start);
+	auto idle = makeCall(home, "idle", 0);
+	store.store(active);
+	store.store(removed);
+	store.store(idle);
+	CHECK_EQUAL(3, store.size());
+	CHECK_EQUAL((uint64_t)3, calls.read());
+
+	/* nothing is due yet */
+	store.removeAndDeleteInactives();
+	CHECK_EQUAL(0, active->checks + removed->checks + idle->checks);
+
+	waitUntil(start + 1);
+	active->lastActivity = getCurrentTime();
+	store.remove(removed);
+	CHECK(removed->terminated);
+	store.removeAndDeleteInactives();
+	/* idle was due: it is reaped, the others are not checked before their deadline */
+	CHECK_EQUAL(1, idle->checks);
+	CHECK(idle->terminated);
+	CHECK_EQUAL(0, active->checks);
+	CHECK_EQUAL(1, store.size());
+	/* both the removed and the reaped call are counted as finished */
+	CHECK_EQUAL((uint64_t)2, finished.read());
+
+	waitUntil(start + 2);
+	store.removeAndDeleteInactives();
+	/* active reached the deadline of its first activity, but it had some since: it is checked again at the deadline
+	 * of the last one */
+	CHECK_EQUAL(1, active->checks);
+	CHECK(!active->terminated);
+	CHECK_EQUAL(1, store.size());
+	/* the timer of removed was cancelled with it */
+	CHECK_EQUAL(0, removed->checks);
+
+	waitUntil(start + 3);
+	store.removeAndDeleteInactives();
+	CHECK_EQUAL(2, active->checks);
+	CHECK(active->terminated);
+	CHECK_EQUAL(0, store.size());
+	CHECK_EQUAL((uint64_t)3, finished.read());
+	CHECK_EQUAL(0, removed->checks);
+}
+
+int main(int argc, char *argv[]) {
+	init_tests();
+	test_inactivity();
+	return testResult();
+}
@@ -0,0 +1,157 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Feeds RTP packets of single NAL, STAP-A and FU-A payloads to the H264 I-frame filter, checking which ones are
+ * forwarded: parameter sets always, one I-frame over the decimation count with all its fragments, nothing else. */
+
+#include "tester.hh"
+#include "../tools/tool_utils.hh"
+#include "../h264iframefilter.hh"
+
+#include <vector>
+
+using namespace std;
+
+enum NalType { Slice = 1, Idr = 5, Sei = 6, Sps = 7, Pps = 8, StapA = 24, FuA = 28 };
+
+/* Builds a RTP packet of the given payload, the NAL header nri bits set as an encoder would. */
+static vector<uint8_t> rtpPacket(uint32_t ts, bool marker, const vector<uint8_t> &payload, uint32_t ssrc = 0x1234) {
+	vector<uint8_t> packet{0x80, (uint8_t)(96 | (marker ? 0x80 : 0)), 0, 1};
+	for (int shift = 24; shift >= 0; shift -= 8)
+		packet.push_back((uint8_t)(ts >> shift));
+	for (int shift = 24; shift >= 0; shift -= 8)
+		packet.push_back((uint8_t)(ssrc >> shift));
+	packet.insert(packet.end(), payload.begin(), payload.end());
+	return packet;
+}
+
+static vector<uint8_t> singleNal(NalType type) {
+	return vector<uint8_t>{(uint8_t)(0x60 | type), 0xaa, 0xbb, 0xcc};
+}
+
+static vector<uint8_t> stapA(const vector<NalType> &types) {
+	vector<uint8_t> payload{0x60 | StapA};
+	for (NalType type : types) {
+		vector<uint8_t> nal = singleNal(type);
+		payload.push_back(0);
+		payload.push_back((uint8_t)nal.size());
+		payload.insert(payload.end(), nal.begin(), nal.end());
+	}
+	return payload;
+}
+
+static vector<uint8_t> fuA(NalType type, bool start, bool end) {
+	return vector<uint8_t>{0x60 | FuA, (uint8_t)((start ? 0x80 : 0) | (end ? 0x40 : 0) | type), 0xaa, 0xbb};
+}
+
+static bool forwarded(H264IFrameFilter &filter, vector<uint8_t> packet) {
+	return filter.onOutgoingTransfer(packet.data(), packet.size(), NULL, 0);
+}
+
+static void test_parameter_sets() {
+	startSuite("parameter sets");
+	H264IFrameFilter filter(1);
+	uint32_t ts = 1000;
+	CHECK(forwarded(filter, rtpPacket(ts, true, singleNal(Sps))));
+	CHECK(forwarded(filter, rtpPacket(ts, true, singleNal(Pps))));
+	CHECK(forwarded(filter, rtpPacket(ts += 3000, true, stapA({Sps, Pps}))));
+	/* parameter sets aggregated with other units outside of an I-frame */
+	CHECK(forwarded(filter, rtpPacket(ts += 3000, true, stapA({Sps, Pps, Sei}))));
+	CHECK(!forwarded(filter, rtpPacket(ts += 3000, true, stapA({Sei}))));
+	CHECK(!forwarded(filter, rtpPacket(ts += 3000, true, singleNal(Slice))));
+	CHECK(!forwarded(filter, rtpPacket(ts += 3000, true, singleNal(Sei))));
+}
+
+static void test_decimation() {
+	startSuite("decimation");
+	/* one I-frame over two is kept */
+	H264IFrameFilter filter(2);
+	uint32_t ts = 1000;
+	for (int frame = 0; frame < 4; ++frame) {
+		bool kept = frame % 2 == 0;
+		ts += 3000;
+		/* an I-frame fragmented over three packets, the parameter sets ahead of it being forwarded anyway */
+		CHECK(forwarded(filter, rtpPacket(ts, false, stapA({Sps, Pps}))));
+		CHECK_EQUAL(kept, forwarded(filter, rtpPacket(ts, false, fuA(Idr, true, false))));
+		CHECK_EQUAL(kept, forwarded(filter, rtpPacket(ts, false, fuA(Idr, false, false))));
+		CHECK_EQUAL(kept, forwarded(filter, rtpPacket(ts, true, fuA(Idr, false, true))));
+		/* the P-frames that follow are never kept */
+		ts += 3000;
+		CHECK(!forwarded(filter, rtpPacket(ts, false, fuA(Slice, true, false))));
+		CHECK(!forwarded(filter, rtpPacket(ts, true, fuA(Slice, false, true))));
+		ts += 3000;
+		CHECK(!forwarded(filter, rtpPacket(ts, true, singleNal(Slice))));
+	}
+
+	/* an IDR slice in an aggregate starts an I-frame too */
+	ts += 3000;
+	CHECK(forwarded(filter, rtpPacket(ts, true, stapA({Sps, Pps, Idr}))));
+}
+
+static void test_new_stream() {
+	startSuite("new stream");
+	H264IFrameFilter filter(3);
+	CHECK(forwarded(filter, rtpPacket(1000, true, singleNal(Idr))));
+	CHECK(!forwarded(filter, rtpPacket(4000, true, singleNal(Idr))));
+	/* the decimation starts over with the first I-frame of a new SSRC */
+	CHECK(forwarded(filter, rtpPacket(7000, true, singleNal(Idr), 0x5678)));
+	CHECK(!forwarded(filter, rtpPacket(10000, true, singleNal(Idr), 0x5678)));
+}
+
+static void test_malformed() {
+	startSuite("malformed");
+	H264IFrameFilter filter(1);
+	/* what is not understood is forwarded */
+	vector<uint8_t> shortPacket{0x80, 0x60, 0, 1};
+	CHECK(forwarded(filter, shortPacket));
+	CHECK(forwarded(filter, rtpPacket(1000, true, vector<uint8_t>())));
+	vector<uint8_t> truncated = stapA({Slice});
+	truncated[2] = 200;
+	CHECK(forwarded(filter, rtpPacket(4000, true, truncated)));
+	/* the end of an I-frame slice whose start was not seen is dropped, even if I-frames are kept */
+	CHECK(!forwarded(filter, rtpPacket(7000, true, fuA(Idr, false, true))));
+}
+
+static void test_counters() {
+	startSuite("counters");
+	StatCounter64 countForwarded("count-forwarded", "Bytes forwarded.", 0);
+	StatCounter64 countDropped("count-dropped", "Bytes dropped.", 0);
+	H264IFrameFilter filter(1, &countForwarded, &countDropped);
+	vector<uint8_t> idr = rtpPacket(1000, true, singleNal(Idr));
+	vector<uint8_t> slice = rtpPacket(4000, true, singleNal(Slice));
+	forwarded(filter, idr);
+	forwarded(filter, slice);
+	forwarded(filter, slice);
+	CHECK_EQUAL((uint64_t)idr.size(), filter.getForwardedBytes());
+	CHECK_EQUAL((uint64_t)(2 * slice.size()), filter.getDroppedBytes());
+	CHECK_EQUAL(filter.getForwardedBytes(), countForwarded.read());
+	CHECK_EQUAL(filter.getDroppedBytes(), countDropped.read());
+}
+
+int main(int argc, char *argv[]) {
+	init_tests();
+	flexisip::log::updateFilter("%Severity% >= error");
+
+	test_parameter_sets();
+	test_decimation();
+	test_new_stream();
+	test_malformed();
+	test_counters();
+	return testResult();
+}
@@ -0,0 +1,106 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Checks the percentiles given by the latency histogram, and that they can be read while values are recorded. */
+
+#include "tester.hh"
+#include "../utils/histogram.hh"
+
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+static void test_empty() {
+	startSuite("empty");
+	LatencyHistogram histogram;
+	CHECK_EQUAL((uint64_t)0, histogram.count());
+	CHECK_EQUAL((uint64_t)0, histogram.percentile(50));
+	CHECK_EQUAL((uint64_t)0, histogram.percentile(100));
+}
+
+static void test_percentiles() {
+	startSuite("percentiles");
+	LatencyHistogram histogram;
+	/* small values have a bucket each */
+	for (uint64_t v = 0; v < 8; ++v) {
+		histogram.record(v);
+	}
+	CHECK_EQUAL((uint64_t)8, histogram.count());
+	CHECK_EQUAL((uint64_t)3, histogram.percentile(50));
+	CHECK_EQUAL((uint64_t)7, histogram.percentile(100));
+
+	/* larger ones are known within an eighth of their value */
+	histogram.reset();
+	for (uint64_t v = 1; v <= 100000; ++v) {
+		histogram.record(v);
+	}
+	CHECK_EQUAL((uint64_t)100000, histogram.count());
+	CHECK_EQUAL((uint64_t)100000, histogram.max());
+	double percents[] = {1, 10, 50, 90, 99, 99.9};
+	for (double percent : percents) {
+		uint64_t exact = (uint64_t)(percent * 1000);
+		uint64_t value = histogram.percentile(percent);
+		CHECK(value >= exact);
+		CHECK(value <= exact + exact / 8);
+	}
+	/* never above the largest recorded value */
+	CHECK_EQUAL((uint64_t)100000, histogram.percentile(100));
+
+	/* values beyond the last bucket are reported as the maximum */
+	histogram.reset();
+	histogram.record(10);
+	histogram.record((uint64_t)1 << 50);
+	CHECK_EQUAL((uint64_t)10, histogram.percentile(50));
+	CHECK_EQUAL((uint64_t)1 << 50, histogram.percentile(100));
+}
+
+static void test_concurrent_read() {
+	startSuite("concurrent read");
+	LatencyHistogram histogram;
+	const uint64_t samples = 1000000;
+	atomic<bool> done(false);
+	/* the exporter reads the histogram while the sip thread records in it */
+	thread writer([&histogram, &done, samples]() {
+		for (uint64_t i = 0; i < samples; ++i) {
+			histogram.record(i % 1000);
+		}
+		done = true;
+	});
+	uint64_t lastCount = 0;
+	bool ordered = true, bounded = true;
+	while (!done) {
+		uint64_t count = histogram.count();
+		ordered = ordered && count >= lastCount;
+		lastCount = count;
+		bounded = bounded && histogram.percentile(99) < 1000 && histogram.max() < 1000;
+	}
+	writer.join();
+	CHECK(ordered);
+	CHECK(bounded);
+	CHECK_EQUAL(samples, histogram.count());
+	CHECK_EQUAL((uint64_t)999, histogram.max());
+}
+
+int main(int argc, char *argv[]) {
+	test_empty();
+	test_percentiles();
+	test_concurrent_read();
+	return testResult();
+}
@@ -0,0 +1,300 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Relays RTP and RTCP between parties on the loopback interface through a MediaRelayServer, and checks that every
+ * packet reaches the other party whatever the size of the bursts, that packets are forked to the branches of a call
+ * not yet answered, and that the channels of removed branches, of the branches that did not answer and of an unused
+ * session are no longer relayed. Also checks how the SDP port range is shared among the workers and their relay
+ * threads, and that new sessions go to the least loaded server. */
+
+#include "tester.hh"
+#include "loopback.hh"
+#include "../tools/tool_utils.hh"
+#include "../mediarelay.hh"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <ctime>
+#include <ortp/ortp.h>
+#include <poll.h>
+#include <sofia-sip/su_wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static const pair<string, string> sRelayIps(sLoopback, sLoopback);
+static const int sPairs = 16;
+/* how long to wait for a packet that should not come */
+static const int sSilenceMs = 200;
+
+/* A party of a call, with its RTP and RTCP sockets on consecutive ports, below the ports of the relay. */
+struct Party {
+	Party() {
+		do {
+			port = 20000 + 2 * (rand() % 5000);
+			sockets[0] = bindLoopback(port);
+			sockets[1] = sockets[0] == -1 ? -1 : bindLoopback(port + 1);
+			if (sockets[0] != -1 && sockets[1] == -1)
+				close(sockets[0]);
+		} while (sockets[1] == -1);
+	}
+	~Party() {
+		close(sockets[0]);
+		close(sockets[1]);
+	}
+	/* Sends count sequence numbers from first on socket i, to port i of the relay channel. */
+	void send(int i, const shared_ptr<RelayChannel> &chan, uint32_t first, int count) {
+		struct sockaddr_in to;
+		memset(&to, 0, sizeof(to));
+		to.sin_family = AF_INET;
+		to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		to.sin_port = htons(chan->getLocalPort() + i);
+		for (uint32_t seq = first; seq < first + count; ++seq) {
+			sendto(sockets[i], &seq, sizeof(seq), 0, (const struct sockaddr *)&to, sizeof(to));
+		}
+	}
+	/* Receives on socket i until expected packets came or none came for timeoutMs, checking that they follow each
+	 * other from first. Returns the number received. */
+	int receive(int i, uint32_t first, int expected, int timeoutMs = 1000) {
+		struct pollfd pfd = {sockets[i], POLLIN, 0};
+		int received = 0;
+		while (received < expected && poll(&pfd, 1, timeoutMs) == 1) {
+			uint32_t seq;
+			if (recv(sockets[i], &seq, sizeof(seq), 0) != sizeof(seq))
+				continue;
+			CHECK_EQUAL(first + received, seq);
+			received++;
+		}
+		return received;
+	}
+	/* Returns true if nothing comes on either socket for a while. */
+	bool silent() {
+		return receive(0, 0, 1, sSilenceMs) == 0 && receive(1, 0, 1, sSilenceMs) == 0;
+	}
+	int port;
+	int sockets[2];
+};
+
+static void test_relay(MediaRelay *module, StatCounter64 &exhausted) {
+	startSuite("relay");
+	int minPort = pickRange();
+	MediaRelayServer server(module, 0, minPort, minPort + 2 * sPairs, &exhausted);
+	Party caller, callee;
+	{
+		shared_ptr<RelaySession> session = server.createSession("caller-tag", sRelayIps);
+		shared_ptr<RelayChannel> front = session->getChannel("caller-tag", "");
+		shared_ptr<RelayChannel> back = session->createBranch("branch-1", sRelayIps, false);
+		CHECK(front && back && front != back);
+		CHECK(session->checkChannels());
+		front->setRemoteAddr(sLoopback, caller.port, RelayChannel::SendRecv);
+		back->setRemoteAddr(sLoopback, callee.port, RelayChannel::SendRecv);
+
+		/* each burst is read by batches until EAGAIN, the last one being short, the longest ones over several rounds
+		 * of the server thread */
+		uint32_t next = 0;
+		const int rounds = RelaySession::sMaxBatches * UdpBatch::sMaxPackets;
+		for (int burst : {1, 5, UdpBatch::sMaxPackets, UdpBatch::sMaxPackets + 1, 3 * UdpBatch::sMaxPackets + 7, rounds,
+						  rounds + 1}) {
+			for (int i = 0; i < 2; ++i) {
+				caller.send(i, front, next, burst);
+				CHECK_EQUAL(burst, callee.receive(i, next, burst));
+				callee.send(i, back, next, burst);
+				CHECK_EQUAL(burst, caller.receive(i, next, burst));
+			}
+			next += burst;
+		}
+
+		/* an inactive stream is not relayed */
+		back->setRemoteAddr(sLoopback, callee.port, RelayChannel::Inactive);
+		caller.send(0, front, 1000, 3);
+		CHECK(callee.silent());
+		session->unuse();
+	}
+	CHECK_EQUAL((uint64_t)0, exhausted.read());
+}
+
+static void test_branches(MediaRelay *module, StatCounter64 &exhausted) {
+	startSuite("branches");
+	int minPort = pickRange();
+	MediaRelayServer server(module, 0, minPort, minPort + 2 * sPairs, &exhausted);
+	Party caller, callees[3];
+	{
+		shared_ptr<RelaySession> session = server.createSession("caller-tag", sRelayIps);
+		shared_ptr<RelayChannel> front = session->getChannel("caller-tag", "");
+		front->setRemoteAddr(sLoopback, caller.port, RelayChannel::SendRecv);
+		shared_ptr<RelayChannel> branches[3];
+		for (int b = 0; b < 3; ++b) {
+			branches[b] = session->createBranch("branch-" + to_string(b), sRelayIps, true);
+			branches[b]->setRemoteAddr(sLoopback, callees[b].port, RelayChannel::SendRecv);
+		}
+		CHECK_EQUAL(3, session->getActiveBranchesCount());
+
+		/* early media: the caller reaches every branch, and every branch reaches the caller */
+		caller.send(0, front, 0, 10);
+		for (int b = 0; b < 3; ++b) {
+			CHECK_EQUAL(10, callees[b].receive(0, 0, 10));
+			callees[b].send(0, branches[b], 100 * b, 2);
+			CHECK_EQUAL(2, caller.receive(0, 100 * b, 2));
+		}
+
+		/* a removed branch is neither sent to nor relayed from */
+		session->removeBranch("branch-1");
+		CHECK(branches[1]->isRetired());
+		CHECK_EQUAL(2, session->getActiveBranchesCount());
+		caller.send(0, front, 10, 10);
+		CHECK_EQUAL(10, callees[0].receive(0, 10, 10));
+		CHECK_EQUAL(10, callees[2].receive(0, 10, 10));
+		CHECK(callees[1].silent());
+		callees[1].send(0, branches[1], 200, 5);
+		CHECK(caller.silent());
+
+		/* once established, only the branch that answered is relayed */
+		session->setEstablished("branch-2");
+		CHECK(branches[0]->isRetired());
+		CHECK(!branches[2]->isRetired());
+		CHECK(session->getChannel("", "branch-0") == branches[2]);
+		caller.send(0, front, 20, 10);
+		CHECK_EQUAL(10, callees[2].receive(0, 20, 10));
+		CHECK(callees[0].silent());
+		callees[0].send(0, branches[0], 300, 5);
+		CHECK(caller.silent());
+		callees[2].send(1, branches[2], 400, 5);
+		CHECK_EQUAL(5, caller.receive(1, 400, 5));
+
+		/* nothing is relayed once the session is unused */
+		session->unuse();
+		CHECK(front->isRetired());
+		CHECK(branches[2]->isRetired());
+		CHECK(!session->isUsed());
+		caller.send(0, front, 30, 5);
+		CHECK(callees[2].silent());
+	}
+}
+
+static void test_port_shares() {
+	startSuite("port shares");
+	const pair<int, int> ranges[] = {{1024, 65535}, {10000, 20000}, {10001, 10100}, {40000, 40016}};
+	for (auto range : ranges) {
+		for (int workers = 1; workers <= 3; ++workers) {
+			for (int threads = 1; threads <= 5; ++threads) {
+				int previousMax = range.first;
+				for (int w = 0; w < workers; ++w) {
+					pair<int, int> worker = MediaRelay::portShare(range.first, range.second, w, workers);
+					/* as many threads as pairs at most, like MediaRelay::createServers() */
+					int count = min(threads, max(1, (worker.second - worker.first) / 2));
+					for (int t = 0; t < count; ++t) {
+						pair<int, int> share = MediaRelay::portShare(worker.first, worker.second, t, count);
+						/* whole pairs, not overlapping the previous share, within the range */
+						CHECK_EQUAL(0, share.first % 2);
+						CHECK(share.first >= previousMax);
+						CHECK(share.second <= range.second);
+						CHECK(share.second - share.first >= 2);
+						previousMax = share.second;
+					}
+				}
+				CHECK_EQUAL(range.second, previousMax);
+			}
+		}
+	}
+	/* shares of the same size, the last one getting the remaining ports */
+	CHECK(MediaRelay::portShare(10000, 20000, 0, 3) == make_pair(10000, 13332));
+	CHECK(MediaRelay::portShare(10000, 20000, 1, 3) == make_pair(13332, 16664));
+	CHECK(MediaRelay::portShare(10000, 20000, 2, 3) == make_pair(16664, 20000));
+	CHECK(MediaRelay::portShare(10001, 10100, 0, 1) == make_pair(10002, 10100));
+}
+
+static void test_balancing(MediaRelay *module, StatCounter64 &exhausted) {
+	startSuite("balancing");
+	int minPort = pickRange();
+	vector<shared_ptr<MediaRelayServer>> servers;
+	for (int i = 0; i < 3; ++i) {
+		servers.push_back(make_shared<MediaRelayServer>(module, i, minPort + 2 * sPairs * i,
+														minPort + 2 * sPairs * (i + 1), &exhausted));
+	}
+	{
+		/* idle servers are picked in turn */
+		for (size_t next = 0; next < servers.size(); ++next) {
+			CHECK_EQUAL(next, MediaRelay::leastLoaded(servers, next));
+		}
+
+		/* a call with two branches on the first server, one without branch yet on the second */
+		shared_ptr<RelaySession> forked = servers[0]->createSession("forked", sRelayIps);
+		forked->createBranch("branch-0", sRelayIps, true);
+		forked->createBranch("branch-1", sRelayIps, true);
+		shared_ptr<RelaySession> early = servers[1]->createSession("early", sRelayIps);
+		CHECK(servers[0]->getLoad() > servers[1]->getLoad());
+		CHECK(servers[1]->getLoad() > 0);
+		CHECK_EQUAL((unsigned int)0, servers[2]->getLoad());
+		for (size_t next = 0; next < servers.size(); ++next) {
+			CHECK_EQUAL((size_t)2, MediaRelay::leastLoaded(servers, next));
+		}
+
+		/* a bigger call on the third server: the second one is the least loaded */
+		shared_ptr<RelaySession> conference = servers[2]->createSession("conference", sRelayIps);
+		for (int b = 0; b < 4; ++b) {
+			conference->createBranch("branch-" + to_string(b), sRelayIps, true);
+		}
+		CHECK_EQUAL((size_t)1, MediaRelay::leastLoaded(servers, 0));
+		CHECK_EQUAL((size_t)1, MediaRelay::leastLoaded(servers, 2));
+
+		/* the channels of the removed branches and of the ended calls no longer count */
+		forked->removeBranch("branch-0");
+		forked->removeBranch("branch-1");
+		CHECK_EQUAL(servers[1]->getLoad(), servers[0]->getLoad());
+		CHECK_EQUAL((size_t)0, MediaRelay::leastLoaded(servers, 0));
+		CHECK_EQUAL((size_t)1, MediaRelay::leastLoaded(servers, 1));
+		forked->unuse();
+		early->unuse();
+		conference->unuse();
+		for (size_t i = 0; i < servers.size(); ++i) {
+			CHECK_EQUAL((unsigned int)0, servers[i]->getLoad());
+		}
+	}
+	CHECK_EQUAL((uint64_t)0, exhausted.read());
+}
+
+int main(int argc, char *argv[]) {
+	init_tests();
+	flexisip::log::updateFilter("%Severity% >= fatal");
+	ortp_init();
+	su_init();
+	srand(time(NULL) ^ getpid());
+
+	su_root_t *root = su_root_create(NULL);
+	shared_ptr<Agent> agent = make_shared<Agent>(root);
+	GenericStruct *modconf = GenericManager::get()->getRoot()->get<GenericStruct>("module::MediaRelay");
+	/* the parties are on the address of the relay */
+	modconf->get<ConfigBoolean>("prevent-loops")->set("false");
+	MediaRelay *module = dynamic_cast<MediaRelay *>(agent->findModule("MediaRelay"));
+	CHECK(module);
+	module->load();
+
+	StatCounter64 exhausted("count-ports-exhausted", "Number of streams that could not get a port.", 0);
+	test_relay(module, exhausted);
+	test_branches(module, exhausted);
+	test_port_shares();
+	test_balancing(module, exhausted);
+
+	agent.reset();
+	su_root_destroy(root);
+	su_deinit();
+	return testResult();
+}
@@ -0,0 +1,129 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Builds the per-method module pipelines from modules handling various methods, and checks that each pipeline holds
+ * the enabled modules handling its method in module order, and that an injected event resumes right after its
+ * module, including when that module is not in the pipeline. */
+
+#include "tester.hh"
+#include "../module-pipelines.hh"
+
+#include <set>
+#include <string>
+
+using namespace std;
+
+struct FakeModule {
+	FakeModule(const string &name, bool enabled, set<int> requests, set<int> responses)
+		: name(name), enabled(enabled), requests(requests), responses(responses) {
+	}
+	bool isEnabled() const {
+		return enabled;
+	}
+	/* an empty set handles every method */
+	bool handlesRequest(sip_method_t method) const {
+		return requests.empty() || requests.count(method);
+	}
+	bool handlesResponse(sip_method_t method) const {
+		return responses.empty() || responses.count(method);
+	}
+	string name;
+	bool enabled;
+	set<int> requests;
+	set<int> responses;
+};
+
+static string names(const vector<FakeModule *> &pipeline) {
+	string result;
+	for (auto it = pipeline.begin(); it != pipeline.end(); ++it) {
+		if (!result.empty())
+			result += " ";
+		result += (*it)->name;
+	}
+	return result;
+}
+
+static void test_pipelines() {
+	startSuite("pipelines");
+	FakeModule sanity("sanity", true, {}, {});
+	FakeModule registrar("registrar", true, {sip_method_register}, {sip_method_register});
+	FakeModule disabled("disabled", false, {}, {});
+	FakeModule relay("relay", true, {sip_method_invite, sip_method_ack, sip_method_bye}, {sip_method_invite});
+	FakeModule forward("forward", true, {}, {});
+	list<FakeModule *> modules{&sanity, &registrar, &disabled, &relay, &forward};
+	ModulePipelines<FakeModule> pipelines(modules);
+
+	CHECK_EQUAL(string("sanity relay forward"), names(pipelines.requests(sip_method_invite)));
+	CHECK_EQUAL(string("sanity relay forward"), names(pipelines.responses(sip_method_invite)));
+	CHECK_EQUAL(string("sanity registrar forward"), names(pipelines.requests(sip_method_register)));
+	CHECK_EQUAL(string("sanity registrar forward"), names(pipelines.responses(sip_method_register)));
+	CHECK_EQUAL(string("sanity relay forward"), names(pipelines.requests(sip_method_bye)));
+	CHECK_EQUAL(string("sanity forward"), names(pipelines.responses(sip_method_bye)));
+	CHECK_EQUAL(string("sanity forward"), names(pipelines.requests(sip_method_options)));
+
+	/* methods sofia doesn't know share the sip_method_unknown pipeline */
+	CHECK_EQUAL(0, ModulePipelines<FakeModule>::index(sip_method_unknown));
+	CHECK_EQUAL(0, ModulePipelines<FakeModule>::index(sip_method_invalid));
+	CHECK_EQUAL((int)sip_method_invite, ModulePipelines<FakeModule>::index(sip_method_invite));
+	CHECK_EQUAL((int)sip_method_publish, ModulePipelines<FakeModule>::index(sip_method_publish));
+	int unknown = ModulePipelines<FakeModule>::index(sip_method_unknown);
+	CHECK_EQUAL(string("sanity forward"), names(pipelines.requests(unknown)));
+}
+
+static void test_resume_index() {
+	startSuite("resume index");
+	FakeModule auth("auth", true, {}, {});
+	FakeModule registrar("registrar", true, {sip_method_register}, {});
+	FakeModule disabled("disabled", false, {}, {});
+	FakeModule relay("relay", true, {sip_method_invite}, {});
+	FakeModule forward("forward", true, {}, {});
+	list<FakeModule *> modules{&auth, &registrar, &disabled, &relay, &forward};
+	ModulePipelines<FakeModule> pipelines(modules);
+
+	const vector<FakeModule *> &invite = pipelines.requests(sip_method_invite);
+	CHECK_EQUAL(string("auth relay forward"), names(invite));
+	/* right after the module that suspended the event */
+	CHECK_EQUAL((size_t)1, pipelines.resumeIndex(invite, &auth));
+	CHECK_EQUAL((size_t)2, pipelines.resumeIndex(invite, &relay));
+	/* past the end after the last module */
+	CHECK_EQUAL((size_t)3, pipelines.resumeIndex(invite, &forward));
+	/* a module out of the pipeline, that is not handling the method or disabled, resumes at the next one in it */
+	CHECK_EQUAL((size_t)1, pipelines.resumeIndex(invite, &registrar));
+	CHECK_EQUAL((size_t)1, pipelines.resumeIndex(invite, &disabled));
+
+	const vector<FakeModule *> &reg = pipelines.requests(sip_method_register);
+	CHECK_EQUAL(string("auth registrar forward"), names(reg));
+	CHECK_EQUAL((size_t)1, pipelines.resumeIndex(reg, &auth));
+	CHECK_EQUAL((size_t)2, pipelines.resumeIndex(reg, &registrar));
+	CHECK_EQUAL((size_t)2, pipelines.resumeIndex(reg, &relay));
+
+	/* pipelines built after a module was disabled still resume after the module of the event */
+	relay.enabled = false;
+	ModulePipelines<FakeModule> rebuilt(modules);
+	const vector<FakeModule *> &inviteRebuilt = rebuilt.requests(sip_method_invite);
+	CHECK_EQUAL(string("auth forward"), names(inviteRebuilt));
+	CHECK_EQUAL((size_t)1, rebuilt.resumeIndex(inviteRebuilt, &relay));
+	CHECK_EQUAL((size_t)2, rebuilt.resumeIndex(inviteRebuilt, &forward));
+}
+
+int main(int argc, char *argv[]) {
+	test_pipelines();
+	test_resume_index();
+	return testResult();
+}
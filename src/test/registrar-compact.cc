@@ -0,0 +1,369 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Checks the compact registrar: that erasing from the middle of a probe chain of colliding aors, wrapping around the
+ * end of the table, leaves the rest of the chain reachable, that the aors sharing a hash share an expiry timer due at
+ * their earliest contact, the reference counts of the interned strings and SmallVector. Then binds, clears and expires
+ * the same contacts in it and in RegistrarDbInternal, and checks that both fetch the same records. */
+
+#include "tester.hh"
+#include "../tools/tool_utils.hh"
+#include "../registrardb-compact.hh"
+#include "../registrardb-internal.hh"
+#include "../utils/smallvector.hh"
+
+#include <cstring>
+#include <sofia-sip/sip_protos.h>
+#include <thread>
+
+using namespace std;
+
+static const int sAors = 1000; /* enough for the table to grow */
+
+/* Access to the internals of RegistrarDbCompact, which befriends it. */
+class RegistrarDbCompactTester {
+  public:
+	typedef RegistrarDbCompact::StringPool StringPool;
+
+	static size_t tableSize(const RegistrarDbCompact &db) {
+		return db.mTable.size();
+	}
+	static size_t notFound() {
+		return RegistrarDbCompact::sNotFound;
+	}
+	/* Adds key without contacts under a chosen hash, so that home slots can be made to collide. */
+	static size_t insert(RegistrarDbCompact &db, const string &key, size_t hash) {
+		return db.insert(key, hash);
+	}
+	static size_t find(const RegistrarDbCompact &db, const string &key, size_t hash) {
+		return db.find(key, hash);
+	}
+	static void erase(RegistrarDbCompact &db, const string &key, size_t hash) {
+		db.erase(db.find(key, hash));
+	}
+	static void setContacts(RegistrarDbCompact &db, const string &key, size_t hash, const Record &record) {
+		db.fromRecord(db.mTable[db.find(key, hash)], record);
+		db.scheduleExpiry(hash);
+	}
+	static void scheduleExpiry(RegistrarDbCompact &db, size_t hash) {
+		db.scheduleExpiry(hash);
+	}
+	static bool isScheduled(const RegistrarDbCompact &db, size_t hash) {
+		return db.mExpiryWheel.contains(hash);
+	}
+};
+
+typedef RegistrarDbCompactTester Tester;
+
+/* Keeps a copy of the record found, the registrar keeping the one it hands out. */
+class FetchListener : public RegistrarDbListener {
+  public:
+	FetchListener() : found(false), errors(0) {
+	}
+	void onRecordFound(Record *r) {
+		found = (r != NULL);
+		record.reset();
+		if (r) {
+			record.reset(new Record(r->getKey()));
+			for (auto it = r->getExtendedContacts().begin(); it != r->getExtendedContacts().end(); ++it) {
+				record->pushContact(make_shared<ExtendedContact>(**it));
+			}
+		}
+	}
+	void onError() {
+		errors++;
+	}
+	void onInvalid() {
+		errors++;
+	}
+	bool found;
+	int errors;
+	unique_ptr<Record> record;
+};
+
+static Record makeRecord(const string &key, time_t now, time_t expireAt) {
+	Record record(key);
+	ExtendedContactCommon ecc("device", list<string>(), ("callid-" + key).c_str(), "urn:uuid:device");
+	record.update(ecc, ("<sip:" + key + ">").c_str(), expireAt, 1.0, 1, now, false, list<string>(), false);
+	return record;
+}
+
+static void test_probe_chain() {
+	startSuite("probe chain");
+	RegistrarDbCompact db("");
+	const size_t size = Tester::tableSize(db);
+	const size_t home = size - 2;
+	/* a to d share the home slot before the last one and wrap around the end of the table, e's home is the first
+	 * slot, taken by the chain, f sits in its own home slot right after it */
+	CHECK_EQUAL(home, Tester::insert(db, "a@example.org", home));
+	CHECK_EQUAL(size - 1, Tester::insert(db, "b@example.org", home + size));
+	CHECK_EQUAL((size_t)0, Tester::insert(db, "c@example.org", home + 2 * size));
+	CHECK_EQUAL((size_t)1, Tester::insert(db, "d@example.org", home + 3 * size));
+	CHECK_EQUAL((size_t)2, Tester::insert(db, "e@example.org", 5 * size));
+	CHECK_EQUAL((size_t)3, Tester::insert(db, "f@example.org", 3 + 7 * size));
+	CHECK_EQUAL((size_t)6, db.count());
+
+	/* from the middle of the chain: the entries after it move back, across the end of the table */
+	Tester::erase(db, "b@example.org", home + size);
+	CHECK_EQUAL(Tester::notFound(), Tester::find(db, "b@example.org", home + size));
+	CHECK_EQUAL(home, Tester::find(db, "a@example.org", home));
+	CHECK_EQUAL(size - 1, Tester::find(db, "c@example.org", home + 2 * size));
+	CHECK_EQUAL((size_t)0, Tester::find(db, "d@example.org", home + 3 * size));
+	CHECK_EQUAL((size_t)1, Tester::find(db, "e@example.org", 5 * size));
+	CHECK_EQUAL((size_t)3, Tester::find(db, "f@example.org", 3 + 7 * size));
+	CHECK_EQUAL((size_t)5, db.count());
+
+	/* from the start of the chain, the hole wrapping around too; f stays in its home slot */
+	Tester::erase(db, "a@example.org", home);
+	CHECK_EQUAL(Tester::notFound(), Tester::find(db, "a@example.org", home));
+	CHECK_EQUAL(home, Tester::find(db, "c@example.org", home + 2 * size));
+	CHECK_EQUAL(size - 1, Tester::find(db, "d@example.org", home + 3 * size));
+	CHECK_EQUAL((size_t)0, Tester::find(db, "e@example.org", 5 * size));
+	CHECK_EQUAL((size_t)3, Tester::find(db, "f@example.org", 3 + 7 * size));
+	CHECK_EQUAL((size_t)4, db.count());
+
+	db.clearAll();
+	CHECK_EQUAL((size_t)0, db.count());
+	CHECK_EQUAL(Tester::notFound(), Tester::find(db, "c@example.org", home + 2 * size));
+}
+
+static void test_shared_hash_expiry() {
+	startSuite("shared hash expiry");
+	RegistrarDbCompact db("");
+	const size_t size = Tester::tableSize(db);
+	const size_t shared = 77, other = 77 + size, empty = 200;
+	time_t now = getCurrentTime();
+	/* alice and bob share a hash, carol only shares their home slot */
+	Tester::insert(db, "alice@example.org", shared);
+	Tester::insert(db, "bob@example.org", shared);
+	Tester::insert(db, "carol@example.org", other);
+	Tester::setContacts(db, "alice@example.org", shared, makeRecord("alice@example.org", now, now + 2));
+	Tester::setContacts(db, "bob@example.org", shared, makeRecord("bob@example.org", now, now + 4));
+	Tester::setContacts(db, "carol@example.org", other, makeRecord("carol@example.org", now, now + 2));
+	CHECK(Tester::isScheduled(db, shared));
+	CHECK(Tester::isScheduled(db, other));
+
+	db.removeExpired(now + 1);
+	CHECK_EQUAL((size_t)3, db.count());
+
+	/* the shared timer expires alice only, and is rescheduled for bob */
+	db.removeExpired(now + 2);
+	CHECK_EQUAL(Tester::notFound(), Tester::find(db, "alice@example.org", shared));
+	CHECK(Tester::find(db, "bob@example.org", shared) != Tester::notFound());
+	CHECK_EQUAL(Tester::notFound(), Tester::find(db, "carol@example.org", other));
+	CHECK(Tester::isScheduled(db, shared));
+	CHECK(!Tester::isScheduled(db, other));
+	CHECK_EQUAL((size_t)1, db.count());
+
+	db.removeExpired(now + 4);
+	CHECK_EQUAL(Tester::notFound(), Tester::find(db, "bob@example.org", shared));
+	CHECK(!Tester::isScheduled(db, shared));
+	CHECK_EQUAL((size_t)0, db.count());
+
+	/* an aor left without contacts is due right away */
+	Tester::insert(db, "dave@example.org", empty);
+	Tester::scheduleExpiry(db, empty);
+	CHECK(Tester::isScheduled(db, empty));
+	db.removeExpired(now + 5);
+	CHECK_EQUAL(Tester::notFound(), Tester::find(db, "dave@example.org", empty));
+	CHECK(!Tester::isScheduled(db, empty));
+	CHECK_EQUAL((size_t)0, db.count());
+}
+
+static void test_string_pool() {
+	startSuite("string pool");
+	Tester::StringPool pool;
+	CHECK_EQUAL((uint32_t)0, pool.intern(""));
+	CHECK_EQUAL(string(), pool.get(0));
+	uint32_t path = pool.intern("<sip:proxy.example.org;lr>");
+	CHECK(path != 0);
+	CHECK_EQUAL(path, pool.intern("<sip:proxy.example.org;lr>"));
+	uint32_t accept = pool.intern("text/plain");
+	CHECK(accept != path);
+
+	/* still referenced once */
+	pool.release(path);
+	CHECK_EQUAL(string("<sip:proxy.example.org;lr>"), pool.get(path));
+	/* freed, its id is reused */
+	pool.release(path);
+	CHECK_EQUAL(path, pool.intern("application/sdp"));
+	CHECK_EQUAL(string("application/sdp"), pool.get(path));
+	uint32_t again = pool.intern("<sip:proxy.example.org;lr>");
+	CHECK(again != path && again != accept);
+	CHECK_EQUAL(string("text/plain"), pool.get(accept));
+	pool.release(0);
+	CHECK_EQUAL(string(), pool.get(0));
+
+	pool.clear();
+	CHECK_EQUAL((uint32_t)1, pool.intern("text/plain"));
+}
+
+static void test_small_vector() {
+	startSuite("small vector");
+	SmallVector<string, 2> v;
+	CHECK(v.empty());
+	v.push_back(string("a"));
+	v.push_back(string("b"));
+	/* beyond the inline storage */
+	v.push_back(string("c"));
+	CHECK_EQUAL((size_t)3, v.size());
+	v.erase(1);
+	CHECK_EQUAL((size_t)2, v.size());
+	CHECK_EQUAL(string("a"), v[0]);
+	CHECK_EQUAL(string("c"), v[1]);
+
+	SmallVector<string, 2> heap(std::move(v));
+	CHECK(v.empty());
+	CHECK_EQUAL(string("c"), heap[1]);
+	SmallVector<string, 2> inlined;
+	inlined.push_back(string("x"));
+	SmallVector<string, 2> moved(std::move(inlined));
+	CHECK(inlined.empty());
+	CHECK_EQUAL((size_t)1, moved.size());
+	CHECK_EQUAL(string("x"), moved[0]);
+	moved = std::move(heap);
+	CHECK(heap.empty());
+	CHECK_EQUAL((size_t)2, moved.size());
+	CHECK_EQUAL(string("a"), moved[0]);
+	moved.clear();
+	CHECK(moved.empty());
+	/* the moved from vectors are usable again */
+	heap.push_back(string("y"));
+	CHECK_EQUAL(string("y"), heap[0]);
+}
+
+static string callIdOf(int i, bool second) {
+	return "callid-" + to_string(i) + (second ? "-b" : "");
+}
+
+static void bindContact(RegistrarDb &db, const url_t *url, const string &contact, const string &callId) {
+	SofiaHome home;
+	sip_contact_t *sipContact = sip_contact_make(home.h, contact.c_str());
+	RegistrarDb::BindParameters params(
+		RegistrarDb::BindParameters::SipParams(url, sipContact, callId.c_str(), 1, NULL, NULL), 3600, false);
+	auto listener = make_shared<FetchListener>();
+	db.bind(params, listener);
+	CHECK(listener->found);
+	CHECK_EQUAL(0, listener->errors);
+}
+
+static void clearAor(RegistrarDb &db, const string &aor, const string &callId) {
+	SofiaHome home;
+	sip_t sip;
+	memset(&sip, 0, sizeof(sip));
+	sip.sip_from = sip_from_make(home.h, ("<sip:" + aor + ">").c_str());
+	sip.sip_call_id = sip_call_id_make(home.h, callId.c_str());
+	sip.sip_cseq = sip_cseq_create(home.h, 2, sip_method_register, NULL);
+	auto listener = make_shared<FetchListener>();
+	db.clear(&sip, listener);
+	CHECK(!listener->found);
+	CHECK_EQUAL(0, listener->errors);
+}
+
+/* Fetches url from both registrars, and checks that they have the same record. Returns whether it was found. */
+static bool fetchBoth(RegistrarDb &internal, RegistrarDb &compact, const url_t *url) {
+	auto expected = make_shared<FetchListener>();
+	auto fetched = make_shared<FetchListener>();
+	internal.fetch(url, expected);
+	compact.fetch(url, fetched);
+	CHECK_EQUAL(expected->found, fetched->found);
+	if (expected->found && fetched->found) {
+		CHECK_EQUAL(expected->record->getKey(), fetched->record->getKey());
+		compare(*expected->record, *fetched->record);
+	}
+	return fetched->found;
+}
+
+static void test_same_as_internal() {
+	startSuite("same as internal");
+	SofiaHome home;
+	RegistrarDbInternal internal("");
+	RegistrarDbCompact compact("");
+	vector<url_t *> urls;
+	for (int i = 0; i < sAors; ++i) {
+		urls.push_back(url_make(home.h, ("sip:user" + to_string(i) + "@example.org").c_str()));
+	}
+
+	/* the contacts are stamped with the time of the bind: start on a new second so that both registrars see the
+	 * same one */
+	time_t start = getCurrentTime();
+	while (getCurrentTime() == start) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+	}
+	time_t now = getCurrentTime();
+	/* one aor in ten only has a contact expiring shortly, one in three has a second device */
+	for (int i = 0; i < sAors; ++i) {
+		string user = "user" + to_string(i);
+		string contact = "<sip:" + user + "@10.0." + to_string(i / 250) + "." + to_string(i % 250 + 1) + ":5060>";
+		if (i % 10 == 0)
+			contact += ";expires=5";
+		string second = "<sip:" + user + "@10.1." + to_string(i / 250) + "." + to_string(i % 250 + 1) + ":5060>";
+		for (RegistrarDb *db : {(RegistrarDb *)&internal, (RegistrarDb *)&compact}) {
+			bindContact(*db, urls[i], contact, callIdOf(i, false));
+			if (i % 3 == 0)
+				bindContact(*db, urls[i], second, callIdOf(i, true));
+		}
+	}
+	CHECK_EQUAL((size_t)sAors, compact.count());
+	CHECK(Tester::tableSize(compact) > 1024);
+	for (int i = 0; i < sAors; ++i) {
+		CHECK(fetchBoth(internal, compact, urls[i]));
+	}
+
+	/* erasing from wherever the aors are in their probe chains */
+	size_t remaining = sAors;
+	for (int i = 0; i < sAors; i += 7) {
+		string aor = "user" + to_string(i) + "@example.org";
+		clearAor(internal, aor, callIdOf(i, false));
+		clearAor(compact, aor, callIdOf(i, false));
+		remaining--;
+	}
+	CHECK_EQUAL(remaining, compact.count());
+	for (int i = 0; i < sAors; ++i) {
+		CHECK_EQUAL(i % 7 != 0, fetchBoth(internal, compact, urls[i]));
+	}
+
+	internal.removeExpired(now + 10);
+	compact.removeExpired(now + 10);
+	for (int i = 0; i < sAors; ++i) {
+		bool expired = (i % 10 == 0 && i % 3 != 0);
+		if (i % 7 != 0 && expired)
+			remaining--;
+		CHECK_EQUAL(i % 7 != 0 && !expired, fetchBoth(internal, compact, urls[i]));
+	}
+	CHECK_EQUAL(remaining, compact.count());
+
+	compact.clearAll();
+	CHECK_EQUAL((size_t)0, compact.count());
+	auto listener = make_shared<FetchListener>();
+	compact.fetch(urls[1], listener);
+	CHECK(!listener->found);
+}
+
+int main(int argc, char *argv[]) {
+	init_tests();
+	flexisip::log::updateFilter("%Severity% >= error");
+
+	test_probe_chain();
+	test_shared_hash_expiry();
+	test_string_pool();
+	test_small_vector();
+	test_same_as_internal();
+	return testResult();
+}
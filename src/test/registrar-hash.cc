@@ -0,0 +1,162 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Binds, refreshes and unregisters contacts of a record stored in the redis 'hash' layout, applying the writes
+ * computed for each bind to an in-memory hash, and checks that fetching the hash back gives the bound record. A
+ * refresh with the same Call-ID must rewrite the refreshed contact, as a single HSET. */
+
+#include "tester.hh"
+#include "../tools/tool_utils.hh"
+#include "../registrardb-redis.hh"
+
+#include <sofia-sip/sip_protos.h>
+
+using namespace std;
+
+static const string sKey = "alice@sip.example.org";
+static const time_t sNow = 1480000000;
+static const char *sDeviceA = "<sip:alice@10.0.0.1:5060;transport=tcp>;+sip.instance=\"<urn:uuid:a>\"";
+static const char *sDeviceB = "<sip:alice@10.0.0.2:5060;transport=tcp>;+sip.instance=\"<urn:uuid:b>\"";
+static const char *sDeviceBUnregister =
+	"<sip:alice@10.0.0.2:5060;transport=tcp>;+sip.instance=\"<urn:uuid:b>\";expires=0";
+
+/* The fs:<aor> hash, as stored by redis. */
+typedef map<string, string> Hash;
+
+/* Applies a bind to record, as handleBindHash() does, and writes its changes to hash. Returns the changes. */
+static RecordHashUpdate applyBind(RecordSerializer *serializer, Hash &hash, Record &record, const char *contact,
+								  const char *callId, uint32_t cseq, time_t now) {
+	SofiaHome home;
+	sip_contact_t *sipContact = sip_contact_make(home.h, contact);
+	set<string> storedFields;
+	for (auto it = hash.begin(); it != hash.end(); ++it) {
+		storedFields.insert(it->first);
+	}
+	RecordHashUpdate changes(record, storedFields);
+	record.clean(sipContact, callId, cseq, now, 0);
+	record.update(sipContact, NULL, 3600, callId, cseq, now, false, list<string>(), false);
+	changes.compare(record);
+	for (auto it = changes.removed().begin(); it != changes.removed().end(); ++it) {
+		hash.erase(*it);
+	}
+	for (auto it = changes.changed().begin(); it != changes.changed().end(); ++it) {
+		string serialized;
+		CHECK(RecordHashUpdate::serialize(serializer, sKey, *it, serialized));
+		hash[RecordHashUpdate::contactField(**it)] = serialized;
+	}
+	return changes;
+}
+
+/* Parses hash from a HGETALL reply, as handleFetch() does. */
+static void fetch(RecordSerializer *serializer, const Hash &hash, Record &record) {
+	vector<redisReply> elements(2 * hash.size());
+	vector<redisReply *> pointers;
+	for (auto it = hash.begin(); it != hash.end(); ++it) {
+		for (const string *str : {&it->first, &it->second}) {
+			redisReply &element = elements[pointers.size()];
+			memset(&element, 0, sizeof(element));
+			element.type = REDIS_REPLY_STRING;
+			element.str = const_cast<char *>(str->data());
+			element.len = str->length();
+			pointers.push_back(&element);
+		}
+	}
+	redisReply reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.type = REDIS_REPLY_ARRAY;
+	reply.elements = pointers.size();
+	reply.element = pointers.empty() ? NULL : &pointers[0];
+	set<string> fields;
+	CHECK(RecordHashUpdate::parse(serializer, &reply, &record, &fields));
+	CHECK_EQUAL(hash.size(), fields.size());
+}
+
+static shared_ptr<ExtendedContact> findContact(const Record &record, const string &callId) {
+	for (auto it = record.getExtendedContacts().begin(); it != record.getExtendedContacts().end(); ++it) {
+		if ((*it)->mCallId == callId)
+			return *it;
+	}
+	return shared_ptr<ExtendedContact>();
+}
+
+static void test_bind_refresh_fetch(const string &serializerName) {
+	startSuite(serializerName.c_str());
+	unique_ptr<RecordSerializer> serializer(RecordSerializer::create(serializerName));
+	Hash hash;
+	Record bound(sKey);
+
+	auto changes = applyBind(serializer.get(), hash, bound, sDeviceA, "call-a", 1, sNow);
+	CHECK_EQUAL(1u, changes.changed().size());
+	CHECK(!changes.isRefresh());
+	changes = applyBind(serializer.get(), hash, bound, sDeviceB, "call-b", 1, sNow);
+	CHECK_EQUAL(1u, changes.changed().size());
+	CHECK(!changes.isRefresh());
+	CHECK_EQUAL(2u, hash.size());
+	{
+		Record fetched(sKey);
+		fetch(serializer.get(), hash, fetched);
+		CHECK_EQUAL(2, fetched.count());
+		compare(*findContact(bound, "call-a"), *findContact(fetched, "call-a"));
+		compare(*findContact(bound, "call-b"), *findContact(fetched, "call-b"));
+	}
+
+	/* each refresh with the same Call-ID replaces the contact, whatever its address: the new one is written */
+	for (uint32_t cseq = 2; cseq < 20; ++cseq) {
+		Record fetched(sKey);
+		fetch(serializer.get(), hash, fetched);
+		time_t now = sNow + 10 * cseq;
+		changes = applyBind(serializer.get(), hash, fetched, sDeviceA, "call-a", cseq, now);
+		CHECK_EQUAL(1u, changes.changed().size());
+		CHECK(changes.removed().empty());
+		CHECK(changes.isRefresh());
+		Record refetched(sKey);
+		fetch(serializer.get(), hash, refetched);
+		auto refreshed = findContact(refetched, "call-a");
+		CHECK(refreshed);
+		if (refreshed) {
+			CHECK_EQUAL(cseq, refreshed->mCSeq);
+			CHECK_EQUAL(now + 3600, refreshed->mExpireAt);
+		}
+		CHECK_EQUAL(sNow + 3600, findContact(refetched, "call-b")->mExpireAt);
+	}
+
+	/* unregistering a contact deletes its field */
+	{
+		Record fetched(sKey);
+		fetch(serializer.get(), hash, fetched);
+		changes = applyBind(serializer.get(), hash, fetched, sDeviceBUnregister, "call-b", 2, sNow + 300);
+		CHECK(changes.changed().empty());
+		CHECK_EQUAL(1u, changes.removed().size());
+		CHECK(!changes.isRefresh());
+		Record refetched(sKey);
+		fetch(serializer.get(), hash, refetched);
+		CHECK_EQUAL(1, refetched.count());
+		CHECK(findContact(refetched, "call-a"));
+	}
+}
+
+int main(int argc, char *argv[]) {
+	init_tests();
+	flexisip::log::updateFilter("%Severity% >= error");
+
+	test_bind_refresh_fetch("c");
+	test_bind_refresh_fetch("json");
+	test_bind_refresh_fetch("binary");
+	return testResult();
+}
@@ -0,0 +1,188 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Writes records with several contacts to the registrar journal and snapshot, and checks that they are read back
+ * whole, including after a partially written frame or a snapshot interrupted before completion. */
+
+#include "tester.hh"
+#include "../tools/tool_utils.hh"
+#include "../registrardb-persistence.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+static Record *makeRecord(const string &key, int contacts) {
+	time_t now = 1480000000;
+	Record *record = new Record(key);
+	for (int c = 0; c < contacts; ++c) {
+		string device = "device" + to_string(c);
+		list<string> path{"<sip:proxy.example.org:5061;transport=tls;lr>"};
+		list<string> accept{"application/sdp", "text/plain"};
+		ExtendedContactCommon ecc(device.c_str(), path, ("callid-" + key + "-" + device).c_str(),
+								  ("urn:uuid:" + device).c_str());
+		string uri = "<sip:" + device + "@10.0.0." + to_string(c + 1) + ":5060;transport=tcp>";
+		record->update(ecc, uri.c_str(), now + 3600 + c, 1.0, 20 + c, now - c, false, accept, false);
+	}
+	return record;
+}
+
+static void clearRecords(map<string, Record *> &records) {
+	for (auto it = records.begin(); it != records.end(); ++it) {
+		delete it->second;
+	}
+	records.clear();
+}
+
+/* Loads the records persisted in dir and compares them with the expected ones. */
+static void checkLoaded(const string &dir, const map<string, Record *> &expected) {
+	RegistrarDbPersistence persistence(dir);
+	map<string, Record *> loaded;
+	CHECK(persistence.load(loaded));
+	CHECK_EQUAL(expected.size(), loaded.size());
+	for (auto it = expected.begin(); it != expected.end(); ++it) {
+		auto found = loaded.find(it->first);
+		CHECK(found != loaded.end());
+		if (found != loaded.end())
+			compare(*it->second, *found->second);
+	}
+	clearRecords(loaded);
+}
+
+static void test_journal(const string &dir) {
+	startSuite("journal");
+	map<string, Record *> records;
+	{
+		RegistrarDbPersistence persistence(dir);
+		CHECK(persistence.load(records));
+		CHECK(records.empty());
+		records["alice@sip.example.org"] = makeRecord("alice@sip.example.org", 3);
+		records["bob@sip.example.org"] = makeRecord("bob@sip.example.org", 2);
+		persistence.journalBind(*records["alice@sip.example.org"]);
+		persistence.journalBind(*records["bob@sip.example.org"]);
+	}
+	checkLoaded(dir, records);
+	clearRecords(records);
+}
+
+static void test_snapshot(const string &dir) {
+	startSuite("snapshot");
+	map<string, Record *> records;
+	{
+		RegistrarDbPersistence persistence(dir);
+		CHECK(persistence.load(records));
+		CHECK(persistence.snapshot(records));
+		Record *carol = makeRecord("carol@sip.example.org", 4);
+		persistence.journalBind(*carol);
+		records[carol->getKey()] = carol;
+		persistence.journalClear("bob@sip.example.org");
+		auto bob = records.find("bob@sip.example.org");
+		delete bob->second;
+		records.erase(bob);
+	}
+	checkLoaded(dir, records);
+	clearRecords(records);
+}
+
+static void test_truncated_frame(const string &dir) {
+	startSuite("truncated frame");
+	map<string, Record *> records;
+	{
+		RegistrarDbPersistence persistence(dir);
+		CHECK(persistence.load(records));
+	}
+	/* the beginning of a frame, as left by a process killed while writing it */
+	int fd = open((dir + "/registrar.journal").c_str(), O_WRONLY | O_APPEND);
+	CHECK(fd != -1);
+	CHECK(write(fd, "B\0\0\0\x10\0\0", 7) == 7);
+	close(fd);
+	{
+		/* the partial frame is cut, the next one is readable */
+		RegistrarDbPersistence persistence(dir);
+		map<string, Record *> loaded;
+		CHECK(persistence.load(loaded));
+		clearRecords(loaded);
+		Record *dave = makeRecord("dave@sip.example.org", 2);
+		persistence.journalBind(*dave);
+		records[dave->getKey()] = dave;
+	}
+	checkLoaded(dir, records);
+	clearRecords(records);
+}
+
+static void test_interrupted_snapshot(const string &dir) {
+	startSuite("interrupted snapshot");
+	map<string, Record *> records;
+	{
+		RegistrarDbPersistence persistence(dir);
+		CHECK(persistence.load(records));
+		Record *erin = makeRecord("erin@sip.example.org", 1);
+		persistence.journalBind(*erin);
+		records[erin->getKey()] = erin;
+	}
+	/* the journal set aside by a snapshot that was never written, as left by a process killed meanwhile */
+	string oldJournal = dir + "/registrar.journal.old";
+	CHECK(rename((dir + "/registrar.journal").c_str(), oldJournal.c_str()) == 0);
+	{
+		RegistrarDbPersistence persistence(dir);
+		map<string, Record *> loaded;
+		CHECK(persistence.load(loaded));
+		CHECK_EQUAL(records.size(), loaded.size());
+		clearRecords(loaded);
+		Record *frank = makeRecord("frank@sip.example.org", 3);
+		persistence.journalBind(*frank);
+		records[frank->getKey()] = frank;
+	}
+	checkLoaded(dir, records);
+	{
+		/* a complete snapshot includes it */
+		RegistrarDbPersistence persistence(dir);
+		map<string, Record *> loaded;
+		CHECK(persistence.load(loaded));
+		CHECK(persistence.snapshot(loaded));
+		clearRecords(loaded);
+	}
+	CHECK(access(oldJournal.c_str(), F_OK) != 0);
+	checkLoaded(dir, records);
+	clearRecords(records);
+}
+
+int main(int argc, char *argv[]) {
+	init_tests();
+	flexisip::log::updateFilter("%Severity% >= error");
+
+	char dir[] = "/tmp/flexisip-persistence-XXXXXX";
+	if (!mkdtemp(dir)) {
+		cerr << "Could not create a temporary directory" << endl;
+		return -1;
+	}
+	test_journal(dir);
+	test_snapshot(dir);
+	test_truncated_frame(dir);
+	test_interrupted_snapshot(dir);
+
+	unlink((string(dir) + "/registrar.snapshot").c_str());
+	unlink((string(dir) + "/registrar.journal").c_str());
+	unlink((string(dir) + "/registrar.journal.old").c_str());
+	rmdir(dir);
+	return testResult();
+}
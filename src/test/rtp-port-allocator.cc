@@ -0,0 +1,185 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Takes and releases RTP/RTCP port pairs of a small range on the loopback interface, checking that they stay within
+ * the range, are handed out in turn, skip the ports bound by someone else, and that the exhaustion is counted. */
+
+#include "tester.hh"
+#include "loopback.hh"
+#include "../tools/tool_utils.hh"
+#include "../mediarelay.hh"
+
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <ctime>
+#include <ortp/ortp.h>
+#include <set>
+#include <unistd.h>
+
+using namespace std;
+
+static const int sPairs = 8;
+
+static bool inRange(int port, int minPort) {
+	return port >= minPort && port + 1 < minPort + 2 * sPairs && port % 2 == 0;
+}
+
+static void test_exhaustion(StatCounter64 &exhausted) {
+	startSuite("exhaustion");
+	int minPort = pickRange();
+	RtpPortAllocator allocator(minPort, minPort + 2 * sPairs, &exhausted);
+	vector<RtpSession *> sessions;
+	set<int> ports;
+	for (int i = 0; i < sPairs; ++i) {
+		RtpSession *session = allocator.take(sLoopback);
+		int port = rtp_session_get_local_port(session);
+		CHECK(inRange(port, minPort));
+		ports.insert(port);
+		sessions.push_back(session);
+	}
+	CHECK_EQUAL((size_t)sPairs, ports.size());
+
+	/* the range is exhausted: an unbound session is given and counted */
+	uint64_t before = exhausted.read();
+	RtpSession *unbound = allocator.take(sLoopback);
+	CHECK(rtp_session_get_local_port(unbound) <= 0);
+	CHECK_EQUAL(before + 1, exhausted.read());
+	allocator.release(sLoopback, unbound);
+
+	/* a released pair can be taken again */
+	int port = rtp_session_get_local_port(sessions.back());
+	allocator.release(sLoopback, sessions.back());
+	sessions.back() = allocator.take(sLoopback);
+	CHECK_EQUAL(port, rtp_session_get_local_port(sessions.back()));
+	for (auto session : sessions) {
+		allocator.release(sLoopback, session);
+	}
+}
+
+static void test_turn(StatCounter64 &exhausted) {
+	startSuite("turn");
+	int minPort = pickRange();
+	RtpPortAllocator allocator(minPort, minPort + 2 * sPairs, &exhausted);
+	RtpSession *first = allocator.take(sLoopback);
+	int firstPort = rtp_session_get_local_port(first);
+	allocator.release(sLoopback, first);
+
+	/* the released pair is reused only after all the other ones */
+	vector<RtpSession *> sessions;
+	for (int i = 1; i < sPairs; ++i) {
+		sessions.push_back(allocator.take(sLoopback));
+		int port = rtp_session_get_local_port(sessions.back());
+		CHECK(inRange(port, minPort));
+		CHECK(port != firstPort);
+	}
+	sessions.push_back(allocator.take(sLoopback));
+	CHECK_EQUAL(firstPort, rtp_session_get_local_port(sessions.back()));
+	for (auto session : sessions) {
+		allocator.release(sLoopback, session);
+	}
+}
+
+static void test_port_in_use(StatCounter64 &exhausted) {
+	startSuite("port in use");
+	int minPort = pickRange();
+	/* another program holds the RTCP port of the third pair */
+	int busyPort = minPort + 5;
+	int sock = bindLoopback(busyPort);
+	if (sock == -1) {
+		cerr << "Could not bind port " << busyPort << ", skipped" << endl;
+		return;
+	}
+
+	RtpPortAllocator allocator(minPort, minPort + 2 * sPairs, &exhausted);
+	vector<RtpSession *> sessions;
+	for (int i = 1; i < sPairs; ++i) {
+		sessions.push_back(allocator.take(sLoopback));
+		int port = rtp_session_get_local_port(sessions.back());
+		CHECK(inRange(port, minPort));
+		CHECK(port != busyPort - 1);
+	}
+	/* only the busy pair is left */
+	RtpSession *unbound = allocator.take(sLoopback);
+	CHECK(rtp_session_get_local_port(unbound) <= 0);
+	allocator.release(sLoopback, unbound);
+	close(sock);
+	for (auto session : sessions) {
+		allocator.release(sLoopback, session);
+	}
+}
+
+static void test_prebound(StatCounter64 &exhausted) {
+	startSuite("prebound");
+	int minPort = pickRange();
+	RtpPortAllocator allocator(minPort, minPort + 2 * sPairs, &exhausted);
+	/* only the interfaces added or used so far are filled */
+	vector<RtpSession *> sessions;
+	sessions.push_back(allocator.take(sLoopback));
+	allocator.fill(sPairs);
+
+	/* all the remaining pairs are prebound, and handed out before the range is reported exhausted */
+	set<int> ports;
+	ports.insert(rtp_session_get_local_port(sessions.back()));
+	for (int i = 1; i < sPairs; ++i) {
+		sessions.push_back(allocator.take(sLoopback));
+		int port = rtp_session_get_local_port(sessions.back());
+		CHECK(inRange(port, minPort));
+		ports.insert(port);
+	}
+	CHECK_EQUAL((size_t)sPairs, ports.size());
+	RtpSession *unbound = allocator.take(sLoopback);
+	CHECK(rtp_session_get_local_port(unbound) <= 0);
+	allocator.release(sLoopback, unbound);
+	for (auto session : sessions) {
+		allocator.release(sLoopback, session);
+	}
+}
+
+static void test_added_interface(StatCounter64 &exhausted) {
+	startSuite("added interface");
+	int minPort = pickRange();
+	RtpPortAllocator allocator(minPort, minPort + 2 * sPairs, &exhausted);
+	/* an interface known in advance is filled before any session is taken from it */
+	allocator.addInterface(sLoopback);
+	allocator.fill(sPairs);
+	int bound = 0;
+	for (int port = minPort; port < minPort + 2 * sPairs; port += 2) {
+		int sock = bindLoopback(port);
+		if (sock == -1)
+			bound++;
+		else
+			close(sock);
+	}
+	CHECK_EQUAL(sPairs, bound);
+}
+
+int main(int argc, char *argv[]) {
+	init_tests();
+	flexisip::log::updateFilter("%Severity% >= fatal");
+	ortp_init();
+	srand(time(NULL) ^ getpid());
+
+	StatCounter64 exhausted("count-ports-exhausted", "Number of streams that could not get a port.", 0);
+	test_exhaustion(exhausted);
+	test_turn(exhausted);
+	test_port_in_use(exhausted);
+	test_prebound(exhausted);
+	test_added_interface(exhausted);
+	return testResult();
+}
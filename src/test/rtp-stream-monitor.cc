@@ -0,0 +1,216 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Feeds RTP and RTCP packets to the stream monitor and checks the loss, jitter and delay it writes in the call
+ * quality reports, measured by the relay or reported by the receiver in its RTCP RR and XR. */
+
+#include "tester.hh"
+#include "../rtp-stream-monitor.hh"
+
+#include <sstream>
+#include <vector>
+
+using namespace std;
+
+static const uint32_t sCallerSsrc = 0x11111111;
+static const uint32_t sCalleeSsrc = 0x22222222;
+
+static void put16(vector<uint8_t> &packet, uint16_t value) {
+	packet.push_back((uint8_t)(value >> 8));
+	packet.push_back((uint8_t)value);
+}
+
+static void put32(vector<uint8_t> &packet, uint32_t value) {
+	put16(packet, (uint16_t)(value >> 16));
+	put16(packet, (uint16_t)value);
+}
+
+static vector<uint8_t> rtpPacket(uint16_t seq, uint32_t ts, uint32_t ssrc) {
+	vector<uint8_t> packet{0x80, 0};
+	put16(packet, seq);
+	put32(packet, ts);
+	put32(packet, ssrc);
+	packet.resize(packet.size() + 160, 0xff);
+	return packet;
+}
+
+/* Sets the RTCP length field of the packet starting at offset, from its actual size. */
+static void setLength(vector<uint8_t> &packet, size_t offset) {
+	uint16_t words = (uint16_t)((packet.size() - offset) / 4 - 1);
+	packet[offset + 2] = (uint8_t)(words >> 8);
+	packet[offset + 3] = (uint8_t)words;
+}
+
+static vector<uint8_t> senderReport(uint32_t ssrc, uint32_t ntpSeconds, uint32_t ntpFraction) {
+	vector<uint8_t> packet{0x80, 200, 0, 0};
+	put32(packet, ssrc);
+	put32(packet, ntpSeconds);
+	put32(packet, ntpFraction);
+	put32(packet, 0); /* rtp timestamp */
+	put32(packet, 0); /* packet count */
+	put32(packet, 0); /* octet count */
+	setLength(packet, 0);
+	return packet;
+}
+
+static vector<uint8_t> receiverReport(uint32_t ssrc, uint32_t source, uint32_t jitter, uint32_t lsr, uint32_t dlsr) {
+	vector<uint8_t> packet{0x81, 201, 0, 0};
+	put32(packet, ssrc);
+	put32(packet, source);
+	put32(packet, 0); /* fraction and cumulative number lost */
+	put32(packet, 0); /* extended highest sequence number */
+	put32(packet, jitter);
+	put32(packet, lsr);
+	put32(packet, dlsr);
+	setLength(packet, 0);
+	return packet;
+}
+
+static vector<uint8_t> voipMetrics(uint32_t ssrc, uint32_t source) {
+	vector<uint8_t> packet{0x80, 207, 0, 0};
+	put32(packet, ssrc);
+	size_t block = packet.size();
+	packet.push_back(7); /* VoIP metrics */
+	packet.push_back(0);
+	put16(packet, 8);
+	put32(packet, source);
+	packet.push_back(26); /* loss rate, 10.2% */
+	packet.push_back(13); /* discard rate, 5.1% */
+	packet.push_back(0); /* burst density */
+	packet.push_back(0); /* gap density */
+	put16(packet, 0); /* burst duration */
+	put16(packet, 0); /* gap duration */
+	put16(packet, 120); /* round trip delay */
+	put16(packet, 40); /* end system delay */
+	packet.push_back((uint8_t)-20); /* signal level */
+	packet.push_back((uint8_t)-60); /* noise level */
+	packet.push_back(127); /* RERL */
+	packet.push_back(16); /* Gmin */
+	packet.push_back(127); /* R factor */
+	packet.push_back(127); /* external R factor */
+	packet.push_back(41); /* MOS-LQ */
+	packet.push_back(39); /* MOS-CQ */
+	packet.push_back(0x20); /* rx config, adaptive jitter buffer */
+	packet.push_back(0);
+	put16(packet, 60); /* jitter buffer nominal */
+	put16(packet, 100); /* jitter buffer maximum */
+	put16(packet, 200); /* jitter buffer absolute maximum */
+	CHECK_EQUAL((size_t)36, packet.size() - block);
+	setLength(packet, 0);
+	return packet;
+}
+
+static string metrics(const RtpStreamMonitor &monitor) {
+	ostringstream ost;
+	monitor.writeMetrics(ost);
+	return ost.str();
+}
+
+static bool contains(const string &text, const string &part) {
+	if (text.find(part) != string::npos)
+		return true;
+	cerr << "\"" << part << "\" not found in:" << endl << text << endl;
+	return false;
+}
+
+/* Sends count packets 20ms apart from seq, skipping those for which lost returns true. */
+template <typename LostT>
+static void sendStream(RtpStreamMonitor &monitor, uint16_t seq, int count, LostT lost, uint64_t now = 0) {
+	for (int i = 0; i < count; ++i, ++seq) {
+		if (lost(i))
+			continue;
+		vector<uint8_t> packet = rtpPacket(seq, 160 * (uint32_t)i, sCallerSsrc);
+		monitor.onRtp(packet.data(), packet.size(), now + 20000 * (uint64_t)i);
+	}
+}
+
+static void test_loss() {
+	startSuite("loss");
+	RtpStreamMonitor monitor;
+	monitor.setPayload(0, "PCMU", 8000);
+	sendStream(monitor, 1000, 100, [](int i) { return i % 10 == 5; });
+	CHECK(monitor.hasRtp());
+	CHECK_EQUAL(sCallerSsrc, monitor.getSsrc());
+	string text = metrics(monitor);
+	CHECK(contains(text, "SessionDesc: PT=0 PD=PCMU SR=8000\r\n"));
+	CHECK(contains(text, "PacketLoss: NLR=10.0\r\n"));
+	/* steady packets have no jitter */
+	CHECK(contains(text, " IAJ=0\r\n"));
+
+	/* the sequence numbers wrap around */
+	RtpStreamMonitor wrapping;
+	sendStream(wrapping, 65500, 100, [](int i) { return i % 20 == 1; });
+	CHECK(contains(metrics(wrapping), "PacketLoss: NLR=5.0\r\n"));
+}
+
+static void test_jitter() {
+	startSuite("jitter");
+	RtpStreamMonitor monitor;
+	monitor.setPayload(8, "PCMA", 8000);
+	/* one packet over two arrives 10ms late: 80 timestamp units of transit difference each time */
+	for (int i = 0; i < 500; ++i) {
+		vector<uint8_t> packet = rtpPacket((uint16_t)i, 160 * (uint32_t)i, sCallerSsrc);
+		monitor.onRtp(packet.data(), packet.size(), 20000 * (uint64_t)i + (i % 2) * 10000);
+	}
+	string text = metrics(monitor);
+	/* the estimate tends to 80 units, 10ms, from below */
+	CHECK(text.find(" IAJ=9\r\n") != string::npos || text.find(" IAJ=10\r\n") != string::npos);
+	CHECK(contains(text, "PacketLoss: NLR=0.0\r\n"));
+}
+
+static void test_reports() {
+	startSuite("reports");
+	RtpStreamMonitor caller, callee;
+	sendStream(caller, 0, 50, [](int i) { return false; });
+
+	/* the caller sends a SR at 1s, the callee reports on the caller stream 175ms later, having held the SR 125ms */
+	uint64_t srTime = 1000000;
+	vector<uint8_t> sr = senderReport(sCallerSsrc, 0x12345678, 0x9abcdef0);
+	caller.onRtcp(sr.data(), sr.size(), srTime, &callee);
+	uint32_t lsr = (0x5678 << 16) | 0x9abc;
+	vector<uint8_t> rr = receiverReport(sCalleeSsrc, sCallerSsrc, 240, lsr, 65536 / 8);
+	callee.onRtcp(rr.data(), rr.size(), srTime + 175000, &caller);
+	string text = metrics(caller);
+	CHECK(contains(text, "Delay: RTD=50 IAJ=30\r\n"));
+
+	/* reports about another stream, or truncated, are ignored */
+	vector<uint8_t> foreign = receiverReport(sCalleeSsrc, 0x33333333, 800, 0, 0);
+	callee.onRtcp(foreign.data(), foreign.size(), srTime + 200000, &caller);
+	vector<uint8_t> truncated = receiverReport(sCalleeSsrc, sCallerSsrc, 800, 0, 0);
+	truncated.resize(truncated.size() - 4);
+	callee.onRtcp(truncated.data(), truncated.size(), srTime + 200000, &caller);
+	CHECK(contains(metrics(caller), " IAJ=30\r\n"));
+
+	/* the VoIP metrics of the callee take over from what the relay measured */
+	vector<uint8_t> xr = voipMetrics(sCalleeSsrc, sCallerSsrc);
+	callee.onRtcp(xr.data(), xr.size(), srTime + 300000, &caller);
+	text = metrics(caller);
+	CHECK(contains(text, "JitterBuffer: JBA=2 JBN=60 JBM=100 JBX=200\r\n"));
+	CHECK(contains(text, "PacketLoss: NLR=10.2 JDR=5.1\r\n"));
+	CHECK(contains(text, "Delay: RTD=120 ESD=40 IAJ=30\r\n"));
+	CHECK(contains(text, "Signal: SL=-20 NL=-60\r\n"));
+	CHECK(contains(text, "QualityEst: MOSLQ=4.1 MOSCQ=3.9\r\n"));
+}
+
+int main(int argc, char *argv[]) {
+	test_loss();
+	test_jitter();
+	test_reports();
+	return testResult();
+}
@@ -0,0 +1,145 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Checks the nonce counts shared by the SIP workers: a count used in a forked worker is seen by the others, a nonce
+ * used with the same count by several workers at once is accepted by only one of them, and expired or evicted nonces
+ * are unknown. */
+
+#include "tester.hh"
+#include "../utils/shared-nonce-table.hh"
+
+#include <memory>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static const time_t sNow = 1480000000;
+
+/* Runs body in a forked process, as a worker, and returns its exit status. */
+template <typename Body>
+static int inWorker(Body body) {
+	pid_t pid = fork();
+	if (pid == 0)
+		_exit(body());
+	int status = -1;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void test_counts() {
+	startSuite("counts");
+	unique_ptr<SharedNonceTable> table(SharedNonceTable::create(64));
+	CHECK(table);
+	CHECK_EQUAL(-1, table->getNc("abcd", sNow));
+	table->insert("abcd", sNow + 60);
+	CHECK_EQUAL(0, table->getNc("abcd", sNow));
+	CHECK_EQUAL(0, table->updateNc("abcd", 1, sNow));
+	CHECK_EQUAL(1, table->updateNc("abcd", 1, sNow));
+	CHECK_EQUAL(1, table->getNc("abcd", sNow));
+	CHECK_EQUAL(1, table->updateNc("abcd", 3, sNow));
+	/* a lower count is refused and does not move the count back */
+	CHECK_EQUAL(3, table->updateNc("abcd", 2, sNow));
+	CHECK_EQUAL(3, table->getNc("abcd", sNow));
+	/* inserting again restarts the count */
+	table->insert("abcd", sNow + 60);
+	CHECK_EQUAL(0, table->getNc("abcd", sNow));
+	CHECK_EQUAL(-1, table->getNc("abcd", sNow + 61));
+	CHECK_EQUAL(-1, table->updateNc("abcd", 1, sNow + 61));
+	table->erase("abcd");
+	CHECK_EQUAL(-1, table->getNc("abcd", sNow));
+	/* too long to be stored: always unknown */
+	string longNonce(SharedNonceTable::sMaxNonceSize + 1, 'n');
+	table->insert(longNonce, sNow + 60);
+	CHECK_EQUAL(-1, table->getNc(longNonce, sNow));
+}
+
+static void test_workers() {
+	startSuite("workers");
+	unique_ptr<SharedNonceTable> table(SharedNonceTable::create(64));
+	/* issued by a worker, used by another */
+	CHECK_EQUAL(0, inWorker([&]() {
+		table->insert("issued-by-1", sNow + 60);
+		return 0;
+	}));
+	CHECK_EQUAL(0, inWorker([&]() { return table->updateNc("issued-by-1", 1, sNow); }));
+	/* the request replayed through a third worker is refused */
+	CHECK_EQUAL(1, inWorker([&]() { return table->updateNc("issued-by-1", 1, sNow); }));
+	CHECK_EQUAL(1, table->getNc("issued-by-1", sNow));
+	/* unknown to all the workers */
+	CHECK_EQUAL(-1, table->getNc("never-issued", sNow));
+}
+
+static void test_concurrent_replay() {
+	startSuite("concurrent replay");
+	unique_ptr<SharedNonceTable> table(SharedNonceTable::create(4096));
+	const int workers = 8, rounds = 200;
+	for (int i = 0; i < rounds; ++i) {
+		table->insert("nonce-" + to_string(i), sNow + 60);
+	}
+	/* each worker tries every nonce with nc=1, and exits with the number of nonces it got accepted */
+	vector<pid_t> pids;
+	for (int w = 0; w < workers; ++w) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			int accepted = 0;
+			for (int i = 0; i < rounds; ++i) {
+				if (table->updateNc("nonce-" + to_string(i), 1, sNow) == 0)
+					accepted++;
+			}
+			_exit(accepted);
+		}
+		pids.push_back(pid);
+	}
+	int accepted = 0;
+	for (auto it = pids.begin(); it != pids.end(); ++it) {
+		int status = 0;
+		waitpid(*it, &status, 0);
+		accepted += WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+	}
+	CHECK_EQUAL(rounds, accepted);
+}
+
+static void test_eviction() {
+	startSuite("eviction");
+	/* a single bucket */
+	unique_ptr<SharedNonceTable> table(SharedNonceTable::create(SharedNonceTable::sWays));
+	CHECK_EQUAL(SharedNonceTable::sWays, table->capacity());
+	for (size_t i = 0; i < SharedNonceTable::sWays; ++i) {
+		table->insert("nonce-" + to_string(i), sNow + 100 + i);
+	}
+	/* the nonce expiring first makes room */
+	table->insert("extra", sNow + 1000);
+	CHECK_EQUAL(-1, table->getNc("nonce-0", sNow));
+	CHECK_EQUAL(0, table->getNc("nonce-1", sNow));
+	CHECK_EQUAL(0, table->getNc("extra", sNow));
+	/* then the next one */
+	table->insert("late", sNow + 1000);
+	CHECK_EQUAL(-1, table->getNc("nonce-1", sNow));
+	CHECK_EQUAL(0, table->getNc("nonce-2", sNow));
+}
+
+int main(int argc, char *argv[]) {
+	test_counts();
+	test_workers();
+	test_concurrent_replay();
+	test_eviction();
+	return testResult();
+}
@@ -0,0 +1,109 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Updates StatCounter64 from more threads than it has slots, and checks that no update is lost, that a reader running
+ * meanwhile sees the value grow, and that decrements and set() keep the sum right. */
+
+#include "tester.hh"
+#include "../configmanager.hh"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const int sThreads = 24;
+
+static void test_single_thread() {
+	startSuite("single thread");
+	StatCounter64 counter("single", "Counter updated by a single thread.", 1);
+	CHECK_EQUAL((uint64_t)0, counter.read());
+	counter++;
+	++counter;
+	counter.add(10);
+	CHECK_EQUAL((uint64_t)12, counter.read());
+	counter--;
+	CHECK_EQUAL((uint64_t)11, counter.read());
+	counter.set(1000);
+	CHECK_EQUAL((uint64_t)1000, counter.read());
+	counter.incr();
+	CHECK_EQUAL((uint64_t)1001, counter.read());
+}
+
+static void test_concurrent_increments() {
+	startSuite("concurrent increments");
+	StatCounter64 counter("increments", "Counter updated by many threads.", 2);
+	const uint64_t increments = 200000;
+	atomic<int> running(sThreads);
+	vector<thread> threads;
+	for (int t = 0; t < sThreads; ++t) {
+		threads.emplace_back([&counter, &running, increments]() {
+			for (uint64_t i = 0; i < increments; ++i) {
+				if (i % 2)
+					counter++;
+				else
+					counter.add(2);
+			}
+			running--;
+		});
+	}
+	/* the exporter reads the counter while the threads update it */
+	uint64_t last = 0;
+	bool ordered = true;
+	while (running > 0) {
+		uint64_t value = counter.read();
+		ordered = ordered && value >= last;
+		last = value;
+	}
+	for (auto it = threads.begin(); it != threads.end(); ++it) {
+		it->join();
+	}
+	CHECK(ordered);
+	CHECK_EQUAL(sThreads * increments / 2 * 3, counter.read());
+}
+
+static void test_concurrent_decrements() {
+	startSuite("concurrent decrements");
+	/* a gauge like use: each thread decrements more than it incremented in its own slot */
+	StatCounter64 counter("decrements", "Counter incremented and decremented by many threads.", 3);
+	counter.set(sThreads * 1000);
+	vector<thread> threads;
+	for (int t = 0; t < sThreads; ++t) {
+		threads.emplace_back([&counter]() {
+			for (int i = 0; i < 500; ++i) {
+				counter++;
+			}
+			for (int i = 0; i < 1500; ++i) {
+				counter--;
+			}
+		});
+	}
+	for (auto it = threads.begin(); it != threads.end(); ++it) {
+		it->join();
+	}
+	CHECK_EQUAL((uint64_t)0, counter.read());
+}
+
+int main(int argc, char *argv[]) {
+	test_single_thread();
+	test_concurrent_increments();
+	test_concurrent_decrements();
+	return testResult();
+}
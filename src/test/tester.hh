@@ -0,0 +1,55 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <iostream>
+
+/* Checks for the unit test programs: a failed check is reported and the test goes on, so that a run shows all the
+ * failures. The program returns testResult(). */
+
+static int sTestFailures = 0;
+
+#define CHECK(test)                                                                                                    \
+	do {                                                                                                               \
+		if (!(test)) {                                                                                                 \
+			std::cerr << "[KO] " << __FILE__ << ":" << __LINE__ << " " << #test << std::endl;                          \
+			sTestFailures++;                                                                                           \
+		}                                                                                                              \
+	} while (0)
+
+#define CHECK_EQUAL(expected, actual)                                                                                  \
+	do {                                                                                                               \
+		auto _expected = (expected);                                                                                   \
+		auto _actual = (actual);                                                                                       \
+		if (!(_expected == _actual)) {                                                                                 \
+			std::cerr << "[KO] " << __FILE__ << ":" << __LINE__ << " " << #actual << " is " << _actual                 \
+					  << ", expected " << _expected << std::endl;                                                      \
+			sTestFailures++;                                                                                           \
+		}                                                                                                              \
+	} while (0)
+
+static inline void startSuite(const char *name) {
+	std::cerr << "Suite " << name << std::endl;
+}
+
+static inline int testResult() {
+	std::cerr << (sTestFailures ? "[KO] " : "[OK] ") << sTestFailures << " failed checks" << std::endl;
+	return sTestFailures != 0;
+}
@@ -0,0 +1,135 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Checks that the timing wheel expires each key at its deadline, whatever the level it is placed on. */
+
+#include "tester.hh"
+#include "../utils/timingwheel.hh"
+
+#include <map>
+#include <vector>
+
+using namespace std;
+
+/* Advances the wheel second by second up to now, recording when each key expired. */
+static void advanceTo(TimingWheel<int> &wheel, time_t from, time_t now, map<int, time_t> &expired) {
+	for (time_t t = from + 1; t <= now; ++t) {
+		wheel.advance(t, [&expired, t](int key, time_t when) {
+			CHECK(when <= t);
+			expired[key] = t;
+		});
+	}
+}
+
+static void test_levels() {
+	startSuite("levels");
+	const time_t start = 1000000;
+	/* deadlines on each level, the slot boundaries of each one and beyond the last level */
+	vector<time_t> delays{1, 2, 63, 64, 65, 100, 4095, 4096, 4097, 200000, 262143, 262144,
+						  16777215, 16777216, 20000000};
+	TimingWheel<int> wheel(start);
+	for (size_t i = 0; i < delays.size(); ++i) {
+		wheel.schedule((int)i, start + delays[i]);
+	}
+	CHECK_EQUAL(delays.size(), wheel.size());
+
+	map<int, time_t> expired;
+	for (size_t i = 0; i < delays.size(); ++i) {
+		time_t deadline = start + delays[i];
+		/* nothing expires a second early, in a single call for the long waits */
+		wheel.advance(deadline - 1, [&expired, deadline](int key, time_t when) { expired[key] = deadline - 1; });
+		CHECK(expired.find((int)i) == expired.end());
+		advanceTo(wheel, deadline - 1, deadline, expired);
+		CHECK_EQUAL(deadline, expired[(int)i]);
+		CHECK(!wheel.contains((int)i));
+	}
+	CHECK_EQUAL(delays.size(), expired.size());
+	CHECK_EQUAL((size_t)0, wheel.size());
+}
+
+static void test_reschedule() {
+	startSuite("reschedule");
+	const time_t start = 5000;
+	TimingWheel<int> wheel(start);
+	map<int, time_t> expired;
+
+	/* a new deadline replaces the previous one, earlier or later, even on another level */
+	wheel.schedule(1, start + 10);
+	wheel.schedule(1, start + 5000);
+	wheel.schedule(2, start + 5000);
+	wheel.schedule(2, start + 3);
+	CHECK_EQUAL((size_t)2, wheel.size());
+	advanceTo(wheel, start, start + 5000, expired);
+	CHECK_EQUAL(start + 5000, expired[1]);
+	CHECK_EQUAL(start + 3, expired[2]);
+
+	/* a cancelled key never expires */
+	time_t now = start + 5000;
+	expired.clear();
+	wheel.schedule(3, now + 70);
+	wheel.schedule(4, now + 70);
+	wheel.cancel(3);
+	wheel.cancel(5);
+	CHECK(!wheel.contains(3));
+	advanceTo(wheel, now, now + 100, expired);
+	CHECK(expired.find(3) == expired.end());
+	CHECK_EQUAL(now + 70, expired[4]);
+}
+
+static void test_past_deadline() {
+	startSuite("past deadline");
+	const time_t start = 100;
+	TimingWheel<int> wheel(start);
+	map<int, time_t> expired;
+	wheel.schedule(1, start - 50);
+	wheel.schedule(2, start);
+	advanceTo(wheel, start, start + 1, expired);
+	CHECK_EQUAL(start + 1, expired[1]);
+	CHECK_EQUAL(start + 1, expired[2]);
+}
+
+static void test_schedule_from_callback() {
+	startSuite("schedule from callback");
+	const time_t start = 0;
+	TimingWheel<int> wheel(start);
+	int count = 0;
+	time_t last = 0;
+	wheel.schedule(1, start + 1);
+	/* a key scheduled again by its own expiry, as refreshed registrations are */
+	for (time_t t = start + 1; t <= start + 10000; ++t) {
+		wheel.advance(t, [&](int key, time_t when) {
+			count++;
+			last = t;
+			wheel.schedule(key, t + 100);
+		});
+	}
+	CHECK_EQUAL(100, count);
+	CHECK_EQUAL(start + 10001 - 100, last);
+	CHECK(wheel.contains(1));
+	wheel.clear();
+	CHECK_EQUAL((size_t)0, wheel.size());
+}
+
+int main(int argc, char *argv[]) {
+	test_levels();
+	test_reschedule();
+	test_past_deadline();
+	test_schedule_from_callback();
+	return testResult();
+}
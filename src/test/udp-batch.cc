@@ -0,0 +1,129 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Relays bursts of datagrams between loopback sockets with UdpBatch, reading an edge-triggered socket until EAGAIN as
+ * the relay does, and checks that every packet is forwarded once, in order, whatever the size of the bursts, and that
+ * dropped packets are not sent. */
+
+#include "tester.hh"
+#include "../utils/udp-batch.hh"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+using namespace std;
+
+static int createSocket(struct sockaddr_in &addr) {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	int size = 1024 * 1024;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	getsockname(sock, (struct sockaddr *)&addr, &len);
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	return sock;
+}
+
+static void sendSequence(int sock, const struct sockaddr_in &to, uint32_t first, int count) {
+	for (uint32_t seq = first; seq < first + count; ++seq) {
+		sendto(sock, &seq, sizeof(seq), 0, (const struct sockaddr *)&to, sizeof(to));
+	}
+}
+
+/* Forwards the packets waiting on relay to sink until EAGAIN, dropping the odd ones if asked. Returns the number of
+ * batches read. */
+static int forward(int relay, const struct sockaddr_in &sink, UdpBatch &batch, bool dropOdd) {
+	int batches = 0;
+	int count;
+	while ((count = batch.receive(relay)) != -1) {
+		batches++;
+		for (int n = 0; n < count; ++n) {
+			uint32_t seq;
+			memcpy(&seq, batch.data(n), sizeof(seq));
+			if (dropOdd && seq % 2)
+				batch.drop(n);
+		}
+		batch.send(relay, (const struct sockaddr *)&sink, sizeof(sink), [](uint8_t *, size_t) { return true; });
+	}
+	CHECK(errno == EAGAIN || errno == EWOULDBLOCK);
+	return batches;
+}
+
+/* Reads the sequence numbers received by sink and checks that they follow each other by step from first. Returns the
+ * number received. */
+static int checkReceived(int sink, uint32_t first, uint32_t step) {
+	uint32_t expected = first;
+	int received = 0;
+	uint32_t seq;
+	while (recv(sink, &seq, sizeof(seq), 0) == sizeof(seq)) {
+		CHECK_EQUAL(expected, seq);
+		expected = seq + step;
+		received++;
+	}
+	return received;
+}
+
+static void test_bursts() {
+	startSuite("bursts");
+	struct sockaddr_in sourceAddr, relayAddr, sinkAddr;
+	int source = createSocket(sourceAddr);
+	int relay = createSocket(relayAddr);
+	int sink = createSocket(sinkAddr);
+	int epfd = epoll_create1(0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = relay;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, relay, &ev);
+	UdpBatch batch;
+
+	uint32_t next = 0;
+	for (int burst : {1, 5, UdpBatch::sMaxPackets - 1, UdpBatch::sMaxPackets, UdpBatch::sMaxPackets + 1,
+					  3 * UdpBatch::sMaxPackets + 7}) {
+		sendSequence(source, relayAddr, next, burst);
+		CHECK_EQUAL(1, epoll_wait(epfd, &ev, 1, 1000));
+		int batches = forward(relay, sinkAddr, batch, false);
+		CHECK(batches >= (burst + UdpBatch::sMaxPackets - 1) / UdpBatch::sMaxPackets);
+		CHECK_EQUAL(burst, checkReceived(sink, next, 1));
+		next += burst;
+		/* drained: no event is pending any more */
+		CHECK_EQUAL(0, epoll_wait(epfd, &ev, 1, 0));
+	}
+
+	/* dropped packets are not sent */
+	sendSequence(source, relayAddr, 1000, 2 * UdpBatch::sMaxPackets);
+	CHECK_EQUAL(1, epoll_wait(epfd, &ev, 1, 1000));
+	forward(relay, sinkAddr, batch, true);
+	CHECK_EQUAL(UdpBatch::sMaxPackets, checkReceived(sink, 1000, 2));
+
+	close(epfd);
+	close(source);
+	close(relay);
+	close(sink);
+}
+
+int main(int argc, char *argv[]) {
+	test_bursts();
+	return testResult();
+}
@@ -0,0 +1,140 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compares the memory used by the in-memory registrar implementations, and their bind and fetch throughput.
+ * Usage: flexisip_registrar_bench [aors] [contacts per aor]
+ * Each implementation runs in its own process, so that its memory usage is measured from a clean heap.*/
+
+#include "tool_utils.hh"
+#include "../registrardb-internal.hh"
+#include "../registrardb-compact.hh"
+#include "../registrardb.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+struct CountingListener : public RegistrarDbListener {
+	unsigned long found = 0;
+	unsigned long contacts = 0;
+	virtual void onRecordFound(Record *r) {
+		if (r) {
+			found++;
+			contacts += r->count();
+		}
+	}
+	virtual void onError() {
+		BAD("RegistrarDbListener:error");
+	}
+	virtual void onInvalid() {
+		BAD("RegistrarDbListener:invalid");
+	}
+};
+
+static long residentKb() {
+	long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double elapsed(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+template <typename RegistrarT>
+static void run(const char *name, int aors, int contactsPerAor) {
+	long before = residentKb();
+	RegistrarT *registrar = new RegistrarT("sip:proxy.example.org;lr");
+	auto listener = make_shared<CountingListener>();
+	const list<string> paths{"<sip:edge1.example.org;lr>", "<sip:proxy.example.org;lr>"};
+	char user[64], uri[64], callid[64];
+
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < aors; ++i) {
+		SofiaHome home;
+		snprintf(user, sizeof(user), "user%d", i);
+		url_t *from = url_format(home.h, "sip:%s@example.org", user);
+		sip_path_t *path = path_fromstl(home.h, paths);
+		sip_accept_t *accept = sip_accept_make(home.h, "application/sdp");
+		for (int c = 0; c < contactsPerAor; ++c) {
+			snprintf(uri, sizeof(uri), "sip:%s@192.168.%d.%d:%d;transport=tls", user, (i >> 8) & 0xff, i & 0xff,
+					 5060 + c);
+			snprintf(callid, sizeof(callid), "call-%d-%d", i, c);
+			sip_contact_t *contact = sip_contact_format(
+				home.h, "<%s>;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-%06d%06d>\";expires=3600", uri, i, c);
+			RegistrarDb::BindParameters params(
+				RegistrarDb::BindParameters::SipParams(from, contact, callid, 1, path, accept), 3600, false);
+			registrar->bind(params, listener);
+		}
+	}
+	double bindTime = elapsed(start);
+	long used = residentKb() - before;
+
+	listener->found = listener->contacts = 0;
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < aors; ++i) {
+		SofiaHome home;
+		url_t *url = url_format(home.h, "sip:user%d@example.org", i);
+		registrar->fetch(url, listener);
+	}
+	double fetchTime = elapsed(start);
+	if (listener->found != (unsigned long)aors)
+		BAD(name << ": " << listener->found << " aors found instead of " << aors);
+
+	cout << name << ": " << used << " kB (" << (used * 1024 / ((long)aors * contactsPerAor)) << " bytes per contact), "
+		 << (long)(aors * contactsPerAor / bindTime) << " binds/s, " << (long)(aors / fetchTime) << " fetches/s"
+		 << endl;
+	registrar->clearAll();
+	delete registrar;
+}
+
+template <typename RegistrarT>
+static void runInChild(const char *name, int aors, int contactsPerAor) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		run<RegistrarT>(name, aors, contactsPerAor);
+		exit(0);
+	}
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		BAD(name << " benchmark failed");
+}
+
+int main(int argc, char **argv) {
+	init_tests();
+	flexisip::log::updateFilter("%Severity% >= error");
+
+	int aors = argc > 1 ? atoi(argv[1]) : 100000;
+	int contactsPerAor = argc > 2 ? atoi(argv[2]) : 2;
+	if (aors <= 0 || contactsPerAor <= 0 || contactsPerAor > Record::sMaxContacts)
+		BAD("usage: " << argv[0] << " [aors] [contacts per aor, at most " << Record::sMaxContacts << "]");
+
+	cout << aors << " aors, " << contactsPerAor << " contacts each" << endl;
+	runInChild<RegistrarDbInternal>("internal", aors, contactsPerAor);
+	runInChild<RegistrarDbCompact>("compact", aors, contactsPerAor);
+	return 0;
+}
@@ -0,0 +1,174 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measures the packets per second the media relay can forward, with one system call per packet as before and with
+ * the recvmmsg()/sendmmsg() batches of UdpBatch. Each stream is a relay socket receiving bursts of RTP sized packets
+ * and forwarding them to a sink, the relay sockets being watched by an edge-triggered epoll set like in
+ * MediaRelayServer. Only the forwarding is timed.
+ * Usage: flexisip_relay_bench [streams] [rounds] [packets per burst]*/
+
+#include "tool_utils.hh"
+#include "../utils/udp-batch.hh"
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iomanip>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static const size_t sPacketSize = 172; /* 20ms of G.711 and the RTP header */
+
+static int createSocket(struct sockaddr_in &addr) {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock == -1)
+		BAD("socket(): " << strerror(errno));
+	int size = 4 * 1024 * 1024;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || getsockname(sock, (struct sockaddr *)&addr, &len))
+		BAD("bind(): " << strerror(errno));
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	return sock;
+}
+
+struct Result {
+	unsigned long packets;
+	unsigned long syscalls;
+	double seconds;
+};
+
+/* Forwards the packets waiting on sock to sink, returns their number. */
+static int forwardSingle(int sock, const struct sockaddr_in &sink, unsigned long &syscalls) {
+	uint8_t buf[1500];
+	int count = 0;
+	for (;;) {
+		syscalls++;
+		ssize_t len = recv(sock, buf, sizeof(buf), 0);
+		if (len < 0)
+			break;
+		syscalls++;
+		sendto(sock, buf, len, 0, (const struct sockaddr *)&sink, sizeof(sink));
+		count++;
+	}
+	return count;
+}
+
+/* Same as forwardSingle() by batches, reading until EAGAIN as MediaRelayServer does. */
+static int forwardBatch(int sock, const struct sockaddr_in &sink, UdpBatch &batch, unsigned long &syscalls) {
+	int count = 0;
+	for (;;) {
+		syscalls++;
+		int received = batch.receive(sock);
+		if (received <= 0)
+			break;
+		syscalls++;
+		batch.send(sock, (const struct sockaddr *)&sink, sizeof(sink), [](uint8_t *data, size_t size) {
+			return true;
+		});
+		count += received;
+	}
+	return count;
+}
+
+static Result run(bool batched, int streams, int rounds, int burst) {
+	Result result = {0, 0, 0};
+	struct sockaddr_in senderAddr, sinkAddr;
+	int sender = createSocket(senderAddr);
+	int sink = createSocket(sinkAddr);
+	int epollFd = epoll_create1(0);
+	vector<int> relays(streams);
+	vector<struct sockaddr_in> relayAddrs(streams);
+	for (int s = 0; s < streams; ++s) {
+		relays[s] = createSocket(relayAddrs[s]);
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.fd = relays[s];
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, relays[s], &ev);
+	}
+
+	UdpBatch batch;
+	uint8_t packet[sPacketSize];
+	memset(packet, 0x80, sizeof(packet));
+	uint8_t drain[1500];
+	struct epoll_event events[128];
+	for (int r = 0; r < rounds; ++r) {
+		for (int s = 0; s < streams; ++s) {
+			for (int p = 0; p < burst; ++p) {
+				sendto(sender, packet, sizeof(packet), 0, (const struct sockaddr *)&relayAddrs[s], sizeof(relayAddrs[s]));
+			}
+		}
+
+		long expected = (long)streams * burst;
+		auto start = chrono::steady_clock::now();
+		while (expected > 0) {
+			result.syscalls++;
+			int count = epoll_wait(epollFd, events, 128, 100);
+			if (count <= 0)
+				break; /* some packets were lost */
+			for (int e = 0; e < count; ++e) {
+				int forwarded = batched ? forwardBatch(events[e].data.fd, sinkAddr, batch, result.syscalls)
+										: forwardSingle(events[e].data.fd, sinkAddr, result.syscalls);
+				result.packets += forwarded;
+				expected -= forwarded;
+			}
+		}
+		result.seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		while (recv(sink, drain, sizeof(drain), 0) > 0) {
+		}
+	}
+
+	for (int s = 0; s < streams; ++s) {
+		close(relays[s]);
+	}
+	close(epollFd);
+	close(sender);
+	close(sink);
+	return result;
+}
+
+int main(int argc, char **argv) {
+	init_tests();
+	int streams = argc > 1 ? atoi(argv[1]) : 500;
+	int rounds = argc > 2 ? atoi(argv[2]) : 200;
+	int burst = argc > 3 ? atoi(argv[3]) : 8;
+	if (streams <= 0 || rounds <= 0 || burst <= 0)
+		BAD("usage: " << argv[0] << " [streams] [rounds] [packets per burst]");
+
+	cout << left << setw(10) << "mode" << right << setw(10) << "streams" << setw(12) << "packets" << setw(14)
+		 << "packets/s" << setw(16) << "syscalls/pkt" << endl;
+	cout << fixed << setprecision(2);
+	const bool modes[] = {false, true};
+	for (bool batched : modes) {
+		Result result = run(batched, streams, rounds, burst);
+		cout << left << setw(10) << (batched ? "batch" : "single") << right << setw(10) << streams << setw(12)
+			 << result.packets << setw(14) << (long)(result.packets / result.seconds) << setw(16)
+			 << (double)result.syscalls / result.packets << endl;
+	}
+	return 0;
+}
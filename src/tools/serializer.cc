@@ -97,6 +97,49 @@ int test_bind_without_ecc(ExtendedContactCommon &ecc, const unique_ptr<RecordSer
 	return 0;
 }
 
+/* A record with several contacts differing in every field, as a user registered from several devices. */
+int test_multiple_contacts(const unique_ptr<RecordSerializer> &serializer, time_t now) {
+	Record initial("key");
+	for (int i = 0; i < 4; ++i) {
+		string device = "device" + to_string(i);
+		list<string> path;
+		for (int p = 0; p < i; ++p) {
+			path.push_back("<sip:proxy" + to_string(p) + ".example.org;lr>");
+		}
+		list<string> accept{"application/sdp"};
+		ExtendedContactCommon ecc(("10.0.0." + to_string(i + 1) + ":5060").c_str(), path,
+								  ("callid-" + device).c_str(), ("urn:uuid:" + device).c_str());
+		string contact = "sip:" + device + "@10.0.0." + to_string(i + 1) + ":5060;transport=tcp";
+		initial.update(ecc, contact.c_str(), now + 1000 + i, 1.0f - 0.25f * i, 100 + i, now - i, i == 3, accept,
+					   false);
+	}
+	if (initial.getExtendedContacts().size() != 4) {
+		cerr << "Initial record has " << initial.getExtendedContacts().size() << " contacts" << endl;
+		return -1;
+	}
+
+	string serialized;
+	if (!serializer->serialize(&initial, serialized, true)) {
+		cerr << "Failed serializing" << endl;
+		return -1;
+	}
+
+	Record final("key");
+	if (!serializer->parse(serialized, &final)) {
+		cerr << "Failed parsing" << endl;
+		return -1;
+	}
+
+	/* every contact is compared, in order */
+	if (!compare(initial, final)) {
+		cerr << "Initial and final records differ" << endl;
+		return -1;
+	}
+
+	cerr << "success : test_multiple_contacts" << endl;
+	return 0;
+}
+
 SofiaHome home;
 
 int main(int argc, char **argv) {
@@ -140,6 +183,10 @@ int main(int argc, char **argv) {
 		BAD("failure in bind without ecc");
 	}
 
+	if (test_multiple_contacts(serializer, now)) {
+		BAD("failure with multiple contacts");
+	}
+
 	cout << "success" << endl;
 	return 0;
 }
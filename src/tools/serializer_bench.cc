@@ -0,0 +1,206 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measures the record serializers on generated records of 1 to 50 contacts: serialize and parse throughput, size of
+ * the serialized records and heap allocations per operation.
+ * Usage: flexisip_serializer_bench [iterations] [serializer...]
+ * Without serializer names, all the ones compiled in are measured. Records are generated the same way on each run,
+ * so that results can be compared between builds.*/
+
+#include "tool_utils.hh"
+#include "../recordserializer.hh"
+#include "../registrardb.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+static unsigned long sAllocations = 0;
+
+void *operator new(size_t size) {
+	sAllocations++;
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+static double elapsed(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/* Contacts like the ones of mobile clients: gruu and push parameters, a few proxies in the path and several accept
+ * headers. */
+static void fillRecord(Record &record, int contacts, unsigned int seed) {
+	time_t now = 1480000000;
+	char buffer[512];
+	for (int c = 0; c < contacts; ++c) {
+		unsigned int n = seed * 7919 + c * 104729;
+		snprintf(buffer, sizeof(buffer), "urn:uuid:%08x-%04x-4%03x-8%03x-%012x", n, n & 0xffff, n & 0xfff,
+				 (n >> 12) & 0xfff, n * 31);
+		string instance = buffer;
+		snprintf(buffer, sizeof(buffer),
+				 "<sip:user%u@10.%u.%u.%u:%u;transport=tls;pn-type=apple;pn-tok=%08x%08x%08x%08x;"
+				 "pn-msg-str=IM_MSG;pn-call-str=IC_MSG;app-id=org.linphone.phone.prod;gr=%s>",
+				 seed, (n >> 16) & 0xff, (n >> 8) & 0xff, n & 0xff, 1024 + n % 60000, n, n * 3, n * 5, n * 7,
+				 instance.c_str());
+		string uri = buffer;
+		snprintf(buffer, sizeof(buffer), "%u-%u-%08x", seed, c, n);
+		string callId = buffer;
+		list<string> path;
+		for (unsigned int p = 0; p < 2 + n % 4; ++p) {
+			snprintf(buffer, sizeof(buffer), "<sip:proxy%u.sip.example.org:5061;transport=tls;lr;ob;fs-conn-id=%08x>",
+					 p, n + p);
+			path.push_back(buffer);
+		}
+		list<string> accept{"application/sdp", "text/plain", "message/external-body",
+							"application/vnd.gsma.rcs-ft-http+xml", "message/imdn+xml"};
+		ExtendedContactCommon ecc(("\"<" + instance + ">\"").c_str(), path, callId.c_str(), instance.c_str());
+		record.update(ecc, uri.c_str(), now + 3600 + c, 1.0, 20 + c, now - c, false, accept, c % 2 == 0);
+	}
+}
+
+struct Result {
+	double serializeRate;
+	double parseRate;
+	unsigned long bytes;
+	double serializeAllocations;
+	double parseAllocations;
+};
+
+/* Measures serializer on records, returns false without measuring if they don't come back whole from it. */
+static bool run(RecordSerializer &serializer, const vector<Record *> &records, int iterations, Result &result) {
+	result = {0, 0, 0, 0, 0};
+	vector<string> serialized(records.size());
+	for (size_t i = 0; i < records.size(); ++i) {
+		if (!serializer.serialize(records[i], serialized[i])) {
+			cerr << "serialization of " << records[i]->getKey() << " failed" << endl;
+			return false;
+		}
+		result.bytes += serialized[i].size();
+		Record parsed(records[i]->getKey());
+		if (!serializer.parse(serialized[i], &parsed)) {
+			cerr << "parsing of " << records[i]->getKey() << " failed" << endl;
+			return false;
+		}
+		if (parsed.count() != records[i]->count()) {
+			cerr << "parsing of " << records[i]->getKey() << " gave " << parsed.count() << " contacts instead of "
+				 << records[i]->count() << endl;
+			return false;
+		}
+	}
+	result.bytes /= records.size();
+
+	unsigned long ops = (unsigned long)iterations * records.size();
+	string out;
+	unsigned long allocations = sAllocations;
+	auto start = chrono::steady_clock::now();
+	for (int it = 0; it < iterations; ++it) {
+		for (size_t i = 0; i < records.size(); ++i) {
+			serializer.serialize(records[i], out);
+		}
+	}
+	result.serializeRate = ops / elapsed(start);
+	result.serializeAllocations = (double)(sAllocations - allocations) / ops;
+
+	allocations = sAllocations;
+	start = chrono::steady_clock::now();
+	for (int it = 0; it < iterations; ++it) {
+		for (size_t i = 0; i < records.size(); ++i) {
+			Record parsed(records[i]->getKey());
+			serializer.parse(serialized[i], &parsed);
+		}
+	}
+	result.parseRate = ops / elapsed(start);
+	result.parseAllocations = (double)(sAllocations - allocations) / ops;
+	return true;
+}
+
+int main(int argc, char **argv) {
+	init_tests();
+	flexisip::log::updateFilter("%Severity% >= error");
+	Record::sMaxContacts = 50;
+
+	int iterations = argc > 1 ? atoi(argv[1]) : 200;
+	if (iterations <= 0)
+		BAD("usage: " << argv[0] << " [iterations] [serializer...]");
+	vector<string> names;
+	for (int i = 2; i < argc; ++i) {
+		names.push_back(argv[i]);
+	}
+	if (names.empty()) {
+		names = {"c", "json", "binary"};
+#if ENABLE_PROTOBUF
+		names.push_back("protobuf");
+#endif
+#if ENABLE_MSGPACK
+		names.push_back("msgpack");
+#endif
+	}
+
+	/* a hundred records per size, so that the measures don't depend on a single record */
+	const int sizes[] = {1, 5, 20, 50};
+	vector<vector<Record *>> records;
+	for (int size : sizes) {
+		records.emplace_back();
+		for (int r = 0; r < 100; ++r) {
+			Record *record = new Record("user" + to_string(r) + "@sip.example.org");
+			fillRecord(*record, size, r);
+			records.back().push_back(record);
+		}
+	}
+
+	cout << left << setw(10) << "format" << setw(10) << "contacts" << right << setw(12) << "bytes" << setw(14)
+		 << "serialize/s" << setw(12) << "allocs" << setw(12) << "parse/s" << setw(12) << "allocs" << endl;
+	cout << fixed << setprecision(1);
+	bool failed = false;
+	for (auto name = names.begin(); name != names.end(); ++name) {
+		unique_ptr<RecordSerializer> serializer(RecordSerializer::create(*name));
+		if (!serializer)
+			BAD("unknown serializer " << *name);
+		for (size_t s = 0; s < records.size(); ++s) {
+			Result result;
+			/* keep the number of contacts handled per size constant */
+			if (!run(*serializer, records[s], max(1, iterations * 50 / sizes[s] / 100), result)) {
+				/* the other serializers are still measured */
+				cout << left << setw(10) << *name << setw(10) << sizes[s] << right << setw(12) << "failed" << endl;
+				failed = true;
+				continue;
+			}
+			cout << left << setw(10) << *name << setw(10) << sizes[s] << right << setw(12) << result.bytes
+				 << setw(14) << (long)result.serializeRate << setw(12) << result.serializeAllocations << setw(12)
+				 << (long)result.parseRate << setw(12) << result.parseAllocations << endl;
+		}
+	}
+
+	for (auto it = records.begin(); it != records.end(); ++it) {
+		for (auto rit = it->begin(); rit != it->end(); ++rit) {
+			delete *rit;
+		}
+	}
+	return failed ? -1 : 0;
+}
@@ -80,12 +80,15 @@ bool compare(const ExtendedContact &ec1, const ExtendedContact &ec2) {
 }
 
 bool compare(const Record &r1, const Record &r2) {
-	auto ec1 = r1.getExtendedContacts();
-	auto ec2 = r2.getExtendedContacts();
+	const auto &ec1 = r1.getExtendedContacts();
+	const auto &ec2 = r2.getExtendedContacts();
 	if (ec1.size() != ec2.size())
 		BAD("ecc size :" << ec1.size() << " / " << ec2.size());
 
-	return compare(firstContact(r1), firstContact(r2));
+	for (auto it1 = ec1.cbegin(), it2 = ec2.cbegin(); it1 != ec1.cend(); ++it1, ++it2) {
+		compare(**it1, **it2);
+	}
+	return true;
 }
 
 sip_path_t *path_fromstl(su_home_t *h, const std::list<std::string> &path) {
@@ -0,0 +1,130 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+ * Lock-free queue of fixed capacity, for any number of producer and consumer threads.
+ * Each cell holds a sequence number telling whether it is ready to be written or read at a given position, so that
+ * pushing and popping only contend on the position counters (D. Vyukov's bounded queue).
+ * The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class BoundedQueue {
+  public:
+	BoundedQueue(size_t capacity) : mCells(roundUp(capacity)), mMask(mCells.size() - 1) {
+		for (size_t i = 0; i < mCells.size(); ++i) {
+			mCells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+	BoundedQueue(const BoundedQueue &) = delete;
+	BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+	size_t capacity() const {
+		return mCells.size();
+	}
+
+	/* Returns false, leaving value untouched, if the queue is full. */
+	bool tryPush(T &&value) {
+		size_t pos = mPushPos.value.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell &cell = mCells[pos & mMask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (mPushPos.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.value = std::move(value);
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = mPushPos.value.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/* Returns false if the queue is empty. */
+	bool tryPop(T &value) {
+		size_t pos = mPopPos.value.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell &cell = mCells[pos & mMask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (mPopPos.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					value = std::move(cell.value);
+					cell.value = T();
+					cell.sequence.store(pos + mMask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = mPopPos.value.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/* Only a hint when other threads are pushing or popping. */
+	bool empty() const {
+		return mPushPos.value.load(std::memory_order_seq_cst) == mPopPos.value.load(std::memory_order_seq_cst);
+	}
+
+  private:
+	struct Cell {
+		Cell() : sequence(0) {
+		}
+		Cell(Cell &&other) : sequence(other.sequence.load()), value(std::move(other.value)) {
+		}
+		std::atomic<size_t> sequence;
+		T value;
+	};
+	static size_t roundUp(size_t capacity) {
+		/*stops at the highest power of two rather than overflowing, a wrapped negative value would never end*/
+		const size_t highest = ~(SIZE_MAX >> 1);
+		size_t size = 2;
+		while (size < capacity && size < highest)
+			size <<= 1;
+		return size;
+	}
+
+	static const size_t sCacheLineSize = 64;
+	/* padded on both sides rather than aligned: alignas() would make the owner of the queue over-aligned, which a plain
+	 * new does not support before C++17 */
+	struct Position {
+		Position() : value(0) {
+		}
+		char before[sCacheLineSize - sizeof(std::atomic<size_t>)];
+		std::atomic<size_t> value;
+		char after[sCacheLineSize - sizeof(std::atomic<size_t>)];
+	};
+
+	std::vector<Cell> mCells;
+	const size_t mMask;
+	/* on separate cache lines, as producers and consumers update them concurrently */
+	Position mPushPos;
+	Position mPopPos;
+};
@@ -0,0 +1,113 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Histogram of durations in microseconds with log-linear buckets: each power of two is split into sSubBuckets equal
+ * buckets, so that percentiles are known within 1/sSubBuckets of their value whatever their magnitude, in a fixed
+ * amount of memory. Recording is a handful of instructions, computing a percentile walks the buckets.
+ * Values beyond 2^sMaxBits microseconds fall in the last bucket.
+ * Values are recorded by a single thread, and can be read from any other one: the buckets are atomic, updated without
+ * read-modify-write since there is one writer.
+ */
+class LatencyHistogram {
+  public:
+	LatencyHistogram() {
+		reset();
+	}
+
+	void record(uint64_t value) {
+		std::atomic<uint64_t> &bucket = mCounts[bucketOf(value)];
+		bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (value > mMax.load(std::memory_order_relaxed))
+			mMax.store(value, std::memory_order_relaxed);
+		/* released after the bucket, so that readers of the count see at least as many samples in the buckets */
+		mCount.store(mCount.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	uint64_t count() const {
+		return mCount.load(std::memory_order_acquire);
+	}
+
+	uint64_t max() const {
+		return mMax.load(std::memory_order_relaxed);
+	}
+
+	/* Upper bound of the bucket holding the given percentile (between 0 and 100), 0 if nothing was recorded. */
+	uint64_t percentile(double percent) const {
+		uint64_t total = count();
+		if (total == 0)
+			return 0;
+		uint64_t rank = (uint64_t)(percent / 100.0 * total + 0.5);
+		if (rank == 0)
+			rank = 1;
+		uint64_t highest = max();
+		uint64_t seen = 0;
+		for (int i = 0; i < sBuckets; ++i) {
+			seen += mCounts[i].load(std::memory_order_relaxed);
+			if (seen >= rank && i < sBuckets - 1) {
+				uint64_t bound = upperBoundOf(i);
+				return bound < highest ? bound : highest;
+			}
+		}
+		return highest;
+	}
+
+	/* Not to be called while a value is recorded. */
+	void reset() {
+		for (int i = 0; i < sBuckets; ++i) {
+			mCounts[i].store(0, std::memory_order_relaxed);
+		}
+		mCount.store(0, std::memory_order_relaxed);
+		mMax.store(0, std::memory_order_relaxed);
+	}
+
+  private:
+	static const int sSubBucketBits = 3;
+	static const int sSubBuckets = 1 << sSubBucketBits;
+	static const int sMaxBits = 40;
+	/* values below sSubBuckets have a bucket each, then sSubBuckets buckets per power of two */
+	static const int sBuckets = (sMaxBits - sSubBucketBits + 1) * sSubBuckets;
+
+	static int bucketOf(uint64_t value) {
+		if (value < (uint64_t)sSubBuckets)
+			return (int)value;
+		int msb = 63 - __builtin_clzll(value);
+		if (msb >= sMaxBits)
+			return sBuckets - 1;
+		int shift = msb - sSubBucketBits;
+		return (shift + 1) * sSubBuckets + (int)((value >> shift) & (sSubBuckets - 1));
+	}
+
+	static uint64_t upperBoundOf(int bucket) {
+		int octave = bucket / sSubBuckets;
+		uint64_t sub = bucket % sSubBuckets;
+		if (octave == 0)
+			return sub;
+		int shift = octave - 1;
+		return ((sSubBuckets + sub + 1) << shift) - 1;
+	}
+
+	std::atomic<uint64_t> mCounts[sBuckets];
+	std::atomic<uint64_t> mCount;
+	std::atomic<uint64_t> mMax;
+};
@@ -0,0 +1,145 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "shared-nonce-table.hh"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+
+using namespace std;
+
+SharedNonceTable *SharedNonceTable::create(size_t capacity) {
+	size_t buckets = (capacity + sWays - 1) / sWays;
+	if (buckets == 0)
+		buckets = 1;
+	size_t size = sizeof(Header) + buckets * sWays * sizeof(Entry);
+	void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return NULL;
+	/* the mapping is zero filled: all the entries are free */
+	Header *header = static_cast<Header *>(memory);
+	header->buckets = buckets;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	int err = pthread_mutex_init(&header->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (err != 0) {
+		munmap(memory, size);
+		return NULL;
+	}
+	return new SharedNonceTable(memory, size);
+}
+
+SharedNonceTable::SharedNonceTable(void *memory, size_t size)
+	: mMemory(memory), mSize(size), mHeader(static_cast<Header *>(memory)),
+	  mEntries(reinterpret_cast<Entry *>(static_cast<char *>(memory) + sizeof(Header))) {
+}
+
+SharedNonceTable::~SharedNonceTable() {
+	munmap(mMemory, mSize);
+}
+
+size_t SharedNonceTable::capacity() const {
+	return mHeader->buckets * sWays;
+}
+
+void SharedNonceTable::lock() {
+	if (pthread_mutex_lock(&mHeader->mutex) == EOWNERDEAD) {
+		/* A worker died while holding the lock. An operation only writes the entry it was given, which is at worst
+		 * left with a stale count: the table stays usable. */
+		pthread_mutex_consistent(&mHeader->mutex);
+	}
+}
+
+void SharedNonceTable::unlock() {
+	pthread_mutex_unlock(&mHeader->mutex);
+}
+
+/* FNV-1a, identical in all the workers. */
+SharedNonceTable::Entry *SharedNonceTable::bucketOf(const string &nonce) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < nonce.size(); ++i) {
+		hash ^= (unsigned char)nonce[i];
+		hash *= 1099511628211ULL;
+	}
+	return &mEntries[(hash % mHeader->buckets) * sWays];
+}
+
+SharedNonceTable::Entry *SharedNonceTable::find(const string &nonce, time_t now) {
+	if (nonce.empty() || nonce.size() > sMaxNonceSize)
+		return NULL;
+	Entry *bucket = bucketOf(nonce);
+	for (size_t i = 0; i < sWays; ++i) {
+		Entry &entry = bucket[i];
+		if (entry.nonce[0] != '\0' && nonce == entry.nonce)
+			return now > entry.expires ? NULL : &entry;
+	}
+	return NULL;
+}
+
+void SharedNonceTable::insert(const string &nonce, time_t expires) {
+	if (nonce.empty() || nonce.size() > sMaxNonceSize)
+		return;
+	lock();
+	Entry *bucket = bucketOf(nonce);
+	Entry *slot = NULL;
+	for (size_t i = 0; i < sWays; ++i) {
+		Entry &entry = bucket[i];
+		if (entry.nonce[0] != '\0' && nonce == entry.nonce) {
+			slot = &entry;
+			break;
+		}
+		/* a free entry, otherwise the one expiring first */
+		if (!slot || (slot->nonce[0] != '\0' && (entry.nonce[0] == '\0' || entry.expires < slot->expires)))
+			slot = &entry;
+	}
+	memcpy(slot->nonce, nonce.c_str(), nonce.size() + 1);
+	slot->nc = 0;
+	slot->expires = expires;
+	unlock();
+}
+
+int SharedNonceTable::getNc(const string &nonce, time_t now) {
+	lock();
+	Entry *entry = find(nonce, now);
+	int nc = entry ? entry->nc : -1;
+	unlock();
+	return nc;
+}
+
+int SharedNonceTable::updateNc(const string &nonce, int nc, time_t now) {
+	lock();
+	Entry *entry = find(nonce, now);
+	int previous = entry ? entry->nc : -1;
+	if (entry && nc > previous)
+		entry->nc = nc;
+	unlock();
+	return previous;
+}
+
+void SharedNonceTable::erase(const string &nonce) {
+	lock();
+	Entry *entry = find(nonce, 0);
+	if (entry)
+		entry->nonce[0] = '\0';
+	unlock();
+}
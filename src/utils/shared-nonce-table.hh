@@ -0,0 +1,74 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <ctime>
+#include <pthread.h>
+#include <string>
+
+/**
+ * Nonce counts of the digest authentication, kept in memory shared by the SIP worker processes, so that a nonce
+ * used through one worker can't be replayed with the same count through another.
+ * The table is mapped before the workers are forked and inherited by all of them. It is a fixed number of buckets of
+ * sWays entries, protected by a process-shared mutex. A nonce inserted in a full bucket replaces its expired entries
+ * first, then the one expiring first: the client of an evicted nonce is challenged again.
+ */
+class SharedNonceTable {
+  public:
+	/* Returns NULL if the memory can't be mapped. */
+	static SharedNonceTable *create(size_t capacity);
+	~SharedNonceTable();
+	SharedNonceTable(const SharedNonceTable &) = delete;
+	SharedNonceTable &operator=(const SharedNonceTable &) = delete;
+
+	size_t capacity() const;
+	/* Starts counting nonce from 0, until expires. Nonces longer than sMaxNonceSize are not stored. */
+	void insert(const std::string &nonce, time_t expires);
+	/* Returns the count of nonce, -1 if it is unknown or expired. */
+	int getNc(const std::string &nonce, time_t now);
+	/* Stores nc as the count of nonce if it is greater than the current one, as a single operation for all the
+	 * workers. Returns the previous count, -1 if the nonce is unknown or expired. */
+	int updateNc(const std::string &nonce, int nc, time_t now);
+	void erase(const std::string &nonce);
+
+	static const size_t sMaxNonceSize = 63;
+	static const size_t sWays = 8;
+
+  private:
+	struct Entry {
+		char nonce[sMaxNonceSize + 1]; /* empty for a free entry */
+		int nc;
+		time_t expires;
+	};
+	struct Header {
+		pthread_mutex_t mutex;
+		size_t buckets;
+	};
+	SharedNonceTable(void *memory, size_t size);
+	void lock();
+	void unlock();
+	Entry *bucketOf(const std::string &nonce);
+	Entry *find(const std::string &nonce, time_t now);
+
+	void *mMemory;
+	size_t mSize;
+	Header *mHeader;
+	Entry *mEntries;
+};
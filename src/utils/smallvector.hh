@@ -0,0 +1,145 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Vector storing up to N elements inline, and its elements contiguously on the heap beyond.
+ * Only what is needed by its users is implemented: it can be moved but not copied.
+ */
+template <typename T, size_t N>
+class SmallVector {
+  public:
+	SmallVector() : mData(inlineData()), mSize(0), mCapacity(N) {
+	}
+	SmallVector(SmallVector &&other) noexcept : mData(inlineData()), mSize(0), mCapacity(N) {
+		steal(other);
+	}
+	SmallVector &operator=(SmallVector &&other) noexcept {
+		if (this != &other) {
+			release();
+			steal(other);
+		}
+		return *this;
+	}
+	SmallVector(const SmallVector &) = delete;
+	SmallVector &operator=(const SmallVector &) = delete;
+	~SmallVector() {
+		release();
+	}
+
+	size_t size() const {
+		return mSize;
+	}
+	bool empty() const {
+		return mSize == 0;
+	}
+	T &operator[](size_t i) {
+		return mData[i];
+	}
+	const T &operator[](size_t i) const {
+		return mData[i];
+	}
+	T *begin() {
+		return mData;
+	}
+	T *end() {
+		return mData + mSize;
+	}
+	const T *begin() const {
+		return mData;
+	}
+	const T *end() const {
+		return mData + mSize;
+	}
+
+	void push_back(T &&value) {
+		if (mSize == mCapacity)
+			grow(mCapacity * 2);
+		new (mData + mSize) T(std::move(value));
+		mSize++;
+	}
+	/* Removes the element at index i, keeping the order of the others. */
+	void erase(size_t i) {
+		for (size_t j = i; j + 1 < mSize; ++j) {
+			mData[j] = std::move(mData[j + 1]);
+		}
+		mSize--;
+		mData[mSize].~T();
+	}
+	void clear() {
+		for (size_t i = 0; i < mSize; ++i) {
+			mData[i].~T();
+		}
+		mSize = 0;
+	}
+
+  private:
+	T *inlineData() {
+		return reinterpret_cast<T *>(mInline);
+	}
+	bool isInline() const {
+		return mData == reinterpret_cast<const T *>(mInline);
+	}
+	void grow(size_t capacity) {
+		T *data = static_cast<T *>(::operator new(capacity * sizeof(T)));
+		for (size_t i = 0; i < mSize; ++i) {
+			new (data + i) T(std::move(mData[i]));
+			mData[i].~T();
+		}
+		if (!isInline())
+			::operator delete(mData);
+		mData = data;
+		mCapacity = capacity;
+	}
+	void release() {
+		clear();
+		if (!isInline())
+			::operator delete(mData);
+		mData = inlineData();
+		mCapacity = N;
+	}
+	/* Takes the elements of other, which is left empty. */
+	void steal(SmallVector &other) {
+		if (other.isInline()) {
+			for (size_t i = 0; i < other.mSize; ++i) {
+				new (mData + i) T(std::move(other.mData[i]));
+			}
+			mSize = other.mSize;
+			other.clear();
+		} else {
+			mData = other.mData;
+			mSize = other.mSize;
+			mCapacity = other.mCapacity;
+			other.mData = other.inlineData();
+			other.mSize = 0;
+			other.mCapacity = N;
+		}
+	}
+
+	typename std::aligned_storage<sizeof(T), alignof(T)>::type mInline[N];
+	T *mData;
+	uint32_t mSize;
+	uint32_t mCapacity;
+};
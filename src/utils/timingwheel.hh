@@ -0,0 +1,164 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <ctime>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+/**
+ * Hierarchical timing wheel with a resolution of one second.
+ * Each key has at most one pending deadline. Scheduling and cancelling are O(1), advancing the clock costs the
+ * number of elapsed seconds plus the number of expired or cascaded timers, whatever the number of keys scheduled.
+ * Level l has sSlots slots of sSlots^l seconds each; deadlines beyond the last level are parked in its furthest
+ * slot and placed again when it is cascaded.
+ * It is not thread safe.
+ */
+template <typename KeyT, typename HashT = std::hash<KeyT>>
+class TimingWheel {
+  public:
+	TimingWheel(time_t now) : mNow(now) {
+	}
+
+	/* Sets the deadline of key, replacing its previous one if any. A deadline in the past expires on the next
+	 * second. */
+	void schedule(const KeyT &key, time_t when) {
+		auto it = mIndex.find(key);
+		if (it == mIndex.end()) {
+			it = mIndex.insert(std::make_pair(key, Position())).first;
+			std::list<Timer> single;
+			single.push_back(Timer(key, when));
+			place(single, single.begin(), it->second, mNow + 1);
+		} else {
+			Position &pos = it->second;
+			pos.it->when = when;
+			place(mSlots[pos.level][pos.slot], pos.it, pos, mNow + 1);
+		}
+	}
+
+	void cancel(const KeyT &key) {
+		auto it = mIndex.find(key);
+		if (it == mIndex.end())
+			return;
+		mSlots[it->second.level][it->second.slot].erase(it->second.it);
+		mIndex.erase(it);
+	}
+
+	bool contains(const KeyT &key) const {
+		return mIndex.find(key) != mIndex.end();
+	}
+
+	size_t size() const {
+		return mIndex.size();
+	}
+
+	void clear() {
+		for (int l = 0; l < sLevels; ++l) {
+			for (int s = 0; s < sSlots; ++s) {
+				mSlots[l][s].clear();
+			}
+		}
+		mIndex.clear();
+	}
+
+	/* Moves the clock to now, calling onExpired(key, deadline) for each key whose deadline is reached. The key is
+	 * no longer scheduled when onExpired is called, which may schedule it again. */
+	template <typename Callback>
+	void advance(time_t now, Callback onExpired) {
+		if (mIndex.empty() && now > mNow) {
+			mNow = now;
+			return;
+		}
+		while (mNow < now) {
+			mNow++;
+			/* cascade the levels whose slot just turned, from the coarsest one */
+			int turned = 0;
+			while (turned + 1 < sLevels && (mNow & mask(turned + 1)) == 0)
+				turned++;
+			for (int l = turned; l >= 1; --l) {
+				cascade(l, (mNow >> (sSlotBits * l)) & (sSlots - 1));
+			}
+
+			/* onExpired may schedule or cancel keys: they never land in the slot being emptied */
+			std::list<Timer> &slot = mSlots[0][mNow & (sSlots - 1)];
+			while (!slot.empty()) {
+				Timer timer = slot.front();
+				slot.pop_front();
+				mIndex.erase(timer.key);
+				onExpired(timer.key, timer.when);
+			}
+		}
+	}
+
+  private:
+	static const int sSlotBits = 6;
+	static const int sSlots = 1 << sSlotBits;
+	static const int sLevels = 4;
+
+	struct Timer {
+		Timer(const KeyT &key, time_t when) : key(key), when(when) {
+		}
+		KeyT key;
+		time_t when;
+	};
+	struct Position {
+		Position() : level(0), slot(0) {
+		}
+		int level;
+		int slot;
+		typename std::list<Timer>::iterator it;
+	};
+
+	static time_t mask(int level) {
+		return ((time_t)1 << (sSlotBits * level)) - 1;
+	}
+
+	/* Moves the timer at it, currently in from, to the slot matching its deadline, or the one of earliest if it is
+	 * already due. */
+	void place(std::list<Timer> &from, typename std::list<Timer>::iterator it, Position &pos, time_t earliest) {
+		time_t when = it->when < earliest ? earliest : it->when;
+		time_t delta = when - mNow;
+		int level = 0;
+		while (level + 1 < sLevels && delta > mask(level + 1))
+			level++;
+		if (delta > mask(sLevels)) {
+			/* beyond the wheel: park it in the furthest slot */
+			when = mNow + mask(sLevels);
+		}
+		pos.level = level;
+		pos.slot = (when >> (sSlotBits * level)) & (sSlots - 1);
+		std::list<Timer> &to = mSlots[level][pos.slot];
+		to.splice(to.end(), from, it);
+		pos.it = it;
+	}
+
+	void cascade(int level, int slot) {
+		std::list<Timer> &from = mSlots[level][slot];
+		while (!from.empty()) {
+			auto it = from.begin();
+			/* timers due now go to the level 0 slot about to be processed */
+			place(from, it, mIndex[it->key], mNow);
+		}
+	}
+
+	time_t mNow;
+	std::list<Timer> mSlots[sLevels][sSlots];
+	std::unordered_map<KeyT, Position, HashT> mIndex;
+};
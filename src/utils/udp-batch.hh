@@ -0,0 +1,119 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2016  Belledonne Communications SARL.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/**
+ * Buffer for up to sMaxPackets UDP datagrams, read from a socket with a single recvmmsg() and forwarded with a
+ * single sendmmsg(). Packets can be dropped individually before sending by setting their size to 0.
+ */
+class UdpBatch {
+  public:
+	static const int sMaxPackets = 32;
+	static const int sMaxPacketSize = 1500;
+
+	UdpBatch() : mCount(0) {
+		memset(mRecvMsgs, 0, sizeof(mRecvMsgs));
+		memset(mSendMsgs, 0, sizeof(mSendMsgs));
+		for (int n = 0; n < sMaxPackets; ++n) {
+			mIov[n].iov_base = mData[n];
+			mIov[n].iov_len = sMaxPacketSize;
+			mRecvMsgs[n].msg_hdr.msg_iov = &mIov[n];
+			mRecvMsgs[n].msg_hdr.msg_iovlen = 1;
+			mRecvMsgs[n].msg_hdr.msg_name = &mSources[n];
+		}
+	}
+
+	/* Reads the datagrams waiting on sock without blocking. Returns their number, or -1 with errno set. */
+	int receive(int sock) {
+		for (int n = 0; n < sMaxPackets; ++n) {
+			mRecvMsgs[n].msg_hdr.msg_namelen = sizeof(mSources[n]);
+		}
+		int count = recvmmsg(sock, mRecvMsgs, sMaxPackets, MSG_DONTWAIT, NULL);
+		mCount = count > 0 ? count : 0;
+		for (int n = 0; n < mCount; ++n) {
+			mSizes[n] = mRecvMsgs[n].msg_len;
+		}
+		return count;
+	}
+
+	/* Sends the packets of the batch accepted by the filter to addr, to which filter(data, size) tells whether a
+	 * packet must be sent. Returns the number of datagrams sent, or -1 with errno set if none could be. */
+	template <typename Filter>
+	int send(int sock, const struct sockaddr *addr, socklen_t addrlen, Filter filter) {
+		int pending = 0;
+		for (int n = 0; n < mCount; ++n) {
+			if (mSizes[n] == 0 || !filter(mData[n], mSizes[n]))
+				continue;
+			struct msghdr &hdr = mSendMsgs[pending].msg_hdr;
+			mSendIov[pending].iov_base = mData[n];
+			mSendIov[pending].iov_len = mSizes[n];
+			hdr.msg_iov = &mSendIov[pending];
+			hdr.msg_iovlen = 1;
+			hdr.msg_name = const_cast<struct sockaddr *>(addr);
+			hdr.msg_namelen = addrlen;
+			pending++;
+		}
+		int sent = 0;
+		while (sent < pending) {
+			int ret = sendmmsg(sock, mSendMsgs + sent, pending - sent, MSG_DONTWAIT);
+			if (ret <= 0) {
+				if (ret == -1 && errno == EINTR)
+					continue;
+				return sent > 0 ? sent : -1;
+			}
+			sent += ret;
+		}
+		return sent;
+	}
+
+	int count() const {
+		return mCount;
+	}
+	uint8_t *data(int n) {
+		return mData[n];
+	}
+	size_t size(int n) const {
+		return mSizes[n];
+	}
+	void drop(int n) {
+		mSizes[n] = 0;
+	}
+	const struct sockaddr *source(int n) const {
+		return (const struct sockaddr *)&mSources[n];
+	}
+	socklen_t sourceLength(int n) const {
+		return mRecvMsgs[n].msg_hdr.msg_namelen;
+	}
+
+  private:
+	uint8_t mData[sMaxPackets][sMaxPacketSize];
+	size_t mSizes[sMaxPackets];
+	struct sockaddr_storage mSources[sMaxPackets];
+	struct iovec mIov[sMaxPackets];
+	struct mmsghdr mRecvMsgs[sMaxPackets];
+	struct iovec mSendIov[sMaxPackets];
+	struct mmsghdr mSendMsgs[sMaxPackets];
+	int mCount;
+};